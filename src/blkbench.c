@@ -0,0 +1,432 @@
+/*
+ * Block device benchmark
+ *
+ * Replay a request trace recorded with block_device_init_trace(), or
+ * generate a synthetic access pattern, directly against the BlockDevice
+ * backends, without a simulated guest.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "cutils.h"
+#include "block_device.h"
+
+typedef enum {
+    PATTERN_SEQREAD,
+    PATTERN_SEQWRITE,
+    PATTERN_RANDREAD,
+    PATTERN_RANDWRITE,
+    PATTERN_MIXED,
+    PATTERN_REPLAY,
+} PatternEnum;
+
+static const char *pattern_names[] = {
+    "seqread", "seqwrite", "randread", "randwrite", "mixed", "replay",
+};
+
+typedef struct BenchState BenchState;
+
+typedef struct {
+    BenchState *b;
+    uint8_t *buf;
+    uint64_t submit_ns;
+    BOOL busy;
+} BenchSlot;
+
+struct BenchState {
+    BlockDevice *bs;
+    int64_t nb_sectors;
+    PatternEnum pattern;
+    int req_sectors; /* synthetic patterns */
+    int write_percent; /* PATTERN_MIXED */
+    uint64_t next_sector; /* sequential patterns */
+    BlockTraceRecord *records; /* PATTERN_REPLAY */
+    BOOL use_timestamps;
+    int64_t nb_requests;
+    int64_t nb_submitted;
+    int64_t nb_completed;
+    int64_t nb_errors;
+    uint64_t bytes;
+    uint64_t *latencies; /* ns, indexed by completion order */
+    int depth;
+    BenchSlot *slots;
+    uint64_t start_ns;
+};
+
+static uint64_t rand_state = 1;
+
+/* xorshift64* */
+static uint64_t bench_rand(void)
+{
+    rand_state ^= rand_state >> 12;
+    rand_state ^= rand_state << 25;
+    rand_state ^= rand_state >> 27;
+    return rand_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchSlot *slot = (BenchSlot *)opaque;
+    BenchState *b = slot->b;
+
+    if (ret < 0)
+        b->nb_errors++;
+    b->latencies[b->nb_completed++] = block_trace_get_ns() - slot->submit_ns;
+    slot->busy = FALSE;
+}
+
+/* fill 'rec' with the next request */
+static void bench_next_request(BenchState *b, BlockTraceRecord *rec)
+{
+    uint64_t range;
+    BOOL is_write;
+
+    if (b->pattern == PATTERN_REPLAY) {
+        *rec = b->records[b->nb_submitted];
+        return;
+    }
+    memset(rec, 0, sizeof(*rec));
+    rec->n = b->req_sectors;
+    switch(b->pattern) {
+    case PATTERN_SEQREAD:
+    case PATTERN_SEQWRITE:
+        if (b->next_sector + rec->n > b->nb_sectors)
+            b->next_sector = 0;
+        rec->sector_num = b->next_sector;
+        b->next_sector += rec->n;
+        is_write = (b->pattern == PATTERN_SEQWRITE);
+        break;
+    default:
+        range = b->nb_sectors / rec->n;
+        rec->sector_num = (bench_rand() % range) * rec->n;
+        if (b->pattern == PATTERN_MIXED)
+            is_write = (bench_rand() % 100) < b->write_percent;
+        else
+            is_write = (b->pattern == PATTERN_RANDWRITE);
+        break;
+    }
+    rec->op = is_write ? BLOCK_TRACE_WRITE : BLOCK_TRACE_READ;
+}
+
+static void bench_submit(BenchState *b, BenchSlot *slot)
+{
+    BlockDevice *bs = b->bs;
+    BlockTraceRecord rec;
+    uint64_t t;
+    int ret;
+
+    bench_next_request(b, &rec);
+    b->nb_submitted++;
+    if (b->use_timestamps) {
+        /* wait for the submission time of the recorded request */
+        while ((t = block_trace_get_ns() - b->start_ns) < rec.timestamp) {
+            if (rec.timestamp - t > 100000)
+                usleep((rec.timestamp - t) / 1000 - 50);
+        }
+    }
+    slot->busy = TRUE;
+    slot->submit_ns = block_trace_get_ns();
+    if (rec.sector_num + rec.n > b->nb_sectors) {
+        ret = -1;
+    } else {
+        switch(rec.op) {
+        case BLOCK_TRACE_READ:
+            ret = bs->read_async(bs, rec.sector_num, slot->buf, rec.n,
+                                 bench_cb, slot);
+            b->bytes += (uint64_t)rec.n * SECTOR_SIZE;
+            break;
+        case BLOCK_TRACE_WRITE:
+            ret = bs->write_async(bs, rec.sector_num, slot->buf, rec.n,
+                                  bench_cb, slot);
+            b->bytes += (uint64_t)rec.n * SECTOR_SIZE;
+            break;
+        case BLOCK_TRACE_FLUSH:
+            ret = bs->flush_async ? bs->flush_async(bs, bench_cb, slot) : 0;
+            break;
+        case BLOCK_TRACE_DISCARD:
+            ret = bs->discard_async ?
+                bs->discard_async(bs, rec.sector_num, rec.n,
+                                  rec.flags & BLOCK_TRACE_ZERO ?
+                                  BF_DISCARD_ZERO : 0, bench_cb, slot) : 0;
+            break;
+        default:
+            ret = -1;
+            break;
+        }
+    }
+    if (ret <= 0)
+        bench_cb(slot, ret);
+}
+
+static void bench_run(BenchState *b)
+{
+    int i;
+
+    b->start_ns = block_trace_get_ns();
+    while (b->nb_completed < b->nb_requests) {
+        for(i = 0; i < b->depth && b->nb_submitted < b->nb_requests; i++) {
+            if (!b->slots[i].busy)
+                bench_submit(b, &b->slots[i]);
+        }
+        if (b->bs->poll)
+            b->bs->poll(b->bs);
+    }
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_report(BenchState *b, uint64_t elapsed_ns)
+{
+    double secs, avg;
+    uint64_t total;
+    int64_t i, n = b->nb_completed;
+
+    secs = elapsed_ns / 1e9;
+    qsort(b->latencies, n, sizeof(b->latencies[0]), cmp_u64);
+    total = 0;
+    for(i = 0; i < n; i++)
+        total += b->latencies[i];
+    avg = n ? (double)total / n : 0;
+    printf("requests %" PRId64 " errors %" PRId64 " time %.3f s\n",
+           n, b->nb_errors, secs);
+    printf("throughput %.1f MB/s %.0f IOPS\n",
+           b->bytes / secs / (1 << 20), n / secs);
+    if (n > 0) {
+        printf("latency us: avg %.1f p50 %.1f p99 %.1f max %.1f\n",
+               avg / 1000, b->latencies[n / 2] / 1000.0,
+               b->latencies[n * 99 / 100] / 1000.0,
+               b->latencies[n - 1] / 1000.0);
+    }
+}
+
+static BlockTraceRecord *load_trace(const char *filename, int64_t *pcount)
+{
+    BlockTraceHeader h;
+    BlockTraceRecord *records;
+    int64_t count, size;
+    FILE *f;
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    if (fread(&h, sizeof(h), 1, f) != 1 ||
+        h.magic != BLOCK_TRACE_MAGIC || h.version != BLOCK_TRACE_VERSION ||
+        h.record_size != sizeof(BlockTraceRecord)) {
+        fprintf(stderr, "%s: not a block trace file\n", filename);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f) - sizeof(h);
+    fseek(f, sizeof(h), SEEK_SET);
+    count = size / sizeof(BlockTraceRecord);
+    records = (BlockTraceRecord *)malloc(sizeof(records[0]) * max_int(count, 1));
+    if (fread(records, sizeof(records[0]), count, f) != count) {
+        fprintf(stderr, "%s: read error\n", filename);
+        exit(1);
+    }
+    fclose(f);
+    *pcount = count;
+    return records;
+}
+
+/* the records are stored in completion order, replay them in
+   submission order */
+static int cmp_record(const void *a, const void *b)
+{
+    const BlockTraceRecord *r1 = (const BlockTraceRecord *)a;
+    const BlockTraceRecord *r2 = (const BlockTraceRecord *)b;
+    return r1->timestamp < r2->timestamp ? -1 : r1->timestamp > r2->timestamp;
+}
+
+static void help(void)
+{
+    printf("usage: blkbench [options] image\n"
+           "\n"
+           "Options:\n"
+           "-b file|mmap|compressed\n"
+           "                  image access backend (default file)\n"
+           "-C cache_mb       chunk cache of the compressed backend\n"
+           "-P chunks         sequential prefetch of the compressed backend\n"
+           "-m rw|ro|snapshot image access mode (default snapshot)\n"
+           "-R window_kb      host readahead window\n"
+           "-t threads        execute the requests on host threads\n"
+           "-q depth          requests in flight (default 1)\n"
+           "-p pattern        seqread, seqwrite, randread, randwrite or mixed\n"
+           "                  (default randread)\n"
+           "-r trace          replay a trace file instead of a pattern\n"
+           "-T                replay the requests at their recorded time\n"
+           "-s size           request size in bytes (default 4096)\n"
+           "-n count          number of requests (default 100000)\n"
+           "-w percent        writes in the mixed pattern (default 30)\n"
+           "-S seed           random seed\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    BenchState b_s, *b = &b_s;
+    const char *backend = "file", *trace_filename = NULL;
+    BlockDeviceModeEnum mode = BF_MODE_SNAPSHOT;
+    int c, i, nb_threads = 0, req_size = 4096, max_sectors;
+    int cache_mb = 0, prefetch = 0, readahead_kb = 0;
+    uint64_t elapsed_ns;
+
+    memset(b, 0, sizeof(*b));
+    b->pattern = PATTERN_RANDREAD;
+    b->nb_requests = 100000;
+    b->write_percent = 30;
+    b->depth = 1;
+    for(;;) {
+        c = getopt(argc, argv, "b:m:C:P:R:t:q:p:r:Ts:n:w:S:h");
+        if (c == -1)
+            break;
+        switch(c) {
+        case 'b':
+            backend = optarg;
+            if (strcmp(backend, "file") && strcmp(backend, "mmap") &&
+                strcmp(backend, "compressed"))
+                help();
+            break;
+        case 'C':
+            cache_mb = atoi(optarg);
+            break;
+        case 'P':
+            prefetch = atoi(optarg);
+            break;
+        case 'R':
+            readahead_kb = atoi(optarg);
+            break;
+        case 'm':
+            if (!strcmp(optarg, "rw"))
+                mode = BF_MODE_RW;
+            else if (!strcmp(optarg, "ro"))
+                mode = BF_MODE_RO;
+            else if (!strcmp(optarg, "snapshot"))
+                mode = BF_MODE_SNAPSHOT;
+            else
+                help();
+            break;
+        case 't':
+            nb_threads = atoi(optarg);
+            break;
+        case 'q':
+            b->depth = atoi(optarg);
+            break;
+        case 'p':
+            for(i = 0; i < PATTERN_REPLAY; i++) {
+                if (!strcmp(optarg, pattern_names[i]))
+                    break;
+            }
+            if (i == PATTERN_REPLAY)
+                help();
+            b->pattern = i;
+            break;
+        case 'r':
+            trace_filename = optarg;
+            break;
+        case 'T':
+            b->use_timestamps = TRUE;
+            break;
+        case 's':
+            req_size = atoi(optarg);
+            break;
+        case 'n':
+            b->nb_requests = strtoll(optarg, NULL, 0);
+            break;
+        case 'w':
+            b->write_percent = atoi(optarg);
+            break;
+        case 'S':
+            rand_state = strtoull(optarg, NULL, 0) | 1;
+            break;
+        default:
+            help();
+        }
+    }
+    if (optind + 1 != argc)
+        help();
+    if (req_size <= 0 || req_size % SECTOR_SIZE != 0 || b->depth <= 0 ||
+        b->nb_requests < 0 || nb_threads < 0) {
+        fprintf(stderr, "invalid size, depth, count or threads\n");
+        exit(1);
+    }
+
+    if (!strcmp(backend, "compressed")) {
+        if (mode == BF_MODE_RW) {
+            fprintf(stderr, "the compressed backend is read only\n");
+            exit(1);
+        }
+        b->bs = block_device_init_compressed(argv[optind], cache_mb, prefetch);
+        if (b->bs && mode == BF_MODE_SNAPSHOT)
+            b->bs = block_device_init_overlay(b->bs, NULL);
+    } else if (!strcmp(backend, "mmap"))
+        b->bs = block_device_init_mmap(argv[optind], mode);
+    else
+        b->bs = block_device_init(argv[optind], mode);
+    if (!b->bs)
+        exit(1);
+    if (readahead_kb > 0)
+        b->bs = block_device_init_readahead(b->bs, readahead_kb, 0);
+    if (nb_threads > 0)
+        b->bs = block_device_init_async(b->bs, nb_threads, 1);
+    b->nb_sectors = b->bs->get_sector_count(b->bs);
+
+    b->req_sectors = req_size / SECTOR_SIZE;
+    max_sectors = b->req_sectors;
+    if (trace_filename) {
+        b->pattern = PATTERN_REPLAY;
+        b->records = load_trace(trace_filename, &b->nb_requests);
+        qsort(b->records, b->nb_requests, sizeof(b->records[0]), cmp_record);
+        max_sectors = 0;
+        for(i = 0; i < b->nb_requests; i++) {
+            if (b->records[i].op <= BLOCK_TRACE_WRITE)
+                max_sectors = max_int(max_sectors, b->records[i].n);
+        }
+    } else if (b->req_sectors > b->nb_sectors) {
+        fprintf(stderr, "the image is smaller than the request size\n");
+        exit(1);
+    }
+
+    b->latencies = (uint64_t *)malloc(sizeof(b->latencies[0]) *
+                                      max_int(b->nb_requests, 1));
+    b->slots = (BenchSlot *)mallocz(sizeof(b->slots[0]) * b->depth);
+    for(i = 0; i < b->depth; i++) {
+        b->slots[i].b = b;
+        b->slots[i].buf = (uint8_t *)malloc((size_t)max_int(max_sectors, 1) *
+                                            SECTOR_SIZE);
+        memset(b->slots[i].buf, 0x5a, (size_t)max_int(max_sectors, 1) *
+               SECTOR_SIZE);
+    }
+
+    printf("backend=%s mode=%s threads=%d depth=%d pattern=%s",
+           backend, mode == BF_MODE_RW ? "rw" :
+           mode == BF_MODE_RO ? "ro" : "snapshot",
+           nb_threads, b->depth, pattern_names[b->pattern]);
+    if (b->pattern == PATTERN_REPLAY)
+        printf(" trace=%s\n", trace_filename);
+    else
+        printf(" size=%d\n", req_size);
+
+    bench_run(b);
+    elapsed_ns = block_trace_get_ns() - b->start_ns;
+    bench_report(b, elapsed_ns);
+
+    block_device_close(b->bs);
+    for(i = 0; i < b->depth; i++)
+        free(b->slots[i].buf);
+    free(b->slots);
+    free(b->latencies);
+    free(b->records);
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Block device checks
+ *
+ * Save the state of a snapshot device after writes and write zeroes,
+ * restore it in a new device of the same image and compare the sectors
+ * with the expected contents, for the file and mmap backends.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "cutils.h"
+#include "block_device.h"
+
+#define CHECK_SECTORS 2048 /* 1 MB image */
+
+static uint8_t expected[CHECK_SECTORS * SECTOR_SIZE];
+
+static BlockDevice *check_open(const char *backend, const char *filename)
+{
+    if (!strcmp(backend, "mmap"))
+        return block_device_init_mmap(filename, BF_MODE_SNAPSHOT);
+    else
+        return block_device_init(filename, BF_MODE_SNAPSHOT);
+}
+
+static void check_write(BlockDevice *bs, uint64_t sector_num, int n, int c)
+{
+    uint8_t *buf = expected + sector_num * SECTOR_SIZE;
+
+    memset(buf, c, (size_t)n * SECTOR_SIZE);
+    if (bs->write_async(bs, sector_num, buf, n, NULL, NULL) != 0) {
+        fprintf(stderr, "write of sector %" PRIu64 " failed\n", sector_num);
+        exit(1);
+    }
+}
+
+static void check_zero(BlockDevice *bs, uint64_t sector_num, uint64_t n)
+{
+    memset(expected + sector_num * SECTOR_SIZE, 0, n * SECTOR_SIZE);
+    if (bs->discard_async(bs, sector_num, n, BF_DISCARD_ZERO,
+                          NULL, NULL) != 0) {
+        fprintf(stderr, "discard of sector %" PRIu64 " failed\n", sector_num);
+        exit(1);
+    }
+}
+
+/* return the number of sectors which differ from 'expected' */
+static int check_compare(BlockDevice *bs)
+{
+    uint8_t buf[SECTOR_SIZE];
+    int i, nb_errors;
+
+    nb_errors = 0;
+    for(i = 0; i < CHECK_SECTORS; i++) {
+        if (bs->read_async(bs, i, buf, 1, NULL, NULL) != 0 ||
+            memcmp(buf, expected + i * SECTOR_SIZE, SECTOR_SIZE) != 0)
+            nb_errors++;
+    }
+    return nb_errors;
+}
+
+static int check_checkpoint(const char *backend, const char *image_filename,
+                            const char *state_filename)
+{
+    BlockDevice *bs;
+    FILE *f;
+    int nb_errors;
+
+    bs = check_open(backend, image_filename);
+    /* written sectors, then zeroed ranges: page aligned, unaligned, and
+       over written sectors, one of them written again */
+    check_write(bs, 0, 16, 0x11);
+    check_write(bs, 600, 40, 0x22);
+    check_zero(bs, 256, 256);
+    check_zero(bs, 601, 37);
+    check_write(bs, 300, 8, 0x33);
+    check_zero(bs, 1500, 500);
+
+    f = fopen(state_filename, "wb");
+    if (!f || bs->save_state(bs, f) < 0 || fclose(f) != 0) {
+        perror(state_filename);
+        exit(1);
+    }
+    block_device_close(bs);
+
+    bs = check_open(backend, image_filename);
+    f = fopen(state_filename, "rb");
+    if (!f || bs->load_state(bs, f) < 0) {
+        fprintf(stderr, "%s: could not restore the state\n", state_filename);
+        exit(1);
+    }
+    fclose(f);
+    nb_errors = check_compare(bs);
+    block_device_close(bs);
+    printf("%-6s checkpoint with write zeroes: %s\n", backend,
+           nb_errors ? "FAILED" : "ok");
+    return nb_errors;
+}
+
+int main(int argc, char **argv)
+{
+    char image_filename[] = "/tmp/blkcheck-image-XXXXXX";
+    char state_filename[] = "/tmp/blkcheck-state-XXXXXX";
+    int fd, i, nb_errors;
+
+    for(i = 0; i < CHECK_SECTORS * SECTOR_SIZE; i++)
+        expected[i] = 0x80 | (i / SECTOR_SIZE);
+    fd = mkstemp(image_filename);
+    if (fd < 0 || write(fd, expected, sizeof(expected)) != sizeof(expected)) {
+        perror(image_filename);
+        exit(1);
+    }
+    close(fd);
+    fd = mkstemp(state_filename);
+    if (fd < 0) {
+        perror(state_filename);
+        exit(1);
+    }
+    close(fd);
+
+    nb_errors = check_checkpoint("file", image_filename, state_filename);
+    for(i = 0; i < CHECK_SECTORS * SECTOR_SIZE; i++)
+        expected[i] = 0x80 | (i / SECTOR_SIZE);
+    nb_errors += check_checkpoint("mmap", image_filename, state_filename);
+
+    unlink(image_filename);
+    unlink(state_filename);
+    return nb_errors != 0;
+}
@@ -0,0 +1,272 @@
+/*
+ * Compressed image packer
+ *
+ * Convert a raw disk image to the chunked compressed format read by
+ * block_device_init_compressed(), or back to a raw image.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <zlib.h>
+
+#include "cutils.h"
+#include "block_device.h"
+
+static int read_full(int fd, uint8_t *buf, size_t len)
+{
+    size_t pos;
+    ssize_t ret;
+
+    for(pos = 0; pos < len; pos += ret) {
+        ret = read(fd, buf + pos, len - pos);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                ret = 0;
+                continue;
+            }
+            return -1;
+        }
+        if (ret == 0)
+            break;
+    }
+    return pos;
+}
+
+static int write_full(int fd, const void *buf, size_t len, uint64_t offset)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = pwrite(fd, p, len, offset);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += ret;
+        offset += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static BOOL is_zero(const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for(i = 0; i < len; i++) {
+        if (buf[i] != 0)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static int pack(const char *in_filename, const char *out_filename,
+                uint32_t chunk_size, int level)
+{
+    BlockCompressedHeader h;
+    BlockCompressedIndexEntry *index;
+    uint8_t *buf, *cbuf;
+    uint64_t offset, i, nb_zero;
+    int64_t file_size;
+    uLongf clen;
+    int fd_in, fd_out, len;
+    size_t index_size;
+
+    fd_in = open(in_filename, O_RDONLY);
+    if (fd_in < 0) {
+        perror(in_filename);
+        return -1;
+    }
+    file_size = lseek(fd_in, 0, SEEK_END);
+    lseek(fd_in, 0, SEEK_SET);
+    fd_out = open(out_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_out < 0) {
+        perror(out_filename);
+        close(fd_in);
+        return -1;
+    }
+
+    memset(&h, 0, sizeof(h));
+    h.magic = BLOCK_COMPRESSED_MAGIC;
+    h.version = BLOCK_COMPRESSED_VERSION;
+    h.chunk_size = chunk_size;
+    h.nb_sectors = file_size / SECTOR_SIZE;
+    h.nb_chunks = (h.nb_sectors * SECTOR_SIZE + chunk_size - 1) / chunk_size;
+    index_size = sizeof(index[0]) * h.nb_chunks;
+    index = (BlockCompressedIndexEntry *)mallocz(index_size ? index_size : 1);
+    buf = (uint8_t *)malloc(chunk_size);
+    cbuf = (uint8_t *)malloc(compressBound(chunk_size));
+
+    /* the chunks follow the index, which is written last */
+    offset = sizeof(h) + index_size;
+    nb_zero = 0;
+    for(i = 0; i < h.nb_chunks; i++) {
+        len = chunk_size;
+        if (i == h.nb_chunks - 1)
+            len = h.nb_sectors * SECTOR_SIZE - i * chunk_size;
+        if (read_full(fd_in, buf, len) != len) {
+            fprintf(stderr, "%s: read error\n", in_filename);
+            goto fail;
+        }
+        index[i].offset = offset;
+        if (is_zero(buf, len)) {
+            nb_zero++;
+            continue;
+        }
+        clen = compressBound(chunk_size);
+        if (compress2(cbuf, &clen, buf, len, level) == Z_OK &&
+            clen < (uLongf)len) {
+            index[i].len = clen;
+            if (write_full(fd_out, cbuf, clen, offset) < 0)
+                goto write_fail;
+        } else {
+            index[i].len = len;
+            index[i].flags = BLOCK_COMPRESSED_RAW;
+            if (write_full(fd_out, buf, len, offset) < 0)
+                goto write_fail;
+        }
+        offset += index[i].len;
+    }
+    if (write_full(fd_out, &h, sizeof(h), 0) < 0 ||
+        write_full(fd_out, index, index_size, sizeof(h)) < 0)
+        goto write_fail;
+    if (close(fd_out) < 0) {
+        fd_out = -1;
+        goto write_fail;
+    }
+    printf("%" PRIu64 " chunks of %u KB, %" PRIu64 " zero, %" PRId64
+           " -> %" PRIu64 " bytes (%.1f%%)\n", (uint64_t)h.nb_chunks,
+           chunk_size >> 10, nb_zero, file_size, offset,
+           file_size ? 100.0 * offset / file_size : 0.0);
+    free(cbuf);
+    free(buf);
+    free(index);
+    close(fd_in);
+    return 0;
+ write_fail:
+    perror(out_filename);
+ fail:
+    free(cbuf);
+    free(buf);
+    free(index);
+    close(fd_in);
+    if (fd_out >= 0)
+        close(fd_out);
+    unlink(out_filename);
+    return -1;
+}
+
+#define UNPACK_SECTORS 2048
+
+/* the zero chunks are left as holes */
+static int unpack(const char *in_filename, const char *out_filename)
+{
+    BlockDevice *bs;
+    uint8_t *buf;
+    int64_t nb_sectors, sector_num;
+    int fd_out, n, ret;
+
+    bs = block_device_init_compressed(in_filename, 0, 0);
+    if (!bs)
+        return -1;
+    fd_out = open(out_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_out < 0) {
+        perror(out_filename);
+        block_device_close(bs);
+        return -1;
+    }
+    nb_sectors = bs->get_sector_count(bs);
+    buf = (uint8_t *)malloc(UNPACK_SECTORS * SECTOR_SIZE);
+    ret = 0;
+    for(sector_num = 0; sector_num < nb_sectors; sector_num += n) {
+        n = min_int(nb_sectors - sector_num, UNPACK_SECTORS);
+        if (bs->read_async(bs, sector_num, buf, n, NULL, NULL) < 0) {
+            fprintf(stderr, "%s: corrupted chunk at sector %" PRId64 "\n",
+                    in_filename, sector_num);
+            ret = -1;
+            break;
+        }
+        if (is_zero(buf, n * SECTOR_SIZE))
+            continue;
+        if (write_full(fd_out, buf, n * SECTOR_SIZE,
+                       sector_num * SECTOR_SIZE) < 0) {
+            perror(out_filename);
+            ret = -1;
+            break;
+        }
+    }
+    if (ret == 0 && ftruncate(fd_out, nb_sectors * SECTOR_SIZE) < 0) {
+        perror(out_filename);
+        ret = -1;
+    }
+    free(buf);
+    close(fd_out);
+    block_device_close(bs);
+    if (ret < 0)
+        unlink(out_filename);
+    return ret;
+}
+
+static void help(void)
+{
+    printf("usage: blkpack [options] input output\n"
+           "\n"
+           "Options:\n"
+           "-c size  chunk size in KB (default 64)\n"
+           "-l level zlib compression level (default 6)\n"
+           "-x       unpack a compressed image to a raw image\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int c, chunk_kb = 64, level = Z_DEFAULT_COMPRESSION;
+    BOOL extract = FALSE;
+
+    for(;;) {
+        c = getopt(argc, argv, "c:l:xh");
+        if (c == -1)
+            break;
+        switch(c) {
+        case 'c':
+            chunk_kb = atoi(optarg);
+            break;
+        case 'l':
+            level = atoi(optarg);
+            break;
+        case 'x':
+            extract = TRUE;
+            break;
+        default:
+            help();
+        }
+    }
+    if (optind + 2 != argc)
+        help();
+    if (chunk_kb <= 0 ||
+        ((uint64_t)chunk_kb << 10) > BLOCK_COMPRESSED_MAX_CHUNK_SIZE) {
+        fprintf(stderr, "chunk size must be between 1 and %d KB\n",
+                BLOCK_COMPRESSED_MAX_CHUNK_SIZE >> 10);
+        exit(1);
+    }
+    if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION) {
+        fprintf(stderr, "compression level must be between 0 and 9\n");
+        exit(1);
+    }
+
+    if (extract) {
+        if (unpack(argv[optind], argv[optind + 1]) < 0)
+            exit(1);
+    } else {
+        if (pack(argv[optind], argv[optind + 1], chunk_kb << 10, level) < 0)
+            exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,2477 @@
+/*
+ * Block device backends
+ *
+ * Copyright (c) 2016 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "cutils.h"
+#include "workqueue.h"
+#include "block_device.h"
+
+static inline BOOL bitmap_get(const uint64_t *bitmap, uint64_t i)
+{
+    return (bitmap[i >> 6] >> (i & 63)) & 1;
+}
+
+static inline void bitmap_set(uint64_t *bitmap, int i, BOOL val)
+{
+    if (val)
+        bitmap[i >> 6] |= (uint64_t)1 << (i & 63);
+    else
+        bitmap[i >> 6] &= ~((uint64_t)1 << (i & 63));
+}
+
+/*********************************************************************/
+/* raw image file */
+
+typedef struct BlockDeviceFile {
+    int fd;
+    int64_t nb_sectors;
+    BlockDeviceModeEnum mode;
+} BlockDeviceFile;
+
+/* read past the end of file returns zeros */
+static int bf_pread(BlockDeviceFile *bf, uint8_t *buf, size_t len,
+                    uint64_t offset)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = pread(bf->fd, buf, len, offset);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ret == 0) {
+            memset(buf, 0, len);
+            break;
+        }
+        buf += ret;
+        offset += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int bf_pwrite(BlockDeviceFile *bf, const uint8_t *buf, size_t len,
+                     uint64_t offset)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = pwrite(bf->fd, buf, len, offset);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += ret;
+        offset += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int64_t bf_get_sector_count(BlockDevice *bs)
+{
+    BlockDeviceFile *bf = (BlockDeviceFile *)bs->opaque;
+    return bf->nb_sectors;
+}
+
+static int bf_read_async(BlockDevice *bs,
+                         uint64_t sector_num, uint8_t *buf, int n,
+                         BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceFile *bf = (BlockDeviceFile *)bs->opaque;
+    int ret;
+
+    if (bf->fd < 0)
+        return -1;
+    ret = bf_pread(bf, buf, (size_t)n * SECTOR_SIZE,
+                   sector_num * SECTOR_SIZE);
+    /* synchronous read */
+    return ret;
+}
+
+static int bf_write_async(BlockDevice *bs,
+                          uint64_t sector_num, const uint8_t *buf, int n,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceFile *bf = (BlockDeviceFile *)bs->opaque;
+    int ret;
+
+    switch(bf->mode) {
+    case BF_MODE_RO:
+        ret = -1; /* error */
+        break;
+    case BF_MODE_RW:
+        ret = bf_pwrite(bf, buf, (size_t)n * SECTOR_SIZE,
+                        sector_num * SECTOR_SIZE);
+        break;
+    default:
+        abort();
+    }
+
+    return ret;
+}
+
+static int bf_flush_async(BlockDevice *bs,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceFile *bf = (BlockDeviceFile *)bs->opaque;
+
+    if (bf->mode != BF_MODE_RW)
+        return 0;
+    return fdatasync(bf->fd) < 0 ? -1 : 0;
+}
+
+static const uint8_t zero_buf[64 * 1024];
+
+/* punch a hole so that the image stays sparse */
+static int bf_discard_async(BlockDevice *bs,
+                            uint64_t sector_num, uint64_t n, int flags,
+                            BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceFile *bf = (BlockDeviceFile *)bs->opaque;
+    uint64_t offset, len, l;
+
+    if (bf->mode != BF_MODE_RW)
+        return -1;
+    if ((sector_num + n) > bf->nb_sectors)
+        return -1;
+    offset = sector_num * SECTOR_SIZE;
+    len = n * SECTOR_SIZE;
+    if (fallocate(bf->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  offset, len) == 0)
+        return 0;
+    /* a discard is only a hint */
+    if (!(flags & BF_DISCARD_ZERO))
+        return 0;
+    if (fallocate(bf->fd, FALLOC_FL_ZERO_RANGE, offset, len) == 0)
+        return 0;
+    while (len > 0) {
+        l = len < sizeof(zero_buf) ? len : sizeof(zero_buf);
+        if (bf_pwrite(bf, zero_buf, l, offset) < 0)
+            return -1;
+        offset += l;
+        len -= l;
+    }
+    return 0;
+}
+
+static void bf_close(BlockDevice *bs)
+{
+    BlockDeviceFile *bf = (BlockDeviceFile *)bs->opaque;
+
+    close(bf->fd);
+    free(bf);
+}
+
+BlockDevice *block_device_init(const char *filename,
+                               BlockDeviceModeEnum mode)
+{
+    BlockDevice *bs;
+    BlockDeviceFile *bf;
+    int64_t file_size;
+    int fd;
+
+    fd = open(filename, mode == BF_MODE_RW ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        exit(1);
+    }
+    file_size = lseek(fd, 0, SEEK_END);
+
+    bs = (BlockDevice*)mallocz(sizeof(*bs));
+    bf = (BlockDeviceFile*)mallocz(sizeof(*bf));
+
+    bf->mode = mode == BF_MODE_SNAPSHOT ? BF_MODE_RO : mode;
+    bf->nb_sectors = file_size / 512;
+    bf->fd = fd;
+
+    bs->opaque = bf;
+    bs->get_sector_count = bf_get_sector_count;
+    bs->read_async = bf_read_async;
+    bs->write_async = bf_write_async;
+    bs->flush_async = bf_flush_async;
+    bs->discard_async = bf_discard_async;
+    bs->close = bf_close;
+
+    /* the modified sectors are kept in memory */
+    if (mode == BF_MODE_SNAPSHOT)
+        bs = block_device_init_overlay(bs, NULL);
+    return bs;
+}
+
+/*********************************************************************/
+/* memory mapped image file */
+
+typedef struct {
+    uint8_t *ptr;
+    int64_t nb_sectors;
+    BlockDeviceModeEnum mode;
+    /* BF_MODE_SNAPSHOT: one bit per page replaced by a zero page */
+    uint64_t *released;
+    uint64_t nb_pages;
+} BlockDeviceMmap;
+
+#define SHARED_COPY_BUF_SIZE (1 << 20)
+
+/* map the image opened as 'fd', which is closed */
+static uint8_t *map_fd(int fd, const char *filename, BlockDeviceModeEnum mode,
+                       int64_t *pnb_sectors)
+{
+    int64_t file_size, nb_sectors;
+    int prot, flags;
+    void *ptr;
+
+    file_size = lseek(fd, 0, SEEK_END);
+    nb_sectors = file_size / SECTOR_SIZE;
+    if (nb_sectors <= 0) {
+        fprintf(stderr, "%s: empty image\n", filename);
+        close(fd);
+        return NULL;
+    }
+    switch(mode) {
+    case BF_MODE_RO:
+        prot = PROT_READ;
+        flags = MAP_SHARED;
+        break;
+    case BF_MODE_RW:
+        prot = PROT_READ | PROT_WRITE;
+        flags = MAP_SHARED;
+        break;
+    case BF_MODE_SNAPSHOT:
+        prot = PROT_READ | PROT_WRITE;
+        flags = MAP_PRIVATE | MAP_NORESERVE;
+        break;
+    default:
+        abort();
+    }
+    ptr = mmap(NULL, nb_sectors * SECTOR_SIZE, prot, flags, fd, 0);
+    /* the mapping keeps a reference to the file */
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        perror(filename);
+        return NULL;
+    }
+    *pnb_sectors = nb_sectors;
+    return (uint8_t *)ptr;
+}
+
+uint8_t *block_device_map_file(const char *filename, BlockDeviceModeEnum mode,
+                               int64_t *pnb_sectors)
+{
+    int fd;
+
+    fd = open(filename, mode == BF_MODE_RW ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        return NULL;
+    }
+    return map_fd(fd, filename, mode, pnb_sectors);
+}
+
+#define FNV_INIT 0xcbf29ce484222325ULL
+#define FNV_ADD(key, v) key = (key ^ (uint64_t)(v)) * 0x100000001b3ULL
+
+/* copy 'src_fd' to the new file 'path'. Return its descriptor, or -1 if
+   error. */
+static int shared_cache_copy(int src_fd, const char *path)
+{
+    char tmp_path[PATH_MAX + 32];
+    uint8_t *buf;
+    ssize_t len, ret, pos;
+    int fd;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0444);
+    if (fd < 0) {
+        perror(tmp_path);
+        return -1;
+    }
+    buf = (uint8_t *)malloc(SHARED_COPY_BUF_SIZE);
+    for(;;) {
+        len = read(src_fd, buf, SHARED_COPY_BUF_SIZE);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break;
+        for(pos = 0; pos < len; pos += ret) {
+            ret = write(fd, buf + pos, len - pos);
+            if (ret < 0 && errno == EINTR)
+                ret = 0;
+            else if (ret < 0)
+                break;
+        }
+        if (pos < len) {
+            len = -1;
+            break;
+        }
+    }
+    free(buf);
+    if (len < 0 || rename(tmp_path, path) < 0) {
+        perror(path);
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    return fd;
+}
+
+/* remove the copies of the previous versions of the image. The
+   instances still using one keep it mapped until they exit. */
+static void shared_cache_remove_stale(const char *cache_dir,
+                                      const char *prefix, const char *path)
+{
+    char stale_path[PATH_MAX + 256];
+    struct dirent *de;
+    DIR *d;
+
+    d = opendir(cache_dir);
+    if (!d)
+        return;
+    while ((de = readdir(d)) != NULL) {
+        if (strncmp(de->d_name, prefix, strlen(prefix)) != 0 ||
+            strlen(de->d_name) < 4 ||
+            strcmp(de->d_name + strlen(de->d_name) - 4, ".img") != 0)
+            continue;
+        snprintf(stale_path, sizeof(stale_path), "%s/%s", cache_dir,
+                 de->d_name);
+        if (strcmp(stale_path, path) != 0)
+            unlink(stale_path);
+    }
+    closedir(d);
+}
+
+/* The copy is named "spike-base-<image>-<version>.img", after the path
+   of the image and its identity (inode, size and modification time), so
+   that a modified image gets a new copy and the previous one is removed.
+   The copy and the removal are made under a lock on
+   "spike-base-<image>.lock", so that concurrent instances make a single
+   copy. Return its descriptor, or -1 if error. */
+static int shared_cache_open(const char *filename, const char *cache_dir,
+                             char *path, int path_size)
+{
+    char real_path[PATH_MAX], prefix[64], lock_path[PATH_MAX + 64];
+    struct stat st;
+    uint64_t path_key, key;
+    const char *p;
+    int fd, src_fd, lock_fd;
+
+    /* the descriptor is used for the copy, so that the identity is the
+       one of the copied file */
+    src_fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (src_fd < 0 || fstat(src_fd, &st) < 0) {
+        perror(filename);
+        if (src_fd >= 0)
+            close(src_fd);
+        return -1;
+    }
+    if (!realpath(filename, real_path))
+        pstrcpy(real_path, sizeof(real_path), filename);
+    /* FNV-1a */
+    path_key = FNV_INIT;
+    for(p = real_path; *p != '\0'; p++)
+        FNV_ADD(path_key, (uint8_t)*p);
+    key = FNV_INIT;
+    FNV_ADD(key, st.st_dev);
+    FNV_ADD(key, st.st_ino);
+    FNV_ADD(key, st.st_size);
+    FNV_ADD(key, st.st_mtim.tv_sec);
+    FNV_ADD(key, st.st_mtim.tv_nsec);
+    snprintf(prefix, sizeof(prefix), "spike-base-%016" PRIx64 "-", path_key);
+    snprintf(path, path_size, "%s/%s%016" PRIx64 ".img", cache_dir, prefix,
+             key);
+    snprintf(lock_path, sizeof(lock_path), "%s/spike-base-%016" PRIx64
+             ".lock", cache_dir, path_key);
+
+    lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX) < 0) {
+        perror(lock_path);
+        if (lock_fd >= 0)
+            close(lock_fd);
+        close(src_fd);
+        return -1;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) {
+        fd = shared_cache_copy(src_fd, path);
+        if (fd >= 0)
+            shared_cache_remove_stale(cache_dir, prefix, path);
+    } else if (fd < 0) {
+        perror(path);
+    }
+    /* closing the descriptor releases the lock */
+    close(lock_fd);
+    close(src_fd);
+    return fd;
+}
+
+uint8_t *block_device_map_shared(const char *filename, const char *cache_dir,
+                                 BlockDeviceModeEnum mode, int64_t *pnb_sectors)
+{
+    char path[PATH_MAX];
+    uint8_t *ptr;
+    int fd;
+
+    if (mode == BF_MODE_RW) {
+        fprintf(stderr, "%s: a shared image is read only\n", filename);
+        return NULL;
+    }
+    fd = shared_cache_open(filename, cache_dir, path, sizeof(path));
+    if (fd < 0)
+        return NULL;
+    ptr = map_fd(fd, path, mode, pnb_sectors);
+    /* huge pages if 'cache_dir' is a tmpfs mounted with huge=advise */
+    if (ptr)
+        madvise(ptr, *pnb_sectors * SECTOR_SIZE, MADV_HUGEPAGE);
+    return ptr;
+}
+
+void block_device_unmap_file(uint8_t *ptr, int64_t nb_sectors)
+{
+    munmap(ptr, nb_sectors * SECTOR_SIZE);
+}
+
+/* The private copies of the pages are found in /proc/self/pagemap: a
+   present page which is not backed by the file, or a swapped one.
+   Without pagemap, all the pages are saved. The zero pages which
+   replaced discarded ones and were not accessed since then are not
+   seen: the device keeps track of them in its own state. */
+#define PM_PRESENT (1ULL << 63)
+#define PM_SWAPPED (1ULL << 62)
+#define PM_FILE    (1ULL << 61)
+
+int block_device_map_save(FILE *f, const uint8_t *ptr, int64_t nb_sectors)
+{
+    uint64_t page_size = getpagesize();
+    uint64_t size = nb_sectors * SECTOR_SIZE;
+    uint64_t nb_pages = (size + page_size - 1) / page_size;
+    uint64_t entries[512], *pages, i, j, n, nb_saved, offset, len;
+    int64_t pos;
+    int fd;
+
+    fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    pages = (uint64_t *)malloc(sizeof(pages[0]) * nb_pages);
+    nb_saved = 0;
+    for(i = 0; i < nb_pages; i += n) {
+        n = nb_pages - i;
+        if (n > countof(entries))
+            n = countof(entries);
+        if (fd >= 0) {
+            pos = ((uintptr_t)ptr / page_size + i) * sizeof(entries[0]);
+            if (pread(fd, entries, n * sizeof(entries[0]), pos) !=
+                n * sizeof(entries[0])) {
+                perror("/proc/self/pagemap");
+                close(fd);
+                fd = -1;
+            }
+        }
+        for(j = 0; j < n; j++) {
+            if (fd < 0 ||
+                (entries[j] & (PM_PRESENT | PM_FILE)) == PM_PRESENT ||
+                (entries[j] & PM_SWAPPED))
+                pages[nb_saved++] = i + j;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+
+    fwrite(&page_size, 1, sizeof(page_size), f);
+    fwrite(&nb_saved, 1, sizeof(nb_saved), f);
+    for(i = 0; i < nb_saved; i++) {
+        offset = pages[i] * page_size;
+        len = size - offset < page_size ? size - offset : page_size;
+        fwrite(&pages[i], 1, sizeof(pages[i]), f);
+        fwrite(ptr + offset, 1, len, f);
+    }
+    free(pages);
+    return ferror(f) ? -1 : 0;
+}
+
+int block_device_map_load(FILE *f, uint8_t *ptr, int64_t nb_sectors)
+{
+    uint64_t size = nb_sectors * SECTOR_SIZE;
+    uint64_t page_size, nb_saved, page, i, offset, len;
+
+    if (fread(&page_size, 1, sizeof(page_size), f) != sizeof(page_size) ||
+        fread(&nb_saved, 1, sizeof(nb_saved), f) != sizeof(nb_saved))
+        return -1;
+    if (page_size != (uint64_t)getpagesize()) {
+        fprintf(stderr, "image saved with pages of %" PRIu64 " bytes\n",
+                page_size);
+        return -1;
+    }
+    for(i = 0; i < nb_saved; i++) {
+        if (fread(&page, 1, sizeof(page), f) != sizeof(page))
+            return -1;
+        offset = page * page_size;
+        if (offset >= size)
+            return -1;
+        len = size - offset < page_size ? size - offset : page_size;
+        if (fread(ptr + offset, 1, len, f) != len)
+            return -1;
+    }
+    return 0;
+}
+
+static int64_t bm_get_sector_count(BlockDevice *bs)
+{
+    BlockDeviceMmap *bm = (BlockDeviceMmap *)bs->opaque;
+    return bm->nb_sectors;
+}
+
+static int bm_read_async(BlockDevice *bs,
+                         uint64_t sector_num, uint8_t *buf, int n,
+                         BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceMmap *bm = (BlockDeviceMmap *)bs->opaque;
+
+    if ((sector_num + n) > bm->nb_sectors)
+        return -1;
+    memcpy(buf, bm->ptr + sector_num * SECTOR_SIZE, (size_t)n * SECTOR_SIZE);
+    return 0;
+}
+
+static int bm_write_async(BlockDevice *bs,
+                          uint64_t sector_num, const uint8_t *buf, int n,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceMmap *bm = (BlockDeviceMmap *)bs->opaque;
+
+    if (bm->mode == BF_MODE_RO)
+        return -1;
+    if ((sector_num + n) > bm->nb_sectors)
+        return -1;
+    memcpy(bm->ptr + sector_num * SECTOR_SIZE, buf, (size_t)n * SECTOR_SIZE);
+    return 0;
+}
+
+static int bm_flush_async(BlockDevice *bs,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceMmap *bm = (BlockDeviceMmap *)bs->opaque;
+
+    if (bm->mode != BF_MODE_RW)
+        return 0;
+    return msync(bm->ptr, bm->nb_sectors * SECTOR_SIZE, MS_SYNC) < 0 ? -1 : 0;
+}
+
+/* The whole pages of the range are released: in rw mode the file gets a
+   hole, in snapshot mode the private copies are replaced by zero pages.
+   The partial pages at the ends are cleared if needed. */
+static void bm_release(BlockDeviceMmap *bm, uint64_t sector_num, uint64_t n,
+                       BOOL zero)
+{
+    uint8_t *start, *end, *pstart, *pend;
+    uintptr_t page_size = getpagesize();
+    uint64_t i;
+    BOOL released;
+
+    start = bm->ptr + sector_num * SECTOR_SIZE;
+    end = start + n * SECTOR_SIZE;
+    pstart = (uint8_t *)(((uintptr_t)start + page_size - 1) & ~(page_size - 1));
+    pend = (uint8_t *)((uintptr_t)end & ~(page_size - 1));
+    released = FALSE;
+    if (pstart < pend) {
+        if (bm->mode == BF_MODE_RW) {
+            released = madvise(pstart, pend - pstart, MADV_REMOVE) == 0;
+        } else {
+            released = mmap(pstart, pend - pstart, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED |
+                            MAP_NORESERVE, -1, 0) != MAP_FAILED;
+            if (released) {
+                for(i = (pstart - bm->ptr) / page_size;
+                    i < (uint64_t)(pend - bm->ptr) / page_size; i++)
+                    bitmap_set(bm->released, i, TRUE);
+            }
+        }
+    }
+    if (!zero)
+        return;
+    if (released) {
+        memset(start, 0, pstart - start);
+        memset(pend, 0, end - pend);
+    } else {
+        memset(start, 0, end - start);
+    }
+}
+
+static int bm_discard_async(BlockDevice *bs,
+                            uint64_t sector_num, uint64_t n, int flags,
+                            BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceMmap *bm = (BlockDeviceMmap *)bs->opaque;
+
+    if (bm->mode == BF_MODE_RO)
+        return -1;
+    if ((sector_num + n) > bm->nb_sectors)
+        return -1;
+    bm_release(bm, sector_num, n, (flags & BF_DISCARD_ZERO) != 0);
+    return 0;
+}
+
+/* find the next run of released pages from page '*pi' and store its
+   first page in '*pi'. Return the page following the run, which is
+   '*pi' if there is none. */
+static uint64_t bm_next_run(BlockDeviceMmap *bm, uint64_t *pi)
+{
+    uint64_t i, j;
+
+    for(i = *pi; i < bm->nb_pages && !bitmap_get(bm->released, i); i++)
+        continue;
+    for(j = i; j < bm->nb_pages && bitmap_get(bm->released, j); j++)
+        continue;
+    *pi = i;
+    return j;
+}
+
+/* the released pages, as runs of sectors, followed by the modified
+   pages. A released page which was written again is in both. */
+static int bm_save_state(BlockDevice *bs, FILE *f)
+{
+    BlockDeviceMmap *bm = (BlockDeviceMmap *)bs->opaque;
+    uint64_t page_sectors = getpagesize() / SECTOR_SIZE;
+    uint64_t i, j, nb_runs, run[2];
+
+    nb_runs = 0;
+    for(i = 0; (j = bm_next_run(bm, &i)) > i; i = j)
+        nb_runs++;
+    fwrite(&nb_runs, 1, sizeof(nb_runs), f);
+    for(i = 0; (j = bm_next_run(bm, &i)) > i; i = j) {
+        run[0] = i * page_sectors;
+        run[1] = (j - i) * page_sectors;
+        fwrite(run, 1, sizeof(run), f);
+    }
+    return block_device_map_save(f, bm->ptr, bm->nb_sectors);
+}
+
+/* the released pages are zero pages again before the modified ones are
+   copied back */
+static int bm_load_state(BlockDevice *bs, FILE *f)
+{
+    BlockDeviceMmap *bm = (BlockDeviceMmap *)bs->opaque;
+    uint64_t i, nb_runs, run[2];
+
+    if (fread(&nb_runs, 1, sizeof(nb_runs), f) != sizeof(nb_runs))
+        return -1;
+    for(i = 0; i < nb_runs; i++) {
+        if (fread(run, 1, sizeof(run), f) != sizeof(run))
+            return -1;
+        if (run[0] > bm->nb_sectors || run[1] > bm->nb_sectors - run[0])
+            return -1;
+        bm_release(bm, run[0], run[1], TRUE);
+    }
+    return block_device_map_load(f, bm->ptr, bm->nb_sectors);
+}
+
+static void bm_close(BlockDevice *bs)
+{
+    BlockDeviceMmap *bm = (BlockDeviceMmap *)bs->opaque;
+
+    block_device_unmap_file(bm->ptr, bm->nb_sectors);
+    free(bm->released);
+    free(bm);
+}
+
+static BlockDevice *bm_init(uint8_t *ptr, int64_t nb_sectors,
+                            BlockDeviceModeEnum mode)
+{
+    BlockDevice *bs;
+    BlockDeviceMmap *bm;
+
+    bs = (BlockDevice*)mallocz(sizeof(*bs));
+    bm = (BlockDeviceMmap*)mallocz(sizeof(*bm));
+    bm->ptr = ptr;
+    bm->nb_sectors = nb_sectors;
+    bm->mode = mode;
+
+    bs->opaque = bm;
+    bs->get_sector_count = bm_get_sector_count;
+    bs->read_async = bm_read_async;
+    bs->write_async = bm_write_async;
+    bs->flush_async = bm_flush_async;
+    bs->discard_async = bm_discard_async;
+    if (mode == BF_MODE_SNAPSHOT) {
+        bm->nb_pages = (nb_sectors * SECTOR_SIZE + getpagesize() - 1) /
+            getpagesize();
+        bm->released = (uint64_t*)mallocz(((bm->nb_pages + 63) / 64) *
+                                          sizeof(uint64_t));
+        bs->save_state = bm_save_state;
+        bs->load_state = bm_load_state;
+    }
+    bs->close = bm_close;
+    return bs;
+}
+
+BlockDevice *block_device_init_mmap(const char *filename,
+                                    BlockDeviceModeEnum mode)
+{
+    int64_t nb_sectors;
+    uint8_t *ptr;
+
+    ptr = block_device_map_file(filename, mode, &nb_sectors);
+    if (!ptr)
+        exit(1);
+    return bm_init(ptr, nb_sectors, mode);
+}
+
+BlockDevice *block_device_init_shared(const char *filename,
+                                      const char *cache_dir,
+                                      BlockDeviceModeEnum mode)
+{
+    int64_t nb_sectors;
+    uint8_t *ptr;
+
+    ptr = block_device_map_shared(filename, cache_dir, mode, &nb_sectors);
+    if (!ptr)
+        exit(1);
+    return bm_init(ptr, nb_sectors, mode);
+}
+
+/*********************************************************************/
+/* compressed image */
+
+/* The image is split in chunks compressed with zlib (see blkpack). The
+   decompressed chunks are kept in a LRU cache shared by the threads
+   reading the device. A chunk is decompressed once even if several
+   threads need it at the same time: the first one loads it while the
+   others wait for it. */
+#define BC_DEFAULT_CACHE_MB 64
+#define BC_HASH_BITS        10
+
+typedef struct {
+    struct list_head hash_link;
+    struct list_head lru_link; /* most recently used first */
+    uint64_t chunk_num;
+    uint8_t *data;
+    BOOL loading; /* being decompressed, 'data' is not valid yet */
+    int refcount; /* readers copying 'data' */
+} CompressedChunk;
+
+typedef struct {
+    int fd;
+    int64_t nb_sectors;
+    uint32_t chunk_size;
+    uint64_t nb_chunks;
+    BlockCompressedIndexEntry *index;
+    pthread_mutex_t lock; /* protects the fields below */
+    pthread_cond_t cond; /* a chunk was loaded */
+    struct list_head hash[1 << BC_HASH_BITS]; /* CompressedChunk.hash_link */
+    struct list_head lru; /* CompressedChunk.lru_link */
+    int nb_cached;
+    int max_cached;
+    /* sequential prefetch */
+    int prefetch; /* chunks, 0 if disabled */
+    uint64_t next_chunk; /* chunk following the previous read */
+    uint64_t prefetch_next, prefetch_end;
+    BOOL prefetch_stop;
+    pthread_cond_t prefetch_cond;
+    pthread_t prefetch_thread;
+} BlockDeviceCompressed;
+
+static struct list_head *bc_bucket(BlockDeviceCompressed *bc,
+                                   uint64_t chunk_num)
+{
+    return &bc->hash[(chunk_num * 0x9e3779b97f4a7c15) >> (64 - BC_HASH_BITS)];
+}
+
+static CompressedChunk *bc_find(BlockDeviceCompressed *bc, uint64_t chunk_num)
+{
+    struct list_head *el, *head;
+    CompressedChunk *c;
+
+    head = bc_bucket(bc, chunk_num);
+    list_for_each(el, head) {
+        c = list_entry(el, CompressedChunk, hash_link);
+        if (c->chunk_num == chunk_num)
+            return c;
+    }
+    return NULL;
+}
+
+static void bc_remove(BlockDeviceCompressed *bc, CompressedChunk *c)
+{
+    list_del(&c->hash_link);
+    list_del(&c->lru_link);
+    free(c->data);
+    free(c);
+    bc->nb_cached--;
+}
+
+/* decompress the chunk 'chunk_num' to 'data'. Called without the lock. */
+static int bc_load(BlockDeviceCompressed *bc, uint64_t chunk_num,
+                   uint8_t *data)
+{
+    BlockCompressedIndexEntry *e = &bc->index[chunk_num];
+    uint8_t *buf;
+    uLongf len;
+    ssize_t ret;
+    uint32_t pos;
+
+    if (e->len == 0) {
+        memset(data, 0, bc->chunk_size);
+        return 0;
+    }
+    /* checked by bc_read_header() */
+    assert(e->len <= ((e->flags & BLOCK_COMPRESSED_RAW) ? bc->chunk_size :
+                      compressBound(bc->chunk_size)));
+    buf = (e->flags & BLOCK_COMPRESSED_RAW) ? data : (uint8_t *)malloc(e->len);
+    for(pos = 0; pos < e->len; pos += ret) {
+        ret = pread(bc->fd, buf + pos, e->len - pos, e->offset + pos);
+        if (ret < 0 && errno == EINTR) {
+            ret = 0;
+        } else if (ret <= 0) {
+            if (buf != data)
+                free(buf);
+            return -1;
+        }
+    }
+    len = e->len;
+    if (!(e->flags & BLOCK_COMPRESSED_RAW)) {
+        len = bc->chunk_size;
+        ret = uncompress(data, &len, buf, e->len);
+        free(buf);
+        if (ret != Z_OK)
+            return -1;
+    }
+    /* the last chunk may be partial */
+    memset(data + len, 0, bc->chunk_size - len);
+    return 0;
+}
+
+/* return the chunk 'chunk_num' with a reference, or NULL if it could
+   not be read. Must be called with the lock held, which is released
+   while the chunk is decompressed. */
+static CompressedChunk *bc_get_chunk(BlockDeviceCompressed *bc,
+                                     uint64_t chunk_num)
+{
+    struct list_head *el;
+    CompressedChunk *c, *c1;
+    uint8_t *data;
+    int ret;
+
+    for(;;) {
+        c = bc_find(bc, chunk_num);
+        if (!c)
+            break;
+        if (!c->loading) {
+            c->refcount++;
+            list_del(&c->lru_link);
+            list_add(&c->lru_link, &bc->lru);
+            return c;
+        }
+        /* the chunk may be gone if its load failed */
+        pthread_cond_wait(&bc->cond, &bc->lock);
+    }
+
+    /* reuse the buffer of the least recently used idle chunk. If every
+       chunk is in use, the cache temporarily exceeds its size. */
+    data = NULL;
+    if (bc->nb_cached >= bc->max_cached) {
+        for(el = bc->lru.prev; el != &bc->lru; el = el->prev) {
+            c1 = list_entry(el, CompressedChunk, lru_link);
+            if (!c1->loading && c1->refcount == 0) {
+                data = c1->data;
+                c1->data = NULL;
+                bc_remove(bc, c1);
+                break;
+            }
+        }
+    }
+    if (!data)
+        data = (uint8_t *)malloc(bc->chunk_size);
+    c = (CompressedChunk *)mallocz(sizeof(*c));
+    c->chunk_num = chunk_num;
+    c->data = data;
+    c->loading = TRUE;
+    c->refcount = 1;
+    list_add(&c->hash_link, bc_bucket(bc, chunk_num));
+    list_add(&c->lru_link, &bc->lru);
+    bc->nb_cached++;
+
+    pthread_mutex_unlock(&bc->lock);
+    ret = bc_load(bc, chunk_num, data);
+    pthread_mutex_lock(&bc->lock);
+
+    c->loading = FALSE;
+    pthread_cond_broadcast(&bc->cond);
+    if (ret < 0) {
+        bc_remove(bc, c);
+        return NULL;
+    }
+    return c;
+}
+
+static void *bc_prefetch_thread(void *arg)
+{
+    BlockDeviceCompressed *bc = (BlockDeviceCompressed *)arg;
+    CompressedChunk *c;
+    uint64_t chunk_num;
+
+    pthread_mutex_lock(&bc->lock);
+    for(;;) {
+        while (!bc->prefetch_stop && bc->prefetch_next >= bc->prefetch_end)
+            pthread_cond_wait(&bc->prefetch_cond, &bc->lock);
+        if (bc->prefetch_stop)
+            break;
+        chunk_num = bc->prefetch_next++;
+        if (bc_find(bc, chunk_num))
+            continue;
+        c = bc_get_chunk(bc, chunk_num);
+        if (c)
+            c->refcount--;
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return NULL;
+}
+
+/* must be called with the lock held. A read starting at the chunk
+   where the previous one ended, or in the same chunk, is sequential:
+   the 'prefetch' chunks following it are loaded in the background. */
+static void bc_read_ahead(BlockDeviceCompressed *bc, uint64_t first,
+                          uint64_t last)
+{
+    uint64_t end;
+
+    if (first == bc->next_chunk || first + 1 == bc->next_chunk) {
+        end = last + 1 + bc->prefetch;
+        if (end > bc->nb_chunks)
+            end = bc->nb_chunks;
+        if (bc->prefetch_next < last + 1 || bc->prefetch_next > end)
+            bc->prefetch_next = last + 1;
+        bc->prefetch_end = end;
+        pthread_cond_signal(&bc->prefetch_cond);
+    }
+    bc->next_chunk = last + 1;
+}
+
+static int64_t bc_get_sector_count(BlockDevice *bs)
+{
+    BlockDeviceCompressed *bc = (BlockDeviceCompressed *)bs->opaque;
+    return bc->nb_sectors;
+}
+
+static int bc_read_async(BlockDevice *bs,
+                         uint64_t sector_num, uint8_t *buf, int n,
+                         BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceCompressed *bc = (BlockDeviceCompressed *)bs->opaque;
+    CompressedChunk *c;
+    uint64_t offset, end, chunk_num;
+    uint32_t pos, len;
+    int ret;
+
+    if ((sector_num + n) > bc->nb_sectors)
+        return -1;
+    offset = sector_num * SECTOR_SIZE;
+    end = offset + (uint64_t)n * SECTOR_SIZE;
+    ret = 0;
+    pthread_mutex_lock(&bc->lock);
+    if (bc->prefetch && n > 0)
+        bc_read_ahead(bc, offset / bc->chunk_size, (end - 1) / bc->chunk_size);
+    while (offset < end) {
+        chunk_num = offset / bc->chunk_size;
+        pos = offset % bc->chunk_size;
+        len = bc->chunk_size - pos;
+        if (len > end - offset)
+            len = end - offset;
+        c = bc_get_chunk(bc, chunk_num);
+        if (!c) {
+            ret = -1;
+            break;
+        }
+        /* the reference keeps the data while the lock is released */
+        pthread_mutex_unlock(&bc->lock);
+        memcpy(buf, c->data + pos, len);
+        pthread_mutex_lock(&bc->lock);
+        c->refcount--;
+        buf += len;
+        offset += len;
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return ret;
+}
+
+/* the image is read only */
+static int bc_write_async(BlockDevice *bs,
+                          uint64_t sector_num, const uint8_t *buf, int n,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    return -1;
+}
+
+static void bc_close(BlockDevice *bs)
+{
+    BlockDeviceCompressed *bc = (BlockDeviceCompressed *)bs->opaque;
+    CompressedChunk *c;
+
+    if (bc->prefetch) {
+        pthread_mutex_lock(&bc->lock);
+        bc->prefetch_stop = TRUE;
+        pthread_cond_signal(&bc->prefetch_cond);
+        pthread_mutex_unlock(&bc->lock);
+        pthread_join(bc->prefetch_thread, NULL);
+        pthread_cond_destroy(&bc->prefetch_cond);
+    }
+    while (!list_empty(&bc->lru)) {
+        c = list_entry(bc->lru.next, CompressedChunk, lru_link);
+        bc_remove(bc, c);
+    }
+    pthread_cond_destroy(&bc->cond);
+    pthread_mutex_destroy(&bc->lock);
+    free(bc->index);
+    close(bc->fd);
+    free(bc);
+}
+
+static int bc_read_header(int fd, const char *filename,
+                          BlockCompressedHeader *h,
+                          BlockCompressedIndexEntry **pindex)
+{
+    BlockCompressedIndexEntry *index, *e;
+    uint64_t index_size, file_size, i;
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        perror(filename);
+        return -1;
+    }
+    file_size = st.st_size;
+    if (pread(fd, h, sizeof(*h), 0) != sizeof(*h) ||
+        h->magic != BLOCK_COMPRESSED_MAGIC) {
+        fprintf(stderr, "%s: not a compressed image\n", filename);
+        return -1;
+    }
+    if (h->version != BLOCK_COMPRESSED_VERSION) {
+        fprintf(stderr, "%s: unsupported compressed image version %u\n",
+                filename, h->version);
+        return -1;
+    }
+    if (h->chunk_size < SECTOR_SIZE || (h->chunk_size % SECTOR_SIZE) != 0 ||
+        h->chunk_size > BLOCK_COMPRESSED_MAX_CHUNK_SIZE ||
+        h->nb_sectors > INT64_MAX / SECTOR_SIZE ||
+        h->nb_chunks != (h->nb_sectors * SECTOR_SIZE + h->chunk_size - 1) /
+        h->chunk_size) {
+        fprintf(stderr, "%s: invalid compressed image header\n", filename);
+        return -1;
+    }
+    /* the index must be in the file, which also bounds its size */
+    if (h->nb_chunks > (file_size - sizeof(*h)) / sizeof(index[0])) {
+        fprintf(stderr, "%s: truncated compressed image\n", filename);
+        return -1;
+    }
+    index_size = sizeof(index[0]) * h->nb_chunks;
+    index = (BlockCompressedIndexEntry *)malloc(index_size ? index_size : 1);
+    if ((uint64_t)pread(fd, index, index_size, sizeof(*h)) != index_size) {
+        fprintf(stderr, "%s: truncated compressed image\n", filename);
+        free(index);
+        return -1;
+    }
+    for(i = 0; i < h->nb_chunks; i++) {
+        e = &index[i];
+        if (e->len == 0)
+            continue;
+        if (e->len > ((e->flags & BLOCK_COMPRESSED_RAW) ? h->chunk_size :
+                      compressBound(h->chunk_size)) ||
+            e->offset < sizeof(*h) + index_size || e->offset > file_size ||
+            e->len > file_size - e->offset) {
+            fprintf(stderr, "%s: invalid index entry for chunk %" PRIu64 "\n",
+                    filename, i);
+            free(index);
+            return -1;
+        }
+    }
+    *pindex = index;
+    return 0;
+}
+
+BlockDevice *block_device_init_compressed(const char *filename, int cache_mb,
+                                          int prefetch)
+{
+    BlockDevice *bs;
+    BlockDeviceCompressed *bc;
+    BlockCompressedHeader h;
+    BlockCompressedIndexEntry *index;
+    uint64_t max_cached;
+    int fd, i;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        return NULL;
+    }
+    if (bc_read_header(fd, filename, &h, &index) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    bs = (BlockDevice*)mallocz(sizeof(*bs));
+    bc = (BlockDeviceCompressed*)mallocz(sizeof(*bc));
+    bc->fd = fd;
+    bc->nb_sectors = h.nb_sectors;
+    bc->chunk_size = h.chunk_size;
+    bc->nb_chunks = h.nb_chunks;
+    bc->index = index;
+    pthread_mutex_init(&bc->lock, NULL);
+    pthread_cond_init(&bc->cond, NULL);
+    for(i = 0; i < (1 << BC_HASH_BITS); i++)
+        init_list_head(&bc->hash[i]);
+    init_list_head(&bc->lru);
+    if (cache_mb <= 0)
+        cache_mb = BC_DEFAULT_CACHE_MB;
+    max_cached = ((uint64_t)cache_mb << 20) / h.chunk_size;
+    bc->max_cached = max_cached < 2 ? 2 :
+        max_cached > INT_MAX ? INT_MAX : max_cached;
+    /* the prefetched chunks must not evict each other */
+    bc->prefetch = min_int(max_int(prefetch, 0), bc->max_cached / 2);
+    if (bc->prefetch) {
+        pthread_cond_init(&bc->prefetch_cond, NULL);
+        if (pthread_create(&bc->prefetch_thread, NULL, bc_prefetch_thread,
+                           bc) != 0) {
+            pthread_cond_destroy(&bc->prefetch_cond);
+            bc->prefetch = 0;
+        }
+    }
+
+    bs->opaque = bc;
+    bs->get_sector_count = bc_get_sector_count;
+    bs->read_async = bc_read_async;
+    bs->write_async = bc_write_async;
+    bs->close = bc_close;
+    return bs;
+}
+
+/*********************************************************************/
+/* copy on write overlay */
+
+/* The written sectors are stored by 64 KB chunks allocated from an
+   arena. A two level table maps a chunk number to its data and to the
+   bitmap of its written sectors: an image of 1 TB needs 128 KB of first
+   level table, and only the regions of 64 MB which were written get a
+   second level table. */
+#define OV_CHUNK_BITS    7
+#define OV_CHUNK_SECTORS (1 << OV_CHUNK_BITS)
+#define OV_CHUNK_SIZE    (OV_CHUNK_SECTORS * SECTOR_SIZE)
+#define OV_L2_BITS       10
+#define OV_L2_SIZE       (1 << OV_L2_BITS)
+#define OV_ARENA_CHUNKS  32
+
+#define OV_DELTA_MAGIC   0x41544c4544767073ULL /* "spvDELTA" */
+#define OV_DELTA_VERSION 1
+
+typedef struct {
+    uint8_t *data; /* NULL if no sector of the chunk was written */
+    uint64_t bitmap[OV_CHUNK_SECTORS / 64];
+    uint64_t zero_bitmap[OV_CHUNK_SECTORS / 64]; /* sectors reading as zeros */
+} OverlayChunk;
+
+typedef struct OverlayArenaBlock {
+    struct OverlayArenaBlock *next;
+    uint8_t *data; /* OV_ARENA_CHUNKS chunks */
+} OverlayArenaBlock;
+
+typedef struct {
+    BlockDevice *bs; /* base device, only read */
+    int64_t nb_sectors;
+    int64_t nb_l1;
+    OverlayChunk **l1_table;
+    OverlayArenaBlock *arena;
+    int arena_used; /* chunks used in the first arena block */
+    uint8_t *free_chunks; /* released chunk data, linked by their first bytes */
+    int64_t nb_chunks; /* allocated chunks */
+    char *delta_filename;
+    pthread_mutex_t lock;
+} BlockDeviceOverlay;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t chunk_sectors;
+    uint64_t nb_sectors;
+    uint64_t nb_chunks;
+} OverlayDeltaHeader;
+
+static OverlayChunk *ov_find_chunk(BlockDeviceOverlay *ov, uint64_t chunk_num,
+                                   BOOL alloc)
+{
+    OverlayChunk *l2;
+    uint64_t l1_idx = chunk_num >> OV_L2_BITS;
+
+    l2 = ov->l1_table[l1_idx];
+    if (!l2) {
+        if (!alloc)
+            return NULL;
+        l2 = (OverlayChunk *)mallocz(sizeof(l2[0]) * OV_L2_SIZE);
+        ov->l1_table[l1_idx] = l2;
+    }
+    return &l2[chunk_num & (OV_L2_SIZE - 1)];
+}
+
+static uint8_t *ov_alloc_chunk_data(BlockDeviceOverlay *ov)
+{
+    OverlayArenaBlock *b = ov->arena;
+    uint8_t *data;
+
+    if (ov->free_chunks) {
+        data = ov->free_chunks;
+        memcpy(&ov->free_chunks, data, sizeof(data));
+        ov->nb_chunks++;
+        return data;
+    }
+
+    if (!b || ov->arena_used == OV_ARENA_CHUNKS) {
+        b = (OverlayArenaBlock *)mallocz(sizeof(*b));
+        b->data = (uint8_t *)malloc((size_t)OV_ARENA_CHUNKS * OV_CHUNK_SIZE);
+        if (!b->data) {
+            fprintf(stderr, "block overlay: out of memory\n");
+            exit(1);
+        }
+        b->next = ov->arena;
+        ov->arena = b;
+        ov->arena_used = 0;
+    }
+    ov->nb_chunks++;
+    return b->data + (size_t)(ov->arena_used++) * OV_CHUNK_SIZE;
+}
+
+static void ov_free_chunk_data(BlockDeviceOverlay *ov, uint8_t *data)
+{
+    memcpy(data, &ov->free_chunks, sizeof(data));
+    ov->free_chunks = data;
+    ov->nb_chunks--;
+}
+
+static BOOL bitmap_empty(const uint64_t *bitmap)
+{
+    int i;
+    for(i = 0; i < OV_CHUNK_SECTORS / 64; i++) {
+        if (bitmap[i])
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* return NULL if the sector was not written */
+static const uint8_t *ov_get_sector(BlockDeviceOverlay *ov, uint64_t sector_num)
+{
+    OverlayChunk *c;
+    int i;
+
+    c = ov_find_chunk(ov, sector_num >> OV_CHUNK_BITS, FALSE);
+    if (!c)
+        return NULL;
+    i = sector_num & (OV_CHUNK_SECTORS - 1);
+    if (c->data && bitmap_get(c->bitmap, i))
+        return c->data + i * SECTOR_SIZE;
+    if (bitmap_get(c->zero_bitmap, i))
+        return zero_buf;
+    return NULL;
+}
+
+/* must be called with the lock held */
+static void ov_write(BlockDeviceOverlay *ov, uint64_t sector_num,
+                     const uint8_t *buf, int n)
+{
+    OverlayChunk *c;
+    int i, l, j;
+
+    while (n > 0) {
+        c = ov_find_chunk(ov, sector_num >> OV_CHUNK_BITS, TRUE);
+        if (!c->data)
+            c->data = ov_alloc_chunk_data(ov);
+        i = sector_num & (OV_CHUNK_SECTORS - 1);
+        l = min_int(n, OV_CHUNK_SECTORS - i);
+        memcpy(c->data + i * SECTOR_SIZE, buf, (size_t)l * SECTOR_SIZE);
+        for(j = i; j < i + l; j++) {
+            bitmap_set(c->bitmap, j, TRUE);
+            bitmap_set(c->zero_bitmap, j, FALSE);
+        }
+        sector_num += l;
+        buf += (size_t)l * SECTOR_SIZE;
+        n -= l;
+    }
+}
+
+/* drop the written data of the sectors, which then read from the base
+   device, or as zeros if 'zero' is set. Must be called with the lock
+   held. */
+static void ov_discard(BlockDeviceOverlay *ov, uint64_t sector_num,
+                       uint64_t n, BOOL zero)
+{
+    OverlayChunk *c;
+    int i, l, j;
+
+    while (n > 0) {
+        i = sector_num & (OV_CHUNK_SECTORS - 1);
+        l = OV_CHUNK_SECTORS - i;
+        if (l > n)
+            l = n;
+        c = ov_find_chunk(ov, sector_num >> OV_CHUNK_BITS, zero);
+        if (c) {
+            for(j = i; j < i + l; j++) {
+                bitmap_set(c->bitmap, j, FALSE);
+                bitmap_set(c->zero_bitmap, j, zero);
+            }
+            if (c->data && bitmap_empty(c->bitmap)) {
+                ov_free_chunk_data(ov, c->data);
+                c->data = NULL;
+            }
+        }
+        sector_num += l;
+        n -= l;
+    }
+}
+
+static int64_t ov_get_sector_count(BlockDevice *bs)
+{
+    BlockDeviceOverlay *ov = (BlockDeviceOverlay *)bs->opaque;
+    return ov->nb_sectors;
+}
+
+static int ov_read_async(BlockDevice *bs,
+                         uint64_t sector_num, uint8_t *buf, int n,
+                         BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceOverlay *ov = (BlockDeviceOverlay *)bs->opaque;
+    const uint8_t *ptr;
+    int len, ret;
+
+    if ((sector_num + n) > ov->nb_sectors)
+        return -1;
+    ret = 0;
+    while (n > 0) {
+        pthread_mutex_lock(&ov->lock);
+        /* written sectors */
+        while (n > 0 && (ptr = ov_get_sector(ov, sector_num)) != NULL) {
+            memcpy(buf, ptr, SECTOR_SIZE);
+            sector_num++;
+            buf += SECTOR_SIZE;
+            n--;
+        }
+        /* the following clean sectors are read from the base device
+           in a single request */
+        for(len = 0; len < n && !ov_get_sector(ov, sector_num + len); len++)
+            continue;
+        pthread_mutex_unlock(&ov->lock);
+        if (len > 0) {
+            if (ov->bs->read_async(ov->bs, sector_num, buf, len,
+                                   NULL, NULL) != 0)
+                ret = -1;
+            sector_num += len;
+            buf += (size_t)len * SECTOR_SIZE;
+            n -= len;
+        }
+    }
+    return ret;
+}
+
+static int ov_write_async(BlockDevice *bs,
+                          uint64_t sector_num, const uint8_t *buf, int n,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceOverlay *ov = (BlockDeviceOverlay *)bs->opaque;
+
+    if ((sector_num + n) > ov->nb_sectors)
+        return -1;
+    pthread_mutex_lock(&ov->lock);
+    ov_write(ov, sector_num, buf, n);
+    pthread_mutex_unlock(&ov->lock);
+    return 0;
+}
+
+/* the base device is only read */
+static int ov_flush_async(BlockDevice *bs,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    return 0;
+}
+
+static int ov_discard_async(BlockDevice *bs,
+                            uint64_t sector_num, uint64_t n, int flags,
+                            BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceOverlay *ov = (BlockDeviceOverlay *)bs->opaque;
+
+    if ((sector_num + n) > ov->nb_sectors)
+        return -1;
+    pthread_mutex_lock(&ov->lock);
+    ov_discard(ov, sector_num, n, (flags & BF_DISCARD_ZERO) != 0);
+    pthread_mutex_unlock(&ov->lock);
+    return 0;
+}
+
+/* delta file: header, then for each modified chunk its number, its
+   bitmaps and its written sectors */
+static void ov_save_delta(BlockDeviceOverlay *ov, FILE *f)
+{
+    OverlayDeltaHeader h;
+    OverlayChunk *c;
+    uint64_t chunk_num;
+    int64_t l1_idx;
+    int i, j, pass;
+
+    pthread_mutex_lock(&ov->lock);
+    memset(&h, 0, sizeof(h));
+    h.magic = OV_DELTA_MAGIC;
+    h.version = OV_DELTA_VERSION;
+    h.chunk_sectors = OV_CHUNK_SECTORS;
+    h.nb_sectors = ov->nb_sectors;
+    for(pass = 0; pass < 2; pass++) {
+        if (pass == 1)
+            fwrite(&h, 1, sizeof(h), f);
+        for(l1_idx = 0; l1_idx < ov->nb_l1; l1_idx++) {
+            if (!ov->l1_table[l1_idx])
+                continue;
+            for(i = 0; i < OV_L2_SIZE; i++) {
+                c = &ov->l1_table[l1_idx][i];
+                if (!c->data && bitmap_empty(c->zero_bitmap))
+                    continue;
+                if (pass == 0) {
+                    h.nb_chunks++;
+                    continue;
+                }
+                chunk_num = ((uint64_t)l1_idx << OV_L2_BITS) | i;
+                fwrite(&chunk_num, 1, sizeof(chunk_num), f);
+                fwrite(c->bitmap, 1, sizeof(c->bitmap), f);
+                fwrite(c->zero_bitmap, 1, sizeof(c->zero_bitmap), f);
+                for(j = 0; j < OV_CHUNK_SECTORS; j++) {
+                    if (c->data && bitmap_get(c->bitmap, j))
+                        fwrite(c->data + j * SECTOR_SIZE, 1, SECTOR_SIZE, f);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&ov->lock);
+}
+
+/* add the sectors of a delta to the overlay. 'filename' is used in the
+   error messages. */
+static int ov_load_delta(BlockDeviceOverlay *ov, FILE *f, const char *filename)
+{
+    OverlayDeltaHeader h;
+    uint64_t chunk_num, k;
+    uint64_t bitmap[OV_CHUNK_SECTORS / 64], zero_bitmap[OV_CHUNK_SECTORS / 64];
+    uint8_t buf[SECTOR_SIZE];
+    int j, ret;
+
+    ret = -1;
+    if (fread(&h, 1, sizeof(h), f) != sizeof(h) ||
+        h.magic != OV_DELTA_MAGIC || h.version != OV_DELTA_VERSION ||
+        h.chunk_sectors != OV_CHUNK_SECTORS) {
+        fprintf(stderr, "%s: not a block overlay delta file\n", filename);
+        goto done;
+    }
+    if (h.nb_sectors != (uint64_t)ov->nb_sectors) {
+        fprintf(stderr, "%s: delta for an image of %" PRIu64
+                " sectors, image has %" PRId64 "\n",
+                filename, h.nb_sectors, ov->nb_sectors);
+        goto done;
+    }
+    pthread_mutex_lock(&ov->lock);
+    for(k = 0; k < h.nb_chunks; k++) {
+        if (fread(&chunk_num, 1, sizeof(chunk_num), f) != sizeof(chunk_num) ||
+            fread(bitmap, 1, sizeof(bitmap), f) != sizeof(bitmap) ||
+            fread(zero_bitmap, 1, sizeof(zero_bitmap), f) != sizeof(zero_bitmap) ||
+            chunk_num >= (uint64_t)ov->nb_l1 << OV_L2_BITS)
+            goto truncated;
+        for(j = 0; j < OV_CHUNK_SECTORS; j++) {
+            if (bitmap_get(zero_bitmap, j))
+                ov_discard(ov, (chunk_num << OV_CHUNK_BITS) | j, 1, TRUE);
+            if (!bitmap_get(bitmap, j))
+                continue;
+            if (fread(buf, 1, SECTOR_SIZE, f) != SECTOR_SIZE)
+                goto truncated;
+            ov_write(ov, (chunk_num << OV_CHUNK_BITS) | j, buf, 1);
+        }
+    }
+    ret = 0;
+ truncated:
+    pthread_mutex_unlock(&ov->lock);
+    if (ret < 0)
+        fprintf(stderr, "%s: truncated delta file\n", filename);
+ done:
+    return ret;
+}
+
+int block_device_overlay_save(BlockDevice *bs, const char *filename)
+{
+    BlockDeviceOverlay *ov = (BlockDeviceOverlay *)bs->opaque;
+    FILE *f;
+
+    f = fopen(filename, "wb");
+    if (!f) {
+        perror(filename);
+        return -1;
+    }
+    ov_save_delta(ov, f);
+    if (ferror(f)) {
+        perror(filename);
+        fclose(f);
+        return -1;
+    }
+    if (fclose(f) != 0) {
+        perror(filename);
+        return -1;
+    }
+    return 0;
+}
+
+int block_device_overlay_load(BlockDevice *bs, const char *filename)
+{
+    BlockDeviceOverlay *ov = (BlockDeviceOverlay *)bs->opaque;
+    FILE *f;
+    int ret;
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        return -1;
+    }
+    ret = ov_load_delta(ov, f, filename);
+    fclose(f);
+    return ret;
+}
+
+/* drop all the modified sectors */
+static void ov_clear(BlockDeviceOverlay *ov)
+{
+    OverlayChunk *c;
+    int64_t l1_idx;
+    int i;
+
+    pthread_mutex_lock(&ov->lock);
+    for(l1_idx = 0; l1_idx < ov->nb_l1; l1_idx++) {
+        if (!ov->l1_table[l1_idx])
+            continue;
+        for(i = 0; i < OV_L2_SIZE; i++) {
+            c = &ov->l1_table[l1_idx][i];
+            if (c->data)
+                ov_free_chunk_data(ov, c->data);
+            memset(c, 0, sizeof(*c));
+        }
+    }
+    pthread_mutex_unlock(&ov->lock);
+}
+
+/* the checkpoint holds the overlay as a delta */
+static int ov_save_state(BlockDevice *bs, FILE *f)
+{
+    BlockDeviceOverlay *ov = (BlockDeviceOverlay *)bs->opaque;
+
+    ov_save_delta(ov, f);
+    return ferror(f) ? -1 : 0;
+}
+
+static int ov_load_state(BlockDevice *bs, FILE *f)
+{
+    BlockDeviceOverlay *ov = (BlockDeviceOverlay *)bs->opaque;
+
+    ov_clear(ov);
+    return ov_load_delta(ov, f, "checkpoint");
+}
+
+static void ov_close(BlockDevice *bs)
+{
+    BlockDeviceOverlay *ov = (BlockDeviceOverlay *)bs->opaque;
+    OverlayArenaBlock *b, *b1;
+    int64_t i;
+
+    if (ov->delta_filename) {
+        block_device_overlay_save(bs, ov->delta_filename);
+        free(ov->delta_filename);
+    }
+    for(i = 0; i < ov->nb_l1; i++)
+        free(ov->l1_table[i]);
+    free(ov->l1_table);
+    for(b = ov->arena; b != NULL; b = b1) {
+        b1 = b->next;
+        free(b->data);
+        free(b);
+    }
+    pthread_mutex_destroy(&ov->lock);
+    block_device_close(ov->bs);
+    free(ov);
+}
+
+BlockDevice *block_device_init_overlay(BlockDevice *bs1,
+                                       const char *delta_filename)
+{
+    BlockDevice *bs;
+    BlockDeviceOverlay *ov;
+    int64_t nb_chunks;
+
+    bs = (BlockDevice*)mallocz(sizeof(*bs));
+    ov = (BlockDeviceOverlay*)mallocz(sizeof(*ov));
+    ov->bs = bs1;
+    ov->nb_sectors = bs1->get_sector_count(bs1);
+    nb_chunks = (ov->nb_sectors + OV_CHUNK_SECTORS - 1) >> OV_CHUNK_BITS;
+    ov->nb_l1 = (nb_chunks + OV_L2_SIZE - 1) >> OV_L2_BITS;
+    ov->l1_table = (OverlayChunk **)mallocz(sizeof(ov->l1_table[0]) *
+                                            (ov->nb_l1 ? ov->nb_l1 : 1));
+    pthread_mutex_init(&ov->lock, NULL);
+
+    bs->opaque = ov;
+    bs->get_sector_count = ov_get_sector_count;
+    bs->read_async = ov_read_async;
+    bs->write_async = ov_write_async;
+    bs->flush_async = ov_flush_async;
+    bs->discard_async = ov_discard_async;
+    bs->save_state = ov_save_state;
+    bs->load_state = ov_load_state;
+    bs->close = ov_close;
+
+    if (delta_filename) {
+        if (access(delta_filename, F_OK) == 0 &&
+            block_device_overlay_load(bs, delta_filename) < 0)
+            exit(1);
+        ov->delta_filename = strdup(delta_filename);
+    }
+    return bs;
+}
+
+/*********************************************************************/
+/* readahead */
+
+/* The image is cached by windows of 'window' sectors, aligned on their
+   size. Each read is matched with the streams being followed: a read
+   starting where one of them ended is sequential, and the windows
+   following it are read by a host thread. Each queue of the guest
+   usually reads its own stream, so up to RA_MAX_STREAMS of them are
+   followed at once. */
+#define RA_MAX_STREAMS           8
+#define RA_AHEAD                 2 /* windows read in advance */
+#define RA_DEFAULT_WINDOW_KB     128
+#define RA_DEFAULT_CACHE_WINDOWS 16
+#define RA_MAX_WINDOW_KB         (16 * 1024)
+
+typedef enum {
+    RA_FREE,
+    RA_QUEUED, /* waiting for the readahead thread */
+    RA_LOADING,
+    RA_READY,
+} ReadaheadStateEnum;
+
+typedef struct {
+    struct list_head lru_link; /* most recently used first */
+    struct list_head queue_link; /* RA_QUEUED only */
+    ReadaheadStateEnum state;
+    uint64_t window_num;
+    BOOL stale; /* written while loading or copied, not to be used */
+    int refcount; /* readers copying 'data' */
+    uint8_t *data;
+} ReadaheadBuffer;
+
+typedef struct {
+    uint64_t next_sector;
+    uint64_t last_use;
+} ReadaheadStream;
+
+typedef struct {
+    BlockDevice *bs; /* synchronous device */
+    int64_t nb_sectors;
+    int window; /* sectors */
+    int nb_buffers;
+    ReadaheadBuffer *buffers;
+    pthread_mutex_t lock; /* protects the fields below */
+    pthread_cond_t cond; /* a buffer was loaded */
+    pthread_cond_t queue_cond; /* a buffer was queued */
+    struct list_head lru; /* ReadaheadBuffer.lru_link */
+    struct list_head queue; /* ReadaheadBuffer.queue_link */
+    ReadaheadStream streams[RA_MAX_STREAMS];
+    uint64_t use_count;
+    BOOL stop;
+    pthread_t thread;
+} BlockDeviceReadahead;
+
+static ReadaheadBuffer *ra_find(BlockDeviceReadahead *ra, uint64_t window_num)
+{
+    ReadaheadBuffer *b;
+    int i;
+
+    for(i = 0; i < ra->nb_buffers; i++) {
+        b = &ra->buffers[i];
+        if (b->state != RA_FREE && !b->stale && b->window_num == window_num)
+            return b;
+    }
+    return NULL;
+}
+
+/* queue the read of a window unless it is cached. The least recently
+   used unused buffer is taken. */
+static void ra_queue(BlockDeviceReadahead *ra, uint64_t window_num)
+{
+    struct list_head *el;
+    ReadaheadBuffer *b;
+
+    if (window_num * ra->window >= ra->nb_sectors ||
+        ra_find(ra, window_num))
+        return;
+    for(el = ra->lru.prev; el != &ra->lru; el = el->prev) {
+        b = list_entry(el, ReadaheadBuffer, lru_link);
+        if ((b->state == RA_FREE || b->state == RA_READY) &&
+            b->refcount == 0) {
+            b->state = RA_QUEUED;
+            b->window_num = window_num;
+            b->stale = FALSE;
+            list_del(&b->lru_link);
+            list_add(&b->lru_link, &ra->lru);
+            list_add_tail(&b->queue_link, &ra->queue);
+            pthread_cond_signal(&ra->queue_cond);
+            return;
+        }
+    }
+}
+
+/* follow the streams. Must be called with the lock held. */
+static void ra_detect(BlockDeviceReadahead *ra, uint64_t sector_num, int n)
+{
+    ReadaheadStream *s, *s1;
+    uint64_t window_num;
+    int i;
+
+    s = NULL;
+    s1 = &ra->streams[0];
+    for(i = 0; i < RA_MAX_STREAMS; i++) {
+        if (ra->streams[i].next_sector == sector_num &&
+            ra->streams[i].last_use != 0) {
+            s = &ra->streams[i];
+            break;
+        }
+        if (ra->streams[i].last_use < s1->last_use)
+            s1 = &ra->streams[i];
+    }
+    if (s) {
+        window_num = (sector_num + n) / ra->window;
+        for(i = 0; i < RA_AHEAD; i++)
+            ra_queue(ra, window_num + i);
+    } else {
+        /* replace the least recently used stream */
+        s = s1;
+    }
+    s->next_sector = sector_num + n;
+    s->last_use = ++ra->use_count;
+}
+
+static void *ra_thread(void *arg)
+{
+    BlockDeviceReadahead *ra = (BlockDeviceReadahead *)arg;
+    BlockDevice *bs1 = ra->bs;
+    ReadaheadBuffer *b;
+    uint64_t sector_num;
+    int n, ret;
+
+    pthread_mutex_lock(&ra->lock);
+    for(;;) {
+        while (!ra->stop && list_empty(&ra->queue))
+            pthread_cond_wait(&ra->queue_cond, &ra->lock);
+        if (ra->stop)
+            break;
+        b = list_entry(ra->queue.next, ReadaheadBuffer, queue_link);
+        list_del(&b->queue_link);
+        b->state = RA_LOADING;
+        sector_num = b->window_num * ra->window;
+        n = min_int(ra->nb_sectors - sector_num, ra->window);
+        pthread_mutex_unlock(&ra->lock);
+        ret = bs1->read_async(bs1, sector_num, b->data, n, NULL, NULL);
+        pthread_mutex_lock(&ra->lock);
+        b->state = (ret == 0 && !b->stale) ? RA_READY : RA_FREE;
+        b->stale = FALSE;
+        pthread_cond_broadcast(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+/* the cached copies of written sectors are dropped. A buffer being
+   loaded or copied is only marked stale. */
+static void ra_invalidate(BlockDeviceReadahead *ra, uint64_t sector_num,
+                          uint64_t n)
+{
+    ReadaheadBuffer *b;
+    uint64_t first, last;
+    int i;
+
+    if (n == 0)
+        return;
+    first = sector_num / ra->window;
+    last = (sector_num + n - 1) / ra->window;
+    pthread_mutex_lock(&ra->lock);
+    for(i = 0; i < ra->nb_buffers; i++) {
+        b = &ra->buffers[i];
+        if (b->window_num < first || b->window_num > last)
+            continue;
+        if (b->state == RA_LOADING || b->refcount > 0)
+            b->stale = TRUE;
+        else if (b->state == RA_READY)
+            b->state = RA_FREE;
+    }
+    pthread_mutex_unlock(&ra->lock);
+}
+
+static int64_t ra_get_sector_count(BlockDevice *bs)
+{
+    BlockDeviceReadahead *ra = (BlockDeviceReadahead *)bs->opaque;
+    return ra->nb_sectors;
+}
+
+/* read 'n' sectors which are not cached. Called with the lock held. */
+static int ra_read_direct(BlockDeviceReadahead *ra, uint64_t sector_num,
+                          uint8_t *buf, int n)
+{
+    BlockDevice *bs1 = ra->bs;
+    int ret;
+
+    if (n == 0)
+        return 0;
+    pthread_mutex_unlock(&ra->lock);
+    ret = bs1->read_async(bs1, sector_num, buf, n, NULL, NULL);
+    pthread_mutex_lock(&ra->lock);
+    return ret;
+}
+
+static int ra_read_async(BlockDevice *bs,
+                         uint64_t sector_num, uint8_t *buf, int n,
+                         BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceReadahead *ra = (BlockDeviceReadahead *)bs->opaque;
+    ReadaheadBuffer *b;
+    uint64_t miss_sector;
+    uint8_t *miss_buf;
+    int pos, l, miss_n, ret;
+
+    if ((sector_num + n) > ra->nb_sectors)
+        return -1;
+    pthread_mutex_lock(&ra->lock);
+    ra_detect(ra, sector_num, n);
+    /* the consecutive sectors which are not cached are read at once */
+    miss_sector = sector_num;
+    miss_buf = buf;
+    miss_n = 0;
+    ret = 0;
+    while (n > 0) {
+        pos = sector_num % ra->window;
+        l = min_int(n, ra->window - pos);
+        for(;;) {
+            b = ra_find(ra, sector_num / ra->window);
+            if (!b || b->state != RA_LOADING)
+                break;
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        }
+        if (b && b->state == RA_READY) {
+            /* the reference keeps the data while the lock is released */
+            b->refcount++;
+            list_del(&b->lru_link);
+            list_add(&b->lru_link, &ra->lru);
+            ret = ra_read_direct(ra, miss_sector, miss_buf, miss_n);
+            if (ret < 0) {
+                b->refcount--;
+                break;
+            }
+            pthread_mutex_unlock(&ra->lock);
+            memcpy(buf, b->data + (size_t)pos * SECTOR_SIZE,
+                   (size_t)l * SECTOR_SIZE);
+            pthread_mutex_lock(&ra->lock);
+            b->refcount--;
+            miss_sector = sector_num + l;
+            miss_buf = buf + (size_t)l * SECTOR_SIZE;
+            miss_n = 0;
+        } else {
+            miss_n += l;
+        }
+        sector_num += l;
+        buf += (size_t)l * SECTOR_SIZE;
+        n -= l;
+    }
+    if (ret == 0)
+        ret = ra_read_direct(ra, miss_sector, miss_buf, miss_n);
+    pthread_mutex_unlock(&ra->lock);
+    return ret;
+}
+
+static int ra_write_async(BlockDevice *bs,
+                          uint64_t sector_num, const uint8_t *buf, int n,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceReadahead *ra = (BlockDeviceReadahead *)bs->opaque;
+    BlockDevice *bs1 = ra->bs;
+    int ret;
+
+    ret = bs1->write_async(bs1, sector_num, buf, n, NULL, NULL);
+    ra_invalidate(ra, sector_num, n);
+    return ret;
+}
+
+static int ra_flush_async(BlockDevice *bs,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceReadahead *ra = (BlockDeviceReadahead *)bs->opaque;
+    BlockDevice *bs1 = ra->bs;
+
+    return bs1->flush_async(bs1, NULL, NULL);
+}
+
+static int ra_discard_async(BlockDevice *bs,
+                            uint64_t sector_num, uint64_t n, int flags,
+                            BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceReadahead *ra = (BlockDeviceReadahead *)bs->opaque;
+    BlockDevice *bs1 = ra->bs;
+    int ret;
+
+    ret = bs1->discard_async(bs1, sector_num, n, flags, NULL, NULL);
+    ra_invalidate(ra, sector_num, n);
+    return ret;
+}
+
+static int ra_save_state(BlockDevice *bs, FILE *f)
+{
+    BlockDeviceReadahead *ra = (BlockDeviceReadahead *)bs->opaque;
+    return ra->bs->save_state(ra->bs, f);
+}
+
+/* the cache is dropped as the contents of the device change */
+static int ra_load_state(BlockDevice *bs, FILE *f)
+{
+    BlockDeviceReadahead *ra = (BlockDeviceReadahead *)bs->opaque;
+
+    ra_invalidate(ra, 0, ra->nb_sectors);
+    return ra->bs->load_state(ra->bs, f);
+}
+
+static void ra_close(BlockDevice *bs)
+{
+    BlockDeviceReadahead *ra = (BlockDeviceReadahead *)bs->opaque;
+    int i;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = TRUE;
+    pthread_cond_signal(&ra->queue_cond);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->thread, NULL);
+    for(i = 0; i < ra->nb_buffers; i++)
+        free(ra->buffers[i].data);
+    free(ra->buffers);
+    pthread_cond_destroy(&ra->queue_cond);
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    block_device_close(ra->bs);
+    free(ra);
+}
+
+BlockDevice *block_device_init_readahead(BlockDevice *bs1, int window_kb,
+                                         int cache_kb)
+{
+    BlockDevice *bs;
+    BlockDeviceReadahead *ra;
+    int i;
+
+    bs = (BlockDevice*)mallocz(sizeof(*bs));
+    ra = (BlockDeviceReadahead*)mallocz(sizeof(*ra));
+    ra->bs = bs1;
+    ra->nb_sectors = bs1->get_sector_count(bs1);
+    if (window_kb <= 0)
+        window_kb = RA_DEFAULT_WINDOW_KB;
+    window_kb = min_int(window_kb, RA_MAX_WINDOW_KB);
+    ra->window = max_int(window_kb * 1024 / SECTOR_SIZE, 1);
+    if (cache_kb <= 0)
+        cache_kb = window_kb * RA_DEFAULT_CACHE_WINDOWS;
+    /* at least the windows read ahead of one stream */
+    ra->nb_buffers = max_int(cache_kb / window_kb, RA_AHEAD + 1);
+    ra->buffers = (ReadaheadBuffer *)mallocz(sizeof(ra->buffers[0]) *
+                                             ra->nb_buffers);
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    pthread_cond_init(&ra->queue_cond, NULL);
+    init_list_head(&ra->lru);
+    init_list_head(&ra->queue);
+    for(i = 0; i < ra->nb_buffers; i++) {
+        ra->buffers[i].data = (uint8_t *)malloc((size_t)ra->window *
+                                                SECTOR_SIZE);
+        list_add_tail(&ra->buffers[i].lru_link, &ra->lru);
+    }
+    if (pthread_create(&ra->thread, NULL, ra_thread, ra) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+
+    bs->opaque = ra;
+    bs->get_sector_count = ra_get_sector_count;
+    bs->read_async = ra_read_async;
+    bs->write_async = ra_write_async;
+    if (bs1->flush_async)
+        bs->flush_async = ra_flush_async;
+    if (bs1->discard_async)
+        bs->discard_async = ra_discard_async;
+    if (bs1->save_state) {
+        bs->save_state = ra_save_state;
+        bs->load_state = ra_load_state;
+    }
+    bs->close = ra_close;
+    return bs;
+}
+
+/*********************************************************************/
+/* asynchronous execution on host threads */
+
+typedef struct {
+    BlockDevice *bs; /* underlying synchronous device */
+    int nb_queues;
+    int cur_queue; /* queue of the next requests */
+    WorkQueue **wq;
+} BlockDeviceAsync;
+
+typedef enum {
+    BA_OP_READ,
+    BA_OP_WRITE,
+    BA_OP_FLUSH,
+    BA_OP_DISCARD,
+} BlockAsyncOpEnum;
+
+typedef struct {
+    WorkItem work;
+    BlockDevice *bs;
+    BlockAsyncOpEnum op;
+    uint64_t sector_num;
+    uint8_t *buf;
+    uint64_t n;
+    int flags; /* BA_OP_DISCARD */
+    int ret;
+    BlockDeviceCompletionFunc *cb;
+    void *opaque;
+} BlockAsyncRequest;
+
+static int64_t ba_get_sector_count(BlockDevice *bs)
+{
+    BlockDeviceAsync *ba = (BlockDeviceAsync *)bs->opaque;
+    return ba->bs->get_sector_count(ba->bs);
+}
+
+static int ba_request_exec(BlockDevice *bs, BlockAsyncOpEnum op,
+                           uint64_t sector_num, uint8_t *buf, uint64_t n,
+                           int flags)
+{
+    switch(op) {
+    case BA_OP_READ:
+        return bs->read_async(bs, sector_num, buf, n, NULL, NULL);
+    case BA_OP_WRITE:
+        return bs->write_async(bs, sector_num, buf, n, NULL, NULL);
+    case BA_OP_FLUSH:
+        return bs->flush_async(bs, NULL, NULL);
+    case BA_OP_DISCARD:
+        return bs->discard_async(bs, sector_num, n, flags, NULL, NULL);
+    default:
+        abort();
+    }
+}
+
+/* worker thread */
+static void ba_request_run(void *opaque)
+{
+    BlockAsyncRequest *req = (BlockAsyncRequest *)opaque;
+
+    req->ret = ba_request_exec(req->bs, req->op, req->sector_num, req->buf,
+                               req->n, req->flags);
+    if (req->ret > 0)
+        req->ret = -1; /* the underlying device must be synchronous */
+}
+
+static void ba_request_done(void *opaque)
+{
+    BlockAsyncRequest *req = (BlockAsyncRequest *)opaque;
+
+    req->cb(req->opaque, req->ret);
+    free(req);
+}
+
+static int ba_submit(BlockDevice *bs, BlockAsyncOpEnum op,
+                     uint64_t sector_num, uint8_t *buf, uint64_t n, int flags,
+                     BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceAsync *ba = (BlockDeviceAsync *)bs->opaque;
+    BlockAsyncRequest *req;
+
+    /* no completion callback: execute synchronously */
+    if (!cb)
+        return ba_request_exec(ba->bs, op, sector_num, buf, n, flags);
+    req = (BlockAsyncRequest *)malloc(sizeof(*req));
+    req->bs = ba->bs;
+    req->op = op;
+    req->sector_num = sector_num;
+    req->buf = buf;
+    req->n = n;
+    req->flags = flags;
+    req->ret = 0;
+    req->cb = cb;
+    req->opaque = opaque;
+    workqueue_submit(ba->wq[ba->cur_queue], &req->work, ba_request_run,
+                     ba_request_done, req);
+    return 1;
+}
+
+static int ba_read_async(BlockDevice *bs,
+                         uint64_t sector_num, uint8_t *buf, int n,
+                         BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    return ba_submit(bs, BA_OP_READ, sector_num, buf, n, 0, cb, opaque);
+}
+
+static int ba_write_async(BlockDevice *bs,
+                          uint64_t sector_num, const uint8_t *buf, int n,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    return ba_submit(bs, BA_OP_WRITE, sector_num, (uint8_t *)buf, n, 0,
+                     cb, opaque);
+}
+
+static int ba_flush_async(BlockDevice *bs,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    return ba_submit(bs, BA_OP_FLUSH, 0, NULL, 0, 0, cb, opaque);
+}
+
+static int ba_discard_async(BlockDevice *bs,
+                            uint64_t sector_num, uint64_t n, int flags,
+                            BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    return ba_submit(bs, BA_OP_DISCARD, sector_num, NULL, n, flags,
+                     cb, opaque);
+}
+
+static void ba_poll(BlockDevice *bs)
+{
+    BlockDeviceAsync *ba = (BlockDeviceAsync *)bs->opaque;
+    int i;
+
+    for(i = 0; i < ba->nb_queues; i++)
+        workqueue_poll(ba->wq[i]);
+}
+
+static void ba_set_queue(BlockDevice *bs, int queue_idx)
+{
+    BlockDeviceAsync *ba = (BlockDeviceAsync *)bs->opaque;
+
+    if (queue_idx >= 0 && queue_idx < ba->nb_queues)
+        ba->cur_queue = queue_idx;
+}
+
+static int ba_save_state(BlockDevice *bs, FILE *f)
+{
+    BlockDeviceAsync *ba = (BlockDeviceAsync *)bs->opaque;
+    return ba->bs->save_state(ba->bs, f);
+}
+
+static int ba_load_state(BlockDevice *bs, FILE *f)
+{
+    BlockDeviceAsync *ba = (BlockDeviceAsync *)bs->opaque;
+    return ba->bs->load_state(ba->bs, f);
+}
+
+static void ba_close(BlockDevice *bs)
+{
+    BlockDeviceAsync *ba = (BlockDeviceAsync *)bs->opaque;
+    int i;
+
+    for(i = 0; i < ba->nb_queues; i++)
+        workqueue_free(ba->wq[i]);
+    free(ba->wq);
+    block_device_close(ba->bs);
+    free(ba);
+}
+
+BlockDevice *block_device_init_async(BlockDevice *bs1, int nb_threads,
+                                     int nb_queues)
+{
+    BlockDevice *bs;
+    BlockDeviceAsync *ba;
+    int i;
+
+    if (nb_queues <= 0)
+        nb_queues = 1;
+    bs = (BlockDevice*)mallocz(sizeof(*bs));
+    ba = (BlockDeviceAsync*)mallocz(sizeof(*ba));
+    ba->bs = bs1;
+    ba->nb_queues = nb_queues;
+    ba->wq = (WorkQueue **)mallocz(sizeof(ba->wq[0]) * nb_queues);
+    for(i = 0; i < nb_queues; i++)
+        ba->wq[i] = workqueue_new(nb_threads);
+
+    bs->opaque = ba;
+    bs->get_sector_count = ba_get_sector_count;
+    bs->read_async = ba_read_async;
+    bs->write_async = ba_write_async;
+    if (bs1->flush_async)
+        bs->flush_async = ba_flush_async;
+    if (bs1->discard_async)
+        bs->discard_async = ba_discard_async;
+    bs->poll = ba_poll;
+    if (nb_queues > 1)
+        bs->set_queue = ba_set_queue;
+    if (bs1->save_state) {
+        bs->save_state = ba_save_state;
+        bs->load_state = ba_load_state;
+    }
+    bs->close = ba_close;
+    return bs;
+}
+
+/*********************************************************************/
+/* request trace */
+
+typedef struct {
+    BlockDevice *bs; /* traced device */
+    pthread_mutex_t lock; /* protects the fields below */
+    FILE *f;
+    uint64_t start_ns;
+    int in_flight;
+} BlockDeviceTrace;
+
+typedef struct {
+    BlockDevice *bs;
+    BlockTraceRecord rec;
+    uint64_t submit_ns;
+    BlockDeviceCompletionFunc *cb;
+    void *opaque;
+} BlockTraceRequest;
+
+uint64_t block_trace_get_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t bt_get_sector_count(BlockDevice *bs)
+{
+    BlockDeviceTrace *bt = (BlockDeviceTrace *)bs->opaque;
+    return bt->bs->get_sector_count(bt->bs);
+}
+
+static BlockTraceRequest *bt_start(BlockDevice *bs, int op,
+                                   uint64_t sector_num, uint64_t n, int flags,
+                                   BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceTrace *bt = (BlockDeviceTrace *)bs->opaque;
+    BlockTraceRequest *req;
+
+    req = (BlockTraceRequest *)malloc(sizeof(*req));
+    req->bs = bs;
+    req->cb = cb;
+    req->opaque = opaque;
+    req->submit_ns = block_trace_get_ns();
+    req->rec.sector_num = sector_num;
+    req->rec.n = n;
+    req->rec.op = op;
+    req->rec.flags = flags;
+    pthread_mutex_lock(&bt->lock);
+    req->rec.timestamp = req->submit_ns - bt->start_ns;
+    req->rec.depth = min_int(bt->in_flight, 0xffff);
+    bt->in_flight++;
+    pthread_mutex_unlock(&bt->lock);
+    return req;
+}
+
+static void bt_end(BlockTraceRequest *req, int ret)
+{
+    BlockDeviceTrace *bt = (BlockDeviceTrace *)req->bs->opaque;
+
+    req->rec.latency = block_trace_get_ns() - req->submit_ns;
+    if (ret < 0)
+        req->rec.flags |= BLOCK_TRACE_ERROR;
+    pthread_mutex_lock(&bt->lock);
+    bt->in_flight--;
+    fwrite(&req->rec, sizeof(req->rec), 1, bt->f);
+    pthread_mutex_unlock(&bt->lock);
+    free(req);
+}
+
+static void bt_cb(void *opaque, int ret)
+{
+    BlockTraceRequest *req = (BlockTraceRequest *)opaque;
+    BlockDeviceCompletionFunc *cb = req->cb;
+    void *cb_opaque = req->opaque;
+
+    bt_end(req, ret);
+    cb(cb_opaque, ret);
+}
+
+/* requests without completion callback are executed synchronously */
+static int bt_submitted(BlockTraceRequest *req, int ret)
+{
+    if (ret <= 0)
+        bt_end(req, ret);
+    return ret;
+}
+
+static int bt_read_async(BlockDevice *bs,
+                         uint64_t sector_num, uint8_t *buf, int n,
+                         BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceTrace *bt = (BlockDeviceTrace *)bs->opaque;
+    BlockTraceRequest *req;
+
+    req = bt_start(bs, BLOCK_TRACE_READ, sector_num, n, 0, cb, opaque);
+    return bt_submitted(req, bt->bs->read_async(bt->bs, sector_num, buf, n,
+                                                cb ? bt_cb : NULL, req));
+}
+
+static int bt_write_async(BlockDevice *bs,
+                          uint64_t sector_num, const uint8_t *buf, int n,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceTrace *bt = (BlockDeviceTrace *)bs->opaque;
+    BlockTraceRequest *req;
+
+    req = bt_start(bs, BLOCK_TRACE_WRITE, sector_num, n, 0, cb, opaque);
+    return bt_submitted(req, bt->bs->write_async(bt->bs, sector_num, buf, n,
+                                                 cb ? bt_cb : NULL, req));
+}
+
+static int bt_flush_async(BlockDevice *bs,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceTrace *bt = (BlockDeviceTrace *)bs->opaque;
+    BlockTraceRequest *req;
+
+    req = bt_start(bs, BLOCK_TRACE_FLUSH, 0, 0, 0, cb, opaque);
+    return bt_submitted(req, bt->bs->flush_async(bt->bs, cb ? bt_cb : NULL,
+                                                 req));
+}
+
+static int bt_discard_async(BlockDevice *bs,
+                            uint64_t sector_num, uint64_t n, int flags,
+                            BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceTrace *bt = (BlockDeviceTrace *)bs->opaque;
+    BlockTraceRequest *req;
+
+    req = bt_start(bs, BLOCK_TRACE_DISCARD, sector_num, n,
+                   flags & BF_DISCARD_ZERO ? BLOCK_TRACE_ZERO : 0,
+                   cb, opaque);
+    return bt_submitted(req, bt->bs->discard_async(bt->bs, sector_num, n,
+                                                   flags, cb ? bt_cb : NULL,
+                                                   req));
+}
+
+static void bt_poll(BlockDevice *bs)
+{
+    BlockDeviceTrace *bt = (BlockDeviceTrace *)bs->opaque;
+    bt->bs->poll(bt->bs);
+}
+
+static void bt_set_queue(BlockDevice *bs, int queue_idx)
+{
+    BlockDeviceTrace *bt = (BlockDeviceTrace *)bs->opaque;
+    bt->bs->set_queue(bt->bs, queue_idx);
+}
+
+static int bt_save_state(BlockDevice *bs, FILE *f)
+{
+    BlockDeviceTrace *bt = (BlockDeviceTrace *)bs->opaque;
+    return bt->bs->save_state(bt->bs, f);
+}
+
+static int bt_load_state(BlockDevice *bs, FILE *f)
+{
+    BlockDeviceTrace *bt = (BlockDeviceTrace *)bs->opaque;
+    return bt->bs->load_state(bt->bs, f);
+}
+
+static void bt_close(BlockDevice *bs)
+{
+    BlockDeviceTrace *bt = (BlockDeviceTrace *)bs->opaque;
+
+    block_device_close(bt->bs);
+    fclose(bt->f);
+    pthread_mutex_destroy(&bt->lock);
+    free(bt);
+}
+
+BlockDevice *block_device_init_trace(BlockDevice *bs1, const char *filename)
+{
+    BlockDevice *bs;
+    BlockDeviceTrace *bt;
+    BlockTraceHeader h;
+    FILE *f;
+
+    f = fopen(filename, "wb");
+    if (!f) {
+        perror(filename);
+        return NULL;
+    }
+    memset(&h, 0, sizeof(h));
+    h.magic = BLOCK_TRACE_MAGIC;
+    h.version = BLOCK_TRACE_VERSION;
+    h.record_size = sizeof(BlockTraceRecord);
+    h.nb_sectors = bs1->get_sector_count(bs1);
+    fwrite(&h, sizeof(h), 1, f);
+
+    bs = (BlockDevice*)mallocz(sizeof(*bs));
+    bt = (BlockDeviceTrace*)mallocz(sizeof(*bt));
+    bt->bs = bs1;
+    bt->f = f;
+    bt->start_ns = block_trace_get_ns();
+    pthread_mutex_init(&bt->lock, NULL);
+
+    bs->opaque = bt;
+    bs->get_sector_count = bt_get_sector_count;
+    bs->read_async = bt_read_async;
+    bs->write_async = bt_write_async;
+    if (bs1->flush_async)
+        bs->flush_async = bt_flush_async;
+    if (bs1->discard_async)
+        bs->discard_async = bt_discard_async;
+    if (bs1->poll)
+        bs->poll = bt_poll;
+    if (bs1->set_queue)
+        bs->set_queue = bt_set_queue;
+    if (bs1->save_state) {
+        bs->save_state = bt_save_state;
+        bs->load_state = bt_load_state;
+    }
+    bs->close = bt_close;
+    return bs;
+}
+
+void block_device_close(BlockDevice *bs)
+{
+    if (bs->close)
+        bs->close(bs);
+    free(bs);
+}
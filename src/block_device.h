@@ -0,0 +1,211 @@
+/*
+ * Block device backends
+ *
+ * Copyright (c) 2016 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef BLOCK_DEVICE_H
+#define BLOCK_DEVICE_H
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SECTOR_SIZE 512
+
+typedef void BlockDeviceCompletionFunc(void *opaque, int ret);
+
+typedef enum {
+    BF_MODE_RO,
+    BF_MODE_RW,
+    BF_MODE_SNAPSHOT,
+} BlockDeviceModeEnum;
+
+typedef struct BlockDevice BlockDevice;
+
+/* discard_async() flag: the sectors must read as zeros afterwards.
+   Otherwise their content is undefined. */
+#define BF_DISCARD_ZERO (1 << 0)
+
+/* read_async(), write_async(), flush_async() and discard_async() return
+   0 if the request has completed, < 0 if error, or > 0 if 'cb' will be
+   called later from poll(). */
+struct BlockDevice {
+    int64_t (*get_sector_count)(BlockDevice *bs);
+    int (*read_async)(BlockDevice *bs,
+                      uint64_t sector_num, uint8_t *buf, int n,
+                      BlockDeviceCompletionFunc *cb, void *opaque);
+    int (*write_async)(BlockDevice *bs,
+                       uint64_t sector_num, const uint8_t *buf, int n,
+                       BlockDeviceCompletionFunc *cb, void *opaque);
+    /* write the data to stable storage. NULL if not supported. */
+    int (*flush_async)(BlockDevice *bs,
+                       BlockDeviceCompletionFunc *cb, void *opaque);
+    /* release the storage of 'n' sectors. NULL if not supported. */
+    int (*discard_async)(BlockDevice *bs,
+                         uint64_t sector_num, uint64_t n, int flags,
+                         BlockDeviceCompletionFunc *cb, void *opaque);
+    /* run the callbacks of the completed asynchronous requests. NULL if
+       the device is synchronous. */
+    void (*poll)(BlockDevice *bs);
+    /* the next requests come from the request queue 'queue_idx', so
+       that the queues are executed independently. NULL if the device
+       has a single queue. */
+    void (*set_queue)(BlockDevice *bs, int queue_idx);
+    /* write or read back the data which is not in the image file, such
+       as the sectors of a snapshot overlay. No request must be in
+       flight. Return < 0 if error. NULL if the device has no such
+       data. */
+    int (*save_state)(BlockDevice *bs, FILE *f);
+    int (*load_state)(BlockDevice *bs, FILE *f);
+    void (*close)(BlockDevice *bs);
+    void *opaque;
+};
+
+/* synchronous raw image file access. The read/write functions are
+   thread safe. In BF_MODE_SNAPSHOT, the file is only read and the written
+   sectors are kept in a copy on write overlay. */
+BlockDevice *block_device_init(const char *filename, BlockDeviceModeEnum mode);
+/* memory mapped raw image file. Pages are faulted in on access. */
+BlockDevice *block_device_init_mmap(const char *filename,
+                                    BlockDeviceModeEnum mode);
+/* memory mapped copy of a read only image, shared by the processes
+   given the same 'cache_dir' (e.g. /dev/shm). The first one copies the
+   image in a file of 'cache_dir', replacing the copy of its previous
+   version. Unlike the page cache of the image, the copy is not evicted
+   and does not change if the image is rewritten. 'mode' is BF_MODE_RO
+   or BF_MODE_SNAPSHOT, where the written pages are private. */
+BlockDevice *block_device_init_shared(const char *filename,
+                                      const char *cache_dir,
+                                      BlockDeviceModeEnum mode);
+/* read only compressed image made by blkpack. Up to 'cache_mb' MB of
+   decompressed chunks are cached (0 for 64 MB). If 'prefetch' is not 0,
+   the chunks following a sequential read are decompressed in advance by
+   a host thread, up to 'prefetch' of them. Return NULL if error. */
+BlockDevice *block_device_init_compressed(const char *filename, int cache_mb,
+                                          int prefetch);
+/* copy on write overlay over the synchronous device 'bs', which is only
+   read. If 'delta_filename' is not NULL, the overlay is loaded from this
+   file when it exists and is saved to it when the device is closed. */
+BlockDevice *block_device_init_overlay(BlockDevice *bs,
+                                       const char *delta_filename);
+/* write the sectors modified in the overlay 'bs' to a delta file, or
+   add those of a delta file to it. Return < 0 if error. */
+int block_device_overlay_save(BlockDevice *bs, const char *filename);
+int block_device_overlay_load(BlockDevice *bs, const char *filename);
+/* cache the synchronous device 'bs' by windows of 'window_kb' KB, with
+   at most 'cache_kb' KB of them (0 for the defaults, 128 KB and 16
+   windows). The windows following a sequential stream of reads are read
+   in advance by a host thread. The result is also synchronous. */
+BlockDevice *block_device_init_readahead(BlockDevice *bs, int window_kb,
+                                         int cache_kb);
+/* execute the requests of the synchronous device 'bs' on 'nb_threads'
+   host threads, with one work queue per request queue among
+   'nb_queues' */
+BlockDevice *block_device_init_async(BlockDevice *bs, int nb_threads,
+                                     int nb_queues);
+
+/* record the requests of 'bs' to a trace file. Return NULL if error. */
+BlockDevice *block_device_init_trace(BlockDevice *bs,
+                                     const char *filename);
+
+void block_device_close(BlockDevice *bs);
+
+/* trace file: a header followed by one record per completed request, in
+   completion order. The fields are in host byte order. */
+#define BLOCK_TRACE_MAGIC   0x4543415254767073ULL /* "spvTRACE" */
+#define BLOCK_TRACE_VERSION 1
+
+typedef enum {
+    BLOCK_TRACE_READ,
+    BLOCK_TRACE_WRITE,
+    BLOCK_TRACE_FLUSH,
+    BLOCK_TRACE_DISCARD,
+} BlockTraceOpEnum;
+
+/* record flags */
+#define BLOCK_TRACE_ZERO  (1 << 0) /* discard with BF_DISCARD_ZERO */
+#define BLOCK_TRACE_ERROR (1 << 7)
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t nb_sectors;
+} BlockTraceHeader;
+
+typedef struct {
+    uint64_t timestamp; /* submission, in ns from the start of the trace */
+    uint64_t latency; /* ns from submission to completion */
+    uint64_t sector_num;
+    uint32_t n; /* sectors */
+    uint16_t depth; /* requests in flight at submission */
+    uint8_t op; /* BlockTraceOpEnum */
+    uint8_t flags;
+} BlockTraceRecord;
+
+/* compressed image: a header, the index of the chunks, then the
+   compressed chunks. The fields are in host byte order. */
+#define BLOCK_COMPRESSED_MAGIC   0x5352504d43767073ULL /* "spvCMPRS" */
+#define BLOCK_COMPRESSED_VERSION 1
+#define BLOCK_COMPRESSED_MAX_CHUNK_SIZE (16 << 20)
+
+/* index entry flags */
+#define BLOCK_COMPRESSED_RAW (1 << 0) /* stored without compression */
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t chunk_size; /* bytes, multiple of SECTOR_SIZE */
+    uint64_t nb_sectors;
+    uint64_t nb_chunks;
+} BlockCompressedHeader;
+
+typedef struct {
+    uint64_t offset; /* in the file */
+    uint32_t len; /* 0 for a chunk of zeros */
+    uint32_t flags;
+} BlockCompressedIndexEntry;
+
+/* monotonic host time in ns */
+uint64_t block_trace_get_ns(void);
+
+/* map the whole image file. BF_MODE_RO gives a read only mapping,
+   BF_MODE_RW a shared one and BF_MODE_SNAPSHOT a private copy on write
+   one. Return NULL if error. */
+uint8_t *block_device_map_file(const char *filename, BlockDeviceModeEnum mode,
+                               int64_t *pnb_sectors);
+/* same with the shared copy of block_device_init_shared() */
+uint8_t *block_device_map_shared(const char *filename, const char *cache_dir,
+                                 BlockDeviceModeEnum mode, int64_t *pnb_sectors);
+void block_device_unmap_file(uint8_t *ptr, int64_t nb_sectors);
+/* write the pages modified in a BF_MODE_SNAPSHOT mapping, or copy them
+   back to a new mapping of the same file. Return < 0 if error. */
+int block_device_map_save(FILE *f, const uint8_t *ptr, int64_t nb_sectors);
+int block_device_map_load(FILE *f, uint8_t *ptr, int64_t nb_sectors);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BLOCK_DEVICE_H */
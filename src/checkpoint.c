@@ -0,0 +1,150 @@
+/*
+ * Device checkpoints
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <signal.h>
+
+#include "cutils.h"
+#include "checkpoint.h"
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    char device[20]; /* NUL terminated */
+} CheckpointHeader;
+
+void checkpoint_init(void)
+{
+    signal_counter_init(SIGUSR2);
+}
+
+BOOL checkpoint_requested(int *pcount)
+{
+    int n = signal_counter_get(SIGUSR2);
+
+    if (n == *pcount)
+        return FALSE;
+    *pcount = n;
+    return TRUE;
+}
+
+static void checkpoint_header_init(CheckpointHeader *h, const char *device)
+{
+    memset(h, 0, sizeof(*h));
+    h->magic = CHECKPOINT_MAGIC;
+    h->version = CHECKPOINT_VERSION;
+    snprintf(h->device, sizeof(h->device), "%s", device);
+}
+
+CheckpointFile *checkpoint_create(const char *filename, const char *device)
+{
+    CheckpointFile *cp;
+    CheckpointHeader h;
+
+    cp = (CheckpointFile *)mallocz(sizeof(*cp));
+    cp->filename = strdup(filename);
+    cp->tmp_filename = (char *)malloc(strlen(filename) + 5);
+    sprintf(cp->tmp_filename, "%s.tmp", filename);
+    cp->f = fopen(cp->tmp_filename, "wb");
+    if (!cp->f) {
+        perror(cp->tmp_filename);
+        free(cp->tmp_filename);
+        free(cp->filename);
+        free(cp);
+        return NULL;
+    }
+    checkpoint_header_init(&h, device);
+    checkpoint_put(cp, &h, sizeof(h));
+    return cp;
+}
+
+CheckpointFile *checkpoint_open(const char *filename, const char *device)
+{
+    CheckpointFile *cp;
+    CheckpointHeader h, h1;
+
+    cp = (CheckpointFile *)mallocz(sizeof(*cp));
+    cp->filename = strdup(filename);
+    cp->f = fopen(filename, "rb");
+    if (!cp->f) {
+        perror(filename);
+        free(cp->filename);
+        free(cp);
+        return NULL;
+    }
+    checkpoint_header_init(&h, device);
+    checkpoint_get(cp, &h1, sizeof(h1));
+    if (h1.magic != h.magic || h1.version != h.version) {
+        checkpoint_fail(cp, "not a device checkpoint");
+    } else if (memcmp(h1.device, h.device, sizeof(h.device)) != 0) {
+        h1.device[sizeof(h1.device) - 1] = '\0';
+        checkpoint_fail(cp, "checkpoint of a %s device, not %s",
+                        h1.device, device);
+    }
+    if (cp->error) {
+        checkpoint_close(cp);
+        return NULL;
+    }
+    return cp;
+}
+
+int checkpoint_close(CheckpointFile *cp)
+{
+    int ret;
+
+    if (cp->tmp_filename) {
+        if (fclose(cp->f) != 0 && !cp->error) {
+            perror(cp->tmp_filename);
+            cp->error = TRUE;
+        }
+        if (cp->error) {
+            remove(cp->tmp_filename);
+        } else if (rename(cp->tmp_filename, cp->filename) < 0) {
+            perror(cp->filename);
+            cp->error = TRUE;
+        }
+        free(cp->tmp_filename);
+    } else {
+        fclose(cp->f);
+    }
+    ret = cp->error ? -1 : 0;
+    free(cp->filename);
+    free(cp);
+    return ret;
+}
+
+void checkpoint_put(CheckpointFile *cp, const void *buf, size_t len)
+{
+    if (cp->error)
+        return;
+    if (fwrite(buf, 1, len, cp->f) != len) {
+        perror(cp->tmp_filename);
+        cp->error = TRUE;
+    }
+}
+
+void checkpoint_get(CheckpointFile *cp, void *buf, size_t len)
+{
+    if (!cp->error && fread(buf, 1, len, cp->f) != len)
+        checkpoint_fail(cp, "truncated checkpoint");
+    if (cp->error)
+        memset(buf, 0, len);
+}
+
+void checkpoint_fail(CheckpointFile *cp, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (cp->error)
+        return;
+    fprintf(stderr, "%s: ", cp->filename);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    cp->error = TRUE;
+}
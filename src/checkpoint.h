@@ -0,0 +1,109 @@
+/*
+ * Device checkpoints
+ *
+ * A device given a `checkpoint` file writes its state to it when the
+ * process receives SIGUSR2, from its next tick, so that all the devices
+ * are saved between the same two simulated instructions. A device given
+ * a `restore` file reads it back when it is created. Each device
+ * instance needs its own file.
+ *
+ * The guest RAM and the harts are not included: a device checkpoint is
+ * restored together with a memory checkpoint of the simulator taken at
+ * the same time. The file is a header naming the device followed by its
+ * fields in host byte order.
+ */
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdio.h>
+#include <inttypes.h>
+#include "cutils.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHECKPOINT_MAGIC   0x54504b4843767073ULL /* "spvCHKPT" */
+#define CHECKPOINT_VERSION 1
+
+typedef struct {
+    FILE *f;
+    char *filename;
+    char *tmp_filename; /* NULL when reading */
+    BOOL error;
+} CheckpointFile;
+
+/* write a checkpoint of the device 'device'. The file is only replaced
+   when it is closed without error. */
+CheckpointFile *checkpoint_create(const char *filename, const char *device);
+/* return NULL if error or if the file is not a checkpoint of 'device' */
+CheckpointFile *checkpoint_open(const char *filename, const char *device);
+/* return < 0 if a field could not be written or read */
+int checkpoint_close(CheckpointFile *cp);
+
+void checkpoint_put(CheckpointFile *cp, const void *buf, size_t len);
+/* a failed read fills 'buf' with zeros */
+void checkpoint_get(CheckpointFile *cp, void *buf, size_t len);
+/* invalid checkpoint, e.g. made with other device parameters */
+void __attribute__((format(printf, 2, 3)))
+checkpoint_fail(CheckpointFile *cp, const char *fmt, ...);
+
+/* install the SIGUSR2 handler */
+void checkpoint_init(void);
+/* TRUE once for each SIGUSR2 received since the previous call with the
+   same 'pcount', which starts at 0 */
+BOOL checkpoint_requested(int *pcount);
+
+static inline void checkpoint_put_u8(CheckpointFile *cp, uint8_t v)
+{
+    checkpoint_put(cp, &v, sizeof(v));
+}
+
+static inline void checkpoint_put_u16(CheckpointFile *cp, uint16_t v)
+{
+    checkpoint_put(cp, &v, sizeof(v));
+}
+
+static inline void checkpoint_put_u32(CheckpointFile *cp, uint32_t v)
+{
+    checkpoint_put(cp, &v, sizeof(v));
+}
+
+static inline void checkpoint_put_u64(CheckpointFile *cp, uint64_t v)
+{
+    checkpoint_put(cp, &v, sizeof(v));
+}
+
+static inline uint8_t checkpoint_get_u8(CheckpointFile *cp)
+{
+    uint8_t v;
+    checkpoint_get(cp, &v, sizeof(v));
+    return v;
+}
+
+static inline uint16_t checkpoint_get_u16(CheckpointFile *cp)
+{
+    uint16_t v;
+    checkpoint_get(cp, &v, sizeof(v));
+    return v;
+}
+
+static inline uint32_t checkpoint_get_u32(CheckpointFile *cp)
+{
+    uint32_t v;
+    checkpoint_get(cp, &v, sizeof(v));
+    return v;
+}
+
+static inline uint64_t checkpoint_get_u64(CheckpointFile *cp)
+{
+    uint64_t v;
+    checkpoint_get(cp, &v, sizeof(v));
+    return v;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CHECKPOINT_H */
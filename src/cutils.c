@@ -29,6 +29,7 @@
 #include <stdarg.h>
 #include <sys/time.h>
 #include <ctype.h>
+#include <signal.h>
 
 #include "cutils.h"
 
@@ -118,3 +119,45 @@ void dbuf_free(DynBuf *s)
     free(s->buf);
     memset(s, 0, sizeof(*s));
 }
+
+typedef struct {
+    BOOL installed;
+    volatile sig_atomic_t count;
+    struct sigaction old_action;
+} SignalCounter;
+
+static SignalCounter signal_counters[NSIG];
+
+static void signal_counter_handler(int sig, siginfo_t *info, void *ctx)
+{
+    SignalCounter *sc = &signal_counters[sig];
+
+    sc->count++;
+    if (sc->old_action.sa_flags & SA_SIGINFO) {
+        if (sc->old_action.sa_sigaction)
+            sc->old_action.sa_sigaction(sig, info, ctx);
+    } else if (sc->old_action.sa_handler != SIG_DFL &&
+               sc->old_action.sa_handler != SIG_IGN) {
+        sc->old_action.sa_handler(sig);
+    }
+}
+
+void signal_counter_init(int sig)
+{
+    SignalCounter *sc = &signal_counters[sig];
+    struct sigaction sa;
+
+    if (sc->installed)
+        return;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = signal_counter_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(sig, &sa, &sc->old_action);
+    sc->installed = TRUE;
+}
+
+int signal_counter_get(int sig)
+{
+    return signal_counters[sig].count;
+}
@@ -197,6 +197,11 @@ void dbuf_putc(DynBuf *s, uint8_t c);
 void dbuf_putstr(DynBuf *s, const char *str);
 void dbuf_free(DynBuf *s);
 
+/* count the deliveries of the signal 'sig'. The handler installed
+   before, e.g. by the simulator, is still called. */
+void signal_counter_init(int sig);
+int signal_counter_get(int sig);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,85 @@
+/*
+ * Guest RAM access for device DMA
+ *
+ * Devices translate a guest physical page to a host pointer once through
+ * simif_t::addr_to_mem() and copy whole page fragments with memcpy. Pages
+ * which are not backed by host memory (MMIO, holes) fall back to the
+ * debug MMU one byte at a time.
+ */
+#ifndef DMA_H
+#define DMA_H
+
+#include <string.h>
+#include <riscv/simif.h>
+#include <riscv/mmu.h>
+
+#define DMA_PAGE_SIZE 4096
+
+/* return NULL if no RAM at this address. The mapping is valid for one page */
+static inline uint8_t *dma_get_ram_ptr(const simif_t *sim, reg_t paddr)
+{
+    return (uint8_t *)const_cast<simif_t *>(sim)->addr_to_mem(paddr);
+}
+
+/* slow path: 'count' bytes inside one page, through the debug MMU */
+static inline void dma_mmu_load_intrapage(const simif_t *sim, uint8_t *buf,
+                                          reg_t addr, size_t count)
+{
+    mmu_t *simdram = sim->debug_mmu;
+    size_t i;
+    for(i = 0; i < count; i++)
+        buf[i] = simdram->load<uint8_t>(addr + i);
+}
+
+static inline void dma_mmu_store_intrapage(const simif_t *sim, reg_t addr,
+                                           const uint8_t *buf, size_t count)
+{
+    mmu_t *simdram = sim->debug_mmu;
+    size_t i;
+    for(i = 0; i < count; i++)
+        simdram->store<uint8_t>(addr + i, buf[i]);
+}
+
+static inline void dma_memcpy_from_ram(const simif_t *sim, uint8_t *buf,
+                                       reg_t addr, size_t count)
+{
+    uint8_t *ptr;
+    size_t l;
+
+    while (count > 0) {
+        l = DMA_PAGE_SIZE - (addr & (DMA_PAGE_SIZE - 1));
+        if (l > count)
+            l = count;
+        ptr = dma_get_ram_ptr(sim, addr);
+        if (ptr)
+            memcpy(buf, ptr, l);
+        else
+            dma_mmu_load_intrapage(sim, buf, addr, l);
+        addr += l;
+        buf += l;
+        count -= l;
+    }
+}
+
+static inline void dma_memcpy_to_ram(const simif_t *sim, reg_t addr,
+                                     const uint8_t *buf, size_t count)
+{
+    uint8_t *ptr;
+    size_t l;
+
+    while (count > 0) {
+        l = DMA_PAGE_SIZE - (addr & (DMA_PAGE_SIZE - 1));
+        if (l > count)
+            l = count;
+        ptr = dma_get_ram_ptr(sim, addr);
+        if (ptr)
+            memcpy(ptr, buf, l);
+        else
+            dma_mmu_store_intrapage(sim, addr, buf, l);
+        addr += l;
+        buf += l;
+        count -= l;
+    }
+}
+
+#endif /* DMA_H */
@@ -23,6 +23,7 @@
  */
 
 #include <inttypes.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -185,6 +186,12 @@ struct FSDevice {
             uint8_t *buf, int count);
     int (*fs_write)(FSDevice *fs, FSFile *f, uint64_t offset,
              const uint8_t *buf, int count);
+    /* same as fs_read()/fs_write() with a scatter-gather buffer. NULL if
+       not supported. */
+    int (*fs_readv)(FSDevice *fs, FSFile *f, uint64_t offset,
+                    const struct iovec *iov, int iovcnt);
+    int (*fs_writev)(FSDevice *fs, FSFile *f, uint64_t offset,
+                     const struct iovec *iov, int iovcnt);
     int (*fs_link)(FSDevice *fs, FSFile *df, FSFile *f, const char *name);
     int (*fs_symlink)(FSDevice *fs, FSQID *qid,
                       FSFile *f, const char *name, const char *symgt, uint32_t gid);
@@ -197,9 +204,32 @@ struct FSDevice {
     int (*fs_unlinkat)(FSDevice *fs, FSFile *f, const char *name);
     int (*fs_lock)(FSDevice *fs, FSFile *f, const FSLock *lock);
     int (*fs_getlock)(FSDevice *fs, FSFile *f, FSLock *lock);
+    /* checkpoint of a file: write in 'buf' the record from which
+       fs_restore_file() creates an equivalent file, possibly opened.
+       Return its length, or < 0 if the file cannot be saved. NULL if not
+       supported. */
+    int (*fs_save_file)(FSDevice *fs, FSFile *f, uint8_t *buf, int buf_size);
+    FSFile *(*fs_restore_file)(FSDevice *fs, const uint8_t *buf, int len);
 };
 
-FSDevice *fs_disk_init(const char *root_path);
+/* largest fs_save_file() record */
+#define FS_FILE_STATE_MAX 4200
+
+/* host metadata cache of fs_disk */
+typedef enum {
+    FS_CACHE_NONE,
+    FS_CACHE_LOOSE, /* only invalidated by the changes made through the device */
+    FS_CACHE_STRICT, /* entries also expire after one second */
+} FSDiskCacheModeEnum;
+
+/* host file access of fs_disk */
+typedef enum {
+    FS_DISK_PATH, /* path based system calls */
+    FS_DISK_AT, /* *at() system calls relative to one descriptor per file */
+} FSDiskBackendEnum;
+
+FSDevice *fs_disk_init(const char *root_path, FSDiskCacheModeEnum cache_mode,
+                       FSDiskBackendEnum backend);
 
 void fs_export_file(const char *filename,
                     const uint8_t *buf, int buf_len);
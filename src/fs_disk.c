@@ -24,16 +24,21 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <inttypes.h>
 #include <assert.h>
 #include <stdarg.h>
 #include <sys/statfs.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "cutils.h"
 #include "list.h"
@@ -42,25 +47,59 @@
 typedef struct {
     FSDevice common;
     char *root_path;
+    FSDiskCacheModeEnum cache_mode;
+    pthread_mutex_t cache_lock; /* protects the cache fields */
+    struct list_head *cache_hash; /* FSCacheEntry.hash_link */
+    struct list_head cache_lru; /* FSCacheEntry.lru_link */
+    int cache_count;
 } FSDeviceDisk;
 
 static void fs_close(FSDevice *fs, FSFile *f);
 
+/* opened directory, read with large getdents64() batches. Sequential
+   readdir requests are answered from the buffered entries. */
+#define DIR_BUF_SIZE 65536
+
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off; /* offset of the next entry */
+    uint16_t d_reclen;
+    uint8_t d_type;
+    char d_name[];
+} FSDirent64;
+
+typedef struct {
+    int fd;
+    int len; /* bytes in buf */
+    int pos; /* next buffered entry */
+    int cache_idx; /* cached listing: index of the entry following the
+                      previous request (cache_lock) */
+    uint64_t next_off; /* directory offset of the entry at pos */
+    uint8_t buf[DIR_BUF_SIZE] __attribute__((aligned(8)));
+} FSDirStream;
+
 struct FSFile {
     uint32_t uid;
-    char *path; /* complete path */
+    char *path; /* complete path, NULL with FS_DISK_AT */
+    int pathfd; /* O_PATH descriptor with FS_DISK_AT, -1 otherwise */
     BOOL is_opened;
     BOOL is_dir;
+    uint32_t open_flags; /* P9_O_x flags of the open file */
     union {
         int fd;
-        DIR *dirp;
+        FSDirStream *dir;
     } u;
+    BOOL ino_valid; /* the inode of path is known */
+    uint64_t dev;
+    uint64_t ino;
 };
 
 static void fs_delete(FSDevice *fs, FSFile *f)
 {
     if (f->is_opened)
         fs_close(fs, f);
+    if (f->pathfd >= 0)
+        close(f->pathfd);
     free(f->path);
     free(f);
 }
@@ -71,6 +110,7 @@ static FSFile *fid_create(FSDevice *s1, char *path, uint32_t uid)
     FSFile *f;
     f = (FSFile*)mallocz(sizeof(*f));
     f->path = path;
+    f->pathfd = -1;
     f->uid = uid;
     return f;
 }
@@ -169,6 +209,350 @@ static char *compose_path(const char *path, const char *name)
     return d;
 }
 
+/* Metadata cache (cache=loose|strict): stat results indexed by inode,
+   the inode of the names looked up in a directory, and the entries of
+   whole directories. The entries are invalidated by the modifications
+   made through this device. With FS_CACHE_STRICT, they also expire after
+   FS_CACHE_TIMEOUT ms and the directory entries are reused only while
+   the directory mtime is unchanged. */
+
+#define FS_CACHE_HASH_BITS 14
+#define FS_CACHE_MAX_ENTRIES 65536
+#define FS_CACHE_TIMEOUT 1000
+
+typedef enum {
+    FS_CACHE_ATTR, /* stat() of an inode */
+    FS_CACHE_DIRENT, /* inode of a name in a directory */
+    FS_CACHE_DIR, /* entries of a directory */
+} FSCacheEntryType;
+
+typedef struct {
+    uint64_t ino;
+    int64_t d_off; /* host offset of the next entry */
+    uint8_t d_type;
+    char *name;
+} FSCacheDirEntry;
+
+typedef struct {
+    struct list_head hash_link;
+    struct list_head lru_link; /* most recently used first */
+    FSCacheEntryType type;
+    uint64_t dev;
+    uint64_t ino; /* inode, or directory inode */
+    char *name; /* FS_CACHE_DIRENT only */
+    int64_t time; /* creation time, in ms */
+    union {
+        struct stat st;
+        struct {
+            uint64_t dev;
+            uint64_t ino;
+        } child;
+        struct {
+            struct timespec mtime;
+            int count;
+            FSCacheDirEntry *tab;
+        } dir;
+    } u;
+} FSCacheEntry;
+
+static int64_t get_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void fid_set_ino(FSFile *f, const struct stat *st)
+{
+    f->ino_valid = TRUE;
+    f->dev = st->st_dev;
+    f->ino = st->st_ino;
+}
+
+static struct list_head *fs_cache_bucket(FSDeviceDisk *fs,
+                                         FSCacheEntryType type, uint64_t dev,
+                                         uint64_t ino, const char *name)
+{
+    uint64_t h;
+
+    h = (ino * 31 + dev) * 3 + type;
+    if (name) {
+        while (*name != '\0')
+            h = (h ^ (uint8_t)*name++) * 0x100000001b3;
+    }
+    h *= 0x9e3779b97f4a7c15;
+    return &fs->cache_hash[h >> (64 - FS_CACHE_HASH_BITS)];
+}
+
+static void fs_cache_remove(FSDeviceDisk *fs, FSCacheEntry *e)
+{
+    int i;
+
+    list_del(&e->hash_link);
+    list_del(&e->lru_link);
+    if (e->type == FS_CACHE_DIR) {
+        for(i = 0; i < e->u.dir.count; i++)
+            free(e->u.dir.tab[i].name);
+        free(e->u.dir.tab);
+    }
+    free(e->name);
+    free(e);
+    fs->cache_count--;
+}
+
+/* must be called with cache_lock held */
+static FSCacheEntry *fs_cache_find(FSDeviceDisk *fs, FSCacheEntryType type,
+                                   uint64_t dev, uint64_t ino,
+                                   const char *name)
+{
+    struct list_head *el, *head;
+    FSCacheEntry *e;
+
+    head = fs_cache_bucket(fs, type, dev, ino, name);
+    list_for_each(el, head) {
+        e = list_entry(el, FSCacheEntry, hash_link);
+        if (e->type == type && e->dev == dev && e->ino == ino &&
+            (!name || !strcmp(e->name, name))) {
+            if (fs->cache_mode == FS_CACHE_STRICT &&
+                get_time_ms() - e->time >= FS_CACHE_TIMEOUT) {
+                fs_cache_remove(fs, e);
+                return NULL;
+            }
+            list_del(&e->lru_link);
+            list_add(&e->lru_link, &fs->cache_lru);
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* must be called with cache_lock held. 'e->name' belongs to the cache. */
+static void fs_cache_insert(FSDeviceDisk *fs, FSCacheEntry *e)
+{
+    FSCacheEntry *e1;
+
+    e1 = fs_cache_find(fs, e->type, e->dev, e->ino, e->name);
+    if (e1)
+        fs_cache_remove(fs, e1);
+    if (fs->cache_count >= FS_CACHE_MAX_ENTRIES) {
+        e1 = list_entry(fs->cache_lru.prev, FSCacheEntry, lru_link);
+        fs_cache_remove(fs, e1);
+    }
+    e->time = get_time_ms();
+    list_add(&e->hash_link, fs_cache_bucket(fs, e->type, e->dev, e->ino,
+                                            e->name));
+    list_add(&e->lru_link, &fs->cache_lru);
+    fs->cache_count++;
+}
+
+static FSCacheEntry *fs_cache_new_entry(FSCacheEntryType type, uint64_t dev,
+                                        uint64_t ino, const char *name)
+{
+    FSCacheEntry *e;
+
+    e = (FSCacheEntry *)mallocz(sizeof(*e));
+    e->type = type;
+    e->dev = dev;
+    e->ino = ino;
+    e->name = name ? strdup(name) : NULL;
+    return e;
+}
+
+static void fs_cache_invalidate(FSDeviceDisk *fs, FSCacheEntryType type,
+                                uint64_t dev, uint64_t ino, const char *name)
+{
+    FSCacheEntry *e;
+
+    e = fs_cache_find(fs, type, dev, ino, name);
+    if (e)
+        fs_cache_remove(fs, e);
+}
+
+static void fs_cache_put_attr(FSDeviceDisk *fs, const struct stat *st)
+{
+    FSCacheEntry *e;
+
+    if (fs->cache_mode == FS_CACHE_NONE)
+        return;
+    e = fs_cache_new_entry(FS_CACHE_ATTR, st->st_dev, st->st_ino, NULL);
+    e->u.st = *st;
+    pthread_mutex_lock(&fs->cache_lock);
+    fs_cache_insert(fs, e);
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+static BOOL fs_cache_get_attr(FSDeviceDisk *fs, FSFile *f, struct stat *st)
+{
+    FSCacheEntry *e;
+
+    if (fs->cache_mode == FS_CACHE_NONE || !f->ino_valid)
+        return FALSE;
+    pthread_mutex_lock(&fs->cache_lock);
+    e = fs_cache_find(fs, FS_CACHE_ATTR, f->dev, f->ino, NULL);
+    if (e)
+        *st = e->u.st;
+    pthread_mutex_unlock(&fs->cache_lock);
+    return e != NULL;
+}
+
+/* "." and ".." are not cached */
+static BOOL is_dot_name(const char *name)
+{
+    return !strcmp(name, ".") || !strcmp(name, "..");
+}
+
+/* record that 'name' in the directory 'dev:ino' has the attributes 'st' */
+static void fs_cache_put_dirent(FSDeviceDisk *fs, uint64_t dev, uint64_t ino,
+                                const char *name, const struct stat *st)
+{
+    FSCacheEntry *e, *e1;
+
+    if (fs->cache_mode == FS_CACHE_NONE || is_dot_name(name))
+        return;
+    e = fs_cache_new_entry(FS_CACHE_DIRENT, dev, ino, name);
+    e->u.child.dev = st->st_dev;
+    e->u.child.ino = st->st_ino;
+    e1 = fs_cache_new_entry(FS_CACHE_ATTR, st->st_dev, st->st_ino, NULL);
+    e1->u.st = *st;
+    pthread_mutex_lock(&fs->cache_lock);
+    fs_cache_insert(fs, e);
+    fs_cache_insert(fs, e1);
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+static BOOL fs_cache_get_dirent(FSDeviceDisk *fs, uint64_t dev, uint64_t ino,
+                                const char *name, struct stat *st)
+{
+    FSCacheEntry *e;
+    BOOL found = FALSE;
+
+    if (fs->cache_mode == FS_CACHE_NONE || is_dot_name(name))
+        return FALSE;
+    pthread_mutex_lock(&fs->cache_lock);
+    e = fs_cache_find(fs, FS_CACHE_DIRENT, dev, ino, name);
+    if (e) {
+        e = fs_cache_find(fs, FS_CACHE_ATTR, e->u.child.dev,
+                          e->u.child.ino, NULL);
+        if (e) {
+            *st = e->u.st;
+            found = TRUE;
+        }
+    }
+    pthread_mutex_unlock(&fs->cache_lock);
+    return found;
+}
+
+/* the attributes of 'f' have been modified */
+static void fs_cache_file_changed(FSDeviceDisk *fs, FSFile *f)
+{
+    if (fs->cache_mode == FS_CACHE_NONE || !f->ino_valid)
+        return;
+    pthread_mutex_lock(&fs->cache_lock);
+    fs_cache_invalidate(fs, FS_CACHE_ATTR, f->dev, f->ino, NULL);
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+/* 'name' has been added, removed or modified in the directory 'f' */
+static void fs_cache_dir_changed(FSDeviceDisk *fs, FSFile *f,
+                                 const char *name)
+{
+    FSCacheEntry *e;
+
+    if (fs->cache_mode == FS_CACHE_NONE || !f->ino_valid)
+        return;
+    pthread_mutex_lock(&fs->cache_lock);
+    fs_cache_invalidate(fs, FS_CACHE_ATTR, f->dev, f->ino, NULL);
+    fs_cache_invalidate(fs, FS_CACHE_DIR, f->dev, f->ino, NULL);
+    e = fs_cache_find(fs, FS_CACHE_DIRENT, f->dev, f->ino, name);
+    if (e) {
+        /* the link count or ctime of the entry may have changed */
+        fs_cache_invalidate(fs, FS_CACHE_ATTR, e->u.child.dev,
+                            e->u.child.ino, NULL);
+        fs_cache_remove(fs, e);
+    }
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+static void fs_cache_end(FSDeviceDisk *fs)
+{
+    struct list_head *el, *el1;
+
+    if (!fs->cache_hash)
+        return;
+    list_for_each_safe(el, el1, &fs->cache_lru) {
+        fs_cache_remove(fs, list_entry(el, FSCacheEntry, lru_link));
+    }
+    free(fs->cache_hash);
+    pthread_mutex_destroy(&fs->cache_lock);
+}
+
+/* lstat() of the file 'f', or of 'name' in the directory 'f' */
+static int file_lstat(FSFile *f, struct stat *st)
+{
+    if (f->pathfd >= 0)
+        return fstatat(f->pathfd, "", st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+    else
+        return lstat(f->path, st);
+}
+
+static int name_lstat(FSFile *f, const char *name, struct stat *st)
+{
+    char *path;
+    int ret;
+
+    if (f->pathfd >= 0)
+        return fstatat(f->pathfd, name, st, AT_SYMLINK_NOFOLLOW);
+    path = compose_path(f->path, name);
+    ret = lstat(path, st);
+    free(path);
+    return ret;
+}
+
+static void dir_open(FSFile *f, int fd)
+{
+    FSDirStream *ds;
+
+    ds = (FSDirStream *)malloc(sizeof(*ds));
+    ds->fd = fd;
+    ds->len = 0;
+    ds->pos = 0;
+    ds->next_off = 0;
+    ds->cache_idx = 0;
+    f->is_opened = TRUE;
+    f->is_dir = TRUE;
+    f->u.dir = ds;
+}
+
+static void dir_seek(FSDirStream *ds, uint64_t offset)
+{
+    lseek(ds->fd, offset, SEEK_SET);
+    ds->len = 0;
+    ds->pos = 0;
+    ds->next_off = offset;
+}
+
+/* return the next entry without consuming it, NULL at the end of the
+   directory or if error */
+static FSDirent64 *dir_peek(FSDirStream *ds)
+{
+    int ret;
+
+    if (ds->pos >= ds->len) {
+        ret = syscall(SYS_getdents64, ds->fd, ds->buf, DIR_BUF_SIZE);
+        if (ret <= 0)
+            return NULL;
+        ds->len = ret;
+        ds->pos = 0;
+    }
+    return (FSDirent64 *)(ds->buf + ds->pos);
+}
+
+static void dir_next(FSDirStream *ds, FSDirent64 *de)
+{
+    ds->pos += de->d_reclen;
+    ds->next_off = de->d_off;
+}
+
 static int fs_attach(FSDevice *fs1, FSFile **pf,
                      FSQID *qid, uint32_t uid,
                      const char *uname, const char *aname)
@@ -182,30 +566,57 @@ static int fs_attach(FSDevice *fs1, FSFile **pf,
         return -errno_to_p9(errno);
     }
     f = fid_create(fs1, strdup(fs->root_path), uid);
+    fid_set_ino(f, &st);
+    fs_cache_put_attr(fs, &st);
     stat_to_qid(qid, &st);
     *pf = f;
     return 0;
 }
 
-static int fs_walk(FSDevice *fs, FSFile **pf, FSQID *qids,
+static int fs_walk(FSDevice *fs1, FSFile **pf, FSQID *qids,
                    FSFile *f, int n, char **names)
 {
-    char *path, *path1;
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    char *path;
     struct stat st;
-    int i;
+    int i, len, path_len;
+    FSFile *f1;
+    BOOL ino_valid;
+    uint64_t dev, ino;
 
-    path = strdup(f->path);
+    /* the path is built in place, one component after the other */
+    path_len = strlen(f->path);
+    len = path_len;
+    for(i = 0; i < n; i++)
+        len += 1 + strlen(names[i]);
+    path = (char *)malloc(len + 1);
+    memcpy(path, f->path, path_len + 1);
+    ino_valid = f->ino_valid;
+    dev = f->dev;
+    ino = f->ino;
     for(i = 0; i < n; i++) {
-        path1 = compose_path(path, names[i]);
-        if (lstat(path1, &st) != 0) {
-            free(path1);
-            break;
+        len = strlen(names[i]);
+        path[path_len] = '/';
+        memcpy(path + path_len + 1, names[i], len + 1);
+        if (!ino_valid || !fs_cache_get_dirent(fs, dev, ino, names[i], &st)) {
+            if (lstat(path, &st) != 0) {
+                path[path_len] = '\0';
+                break;
+            }
+            if (ino_valid)
+                fs_cache_put_dirent(fs, dev, ino, names[i], &st);
         }
-        free(path);
-        path = path1;
+        path_len += 1 + len;
+        ino_valid = TRUE;
+        dev = st.st_dev;
+        ino = st.st_ino;
         stat_to_qid(&qids[i], &st);
     }
-    *pf = fid_create(fs, path, f->uid);
+    f1 = fid_create(fs1, path, f->uid);
+    f1->ino_valid = ino_valid;
+    f1->dev = dev;
+    f1->ino = ino;
+    *pf = f1;
     return i;
 }
 
@@ -226,6 +637,7 @@ static int fs_mkdir(FSDevice *fs, FSQID *qid, FSFile *f,
         return -errno_to_p9(errno);
     }
     free(path);
+    fs_cache_dir_changed((FSDeviceDisk *)fs, f, name);
     stat_to_qid(qid, &st);
     return 0;
 }
@@ -241,22 +653,23 @@ static int fs_open(FSDevice *fs, FSQID *qid, FSFile *f, uint32_t flags,
     stat_to_qid(qid, &st);
     
     if (S_ISDIR(st.st_mode)) {
-        DIR *dirp;
-        dirp = opendir(f->path);
-        if (!dirp)
+        int fd;
+        fd = open(f->path, O_RDONLY | O_DIRECTORY);
+        if (fd < 0)
             return -errno_to_p9(errno);
-        f->is_opened = TRUE;
-        f->is_dir = TRUE;
-        f->u.dirp = dirp;
+        dir_open(f, fd);
     } else {
         int fd;
         fd = open(f->path, p9_flags_to_host(flags) & ~O_CREAT);
         if (fd < 0)
             return -errno_to_p9(errno);
+        if (flags & P9_O_TRUNC)
+            fs_cache_file_changed((FSDeviceDisk *)fs, f);
         f->is_opened = TRUE;
         f->is_dir = FALSE;
         f->u.fd = fd;
     }
+    f->open_flags = flags;
     return 0;
 }
 
@@ -281,67 +694,203 @@ static int fs_create(FSDevice *fs, FSQID *qid, FSFile *f, const char *name,
         close(fd);
         return -errno_to_p9(errno);
     }
+    fs_cache_dir_changed((FSDeviceDisk *)fs, f, name);
     free(f->path);
     f->path = path;
     f->is_opened = TRUE;
     f->is_dir = FALSE;
     f->u.fd = fd;
+    f->open_flags = flags;
+    fid_set_ino(f, &st);
     stat_to_qid(qid, &st);
     return 0;
 }
 
-static int fs_readdir(FSDevice *fs, FSFile *f, uint64_t offset,
+/* 9p directory entry. Return its length, or -1 if it does not fit in
+   'size' bytes. */
+static int marshall_dirent(uint8_t *buf, int size, uint64_t ino,
+                           uint64_t offset, int d_type, const char *name)
+{
+    int len, pos, name_len, type;
+
+    name_len = strlen(name);
+    len = 13 + 8 + 1 + 2 + name_len;
+    if (len > size)
+        return -1;
+    if (d_type == DT_DIR)
+        type = P9_QTDIR;
+    else if (d_type == DT_LNK)
+        type = P9_QTSYMLINK;
+    else
+        type = P9_QTFILE;
+    pos = 0;
+    buf[pos++] = type;
+    put_le32(buf + pos, 0); /* version */
+    pos += 4;
+    put_le64(buf + pos, ino);
+    pos += 8;
+    put_le64(buf + pos, offset);
+    pos += 8;
+    buf[pos++] = d_type;
+    put_le16(buf + pos, name_len);
+    pos += 2;
+    memcpy(buf + pos, name, name_len);
+    pos += name_len;
+    return pos;
+}
+
+/* DT_xxx type of 'name' in the directory 'f' when readdir() does not
+   give it */
+static int get_d_type(FSDeviceDisk *fs, FSFile *f, const char *name)
+{
+    struct stat st;
+    int d_type;
+
+    if (name_lstat(f, name, &st) == 0) {
+        d_type = st.st_mode >> 12;
+        if (f->ino_valid)
+            fs_cache_put_dirent(fs, f->dev, f->ino, name, &st);
+    } else {
+        d_type = DT_REG; /* default */
+    }
+    return d_type;
+}
+
+/* read all the entries of the opened directory 'f' */
+static FSCacheEntry *fs_cache_read_dir(FSDeviceDisk *fs, FSFile *f)
+{
+    FSCacheEntry *e;
+    FSCacheDirEntry *de1;
+    FSDirStream *ds = f->u.dir;
+    FSDirent64 *de;
+    int size;
+
+    e = fs_cache_new_entry(FS_CACHE_DIR, f->dev, f->ino, NULL);
+    size = 0;
+    dir_seek(ds, 0);
+    for(;;) {
+        de = dir_peek(ds);
+        if (de == NULL)
+            break;
+        dir_next(ds, de);
+        if (e->u.dir.count == size) {
+            size = max_int(16, size * 3 / 2);
+            e->u.dir.tab = (FSCacheDirEntry *)realloc(e->u.dir.tab,
+                                               sizeof(e->u.dir.tab[0]) * size);
+        }
+        de1 = &e->u.dir.tab[e->u.dir.count++];
+        de1->ino = de->d_ino;
+        de1->d_off = de->d_off;
+        de1->d_type = de->d_type;
+        if (de1->d_type == DT_UNKNOWN)
+            de1->d_type = get_d_type(fs, f, de->d_name);
+        de1->name = strdup(de->d_name);
+    }
+    return e;
+}
+
+/* index of the entry following the host offset 'offset' in the cached
+   listing, -1 if no entry has it */
+static int fs_cache_dir_find(FSCacheEntry *e, FSDirStream *ds, uint64_t offset)
+{
+    FSCacheDirEntry *tab = e->u.dir.tab;
+    int i;
+
+    if (offset == 0)
+        return 0;
+    /* usually the continuation of the previous request */
+    i = ds->cache_idx;
+    if (i > 0 && i <= e->u.dir.count && tab[i - 1].d_off == (int64_t)offset)
+        return i;
+    for(i = 0; i < e->u.dir.count; i++) {
+        if (tab[i].d_off == (int64_t)offset)
+            return i + 1;
+    }
+    return -1;
+}
+
+/* the directory offsets are the host ones, so that they stay valid when
+   the listing is read again after a change. Return FALSE if 'offset'
+   is not in the listing, e.g. because its entry was removed: the host
+   directory is read instead. */
+static BOOL fs_readdir_cached(FSDeviceDisk *fs, FSFile *f, uint64_t offset,
+                              uint8_t *buf, int count, int *plen)
+{
+    FSCacheEntry *e;
+    FSCacheDirEntry *de;
+    struct timespec mtime;
+    struct stat st;
+    int i, len, pos;
+
+    mtime.tv_sec = 0;
+    mtime.tv_nsec = 0;
+    if (fs->cache_mode == FS_CACHE_STRICT && file_lstat(f, &st) == 0)
+        mtime = st.st_mtim;
+    pthread_mutex_lock(&fs->cache_lock);
+    e = fs_cache_find(fs, FS_CACHE_DIR, f->dev, f->ino, NULL);
+    if (e && (e->u.dir.mtime.tv_sec != mtime.tv_sec ||
+              e->u.dir.mtime.tv_nsec != mtime.tv_nsec)) {
+        fs_cache_remove(fs, e);
+        e = NULL;
+    }
+    if (!e) {
+        pthread_mutex_unlock(&fs->cache_lock);
+        e = fs_cache_read_dir(fs, f);
+        e->u.dir.mtime = mtime;
+        pthread_mutex_lock(&fs->cache_lock);
+        fs_cache_insert(fs, e);
+    }
+    i = fs_cache_dir_find(e, f->u.dir, offset);
+    if (i < 0) {
+        pthread_mutex_unlock(&fs->cache_lock);
+        return FALSE;
+    }
+    pos = 0;
+    for(; i < e->u.dir.count; i++) {
+        de = &e->u.dir.tab[i];
+        len = marshall_dirent(buf + pos, count - pos, de->ino, de->d_off,
+                              de->d_type, de->name);
+        if (len < 0)
+            break;
+        pos += len;
+    }
+    f->u.dir->cache_idx = i;
+    pthread_mutex_unlock(&fs->cache_lock);
+    *plen = pos;
+    return TRUE;
+}
+
+static int fs_readdir(FSDevice *fs1, FSFile *f, uint64_t offset,
                       uint8_t *buf, int count)
 {
-    struct dirent *de;
-    int len, pos, name_len, type, d_type;
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    FSDirStream *ds;
+    FSDirent64 *de;
+    int len, pos, d_type;
 
     if (!f->is_opened || !f->is_dir)
         return -P9_EPROTO;
-    if (offset == 0)
-        rewinddir(f->u.dirp);
-    else
-        seekdir(f->u.dirp, offset);
+    if (fs->cache_mode != FS_CACHE_NONE && f->ino_valid &&
+        fs_readdir_cached(fs, f, offset, buf, count, &pos))
+        return pos;
+    ds = f->u.dir;
+    /* only seek if the guest does not continue the previous request */
+    if (offset != ds->next_off)
+        dir_seek(ds, offset);
     pos = 0;
     for(;;) {
-        de = readdir(f->u.dirp);
+        de = dir_peek(ds);
         if (de == NULL)
             break;
-        name_len = strlen(de->d_name);
-        len = 13 + 8 + 1 + 2 + name_len;
-        if ((pos + len) > count)
-            break;
-        offset = telldir(f->u.dirp);
         d_type = de->d_type;
-        if (d_type == DT_UNKNOWN) {
-            char *path;
-            struct stat st;
-            path = compose_path(f->path, de->d_name);
-            if (lstat(path, &st) == 0) {
-                d_type = st.st_mode >> 12;
-            } else {
-                d_type = DT_REG; /* default */
-            }
-            free(path);
-        }
-        if (d_type == DT_DIR)
-            type = P9_QTDIR;
-        else if (d_type == DT_LNK)
-            type = P9_QTSYMLINK;
-        else
-            type = P9_QTFILE;
-        buf[pos++] = type;
-        put_le32(buf + pos, 0); /* version */
-        pos += 4;
-        put_le64(buf + pos, de->d_ino);
-        pos += 8;
-        put_le64(buf + pos, offset);
-        pos += 8;
-        buf[pos++] = d_type;
-        put_le16(buf + pos, name_len);
-        pos += 2;
-        memcpy(buf + pos, de->d_name, name_len);
-        pos += name_len;
+        if (d_type == DT_UNKNOWN)
+            d_type = get_d_type(fs, f, de->d_name);
+        len = marshall_dirent(buf + pos, count - pos, de->d_ino, de->d_off,
+                              d_type, de->d_name);
+        if (len < 0)
+            break;
+        pos += len;
+        dir_next(ds, de);
     }
     return pos;
 }
@@ -368,20 +917,52 @@ static int fs_write(FSDevice *fs, FSFile *f, uint64_t offset,
     if (!f->is_opened || f->is_dir)
         return -P9_EPROTO;
     ret = pwrite(f->u.fd, buf, count, offset);
+    fs_cache_file_changed((FSDeviceDisk *)fs, f);
     if (ret < 0) 
         return -errno_to_p9(errno);
     else
         return ret;
 }
 
+static int fs_readv(FSDevice *fs, FSFile *f, uint64_t offset,
+                    const struct iovec *iov, int iovcnt)
+{
+    int ret;
+
+    if (!f->is_opened || f->is_dir)
+        return -P9_EPROTO;
+    ret = preadv(f->u.fd, iov, iovcnt, offset);
+    if (ret < 0)
+        return -errno_to_p9(errno);
+    else
+        return ret;
+}
+
+static int fs_writev(FSDevice *fs, FSFile *f, uint64_t offset,
+                     const struct iovec *iov, int iovcnt)
+{
+    int ret;
+
+    if (!f->is_opened || f->is_dir)
+        return -P9_EPROTO;
+    ret = pwritev(f->u.fd, iov, iovcnt, offset);
+    fs_cache_file_changed((FSDeviceDisk *)fs, f);
+    if (ret < 0)
+        return -errno_to_p9(errno);
+    else
+        return ret;
+}
+
 static void fs_close(FSDevice *fs, FSFile *f)
 {
     if (!f->is_opened)
         return;
-    if (f->is_dir)
-        closedir(f->u.dirp);
-    else
+    if (f->is_dir) {
+        close(f->u.dir->fd);
+        free(f->u.dir);
+    } else {
         close(f->u.fd);
+    }
     f->is_opened = FALSE;
 }
 
@@ -389,8 +970,12 @@ static int fs_stat(FSDevice *fs, FSFile *f, FSStat *st)
 {
     struct stat st1;
 
-    if (lstat(f->path, &st1) != 0)
-        return -P9_ENOENT;
+    if (!fs_cache_get_attr((FSDeviceDisk *)fs, f, &st1)) {
+        if (file_lstat(f, &st1) != 0)
+            return -P9_ENOENT;
+        fs_cache_put_attr((FSDeviceDisk *)fs, &st1);
+        fid_set_ino(f, &st1);
+    }
     stat_to_qid(&st->qid, &st1);
     st->st_mode = st1.st_mode;
     st->st_uid = st1.st_uid;
@@ -409,27 +994,49 @@ static int fs_stat(FSDevice *fs, FSFile *f, FSStat *st)
     return 0;
 }
 
-static int fs_setattr(FSDevice *fs, FSFile *f, uint32_t mask,
-                      uint32_t mode, uint32_t uid, uint32_t gid,
-                      uint64_t size, uint64_t atime_sec, uint64_t atime_nsec,
-                      uint64_t mtime_sec, uint64_t mtime_nsec)
+static void fd_proc_path(char *buf, int buf_size, int fd);
+
+static int file_lchown(FSFile *f, uid_t uid, gid_t gid)
+{
+    if (f->pathfd >= 0)
+        return fchownat(f->pathfd, "", uid, gid,
+                        AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+    else
+        return lchown(f->path, uid, gid);
+}
+
+static int fs_setattr1(FSDevice *fs, FSFile *f, uint32_t mask,
+                       uint32_t mode, uint32_t uid, uint32_t gid,
+                       uint64_t size, uint64_t atime_sec, uint64_t atime_nsec,
+                       uint64_t mtime_sec, uint64_t mtime_nsec)
 {
     BOOL ctime_updated = FALSE;
+    char proc_path[32];
+    const char *path;
+
+    /* the file itself with FS_DISK_AT, as chmod() and truncate() follow
+       the /proc link */
+    if (f->pathfd >= 0) {
+        fd_proc_path(proc_path, sizeof(proc_path), f->pathfd);
+        path = proc_path;
+    } else {
+        path = f->path;
+    }
 
     if (mask & (P9_SETATTR_UID | P9_SETATTR_GID)) {
-        if (lchown(f->path, (mask & P9_SETATTR_UID) ? uid : -1,
-                   (mask & P9_SETATTR_GID) ? gid : -1) < 0)
+        if (file_lchown(f, (mask & P9_SETATTR_UID) ? uid : -1,
+                        (mask & P9_SETATTR_GID) ? gid : -1) < 0)
             return -errno_to_p9(errno);
         ctime_updated = TRUE;
     }
     /* must be done after uid change for suid */
     if (mask & P9_SETATTR_MODE) {
-        if (chmod(f->path, mode) < 0)
+        if (chmod(path, mode) < 0)
             return -errno_to_p9(errno);
         ctime_updated = TRUE;
     }
     if (mask & P9_SETATTR_SIZE) {
-        if (truncate(f->path, size) < 0)
+        if (truncate(path, size) < 0)
             return -errno_to_p9(errno);
         ctime_updated = TRUE;
     }
@@ -459,17 +1066,32 @@ static int fs_setattr(FSDevice *fs, FSFile *f, uint32_t mask,
             ts[1].tv_sec = 0;
             ts[1].tv_nsec = UTIME_OMIT;
         }
-        if (utimensat(AT_FDCWD, f->path, ts, AT_SYMLINK_NOFOLLOW) < 0)
+        if (utimensat(AT_FDCWD, path, ts,
+                      f->pathfd >= 0 ? 0 : AT_SYMLINK_NOFOLLOW) < 0)
             return -errno_to_p9(errno);
         ctime_updated = TRUE;
     }
     if ((mask & P9_SETATTR_CTIME) && !ctime_updated) {
-        if (lchown(f->path, -1, -1) < 0)
+        if (file_lchown(f, -1, -1) < 0)
             return -errno_to_p9(errno);
     }
     return 0;
 }
 
+static int fs_setattr(FSDevice *fs, FSFile *f, uint32_t mask,
+                      uint32_t mode, uint32_t uid, uint32_t gid,
+                      uint64_t size, uint64_t atime_sec, uint64_t atime_nsec,
+                      uint64_t mtime_sec, uint64_t mtime_nsec)
+{
+    int ret;
+
+    ret = fs_setattr1(fs, f, mask, mode, uid, gid, size, atime_sec,
+                      atime_nsec, mtime_sec, mtime_nsec);
+    /* also if only a part of the attributes could be changed */
+    fs_cache_file_changed((FSDeviceDisk *)fs, f);
+    return ret;
+}
+
 static int fs_link(FSDevice *fs, FSFile *df, FSFile *f, const char *name)
 {
     char *path;
@@ -480,6 +1102,8 @@ static int fs_link(FSDevice *fs, FSFile *df, FSFile *f, const char *name)
         return -errno_to_p9(errno);
     }
     free(path);
+    fs_cache_dir_changed((FSDeviceDisk *)fs, df, name);
+    fs_cache_file_changed((FSDeviceDisk *)fs, f);
     return 0;
 }
 
@@ -499,6 +1123,7 @@ static int fs_symlink(FSDevice *fs, FSQID *qid,
         return -errno_to_p9(errno);
     }
     free(path);
+    fs_cache_dir_changed((FSDeviceDisk *)fs, f, name);
     stat_to_qid(qid, &st);
     return 0;
 }
@@ -520,6 +1145,7 @@ static int fs_mknod(FSDevice *fs, FSQID *qid,
         return -errno_to_p9(errno);
     }
     free(path);
+    fs_cache_dir_changed((FSDeviceDisk *)fs, f, name);
     stat_to_qid(qid, &st);
     return 0;
 }
@@ -547,6 +1173,8 @@ static int fs_renameat(FSDevice *fs, FSFile *f, const char *name,
     free(new_path);
     if (ret < 0)
         return -errno_to_p9(errno);
+    fs_cache_dir_changed((FSDeviceDisk *)fs, f, name);
+    fs_cache_dir_changed((FSDeviceDisk *)fs, new_f, new_name);
     return 0;
 }
 
@@ -560,10 +1188,248 @@ static int fs_unlinkat(FSDevice *fs, FSFile *f, const char *name)
     free(path);
     if (ret < 0)
         return -errno_to_p9(errno);
+    fs_cache_dir_changed((FSDeviceDisk *)fs, f, name);
     return 0;
     
 }
 
+/* FS_DISK_AT backend: each file holds an O_PATH file descriptor and the
+   operations use the *at() system calls relative to it, so that the host
+   does not resolve the complete path again each time. The files which
+   must be reopened are accessed through /proc/self/fd. */
+
+static void fd_proc_path(char *buf, int buf_size, int fd)
+{
+    snprintf(buf, buf_size, "/proc/self/fd/%d", fd);
+}
+
+static int fs_at_attach(FSDevice *fs1, FSFile **pf,
+                        FSQID *qid, uint32_t uid,
+                        const char *uname, const char *aname)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    struct stat st;
+    FSFile *f;
+    int fd;
+
+    *pf = NULL;
+    fd = open(fs->root_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno_to_p9(errno);
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -errno_to_p9(errno);
+    }
+    f = fid_create(fs1, NULL, uid);
+    f->pathfd = fd;
+    fid_set_ino(f, &st);
+    fs_cache_put_attr(fs, &st);
+    stat_to_qid(qid, &st);
+    *pf = f;
+    return 0;
+}
+
+static int fs_at_walk(FSDevice *fs1, FSFile **pf, FSQID *qids,
+                      FSFile *f, int n, char **names)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    struct stat st;
+    int i, fd, fd1;
+    FSFile *f1;
+    BOOL ino_valid;
+    uint64_t dev, ino;
+
+    fd = f->pathfd;
+    ino_valid = f->ino_valid;
+    dev = f->dev;
+    ino = f->ino;
+    for(i = 0; i < n; i++) {
+        fd1 = openat(fd, names[i], O_PATH | O_NOFOLLOW | O_CLOEXEC);
+        if (fd1 < 0)
+            break;
+        if (!ino_valid || !fs_cache_get_dirent(fs, dev, ino, names[i], &st)) {
+            if (fstatat(fd1, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)) {
+                close(fd1);
+                break;
+            }
+            if (ino_valid)
+                fs_cache_put_dirent(fs, dev, ino, names[i], &st);
+        }
+        if (fd != f->pathfd)
+            close(fd);
+        fd = fd1;
+        ino_valid = TRUE;
+        dev = st.st_dev;
+        ino = st.st_ino;
+        stat_to_qid(&qids[i], &st);
+    }
+    if (fd == f->pathfd)
+        fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    f1 = fid_create(fs1, NULL, f->uid);
+    f1->pathfd = fd;
+    f1->ino_valid = ino_valid;
+    f1->dev = dev;
+    f1->ino = ino;
+    *pf = f1;
+    return i;
+}
+
+static int fs_at_mkdir(FSDevice *fs, FSQID *qid, FSFile *f,
+                       const char *name, uint32_t mode, uint32_t gid)
+{
+    struct stat st;
+
+    if (mkdirat(f->pathfd, name, mode) < 0)
+        return -errno_to_p9(errno);
+    if (fstatat(f->pathfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return -errno_to_p9(errno);
+    fs_cache_dir_changed((FSDeviceDisk *)fs, f, name);
+    stat_to_qid(qid, &st);
+    return 0;
+}
+
+static int fs_at_open(FSDevice *fs, FSQID *qid, FSFile *f, uint32_t flags,
+                      FSOpenCompletionFunc *cb, void *opaque)
+{
+    struct stat st;
+    char path[32];
+    int fd;
+
+    fs_close(fs, f);
+
+    if (fstatat(f->pathfd, "", &st, AT_EMPTY_PATH) != 0)
+        return -errno_to_p9(errno);
+    stat_to_qid(qid, &st);
+
+    if (S_ISDIR(st.st_mode)) {
+        fd = openat(f->pathfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            return -errno_to_p9(errno);
+        dir_open(f, fd);
+    } else {
+        fd_proc_path(path, sizeof(path), f->pathfd);
+        fd = open(path, (p9_flags_to_host(flags) & ~O_CREAT) | O_CLOEXEC);
+        if (fd < 0)
+            return -errno_to_p9(errno);
+        if (flags & P9_O_TRUNC)
+            fs_cache_file_changed((FSDeviceDisk *)fs, f);
+        f->is_opened = TRUE;
+        f->is_dir = FALSE;
+        f->u.fd = fd;
+    }
+    f->open_flags = flags;
+    return 0;
+}
+
+static int fs_at_create(FSDevice *fs, FSQID *qid, FSFile *f, const char *name,
+                        uint32_t flags, uint32_t mode, uint32_t gid)
+{
+    struct stat st;
+    int fd, pathfd;
+
+    fs_close(fs, f);
+
+    fd = openat(f->pathfd, name, p9_flags_to_host(flags) | O_CREAT | O_CLOEXEC,
+                mode);
+    if (fd < 0)
+        return -errno_to_p9(errno);
+    pathfd = openat(f->pathfd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    if (pathfd < 0 || fstat(fd, &st) != 0) {
+        int err = errno;
+        if (pathfd >= 0)
+            close(pathfd);
+        close(fd);
+        return -errno_to_p9(err);
+    }
+    fs_cache_dir_changed((FSDeviceDisk *)fs, f, name);
+    close(f->pathfd);
+    f->pathfd = pathfd;
+    f->is_opened = TRUE;
+    f->is_dir = FALSE;
+    f->u.fd = fd;
+    f->open_flags = flags;
+    fid_set_ino(f, &st);
+    stat_to_qid(qid, &st);
+    return 0;
+}
+
+static int fs_at_link(FSDevice *fs, FSFile *df, FSFile *f, const char *name)
+{
+    char path[32];
+
+    /* linkat() with AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH */
+    fd_proc_path(path, sizeof(path), f->pathfd);
+    if (linkat(AT_FDCWD, path, df->pathfd, name, AT_SYMLINK_FOLLOW) < 0)
+        return -errno_to_p9(errno);
+    fs_cache_dir_changed((FSDeviceDisk *)fs, df, name);
+    fs_cache_file_changed((FSDeviceDisk *)fs, f);
+    return 0;
+}
+
+static int fs_at_symlink(FSDevice *fs, FSQID *qid,
+                         FSFile *f, const char *name, const char *symgt,
+                         uint32_t gid)
+{
+    struct stat st;
+
+    if (symlinkat(symgt, f->pathfd, name) < 0)
+        return -errno_to_p9(errno);
+    if (fstatat(f->pathfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return -errno_to_p9(errno);
+    fs_cache_dir_changed((FSDeviceDisk *)fs, f, name);
+    stat_to_qid(qid, &st);
+    return 0;
+}
+
+static int fs_at_mknod(FSDevice *fs, FSQID *qid,
+                       FSFile *f, const char *name, uint32_t mode,
+                       uint32_t major, uint32_t minor, uint32_t gid)
+{
+    struct stat st;
+
+    if (mknodat(f->pathfd, name, mode, makedev(major, minor)) < 0)
+        return -errno_to_p9(errno);
+    if (fstatat(f->pathfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return -errno_to_p9(errno);
+    fs_cache_dir_changed((FSDeviceDisk *)fs, f, name);
+    stat_to_qid(qid, &st);
+    return 0;
+}
+
+static int fs_at_readlink(FSDevice *fs, char *buf, int buf_size, FSFile *f)
+{
+    int ret;
+    ret = readlinkat(f->pathfd, "", buf, buf_size - 1);
+    if (ret < 0)
+        return -errno_to_p9(errno);
+    buf[ret] = '\0';
+    return 0;
+}
+
+static int fs_at_renameat(FSDevice *fs, FSFile *f, const char *name,
+                          FSFile *new_f, const char *new_name)
+{
+    if (renameat(f->pathfd, name, new_f->pathfd, new_name) < 0)
+        return -errno_to_p9(errno);
+    fs_cache_dir_changed((FSDeviceDisk *)fs, f, name);
+    fs_cache_dir_changed((FSDeviceDisk *)fs, new_f, new_name);
+    return 0;
+}
+
+static int fs_at_unlinkat(FSDevice *fs, FSFile *f, const char *name)
+{
+    int ret;
+
+    /* same as remove() */
+    ret = unlinkat(f->pathfd, name, 0);
+    if (ret < 0 && errno == EISDIR)
+        ret = unlinkat(f->pathfd, name, AT_REMOVEDIR);
+    if (ret < 0)
+        return -errno_to_p9(errno);
+    fs_cache_dir_changed((FSDeviceDisk *)fs, f, name);
+    return 0;
+}
+
 static int fs_lock(FSDevice *fs, FSFile *f, const FSLock *lock)
 {
     int ret;
@@ -614,13 +1480,94 @@ static int fs_getlock(FSDevice *fs, FSFile *f, FSLock *lock)
     return ret;
 }
 
+/* record: uid[4] open_flags[4] is_opened[1] followed by the path
+   relative to the root, which is looked up again on restore. The file
+   must still be reachable: an unlinked file is not saved. */
+static int fs_save_file(FSDevice *fs1, FSFile *f, uint8_t *buf, int buf_size)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    char path[PATH_MAX], root[PATH_MAX], proc_path[32];
+    const char *rel;
+    struct stat st;
+    int len, root_len;
+
+    if (f->pathfd >= 0) {
+        /* the kernel knows the current path of the descriptor */
+        fd_proc_path(proc_path, sizeof(proc_path), f->pathfd);
+        len = readlink(proc_path, path, sizeof(path) - 1);
+        if (len < 0 || !realpath(fs->root_path, root))
+            return -1;
+        path[len] = '\0';
+        root_len = strlen(root);
+        if (root_len == 1)
+            root_len = 0; /* "/" */
+    } else {
+        snprintf(path, sizeof(path), "%s", f->path);
+        snprintf(root, sizeof(root), "%s", fs->root_path);
+        root_len = strlen(root);
+    }
+    if (strncmp(path, root, root_len) != 0 ||
+        (path[root_len] != '\0' && path[root_len] != '/'))
+        return -1;
+    rel = path + root_len;
+    if (lstat(path, &st) != 0 ||
+        (f->ino_valid && (st.st_dev != f->dev || st.st_ino != f->ino)))
+        return -1;
+    len = strlen(rel);
+    if (9 + len > buf_size)
+        return -1;
+    put_le32(buf, f->uid);
+    put_le32(buf + 4, f->open_flags);
+    buf[8] = f->is_opened;
+    memcpy(buf + 9, rel, len);
+    return 9 + len;
+}
+
+static FSFile *fs_restore_file(FSDevice *fs1, const uint8_t *buf, int len)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    char path[PATH_MAX];
+    struct stat st;
+    FSQID qid;
+    FSFile *f;
+    uint32_t flags;
+    int fd;
+
+    if (len < 9 || snprintf(path, sizeof(path), "%s%.*s", fs->root_path,
+                            len - 9, buf + 9) >= (int)sizeof(path))
+        return NULL;
+    if (lstat(path, &st) != 0)
+        return NULL;
+    if (fs1->fs_attach == fs_at_attach) {
+        fd = open(path, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+            return NULL;
+        f = fid_create(fs1, NULL, get_le32(buf));
+        f->pathfd = fd;
+    } else {
+        f = fid_create(fs1, strdup(path), get_le32(buf));
+    }
+    fid_set_ino(f, &st);
+    if (buf[8]) {
+        /* the file was created or truncated when it was first opened */
+        flags = get_le32(buf + 4) & ~(P9_O_CREAT | P9_O_EXCL | P9_O_TRUNC);
+        if (fs1->fs_open(fs1, &qid, f, flags, NULL, NULL) < 0) {
+            fs_delete(fs1, f);
+            return NULL;
+        }
+    }
+    return f;
+}
+
 static void fs_disk_end(FSDevice *fs1)
 {
     FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    fs_cache_end(fs);
     free(fs->root_path);
 }
 
-FSDevice *fs_disk_init(const char *root_path)
+FSDevice *fs_disk_init(const char *root_path, FSDiskCacheModeEnum cache_mode,
+                       FSDiskBackendEnum backend)
 {
     FSDeviceDisk *fs;
     struct stat st;
@@ -645,6 +1592,8 @@ FSDevice *fs_disk_init(const char *root_path)
     fs->common.fs_readdir = fs_readdir;
     fs->common.fs_read = fs_read;
     fs->common.fs_write = fs_write;
+    fs->common.fs_readv = fs_readv;
+    fs->common.fs_writev = fs_writev;
     fs->common.fs_link = fs_link;
     fs->common.fs_symlink = fs_symlink;
     fs->common.fs_mknod = fs_mknod;
@@ -653,7 +1602,40 @@ FSDevice *fs_disk_init(const char *root_path)
     fs->common.fs_unlinkat = fs_unlinkat;
     fs->common.fs_lock = fs_lock;
     fs->common.fs_getlock = fs_getlock;
+    fs->common.fs_save_file = fs_save_file;
+    fs->common.fs_restore_file = fs_restore_file;
+    if (backend == FS_DISK_AT) {
+        struct rlimit rl;
+
+        fs->common.fs_attach = fs_at_attach;
+        fs->common.fs_walk = fs_at_walk;
+        fs->common.fs_mkdir = fs_at_mkdir;
+        fs->common.fs_open = fs_at_open;
+        fs->common.fs_create = fs_at_create;
+        fs->common.fs_link = fs_at_link;
+        fs->common.fs_symlink = fs_at_symlink;
+        fs->common.fs_mknod = fs_at_mknod;
+        fs->common.fs_readlink = fs_at_readlink;
+        fs->common.fs_renameat = fs_at_renameat;
+        fs->common.fs_unlinkat = fs_at_unlinkat;
+        /* one descriptor per fid */
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
     
     fs->root_path = strdup(root_path);
+
+    fs->cache_mode = cache_mode;
+    if (cache_mode != FS_CACHE_NONE) {
+        int i;
+        pthread_mutex_init(&fs->cache_lock, NULL);
+        fs->cache_hash = (struct list_head *)malloc(sizeof(fs->cache_hash[0]) <<
+                                                    FS_CACHE_HASH_BITS);
+        for(i = 0; i < (1 << FS_CACHE_HASH_BITS); i++)
+            init_list_head(&fs->cache_hash[i]);
+        init_list_head(&fs->cache_lru);
+    }
     return (FSDevice *)fs;
 }
@@ -6,7 +6,9 @@
 #include <stddef.h>
 #include <vector>
 #include <map>
+#include <algorithm>
 #include "iceblk.h"
+#include "dma.h"
 
 #define BLKDEV_ADDR      0
 #define BLKDEV_OFFSET    8
@@ -22,6 +24,7 @@
 #define BLKDEV_SECTOR_SHIFT 9
 
 #define MAX_REQUEST_LENGTH 16
+#define MAX_TRACKERS 256
 
 /* #define DEBUG_BLKDEV */
 
@@ -51,90 +54,180 @@ iceblk_t::iceblk_t(
   }
 
 
-  auto it = argmap.find("img");
+  // no ro mode: the device has no status to fail a write with, so the
+  // guest would take a dropped write for a completed one
+  auto it = argmap.find("mode");
+  if (it != argmap.end()) {
+    if (it->second == "ro") {
+      printf("iceblk cannot fail writes, use mode snapshot for a read only image\n");
+      exit(1);
+    } else if (it->second == "rw") {
+      blockdevice_mode = BF_MODE_RW;
+    } else if (it->second == "snapshot") {
+      blockdevice_mode = BF_MODE_SNAPSHOT;
+    } else {
+      printf("Invalid iceblk mode %s, must be rw or snapshot\n",
+             it->second.c_str());
+      exit(1);
+    }
+  }
+
+  it = argmap.find("trackers");
+  if (it != argmap.end()) {
+    trackers = std::stoi(it->second);
+    if (trackers < 1 || trackers > MAX_TRACKERS) {
+      printf("Invalid iceblk trackers %s, must be 1 to %d\n",
+             it->second.c_str(), MAX_TRACKERS);
+      exit(1);
+    }
+  }
+
+  it = argmap.find("latency");
+  if (it != argmap.end())
+    blockdevice_latency = std::stoull(it->second);
+
+  it = argmap.find("sector_latency");
+  if (it != argmap.end())
+    blockdevice_sector_latency = std::stoull(it->second);
+
+  it = argmap.find("img");
   if (it == argmap.end()) {
     blockdevice_size = (sizeof(uint64_t)/sizeof(uint8_t)) * BLKDEV_SECTOR_SIZE * 8;
     blockdevice = (uint64_t*)malloc(sizeof(uint64_t) * blockdevice_size);
+    blockdevice_mode = BF_MODE_SNAPSHOT;
   } else {
+    // the image is mapped, not read: pages are only loaded when the guest
+    // touches them, and rw mode writes go back to the file
     std::string img_path = it->second;
-    FILE* fp = fopen(img_path.c_str(), "r");
-    if (fp == nullptr) {
+    int64_t sectors_in_img;
+    auto shared_it = argmap.find("shared");
+    if (shared_it != argmap.end()) {
+      // read only base shared with the other instances
+      if (blockdevice_mode == BF_MODE_RW) {
+        printf("iceblk shared requires mode snapshot\n");
+        exit(1);
+      }
+      blockdevice = (uint64_t*)block_device_map_shared(img_path.c_str(),
+                                                       shared_it->second.c_str(),
+                                                       blockdevice_mode,
+                                                       &sectors_in_img);
+    } else {
+      blockdevice = (uint64_t*)block_device_map_file(img_path.c_str(),
+                                                     blockdevice_mode,
+                                                     &sectors_in_img);
+    }
+    if (blockdevice == nullptr) {
       printf("Error opening file %s\n", img_path.c_str());
       exit(1);
     }
-
-    fseek(fp, 0, SEEK_END);
-    uint64_t img_sz = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    uint64_t sectors_in_img = (img_sz + BLKDEV_SECTOR_SIZE) / BLKDEV_SECTOR_SIZE;
+    blockdevice_mapped = true;
     blockdevice_size = sectors_in_img * BLKDEV_SECTOR_SIZE;
-    blockdevice = (uint64_t*)malloc(blockdevice_size);
+  }
 
-    fread((void*)blockdevice, sizeof(uint64_t), img_sz/sizeof(uint64_t), fp);
-    fclose(fp);
+  it = argmap.find("stats");
+  if (it != argmap.end()) {
+    stats = stats_new("iceblk", it->second.c_str(), 2);
+    stats_set_op_name(stats, 0, "read");
+    stats_set_op_name(stats, 1, "write");
+    stats_irqs = stats_add_counter(stats, "irqs");
   }
 
+  requests.resize(trackers);
   for (int i = 0; i < trackers; i++) {
     idle_tags.push(i);
   }
+
+  it = argmap.find("checkpoint");
+  if (it != argmap.end()) {
+    checkpoint_file = it->second;
+    checkpoint_init();
+  }
+  it = argmap.find("restore");
+  if (it != argmap.end() && !checkpoint_restore(it->second.c_str())) {
+    printf("Cannot restore the iceblk checkpoint %s\n", it->second.c_str());
+    exit(1);
+  }
 }
 
 iceblk_t::~iceblk_t() {
-  free(blockdevice);
+  if (stats)
+    stats_free(stats);
+  if (blockdevice_mapped)
+    block_device_unmap_file((uint8_t*)blockdevice, blockdevice_size / BLKDEV_SECTOR_SIZE);
+  else
+    free(blockdevice);
 }
 
-void iceblk_t::handle_request() {
-  assert(req_addr % 8 == 0);
-  if (req_write) handle_write_request();
-  else handle_read_request();
-  intctrl->set_interrupt_level(interrupt_id, 1);
+void iceblk_t::handle_request(unsigned int tag) {
+  const request_t& req = requests[tag];
+  assert(req.addr % 8 == 0);
+  if (req.write) handle_write_request(req);
+  else handle_read_request(req);
 }
 
-void iceblk_t::handle_read_request() {
-  mmu_t* simdram = sim->debug_mmu;
-  uint64_t data;
-  for (reg_t sidx = 0; sidx < req_len; sidx++) {
-    for (reg_t i = 0; i < BLKDEV_SECTOR_SIZE; i += 8) {
-      read_blockdevice_u64(&data, sidx + req_offset, i);
-      simdram->store<uint64_t>(req_addr + sidx * BLKDEV_SECTOR_SIZE + i, data);
-    }
-  }
+// Whole requests are copied between the image and guest RAM, one guest
+// page fragment at a time.
+void iceblk_t::handle_read_request(const request_t& req) {
+  reg_t byte_idx = req.offset * BLKDEV_SECTOR_SIZE;
+  reg_t byte_len = req.len * BLKDEV_SECTOR_SIZE;
+  assert(byte_idx + byte_len <= blockdevice_size);
+  blkdev_printf("blkdev rd: sector %" PRIu64 " len %" PRIu64 " -> 0x%" PRIx64 "\n",
+                req.offset, req.len, req.addr);
+  dma_memcpy_to_ram(sim, req.addr, (uint8_t*)blockdevice + byte_idx, byte_len);
 }
 
-void iceblk_t::read_blockdevice_u64(uint64_t* data, reg_t sidx, reg_t boff) {
-  assert(boff % 8 == 0);
-  assert(sidx * BLKDEV_SECTOR_SIZE + boff < blockdevice_size);
-  reg_t byte_idx = sidx * BLKDEV_SECTOR_SIZE + boff;
-  reg_t bytes_per_elem = sizeof(uint64_t) / sizeof(uint8_t);
-  reg_t blkdev_idx = byte_idx / bytes_per_elem;
-  *data = blockdevice[blkdev_idx];
-  blkdev_printf("blkdev rd: [%" PRIu64 "]: 0x%" PRIx64 "\n", blkdev_idx, *data);
+void iceblk_t::handle_write_request(const request_t& req) {
+  reg_t byte_idx = req.offset * BLKDEV_SECTOR_SIZE;
+  reg_t byte_len = req.len * BLKDEV_SECTOR_SIZE;
+  assert(byte_idx + byte_len <= blockdevice_size);
+  blkdev_printf("blkdev wr: sector %" PRIu64 " len %" PRIu64 " <- 0x%" PRIx64 "\n",
+                req.offset, req.len, req.addr);
+  dma_memcpy_from_ram(sim, (uint8_t*)blockdevice + byte_idx, req.addr, byte_len);
 }
 
-void iceblk_t::handle_write_request() {
-  mmu_t* simdram = sim->debug_mmu;
-  for (reg_t sidx = 0; sidx < req_len; sidx++) {
-    for (reg_t i = 0; i < BLKDEV_SECTOR_SIZE; i+= 8) {
-      uint64_t data = simdram->load<uint64_t>(req_addr + sidx * BLKDEV_SECTOR_SIZE + i);
-      write_blockdevice_u64(data, sidx, i);
-    }
+void iceblk_t::complete_request(unsigned int tag) {
+  handle_request(tag);
+  if (stats) {
+    const request_t& req = requests[tag];
+    stats_end(stats, req.write ? 1 : 0, req.len * BLKDEV_SECTOR_SIZE,
+              cur_tick - req.post_tick, stats_get_ns() - req.post_ns, false);
+    if (cmpl_tags.empty())
+      stats_inc(stats, stats_irqs, 1);
   }
+  cmpl_tags.push(tag);
+  intctrl->set_interrupt_level(interrupt_id, 1);
 }
 
-void iceblk_t::write_blockdevice_u64(uint64_t data, reg_t sidx, reg_t boff) {
-  reg_t byte_idx = sidx * BLKDEV_SECTOR_SIZE + boff;
-  assert(byte_idx < blockdevice_size);
+unsigned int iceblk_t::post_request() {
+  assert(!idle_tags.empty());
+  unsigned int tag = idle_tags.front();
+  idle_tags.pop();
+
+  request_t& req = requests[tag];
+  req.addr = req_addr;
+  req.offset = req_offset;
+  req.len = req_len;
+  req.write = req_write;
+  if (stats) {
+    req.post_tick = cur_tick;
+    req.post_ns = stats_get_ns();
+    stats_start(stats);
+  }
 
-  reg_t bytes_per_elem = sizeof(uint64_t) / sizeof(uint8_t);
-  reg_t blkdev_idx = byte_idx / bytes_per_elem;
-  blockdevice[blkdev_idx] = data;
-  blkdev_printf("blkdev wr: [%" PRIu64 "]: 0x%" PRIx64 "\n", blkdev_idx, data);
-}
+  uint64_t cost = blockdevice_latency + req.len * blockdevice_sector_latency;
+  if (cost == 0) {
+    complete_request(tag);
+    return tag;
+  }
 
-void iceblk_t::post_request() {
-  pending_tags.push(idle_tags.front());
-  idle_tags.pop();
+  // the device transfers one request at a time, in order
+  uint64_t start = std::max(cur_tick, busy_until);
+  req.ready_tick = start + cost;
+  busy_until = req.ready_tick;
+  pending_tags.push(tag);
+  if (pending_tags.size() == 1)
+    next_deadline = req.ready_tick;
+  return tag;
 }
 
 bool iceblk_t::load(reg_t addr, size_t len, uint8_t* bytes) {
@@ -143,7 +236,8 @@ bool iceblk_t::load(reg_t addr, size_t len, uint8_t* bytes) {
   int tag;
   switch (addr) {
     case BLKDEV_REQUEST:
-      post_request();
+      tag = post_request();
+      read_little_endian_reg(tag, 0, len, bytes);
       break;
     case BLKDEV_NREQUEST:
       read_little_endian_reg((int)idle_tags.size(), 0, len, bytes);
@@ -200,15 +294,154 @@ bool iceblk_t::store(reg_t addr, size_t len, const uint8_t* bytes) {
 }
 
 void iceblk_t::tick(reg_t rtc_ticks) {
-  if (++cur_tick % blockdevice_latency == 0) {
-    cur_tick = 0;
+  cur_tick++;
+  if (stats)
+    stats_poll();
+
+  // nothing completes before the deadline
+  if (cur_tick >= next_deadline) {
+    while (!pending_tags.empty() &&
+           requests[pending_tags.front()].ready_tick <= cur_tick) {
+      complete_request(pending_tags.front());
+      pending_tags.pop();
+    }
+    update_deadline();
   }
 
-  if (cur_tick > 0 || pending_tags.empty()) return;
+  if (!checkpoint_file.empty() && checkpoint_requested(&checkpoint_count))
+    checkpoint_save(checkpoint_file.c_str());
+}
+
+// image data in the checkpoint
+enum {
+  ICEBLK_IMAGE_NONE, // mapped in rw mode: the file has the data
+  ICEBLK_IMAGE_PAGES, // modified pages of a snapshot mapping
+  ICEBLK_IMAGE_BUFFER, // no image file
+};
+
+void iceblk_t::save_tags(CheckpointFile *cp, std::queue<unsigned int> tags) {
+  checkpoint_put_u32(cp, tags.size());
+  for (; !tags.empty(); tags.pop())
+    checkpoint_put_u32(cp, tags.front());
+}
 
-  handle_request();
-  cmpl_tags.push(pending_tags.front());
-  pending_tags.pop();
+void iceblk_t::load_tags(CheckpointFile *cp, std::queue<unsigned int>& tags) {
+  tags = std::queue<unsigned int>();
+  uint32_t n = checkpoint_get_u32(cp);
+  if (n > (uint32_t)trackers) {
+    checkpoint_fail(cp, "invalid tag queue");
+    return;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t tag = checkpoint_get_u32(cp);
+    if (tag >= (uint32_t)trackers) {
+      checkpoint_fail(cp, "invalid tag %u", tag);
+      return;
+    }
+    tags.push(tag);
+  }
+}
+
+// The requests in progress are saved with the tick at which they
+// complete, so nothing is executed early.
+bool iceblk_t::checkpoint_save(const char *filename) {
+  CheckpointFile *cp = checkpoint_create(filename, "iceblk");
+  if (!cp)
+    return false;
+  checkpoint_put_u32(cp, trackers);
+  checkpoint_put_u64(cp, blockdevice_size);
+  checkpoint_put_u64(cp, cur_tick);
+  checkpoint_put_u64(cp, busy_until);
+  checkpoint_put_u64(cp, req_addr);
+  checkpoint_put_u64(cp, req_offset);
+  checkpoint_put_u64(cp, req_len);
+  checkpoint_put_u64(cp, req_write);
+  for (const request_t& req : requests) {
+    checkpoint_put_u64(cp, req.addr);
+    checkpoint_put_u64(cp, req.offset);
+    checkpoint_put_u64(cp, req.len);
+    checkpoint_put_u64(cp, req.write);
+    checkpoint_put_u64(cp, req.ready_tick);
+  }
+  save_tags(cp, idle_tags);
+  save_tags(cp, pending_tags);
+  save_tags(cp, cmpl_tags);
+
+  if (!blockdevice_mapped) {
+    checkpoint_put_u8(cp, ICEBLK_IMAGE_BUFFER);
+    checkpoint_put(cp, blockdevice, blockdevice_size);
+  } else if (blockdevice_mode == BF_MODE_SNAPSHOT) {
+    checkpoint_put_u8(cp, ICEBLK_IMAGE_PAGES);
+    if (!cp->error &&
+        block_device_map_save(cp->f, (uint8_t*)blockdevice,
+                              blockdevice_size / BLKDEV_SECTOR_SIZE) < 0)
+      checkpoint_fail(cp, "cannot save the image");
+  } else {
+    checkpoint_put_u8(cp, ICEBLK_IMAGE_NONE);
+  }
+  return checkpoint_close(cp) == 0;
+}
+
+// the device must have been created with the same arguments
+bool iceblk_t::checkpoint_restore(const char *filename) {
+  CheckpointFile *cp = checkpoint_open(filename, "iceblk");
+  if (!cp)
+    return false;
+  if (checkpoint_get_u32(cp) != (uint32_t)trackers ||
+      checkpoint_get_u64(cp) != blockdevice_size) {
+    checkpoint_fail(cp, "checkpoint with other trackers or image size");
+    checkpoint_close(cp);
+    return false;
+  }
+  cur_tick = checkpoint_get_u64(cp);
+  busy_until = checkpoint_get_u64(cp);
+  req_addr = checkpoint_get_u64(cp);
+  req_offset = checkpoint_get_u64(cp);
+  req_len = checkpoint_get_u64(cp);
+  req_write = checkpoint_get_u64(cp);
+  for (request_t& req : requests) {
+    req.addr = checkpoint_get_u64(cp);
+    req.offset = checkpoint_get_u64(cp);
+    req.len = checkpoint_get_u64(cp);
+    req.write = checkpoint_get_u64(cp);
+    req.ready_tick = checkpoint_get_u64(cp);
+    if (req.offset * BLKDEV_SECTOR_SIZE + req.len * BLKDEV_SECTOR_SIZE >
+        blockdevice_size)
+      checkpoint_fail(cp, "request beyond the end of the image");
+  }
+  load_tags(cp, idle_tags);
+  load_tags(cp, pending_tags);
+  load_tags(cp, cmpl_tags);
+  if (idle_tags.size() + pending_tags.size() + cmpl_tags.size() !=
+      (size_t)trackers)
+    checkpoint_fail(cp, "invalid tag queues");
+
+  int image = checkpoint_get_u8(cp);
+  int expected = !blockdevice_mapped ? ICEBLK_IMAGE_BUFFER :
+    blockdevice_mode == BF_MODE_SNAPSHOT ? ICEBLK_IMAGE_PAGES :
+    ICEBLK_IMAGE_NONE;
+  if (image != expected)
+    checkpoint_fail(cp, "checkpoint with another image mode");
+  if (!cp->error && image == ICEBLK_IMAGE_BUFFER)
+    checkpoint_get(cp, blockdevice, blockdevice_size);
+  if (!cp->error && image == ICEBLK_IMAGE_PAGES &&
+      block_device_map_load(cp->f, (uint8_t*)blockdevice,
+                            blockdevice_size / BLKDEV_SECTOR_SIZE) < 0)
+    checkpoint_fail(cp, "invalid image data");
+  if (checkpoint_close(cp) < 0)
+    return false;
+
+  // the latencies of the requests in progress count from the restore
+  if (stats) {
+    for (std::queue<unsigned int> q = pending_tags; !q.empty(); q.pop()) {
+      requests[q.front()].post_tick = cur_tick;
+      requests[q.front()].post_ns = stats_get_ns();
+      stats_start(stats);
+    }
+  }
+  update_deadline();
+  intctrl->set_interrupt_level(interrupt_id, !cmpl_tags.empty());
+  return true;
 }
 
 int fdt_parse_blkdev(
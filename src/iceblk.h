@@ -14,6 +14,9 @@
 #include <riscv/sim.h>
 #include <riscv/dts.h>
 #include <fdt/libfdt.h>
+#include "block_device.h"
+#include "stats.h"
+#include "checkpoint.h"
 
 #define BLKDEV_BASE         0x10015000
 #define BLKDEV_INTERRUPT_ID 2
@@ -32,30 +35,65 @@ public:
   void tick(reg_t rtc_ticks) override;
 
 private:
-  void post_request();
-  void handle_request();
-  void handle_read_request();
-  void handle_write_request();
+  struct request_t {
+    reg_t addr;
+    reg_t offset;
+    reg_t len;
+    reg_t write;
+    uint64_t ready_tick; // tick at which the transfer is done
+    uint64_t post_tick;  // statistics
+    uint64_t post_ns;
+  };
 
-  void read_blockdevice_u64(uint64_t* data, reg_t sector_idx, reg_t byte_offset);
-  void write_blockdevice_u64(uint64_t data, reg_t sector_idx, reg_t byte_offset);
+  unsigned int post_request();
+  void handle_request(unsigned int tag);
+  void handle_read_request(const request_t& req);
+  void handle_write_request(const request_t& req);
+  void complete_request(unsigned int tag);
+  void update_deadline() {
+    next_deadline = pending_tags.empty() ? UINT64_MAX :
+      requests[pending_tags.front()].ready_tick;
+  }
+  // device state and the image data not in the file, return false if
+  // error
+  bool checkpoint_save(const char *filename);
+  bool checkpoint_restore(const char *filename);
+  void save_tags(CheckpointFile *cp, std::queue<unsigned int> tags);
+  void load_tags(CheckpointFile *cp, std::queue<unsigned int>& tags);
 
 private:
+  // a request costs blockdevice_latency + len * blockdevice_sector_latency
+  // ticks, serviced one after another. 0 and 0 complete requests as soon
+  // as they are posted.
   uint64_t blockdevice_latency = 500;
+  uint64_t blockdevice_sector_latency = 0;
   uint64_t cur_tick = 0;
+  uint64_t busy_until = 0;
+  // tick() has nothing to do before this tick, the ready tick of the
+  // first pending request
+  uint64_t next_deadline = UINT64_MAX;
   uint64_t* blockdevice;
   uint64_t blockdevice_size;
+  bool blockdevice_mapped = false;
+  BlockDeviceModeEnum blockdevice_mode = BF_MODE_SNAPSHOT;
 
   const simif_t* sim;
   abstract_interrupt_controller_t *intctrl;
   uint32_t interrupt_id;
 
+  DeviceStats* stats = nullptr; // `stats` argument
+  int stats_irqs;
+
+  std::string checkpoint_file; // `checkpoint` argument, written on SIGUSR2
+  int checkpoint_count = 0;
+
   int trackers = 1;
+  std::vector<request_t> requests; // indexed by tag
   std::queue<unsigned int> idle_tags;
   std::queue<unsigned int> pending_tags;
   std::queue<unsigned int> cmpl_tags;
 
-  // FIXME : When tracker > 1, need to change these to queues as well
+  // request being set up by the driver, copied to its tag on post
   reg_t req_addr   = 0;
   reg_t req_offset = 0;
   reg_t req_len    = 0;
@@ -0,0 +1,133 @@
+/*
+ * Host input notification
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "cutils.h"
+#include "notify.h"
+
+struct FDNotifier {
+    int fd;
+    int epoll_fd; /* -1 if there is no thread */
+    int stop_fd; /* eventfd waking up the thread to stop it */
+    BOOL always_ready;
+    int ready; /* set by the thread, cleared by fd_notifier_rearm() */
+    pthread_t thread;
+};
+
+/* The descriptor is registered with EPOLLONESHOT: after an event, it
+   is only reported again once rearmed, so the thread sleeps while the
+   input waits to be read. */
+static void *fd_notifier_thread(void *opaque)
+{
+    FDNotifier *n = (FDNotifier *)opaque;
+    struct epoll_event ev;
+    int ret;
+
+    for(;;) {
+        ret = epoll_wait(n->epoll_fd, &ev, 1, -1);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+        if (ret == 0)
+            continue;
+        if (ev.data.fd == n->stop_fd)
+            break;
+        __atomic_store_n(&n->ready, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+FDNotifier *fd_notifier_new(int fd)
+{
+    FDNotifier *n;
+    struct epoll_event ev;
+
+    n = (FDNotifier *)mallocz(sizeof(*n));
+    n->fd = fd;
+    n->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (n->epoll_fd < 0) {
+        perror("epoll_create1");
+        free(n);
+        return NULL;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = fd;
+    if (epoll_ctl(n->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        if (errno != EPERM) {
+            perror("epoll_ctl");
+            close(n->epoll_fd);
+            free(n);
+            return NULL;
+        }
+        /* regular file or /dev/null: reading never blocks */
+        close(n->epoll_fd);
+        n->epoll_fd = -1;
+        n->always_ready = TRUE;
+        n->ready = 1;
+        return n;
+    }
+    n->stop_fd = eventfd(0, EFD_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.fd = n->stop_fd;
+    if (n->stop_fd < 0 ||
+        epoll_ctl(n->epoll_fd, EPOLL_CTL_ADD, n->stop_fd, &ev) < 0 ||
+        pthread_create(&n->thread, NULL, fd_notifier_thread, n) != 0) {
+        perror("fd_notifier_new");
+        if (n->stop_fd >= 0)
+            close(n->stop_fd);
+        close(n->epoll_fd);
+        free(n);
+        return NULL;
+    }
+    return n;
+}
+
+void fd_notifier_free(FDNotifier *n)
+{
+    uint64_t v = 1;
+
+    if (n->epoll_fd >= 0) {
+        if (write(n->stop_fd, &v, sizeof(v)) != sizeof(v))
+            perror("fd_notifier_free");
+        pthread_join(n->thread, NULL);
+        close(n->stop_fd);
+        close(n->epoll_fd);
+    }
+    free(n);
+}
+
+BOOL fd_notifier_ready(FDNotifier *n)
+{
+    return __atomic_load_n(&n->ready, __ATOMIC_ACQUIRE) != 0;
+}
+
+void fd_notifier_rearm(FDNotifier *n)
+{
+    struct epoll_event ev;
+
+    if (n->always_ready)
+        return;
+    __atomic_store_n(&n->ready, 0, __ATOMIC_RELEASE);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = n->fd;
+    if (epoll_ctl(n->epoll_fd, EPOLL_CTL_MOD, n->fd, &ev) < 0) {
+        /* keep reading the descriptor on every tick */
+        perror("epoll_ctl");
+        n->always_ready = TRUE;
+        __atomic_store_n(&n->ready, 1, __ATOMIC_RELEASE);
+    }
+}
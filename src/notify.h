@@ -0,0 +1,33 @@
+/*
+ * Host input notification
+ *
+ * A host thread waits for input on a file descriptor with epoll, so
+ * that the devices polled from their tick() only read a flag instead of
+ * making a system call on every tick. The descriptor is watched again
+ * once the input was read.
+ */
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include "cutils.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct FDNotifier FDNotifier;
+
+/* watch 'fd' for input. A descriptor which epoll does not support, such
+   as a regular file, is always ready. Return NULL if error. */
+FDNotifier *fd_notifier_new(int fd);
+void fd_notifier_free(FDNotifier *n);
+/* TRUE if input, end of file or an error is pending on the descriptor */
+BOOL fd_notifier_ready(FDNotifier *n);
+/* to be called after reading the descriptor: wait for the next input */
+void fd_notifier_rearm(FDNotifier *n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NOTIFY_H */
@@ -1,4 +1,129 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
 #include "sifive_uart.h"
+#include "checkpoint.h"
+
+sifive_uart_t::sifive_uart_t(abstract_interrupt_controller_t *intctrl, reg_t int_id,
+                             std::vector<std::string> sargs) :
+  rx_head(0), rx_count(0), rx_eof(false), rx_notifier(NULL), tx_len(0), tx_buf_size(UART_TX_BUF_SIZE),
+  stats(NULL), checkpoint_count(0), irq_level(0), ie(0), ip(0), txctrl(0), rxctrl(0), div(0), interrupt_id(int_id), intctrl(intctrl)
+{
+  std::map<std::string, std::string> argmap;
+
+  for (auto arg : sargs) {
+    size_t eq_idx = arg.find('=');
+    if (eq_idx != std::string::npos) {
+      argmap.insert(std::pair<std::string, std::string>(arg.substr(0, eq_idx), arg.substr(eq_idx+1)));
+    }
+  }
+
+  // transmitted bytes go to stdout, or to a file or a named pipe
+  out_fd = STDOUT_FILENO;
+  auto it = argmap.find("out");
+  if (it != argmap.end()) {
+    out_fd = open(it->second.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out_fd < 0) {
+      printf("Invalid sifive_uart out %s: %s\n", it->second.c_str(), strerror(errno));
+      exit(1);
+    }
+  }
+
+  it = argmap.find("txbuf");
+  if (it != argmap.end()) {
+    tx_buf_size = std::stoi(it->second);
+    if (tx_buf_size < 0 || tx_buf_size > (1 << 20)) {
+      printf("Invalid sifive_uart txbuf %s, must be 0 to %d\n",
+             it->second.c_str(), 1 << 20);
+      exit(1);
+    }
+  }
+  if (tx_buf_size == 0)
+    tx_buf_size = 1;
+  tx_buf = new uint8_t[tx_buf_size];
+  // keep a terminal responsive, the other outputs are only flushed when
+  // the buffer is full or from tick()
+  tx_line = isatty(out_fd);
+
+  // a host thread waits for the input, tick() only reads when some is
+  // pending
+  rx_notifier = fd_notifier_new(STDIN_FILENO);
+
+  it = argmap.find("stats");
+  if (it != argmap.end()) {
+    stats = stats_new("sifive_uart", it->second.c_str(), 0);
+    stats_tx_bytes = stats_add_counter(stats, "tx_bytes");
+    stats_tx_writes = stats_add_counter(stats, "tx_writes");
+    stats_rx_bytes = stats_add_counter(stats, "rx_bytes");
+    stats_irqs = stats_add_counter(stats, "irqs");
+  }
+
+  it = argmap.find("checkpoint");
+  if (it != argmap.end()) {
+    checkpoint_file = it->second;
+    checkpoint_init();
+  }
+  it = argmap.find("restore");
+  if (it != argmap.end() && !checkpoint_restore(it->second.c_str())) {
+    printf("Cannot restore the sifive_uart checkpoint %s\n", it->second.c_str());
+    exit(1);
+  }
+}
+
+sifive_uart_t::~sifive_uart_t() {
+  tx_flush();
+  if (rx_notifier)
+    fd_notifier_free(rx_notifier);
+  if (stats)
+    stats_free(stats);
+  if (out_fd != STDOUT_FILENO)
+    close(out_fd);
+  delete[] tx_buf;
+}
+
+void sifive_uart_t::tx_flush() {
+  int pos = 0;
+  if (stats && tx_len) stats_inc(stats, stats_tx_writes, 1);
+  while (pos < tx_len) {
+    ssize_t ret = ::write(out_fd, tx_buf + pos, tx_len - pos);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      break; // the output is lost, e.g. closed pipe
+    }
+    pos += ret;
+  }
+  tx_len = 0;
+}
+
+// read the available input bytes, without blocking
+void sifive_uart_t::rx_fill() {
+  struct pollfd pfd;
+  int room, tail, ret;
+
+  room = UART_RX_RING_SIZE - rx_count;
+  if (rx_eof || room == 0) return;
+  pfd.fd = STDIN_FILENO;
+  pfd.events = POLLIN;
+  // the input may have been read by another reader of stdin meanwhile
+  if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & (POLLIN | POLLHUP))) {
+    if (rx_notifier) fd_notifier_rearm(rx_notifier);
+    return;
+  }
+  tail = (rx_head + rx_count) % UART_RX_RING_SIZE;
+  if (tail + room > UART_RX_RING_SIZE)
+    room = UART_RX_RING_SIZE - tail;
+  ret = ::read(STDIN_FILENO, rx_ring + tail, room);
+  if (ret == 0)
+    rx_eof = true;
+  else if (rx_notifier)
+    fd_notifier_rearm(rx_notifier);
+  if (ret <= 0) return;
+  rx_count += ret;
+  if (stats) stats_inc(stats, stats_rx_bytes, ret);
+  update_interrupts();
+}
 
 bool sifive_uart_t::load(reg_t addr, size_t len, uint8_t* bytes) {
   if (addr >= 0x1000 || len > 4) return false;
@@ -21,27 +146,69 @@ bool sifive_uart_t::load(reg_t addr, size_t len, uint8_t* bytes) {
 bool sifive_uart_t::store(reg_t addr, size_t len, const uint8_t* bytes) {
   if (addr >= 0x1000 || len > 4) return false;
   switch (addr) {
-  case UART_TXFIFO: canonical_terminal_t::write(*bytes); return true;
-  case UART_TXCTRL: memcpy(&txctrl, bytes, len); return true;
-  case UART_RXCTRL: memcpy(&rxctrl, bytes, len); return true;
+  case UART_TXFIFO: write_txfifo(*bytes); return true;
+  case UART_TXCTRL: memcpy(&txctrl, bytes, len); update_interrupts(); return true;
+  case UART_RXCTRL: memcpy(&rxctrl, bytes, len); update_interrupts(); return true;
   case UART_IE:     memcpy(&ie, bytes, len); update_interrupts(); return true;
   case UART_DIV:    memcpy(&div, bytes, len); return true;
   default: printf("STORE -- ADDR=0x%lx LEN=%lu\n", addr, len); abort();
   }
 }
 
-void sifive_uart_t::tick(reg_t UNUSED rtc_ticks) {
-  if (rx_fifo.size() >= UART_RX_FIFO_SIZE) return;
-  int rc = canonical_terminal_t::read();
-  if (rc < 0) return;
-  rx_fifo.push((uint8_t)rc);
+// The transmitted bytes are flushed first. The received bytes are
+// saved since they were consumed from the input, the end of the input
+// is not.
+bool sifive_uart_t::checkpoint_save(const char *filename) {
+  CheckpointFile *cp = checkpoint_create(filename, "sifive_uart");
+  if (!cp)
+    return false;
+  if (tx_len) tx_flush();
+  checkpoint_put_u32(cp, ie);
+  checkpoint_put_u32(cp, ip);
+  checkpoint_put_u32(cp, txctrl);
+  checkpoint_put_u32(cp, rxctrl);
+  checkpoint_put_u32(cp, div);
+  checkpoint_put_u32(cp, rx_count);
+  for (int i = 0; i < rx_count; i++)
+    checkpoint_put_u8(cp, rx_ring[(rx_head + i) % UART_RX_RING_SIZE]);
+  return checkpoint_close(cp) == 0;
+}
+
+bool sifive_uart_t::checkpoint_restore(const char *filename) {
+  CheckpointFile *cp = checkpoint_open(filename, "sifive_uart");
+  if (!cp)
+    return false;
+  ie = checkpoint_get_u32(cp);
+  ip = checkpoint_get_u32(cp);
+  txctrl = checkpoint_get_u32(cp);
+  rxctrl = checkpoint_get_u32(cp);
+  div = checkpoint_get_u32(cp);
+  uint32_t n = checkpoint_get_u32(cp);
+  if (n > UART_RX_RING_SIZE)
+    checkpoint_fail(cp, "%u received bytes, at most %d", n, UART_RX_RING_SIZE);
+  else
+    checkpoint_get(cp, rx_ring, n);
+  rx_head = 0;
+  rx_count = cp->error ? 0 : n;
+  if (checkpoint_close(cp) < 0)
+    return false;
   update_interrupts();
+  return true;
+}
+
+void sifive_uart_t::tick(reg_t UNUSED rtc_ticks) {
+  if (stats) stats_poll();
+  if (!checkpoint_file.empty() && checkpoint_requested(&checkpoint_count))
+    checkpoint_save(checkpoint_file.c_str());
+  if (tx_len) tx_flush();
+  if (rx_count >= UART_RX_FIFO_SIZE) return;
+  if (rx_notifier && !fd_notifier_ready(rx_notifier)) return;
+  rx_fill();
 }
 
 int fdt_parse_sifive_uart(const void *fdt, reg_t *sifive_uart_addr,
 			  const char *compatible) {
-  int nodeoffset, len, rc;
-  const fdt32_t *reg_p;
+  int nodeoffset, rc;
 
   nodeoffset = fdt_node_offset_by_compatible(fdt, -1, compatible);
   if (nodeoffset < 0)
@@ -59,7 +226,7 @@ int fdt_parse_sifive_uart(const void *fdt, reg_t *sifive_uart_addr,
 sifive_uart_t* sifive_uart_parse_from_fdt(const void* fdt, const sim_t* sim, reg_t* base, std::vector<std::string> sargs) {
   if (fdt_parse_sifive_uart(fdt, base, "sifive,uart0") == 0) {
     printf("Found uart at %lx\n", *base);
-    return new sifive_uart_t(sim->get_intctrl(), 1);
+    return new sifive_uart_t(sim->get_intctrl(), 1, sargs);
   } else {
     return nullptr;
   }
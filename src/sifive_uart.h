@@ -6,6 +6,8 @@
 #include <riscv/sim.h>
 #include <fesvr/term.h>
 #include <fdt/libfdt.h>
+#include "stats.h"
+#include "notify.h"
 
 #define UART_TXFIFO (0x00)
 #define UART_RXFIFO (0x04)
@@ -25,6 +27,11 @@
 #define UART_GET_RXCNT(rxctrl)   ((rxctrl >> 16) & 0x7)
 #define UART_RX_FIFO_SIZE (8)
 
+// host side buffers: transmitted bytes are written to the output in
+// batches, received bytes are read from stdin in batches
+#define UART_TX_BUF_SIZE (4096)
+#define UART_RX_RING_SIZE (4096)
+
 #define UART_IE_TXWM       (1)
 #define UART_IE_RXWM       (2)
 
@@ -33,15 +40,32 @@
 
 class sifive_uart_t : public abstract_device_t {
 public:
-  sifive_uart_t(abstract_interrupt_controller_t *intctrl, reg_t int_id) :
-    ie(0), ip(0), txctrl(0), rxctrl(0), div(0), interrupt_id(int_id), intctrl(intctrl) {}
+  sifive_uart_t(abstract_interrupt_controller_t *intctrl, reg_t int_id,
+                std::vector<std::string> sargs);
+  ~sifive_uart_t();
 
   bool load(reg_t addr, size_t len, uint8_t* bytes) override;
   bool store(reg_t addr, size_t len, const uint8_t* bytes) override;
   void tick(reg_t UNUSED rtc_ticks) override;
 
 private:
-  std::queue<uint8_t> rx_fifo;
+  // bytes received from the host. The first UART_RX_FIFO_SIZE of them
+  // are in the RX FIFO seen by the guest.
+  uint8_t rx_ring[UART_RX_RING_SIZE];
+  int rx_head;
+  int rx_count;
+  bool rx_eof;
+  FDNotifier *rx_notifier; // stdin readiness, NULL to poll it on each tick
+  uint8_t *tx_buf;
+  int tx_len;
+  int tx_buf_size; // flush threshold, 0 to write each byte
+  bool tx_line; // flush on newline
+  int out_fd;
+  DeviceStats *stats; // `stats` argument, NULL if not given
+  int stats_tx_bytes, stats_tx_writes, stats_rx_bytes, stats_irqs;
+  std::string checkpoint_file; // `checkpoint` argument, written on SIGUSR2
+  int checkpoint_count;
+  int irq_level;
   uint32_t ie;
   uint32_t ip;
   uint32_t txctrl;
@@ -50,29 +74,45 @@ private:
   reg_t interrupt_id;
   abstract_interrupt_controller_t *intctrl;
 
+  int rx_fifo_size() {
+    return rx_count < UART_RX_FIFO_SIZE ? rx_count : UART_RX_FIFO_SIZE;
+  }
+
+  void rx_fill();
+  void tx_flush();
+  // registers and received bytes, return false if error
+  bool checkpoint_save(const char *filename);
+  bool checkpoint_restore(const char *filename);
+  void write_txfifo(uint8_t c) {
+    if (stats) stats_inc(stats, stats_tx_bytes, 1);
+    tx_buf[tx_len++] = c;
+    if (tx_len >= tx_buf_size || (tx_line && c == '\n'))
+      tx_flush();
+  }
+
   uint64_t read_ip() {
     uint64_t ret = 0;
     uint64_t txcnt = UART_GET_TXCNT(txctrl);
     uint64_t rxcnt = UART_GET_RXCNT(rxctrl);
     if (txcnt != 0) ret |= UART_IP_TXWM;
-    if (rx_fifo.size() > rxcnt) ret |= UART_IP_RXWM;
+    if ((uint64_t)rx_fifo_size() > rxcnt) ret |= UART_IP_RXWM;
     return ret;
   }
 
   uint32_t read_rxfifo() {
-    if (!rx_fifo.size()) return 0x80000000;
-    uint8_t r = rx_fifo.front();
-    rx_fifo.pop();
+    if (!rx_count) return 0x80000000;
+    uint8_t r = rx_ring[rx_head];
+    rx_head = (rx_head + 1) % UART_RX_RING_SIZE;
+    rx_count--;
     update_interrupts();
     return r;
   }
 
+  // the TX FIFO is always empty: its bytes are moved to tx_buf at once
   void update_interrupts() {
-    int cond = 0;
-    if ((ie & UART_IE_TXWM) ||
-        ((ie & UART_IE_RXWM) && rx_fifo.size())) {
-      cond = 1;
-    }
+    int cond = (read_ip() & ie) != 0;
+    if (stats && cond && !irq_level) stats_inc(stats, stats_irqs, 1);
+    irq_level = cond;
     intctrl->set_interrupt_level(interrupt_id, (cond) ? 1 : 0);
   }
 };
@@ -0,0 +1,226 @@
+/*
+ * Device statistics
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <assert.h>
+
+#include "cutils.h"
+#include "stats.h"
+
+static struct list_head stats_list = { &stats_list, &stats_list };
+static BOOL stats_initialized;
+static int stats_dump_count;
+
+static void stats_init(void)
+{
+    signal_counter_init(SIGUSR1);
+    atexit(stats_dump_all);
+    stats_initialized = TRUE;
+}
+
+DeviceStats *stats_new(const char *name, const char *filename, int nb_ops)
+{
+    DeviceStats *st;
+    int len;
+
+    if (!stats_initialized)
+        stats_init();
+    st = (DeviceStats *)mallocz(sizeof(*st));
+    st->name = strdup(name);
+    st->filename = strdup(filename);
+    len = strlen(filename);
+    st->csv = len >= 4 && !strcmp(filename + len - 4, ".csv");
+    st->nb_ops = nb_ops;
+    st->ops = (StatsOp *)mallocz(sizeof(st->ops[0]) * nb_ops);
+    list_add_tail(&st->link, &stats_list);
+    return st;
+}
+
+static void stats_dump_file(const char *filename);
+
+void stats_free(DeviceStats *st)
+{
+    struct list_head *el;
+    DeviceStats *st1;
+
+    stats_dump_file(st->filename);
+    /* keep the statistics if another device writes them later */
+    list_for_each(el, &stats_list) {
+        st1 = list_entry(el, DeviceStats, link);
+        if (st1 != st && !strcmp(st1->filename, st->filename))
+            return;
+    }
+    list_del(&st->link);
+    free(st->name);
+    free(st->filename);
+    free(st->ops);
+    free(st);
+}
+
+void stats_set_op_name(DeviceStats *st, int op, const char *name)
+{
+    st->ops[op].name = name;
+}
+
+int stats_add_counter(DeviceStats *st, const char *name)
+{
+    assert(st->nb_counters < STATS_MAX_COUNTERS);
+    st->counter_names[st->nb_counters] = name;
+    return st->nb_counters++;
+}
+
+static void stats_write_hist(FILE *f, const uint64_t *hist, const char *sep)
+{
+    int i, n;
+
+    /* the trailing empty buckets are omitted */
+    for(n = STATS_HIST_SIZE; n > 0 && hist[n - 1] == 0; n--)
+        continue;
+    for(i = 0; i < n; i++)
+        fprintf(f, "%s%" PRIu64, i == 0 ? "" : sep, hist[i]);
+}
+
+static void stats_write_json(FILE *f, DeviceStats *st)
+{
+    StatsOp *o;
+    int i;
+    BOOL first;
+
+    fprintf(f, "  {\n    \"device\": \"%s\",\n", st->name);
+    fprintf(f, "    \"in_flight\": %d,\n    \"max_in_flight\": %d,\n",
+            st->in_flight, st->max_in_flight);
+    fprintf(f, "    \"avg_in_flight\": %.2f,\n",
+            st->nb_started ? (double)st->in_flight_total / st->nb_started : 0.0);
+    fprintf(f, "    \"counters\": {");
+    for(i = 0; i < st->nb_counters; i++) {
+        fprintf(f, "%s\"%s\": %" PRIu64, i == 0 ? "" : ", ",
+                st->counter_names[i], st->counters[i]);
+    }
+    fprintf(f, "},\n    \"ops\": {");
+    first = TRUE;
+    for(i = 0; i < st->nb_ops; i++) {
+        o = &st->ops[i];
+        if (!o->name || o->count == 0)
+            continue;
+        fprintf(f, "%s\n      \"%s\": {\"count\": %" PRIu64
+                ", \"errors\": %" PRIu64 ", \"bytes\": %" PRIu64
+                ", \"ticks_total\": %" PRIu64 ", \"ns_total\": %" PRIu64
+                ", \"ticks_hist\": [",
+                first ? "" : ",", o->name, o->count, o->errors, o->bytes,
+                o->ticks_total, o->ns_total);
+        stats_write_hist(f, o->ticks_hist, ", ");
+        fprintf(f, "], \"ns_hist\": [");
+        stats_write_hist(f, o->ns_hist, ", ");
+        fprintf(f, "]}");
+        first = FALSE;
+    }
+    fprintf(f, "%s}\n  }", first ? "" : "\n    ");
+}
+
+/* one line per operation and per counter. The histograms are lists of
+   buckets separated by spaces. */
+static void stats_write_csv(FILE *f, DeviceStats *st)
+{
+    StatsOp *o;
+    int i;
+
+    fprintf(f, "%s,in_flight,%d,,,,,,\n", st->name, st->in_flight);
+    fprintf(f, "%s,max_in_flight,%d,,,,,,\n", st->name, st->max_in_flight);
+    for(i = 0; i < st->nb_counters; i++) {
+        fprintf(f, "%s,%s,%" PRIu64 ",,,,,,\n",
+                st->name, st->counter_names[i], st->counters[i]);
+    }
+    for(i = 0; i < st->nb_ops; i++) {
+        o = &st->ops[i];
+        if (!o->name || o->count == 0)
+            continue;
+        fprintf(f, "%s,%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+                ",%" PRIu64 ",", st->name, o->name, o->count, o->errors,
+                o->bytes, o->ticks_total, o->ns_total);
+        stats_write_hist(f, o->ticks_hist, " ");
+        fprintf(f, ",");
+        stats_write_hist(f, o->ns_hist, " ");
+        fprintf(f, "\n");
+    }
+}
+
+/* write the devices sharing the file 'filename'. The file is replaced
+   at once so that a reader never sees a partial dump. */
+static void stats_dump_file(const char *filename)
+{
+    struct list_head *el;
+    DeviceStats *st;
+    char *tmp_filename;
+    FILE *f;
+    BOOL csv, first;
+
+    tmp_filename = (char *)malloc(strlen(filename) + 5);
+    sprintf(tmp_filename, "%s.tmp", filename);
+    f = fopen(tmp_filename, "w");
+    if (!f) {
+        perror(tmp_filename);
+        free(tmp_filename);
+        return;
+    }
+    first = TRUE;
+    csv = FALSE;
+    list_for_each(el, &stats_list) {
+        st = list_entry(el, DeviceStats, link);
+        if (strcmp(st->filename, filename) != 0)
+            continue;
+        csv = st->csv;
+        if (csv) {
+            if (first)
+                fprintf(f, "device,name,count,errors,bytes,ticks_total,ns_total,ticks_hist,ns_hist\n");
+            stats_write_csv(f, st);
+        } else {
+            fprintf(f, "%s", first ? "[\n" : ",\n");
+            stats_write_json(f, st);
+        }
+        first = FALSE;
+    }
+    if (!csv)
+        fprintf(f, "%s]\n", first ? "[" : "\n");
+    fclose(f);
+    if (rename(tmp_filename, filename) < 0)
+        perror(filename);
+    free(tmp_filename);
+}
+
+void stats_dump_all(void)
+{
+    struct list_head *el, *el1;
+    DeviceStats *st, *st1;
+    BOOL done;
+
+    list_for_each(el, &stats_list) {
+        st = list_entry(el, DeviceStats, link);
+        /* write each file once */
+        done = FALSE;
+        list_for_each(el1, &stats_list) {
+            if (el1 == el)
+                break;
+            st1 = list_entry(el1, DeviceStats, link);
+            if (!strcmp(st1->filename, st->filename)) {
+                done = TRUE;
+                break;
+            }
+        }
+        if (!done)
+            stats_dump_file(st->filename);
+    }
+}
+
+void stats_poll(void)
+{
+    int n = signal_counter_get(SIGUSR1);
+
+    if (n != stats_dump_count) {
+        stats_dump_count = n;
+        stats_dump_all();
+    }
+}
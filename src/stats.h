@@ -0,0 +1,118 @@
+/*
+ * Device statistics
+ *
+ * Request counters and latency histograms of a device instance. They are
+ * written to a JSON or CSV file when the process receives SIGUSR1, when
+ * the device is closed and at exit. A device without statistics has a
+ * NULL DeviceStats pointer, so that the disabled case only costs a
+ * test.
+ *
+ * The functions must be called from the thread which drives the devices
+ * (the simulator thread).
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <inttypes.h>
+#include <time.h>
+#include "cutils.h"
+#include "list.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* histogram bucket i > 0 counts the latencies in [2^(i-1), 2^i), bucket
+   0 the null ones. The last bucket also holds the larger values. */
+#define STATS_HIST_SIZE 48
+#define STATS_MAX_COUNTERS 8
+
+typedef struct {
+    const char *name; /* NULL if the operation is not reported */
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t ticks_total; /* latency in device ticks */
+    uint64_t ns_total; /* latency in host nanoseconds */
+    uint64_t ticks_hist[STATS_HIST_SIZE];
+    uint64_t ns_hist[STATS_HIST_SIZE];
+} StatsOp;
+
+typedef struct {
+    struct list_head link;
+    char *name; /* device instance, e.g. "virtioblk0" */
+    char *filename;
+    BOOL csv; /* CSV if the file name ends with ".csv", JSON otherwise */
+    int nb_ops;
+    StatsOp *ops;
+    int in_flight; /* requests started and not ended */
+    int max_in_flight;
+    uint64_t nb_started;
+    uint64_t in_flight_total; /* sum of in_flight when a request starts */
+    int nb_counters;
+    const char *counter_names[STATS_MAX_COUNTERS];
+    uint64_t counters[STATS_MAX_COUNTERS];
+} DeviceStats;
+
+DeviceStats *stats_new(const char *name, const char *filename, int nb_ops);
+/* write the file a last time */
+void stats_free(DeviceStats *st);
+void stats_set_op_name(DeviceStats *st, int op, const char *name);
+/* return the index of a new counter */
+int stats_add_counter(DeviceStats *st, const char *name);
+/* write the files if SIGUSR1 was received. Cheap otherwise. */
+void stats_poll(void);
+/* write the files of all the devices */
+void stats_dump_all(void);
+
+static inline uint64_t stats_get_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int stats_hist_bucket(uint64_t v)
+{
+    int i;
+    if (v == 0)
+        return 0;
+    i = 64 - __builtin_clzll(v);
+    return i < STATS_HIST_SIZE ? i : STATS_HIST_SIZE - 1;
+}
+
+static inline void stats_inc(DeviceStats *st, int counter, uint64_t n)
+{
+    st->counters[counter] += n;
+}
+
+static inline void stats_start(DeviceStats *st)
+{
+    st->in_flight++;
+    if (st->in_flight > st->max_in_flight)
+        st->max_in_flight = st->in_flight;
+    st->nb_started++;
+    st->in_flight_total += st->in_flight;
+}
+
+/* end of a request of operation 'op' started with stats_start() */
+static inline void stats_end(DeviceStats *st, int op, uint64_t bytes,
+                             uint64_t ticks, uint64_t ns, BOOL error)
+{
+    StatsOp *o = &st->ops[op];
+
+    st->in_flight--;
+    o->count++;
+    o->errors += error;
+    o->bytes += bytes;
+    o->ticks_total += ticks;
+    o->ns_total += ns;
+    o->ticks_hist[stats_hist_bucket(ticks)]++;
+    o->ns_hist[stats_hist_bucket(ns)]++;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STATS_H */
@@ -8,37 +8,16 @@
 #include "cutils.h"
 
 
-int fdt_parse_virtio9p(
-    const void *fdt,
-    reg_t* blkdev_addr,
-    uint32_t* blkdev_int_id,
-    const char *compatible) {
-  int nodeoffset, rc, len;
-  const fdt32_t *reg_p;
-
-  nodeoffset = fdt_node_offset_by_compatible(fdt, -1, compatible);
-  if (nodeoffset < 0)
-    return nodeoffset;
-
-  rc = fdt_get_node_addr_size(fdt, nodeoffset, blkdev_addr, NULL, "reg");
-  if (rc < 0 || !blkdev_addr)
-    return -ENODEV;
-
-  reg_p = (fdt32_t *)fdt_getprop(fdt, nodeoffset, "interrupts", &len);
-  if (blkdev_int_id) {
-    if (reg_p)
-      *blkdev_int_id = fdt32_to_cpu(*reg_p);
-    else
-      *blkdev_int_id = VIRTIO_9P_FS_IRQ;
-  }
-
-  return 0;
-}
+// instances created so far, numbered from 0 in the order of the
+// --device options
+static int virtio9p_dts_count;
+static int virtio9p_fdt_count;
 
 virtio9p_t::virtio9p_t(
       const simif_t* sim,
       abstract_interrupt_controller_t *intctrl,
       uint32_t interrupt_id,
+      int instance,
       std::vector<std::string> sargs)
   : virtio_base_t(sim, intctrl, interrupt_id, sargs)
 {
@@ -73,22 +52,87 @@ virtio9p_t::virtio9p_t(
     printf("Virtio 9p disk fs device plugin INIT WARN: `tag` argument not specified. Use default %s\n", mount_tag.c_str());
   }
   
-  int irq_num;
+  // largest message size negotiated with the guest
+  uint32_t max_msize = 0;
+  it = argmap.find("msize");
+  if (it != argmap.end()) {
+    long msize = atol(it->second.c_str());
+    if (msize < 4096 || msize > (16 << 20)) {
+      printf("Virtio 9p disk fs device plugin INIT ERROR: `msize` must be 4096 to %d.\n", 16 << 20);
+      exit(1);
+    }
+    max_msize = msize;
+  }
+
+  // requests executed on a pool of host threads
+  int nb_threads = 0;
+  it = argmap.find("threads");
+  if (it != argmap.end()) {
+    nb_threads = atoi(it->second.c_str());
+    if (nb_threads < 0) {
+      printf("Virtio 9p disk fs device plugin INIT ERROR: `threads` must not be negative.\n");
+      exit(1);
+    }
+  }
+
+  // host metadata cache
+  FSDiskCacheModeEnum cache_mode = FS_CACHE_NONE;
+  it = argmap.find("cache");
+  if (it != argmap.end()) {
+    if (it->second == "loose") {
+      cache_mode = FS_CACHE_LOOSE;
+    }
+    else if (it->second == "strict") {
+      cache_mode = FS_CACHE_STRICT;
+    }
+    else if (it->second != "none") {
+      printf("Virtio 9p disk fs device plugin INIT ERROR: unsupported `cache` mode %s.\n"
+             "Available modes are `none`, `loose` and `strict`.\n", it->second.c_str());
+      exit(1);
+    }
+  }
+
+  // host file access: full paths, or *at() calls on a descriptor per fid
+  FSDiskBackendEnum backend = FS_DISK_PATH;
+  it = argmap.find("backend");
+  if (it != argmap.end()) {
+    if (it->second == "at") {
+      backend = FS_DISK_AT;
+    }
+    else if (it->second != "path") {
+      printf("Virtio 9p disk fs device plugin INIT ERROR: unsupported `backend` %s.\n"
+             "Available backends are `path` and `at`.\n", it->second.c_str());
+      exit(1);
+    }
+  }
+
   VIRTIOBusDef vbus_s, *vbus = &vbus_s;
-  FSDevice* fs = fs_disk_init(fname.c_str());
+  FSDevice* fs = fs_disk_init(fname.c_str(), cache_mode, backend);
   if (!fs) {
     printf("Virtio 9p disk fs device plugin INIT ERROR: `path` %s must be a directory\n", fname.c_str());
     exit(1);
   }
 
   memset(vbus, 0, sizeof(*vbus));
-  vbus->addr = VIRTIO_9P_FS_BASE;
-  irq_num  = VIRTIO_9P_FS_IRQ;
-  irq = new IRQSpike(intctrl, irq_num);
+  irq = new IRQSpike(intctrl, interrupt_id);
   vbus->irq = irq;
+  vbus->queue_num_max = queue_size;
+  vbus->irq_batch = irq_batch;
+  vbus->irq_delay = irq_delay;
+
+  std::string stats_name = "virtio9p" + std::to_string(instance);
+  if (!stats_file.empty()) {
+    vbus->stats_name = stats_name.c_str();
+    vbus->stats_file = stats_file.c_str();
+  }
 
-  virtio_dev = virtio_9p_init(vbus, fs, mount_tag.c_str(), sim);
-  vbus->addr += VIRTIO_SIZE;
+  virtio_dev = virtio_9p_init(vbus, fs, mount_tag.c_str(), max_msize,
+                               nb_threads, sim);
+  if (!restore_file.empty() && !checkpoint_restore(restore_file.c_str())) {
+    printf("Virtio 9p disk fs device plugin INIT ERROR: cannot restore the `restore` checkpoint %s.\n",
+           restore_file.c_str());
+    exit(1);
+  }
 
 }
 
@@ -98,19 +142,13 @@ virtio9p_t::~virtio9p_t() {
 
 
 std::string virtio9p_generate_dts(const sim_t* sim, const std::vector<std::string>& args) {
-  std::stringstream s;
-  s << std::hex 
-    << "    virtio9p: virtio@" << VIRTIO_9P_FS_BASE << " {\n"
-    << "      compatible = \"virtio,mmio\";\n"
-       "      interrupt-parent = <&PLIC>;\n"
-       "      interrupts = <" << std::dec << VIRTIO_9P_FS_IRQ;
-    reg_t virtio9pbs = VIRTIO_9P_FS_BASE;
-    reg_t virtio9psz = VIRTIO_SIZE;
-  s << std::hex << ">;\n"
-       "      reg = <0x" << (virtio9pbs >> 32) << " 0x" << (virtio9pbs & (uint32_t)-1) <<
-                   " 0x" << (virtio9psz >> 32) << " 0x" << (virtio9psz & (uint32_t)-1) << ">;\n"
-       "    };\n";
-    return s.str();
+  int idx = virtio9p_dts_count++;
+  if (idx >= VIRTIO_MAX_INSTANCES) {
+    printf("Virtio 9p disk fs device plugin INIT ERROR: at most %d devices are supported.\n",
+           VIRTIO_MAX_INSTANCES);
+    exit(1);
+  }
+  return virtio_generate_dts("virtio9p", VIRTIO_TYPE_9P, idx);
 }
 
 virtio9p_t* virtio9p_parse_from_fdt(
@@ -118,9 +156,11 @@ virtio9p_t* virtio9p_parse_from_fdt(
     std::vector<std::string> sargs)
 {
   uint32_t blkdev_int_id;
-  if (fdt_parse_virtio9p(fdt, base, &blkdev_int_id, "virtio,mmio") == 0) {
+  int idx = virtio9p_fdt_count++;
+  if (idx < VIRTIO_MAX_INSTANCES &&
+      fdt_parse_virtio(fdt, VIRTIO_TYPE_9P, idx, base, &blkdev_int_id) == 0) {
     abstract_interrupt_controller_t* intctrl = sim->get_intctrl();
-    return new virtio9p_t(sim, intctrl, blkdev_int_id, sargs);
+    return new virtio9p_t(sim, intctrl, blkdev_int_id, idx, sargs);
   } else {
     return nullptr;
   }
@@ -12,15 +12,13 @@
 #include "fs.h"
 #include "list.h" 
 
-#define VIRTIO_9P_FS_BASE 0x40011000
-#define VIRTIO_9P_FS_IRQ       2
-
 class virtio9p_t: public virtio_base_t {
 public:
   virtio9p_t(
       const simif_t* sim,
       abstract_interrupt_controller_t *intctrl,
       uint32_t interrupt_id,
+      int instance,
       std::vector<std::string> sargs);
   ~virtio9p_t();
 private:
@@ -7,37 +7,16 @@
 #include "virtio-block.h"
 #include "cutils.h"
 
-int fdt_parse_virtioblk(
-    const void *fdt,
-    reg_t* blkdev_addr,
-    uint32_t* blkdev_int_id,
-    const char *compatible) {
-  int nodeoffset, rc, len;
-  const fdt32_t *reg_p;
-
-  nodeoffset = fdt_node_offset_by_compatible(fdt, -1, compatible);
-  if (nodeoffset < 0)
-    return nodeoffset;
-
-  rc = fdt_get_node_addr_size(fdt, nodeoffset, blkdev_addr, NULL, "reg");
-  if (rc < 0 || !blkdev_addr)
-    return -ENODEV;
-
-  reg_p = (fdt32_t *)fdt_getprop(fdt, nodeoffset, "interrupts", &len);
-  if (blkdev_int_id) {
-    if (reg_p)
-      *blkdev_int_id = fdt32_to_cpu(*reg_p);
-    else
-      *blkdev_int_id = VIRTIO_IRQ;
-  }
-
-  return 0;
-}
+// instances created so far, numbered from 0 in the order of the
+// --device options
+static int virtioblk_dts_count;
+static int virtioblk_fdt_count;
 
 virtioblk_t::virtioblk_t(
       const simif_t* sim,
       abstract_interrupt_controller_t *intctrl,
       uint32_t interrupt_id,
+      int instance,
       std::vector<std::string> sargs)
   : virtio_base_t(sim, intctrl, interrupt_id, sargs)
 {
@@ -78,45 +57,227 @@ virtioblk_t::virtioblk_t(
     }
 
 
-    int irq_num;
+    // image access: read/write system calls, or a memory mapping
+    bool backend_mmap = false;
+    it = argmap.find("backend");
+    if (it != argmap.end()) {
+        if (it->second == "mmap") {
+            backend_mmap = true;
+        }
+        else if (it->second != "file") {
+            printf("Virtio block device plugin INIT ERROR: unsupported `backend` %s.\n"
+                    "Available backends are `file` and `mmap`.\n", it->second.c_str());
+            exit(1);
+        }
+    }
+
+    // host I/O model: synchronous, or on a pool of host threads
+    bool aio_threads = false;
+    int aio_nb_threads = 4;
+    it = argmap.find("aio");
+    if (it != argmap.end()) {
+        if (it->second == "threads") {
+            aio_threads = true;
+        }
+        else if (it->second != "sync") {
+            printf("Virtio block device plugin INIT ERROR: unsupported `aio` mode %s.\n"
+                    "Available modes are `sync` and `threads`.\n", it->second.c_str());
+            exit(1);
+        }
+    }
+    it = argmap.find("threads");
+    if (it != argmap.end()) {
+        aio_nb_threads = atoi(it->second.c_str());
+        if (aio_nb_threads <= 0) {
+            printf("Virtio block device plugin INIT ERROR: `threads` must be positive.\n");
+            exit(1);
+        }
+    }
+
+    // one request queue per guest hart with VIRTIO_BLK_F_MQ
+    int num_queues = 1;
+    it = argmap.find("num_queues");
+    if (it != argmap.end()) {
+        num_queues = atoi(it->second.c_str());
+        if (num_queues < 1 || num_queues > 8) {
+            printf("Virtio block device plugin INIT ERROR: `num_queues` must be 1 to 8.\n");
+            exit(1);
+        }
+    }
+
+    // snapshot mode: keep the written sectors in a file across runs
+    std::string delta_fname;
+    it = argmap.find("delta");
+    if (it != argmap.end()) {
+        if (block_device_mode != BF_MODE_SNAPSHOT) {
+            printf("Virtio block device plugin INIT ERROR: `delta` requires `mode=snapshot`.\n");
+            exit(1);
+        }
+        delta_fname = it->second;
+    }
+
+    // read only base shared with the other instances through a copy in
+    // this directory, accessed like the mmap backend
+    std::string shared_dir;
+    it = argmap.find("shared");
+    if (it != argmap.end()) {
+        if (block_device_mode == BF_MODE_RW) {
+            printf("Virtio block device plugin INIT ERROR: `shared` requires `mode=ro` or `mode=snapshot`.\n");
+            exit(1);
+        }
+        shared_dir = it->second;
+    }
+
+    // chunked compressed image made by blkpack, decompressed on demand
+    bool format_compressed = false;
+    int cache_mb = 0, prefetch = 0;
+    it = argmap.find("format");
+    if (it != argmap.end()) {
+        if (it->second == "compressed") {
+            format_compressed = true;
+        }
+        else if (it->second != "raw") {
+            printf("Virtio block device plugin INIT ERROR: unsupported `format` %s.\n"
+                    "Available formats are `raw` and `compressed`.\n", it->second.c_str());
+            exit(1);
+        }
+    }
+    if (format_compressed) {
+        if (block_device_mode == BF_MODE_RW) {
+            printf("Virtio block device plugin INIT ERROR: `format=compressed` requires `mode=ro` or `mode=snapshot`.\n");
+            exit(1);
+        }
+        if (backend_mmap || !shared_dir.empty()) {
+            printf("Virtio block device plugin INIT ERROR: `format=compressed` cannot be used with `backend=mmap` or `shared`.\n");
+            exit(1);
+        }
+    }
+    it = argmap.find("cache_mb");
+    if (it != argmap.end()) {
+        cache_mb = atoi(it->second.c_str());
+        if (cache_mb <= 0) {
+            printf("Virtio block device plugin INIT ERROR: `cache_mb` must be positive.\n");
+            exit(1);
+        }
+    }
+    it = argmap.find("prefetch");
+    if (it != argmap.end()) {
+        prefetch = atoi(it->second.c_str());
+        if (prefetch < 0) {
+            printf("Virtio block device plugin INIT ERROR: `prefetch` must not be negative.\n");
+            exit(1);
+        }
+    }
+
+    // host readahead of the sequential streams of the file backend
+    int readahead_kb = 0, readahead_cache_kb = 0;
+    it = argmap.find("readahead");
+    if (it != argmap.end()) {
+        readahead_kb = atoi(it->second.c_str());
+        if (readahead_kb <= 0) {
+            printf("Virtio block device plugin INIT ERROR: `readahead` must be positive.\n");
+            exit(1);
+        }
+        if (backend_mmap || !shared_dir.empty() || format_compressed) {
+            printf("Virtio block device plugin INIT ERROR: `readahead` requires the `file` backend and a raw image.\n");
+            exit(1);
+        }
+    }
+    it = argmap.find("readahead_cache");
+    if (it != argmap.end()) {
+        readahead_cache_kb = atoi(it->second.c_str());
+        if (readahead_cache_kb <= 0 || readahead_kb == 0) {
+            printf("Virtio block device plugin INIT ERROR: `readahead_cache` must be positive and requires `readahead`.\n");
+            exit(1);
+        }
+    }
+
+    // record the requests to a trace file, replayed by blkbench
+    std::string trace_fname;
+    it = argmap.find("trace");
+    if (it != argmap.end())
+        trace_fname = it->second;
+
     VIRTIOBusDef vbus_s, *vbus = &vbus_s;
-    BlockDevice* bs = block_device_init(fname.c_str(), block_device_mode); //initialization
+    if (format_compressed) {
+        bs = block_device_init_compressed(fname.c_str(), cache_mb, prefetch);
+        if (!bs) {
+            printf("Virtio block device plugin INIT ERROR: cannot open the compressed image %s.\n",
+                   fname.c_str());
+            exit(1);
+        }
+        if (block_device_mode == BF_MODE_SNAPSHOT)
+            bs = block_device_init_overlay(bs, delta_fname.empty() ? NULL :
+                                           delta_fname.c_str());
+    }
+    else if (!delta_fname.empty()) {
+        if (!shared_dir.empty())
+            bs = block_device_init_shared(fname.c_str(), shared_dir.c_str(),
+                                          BF_MODE_RO);
+        else if (backend_mmap)
+            bs = block_device_init_mmap(fname.c_str(), BF_MODE_RO);
+        else
+            bs = block_device_init(fname.c_str(), BF_MODE_RO);
+        bs = block_device_init_overlay(bs, delta_fname.c_str());
+    }
+    else if (!shared_dir.empty())
+        bs = block_device_init_shared(fname.c_str(), shared_dir.c_str(),
+                                      block_device_mode);
+    else if (backend_mmap)
+        bs = block_device_init_mmap(fname.c_str(), block_device_mode);
+    else
+        bs = block_device_init(fname.c_str(), block_device_mode); //initialization
+    if (readahead_kb)
+        bs = block_device_init_readahead(bs, readahead_kb, readahead_cache_kb);
+    if (aio_threads)
+        bs = block_device_init_async(bs, aio_nb_threads, num_queues);
+    if (!trace_fname.empty()) {
+        bs = block_device_init_trace(bs, trace_fname.c_str());
+        if (!bs) {
+            printf("Virtio block device plugin INIT ERROR: cannot create `trace` file %s.\n",
+                   trace_fname.c_str());
+            exit(1);
+        }
+    }
 
     memset(vbus, 0, sizeof(*vbus));
-    vbus->addr = VIRTIO_BASE_ADDR;
-    irq_num = VIRTIO_IRQ;
-    irq = new IRQSpike(intctrl, irq_num);
-
-    // only one virtio block device
-    //REQUIRE: register irq_num as plic_irq number
-    // vbus->irq = &s->plci_irq[irq_num];
+    irq = new IRQSpike(intctrl, interrupt_id);
     vbus->irq = irq;
+    vbus->queue_num_max = queue_size;
+    vbus->irq_batch = irq_batch;
+    vbus->irq_delay = irq_delay;
 
-    virtio_dev = virtio_block_init(vbus, bs, sim);
-    vbus->addr += VIRTIO_SIZE;
+    std::string stats_name = "virtioblk" + std::to_string(instance);
+    if (!stats_file.empty()) {
+        vbus->stats_name = stats_name.c_str();
+        vbus->stats_file = stats_file.c_str();
+    }
 
+    virtio_dev = virtio_block_init(vbus, bs, num_queues, sim);
+    if (!restore_file.empty() && !checkpoint_restore(restore_file.c_str())) {
+        printf("Virtio block device plugin INIT ERROR: cannot restore the `restore` checkpoint %s.\n",
+               restore_file.c_str());
+        exit(1);
+    }
 
 }
 
 virtioblk_t::~virtioblk_t() {
+    // closing drains the asynchronous requests, whose completions raise
+    // the interrupt
+    if (bs) block_device_close(bs);
     if (irq) delete irq;
 }
 
 
 std::string virtioblk_generate_dts(const sim_t* sim, const std::vector<std::string>& args) {
-  std::stringstream s;
-  s << std::hex 
-    << "    virtioblk: virtio@" << VIRTIO_BASE_ADDR << " {\n"
-    << "      compatible = \"virtio,mmio\";\n"
-       "      interrupt-parent = <&PLIC>;\n"
-       "      interrupts = <" << std::dec << VIRTIO_IRQ;
-    reg_t virtioblkbs = VIRTIO_BASE_ADDR;
-    reg_t virtioblksz = VIRTIO_SIZE;
-  s << std::hex << ">;\n"
-       "      reg = <0x" << (virtioblkbs >> 32) << " 0x" << (virtioblkbs & (uint32_t)-1) <<
-                   " 0x" << (virtioblksz >> 32) << " 0x" << (virtioblksz & (uint32_t)-1) << ">;\n"
-       "    };\n";
-    return s.str();
+  int idx = virtioblk_dts_count++;
+  if (idx >= VIRTIO_MAX_INSTANCES) {
+    printf("Virtio block device plugin INIT ERROR: at most %d devices are supported.\n",
+           VIRTIO_MAX_INSTANCES);
+    exit(1);
+  }
+  return virtio_generate_dts("virtioblk", VIRTIO_TYPE_BLOCK, idx);
 }
 
 virtioblk_t* virtioblk_parse_from_fdt(
@@ -124,9 +285,11 @@ virtioblk_t* virtioblk_parse_from_fdt(
     std::vector<std::string> sargs)
 {
   uint32_t blkdev_int_id;
-  if (fdt_parse_virtioblk(fdt, base, &blkdev_int_id, "virtio,mmio") == 0) {
+  int idx = virtioblk_fdt_count++;
+  if (idx < VIRTIO_MAX_INSTANCES &&
+      fdt_parse_virtio(fdt, VIRTIO_TYPE_BLOCK, idx, base, &blkdev_int_id) == 0) {
     abstract_interrupt_controller_t* intctrl = sim->get_intctrl();
-    return new virtioblk_t(sim, intctrl, blkdev_int_id, sargs);
+    return new virtioblk_t(sim, intctrl, blkdev_int_id, idx, sargs);
   } else {
     return nullptr;
   }
@@ -10,17 +10,15 @@
 #include <fdt/libfdt.h>
 #include "virtio.h"
 
-#define VIRTIO_BASE_ADDR 0x40010000
-#define VIRTIO_SIZE      0x1000
-#define VIRTIO_IRQ       1
-
 class virtioblk_t: public virtio_base_t {
 public:
   virtioblk_t(
       const simif_t* sim,
       abstract_interrupt_controller_t *intctrl,
       uint32_t interrupt_id,
+      int instance,
       std::vector<std::string> sargs);
   ~virtioblk_t();
 private:
+  BlockDevice* bs;
 };
\ No newline at end of file
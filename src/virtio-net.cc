@@ -0,0 +1,250 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include "virtio-net.h"
+#include "notify.h"
+#include "cutils.h"
+
+// instances created so far, numbered from 0 in the order of the
+// --device options
+static int virtionet_dts_count;
+static int virtionet_fdt_count;
+
+/* TAP backend: the frames are read and written with readv() and
+   writev() on the guest buffers */
+typedef struct {
+    int fd;
+    FDNotifier *notifier; /* input on fd */
+} TapState;
+
+static int tap_write_packet(EthernetDevice *net, const struct iovec *iov,
+                            int iovcnt)
+{
+    TapState *s = (TapState *)net->opaque;
+    ssize_t ret;
+
+    do {
+        ret = writev(s->fd, iov, iovcnt);
+    } while (ret < 0 && errno == EINTR);
+    /* dropped if the interface queue is full */
+    return ret < 0 ? -1 : 0;
+}
+
+static int tap_read_packet(EthernetDevice *net, const struct iovec *iov,
+                           int iovcnt)
+{
+    TapState *s = (TapState *)net->opaque;
+    ssize_t ret;
+
+    do {
+        ret = readv(s->fd, iov, iovcnt);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0) {
+        fd_notifier_rearm(s->notifier);
+        return 0;
+    }
+    return ret;
+}
+
+static BOOL tap_can_read(EthernetDevice *net)
+{
+    TapState *s = (TapState *)net->opaque;
+
+    return fd_notifier_ready(s->notifier);
+}
+
+static void tap_close(EthernetDevice *net)
+{
+    TapState *s = (TapState *)net->opaque;
+
+    fd_notifier_free(s->notifier);
+    close(s->fd);
+    free(s);
+    free(net);
+}
+
+/* attach to the TAP interface 'ifname', which is created if it does not
+   exist. Return NULL if error. */
+static EthernetDevice *tap_open(const char *ifname)
+{
+    EthernetDevice *net;
+    TapState *s;
+    struct ifreq ifr;
+    int fd;
+
+    fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        perror("/dev/net/tun");
+        return NULL;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        perror(ifname);
+        close(fd);
+        return NULL;
+    }
+
+    s = (TapState *)mallocz(sizeof(*s));
+    s->fd = fd;
+    s->notifier = fd_notifier_new(fd);
+    if (!s->notifier) {
+        close(fd);
+        free(s);
+        return NULL;
+    }
+    net = (EthernetDevice *)mallocz(sizeof(*net));
+    net->write_packet = tap_write_packet;
+    net->read_packet = tap_read_packet;
+    net->can_read = tap_can_read;
+    net->close = tap_close;
+    net->opaque = s;
+    return net;
+}
+
+static bool parse_mac(uint8_t *mac, const char *str)
+{
+    unsigned int v[6];
+    char c;
+    int i;
+
+    if (sscanf(str, "%x:%x:%x:%x:%x:%x%c",
+               &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &c) != 6)
+        return false;
+    for (i = 0; i < 6; i++) {
+        if (v[i] > 0xff)
+            return false;
+        mac[i] = v[i];
+    }
+    return true;
+}
+
+virtionet_t::virtionet_t(
+      const simif_t* sim,
+      abstract_interrupt_controller_t *intctrl,
+      uint32_t interrupt_id,
+      int instance,
+      std::vector<std::string> sargs)
+  : virtio_base_t(sim, intctrl, interrupt_id, sargs)
+{
+  std::map<std::string, std::string> argmap;
+
+  for (auto arg : sargs) {
+    size_t eq_idx = arg.find('=');
+    if (eq_idx != std::string::npos) {
+      argmap.insert(std::pair<std::string, std::string>(arg.substr(0, eq_idx), arg.substr(eq_idx+1)));
+    }
+  }
+
+  std::string ifname;
+  auto it = argmap.find("ifname");
+  if (it == argmap.end()) {
+    printf("Virtio net device plugin INIT ERROR: `ifname` argument not specified.\n"
+           "Please use spike option --device=virtionet,ifname=tap0 to attach the device to a host TAP interface.\n");
+    exit(1);
+  }
+  else {
+    ifname = it->second;
+  }
+
+  // host side of the link, only TAP for now
+  it = argmap.find("backend");
+  if (it != argmap.end() && it->second != "tap") {
+    printf("Virtio net device plugin INIT ERROR: unsupported `backend` %s.\n"
+           "Available backends are `tap`.\n", it->second.c_str());
+    exit(1);
+  }
+
+  // locally administered address, one per instance by default
+  uint8_t mac_addr[6] = { 0x02, 0x00, 0x00, 0x00, 0x00,
+                          (uint8_t)(instance + 1) };
+  it = argmap.find("mac");
+  if (it != argmap.end() && !parse_mac(mac_addr, it->second.c_str())) {
+    printf("Virtio net device plugin INIT ERROR: invalid `mac` %s.\n",
+           it->second.c_str());
+    exit(1);
+  }
+
+  // largest payload of the frames, the guest uses it as its MTU. The
+  // TAP interface should have the same MTU.
+  int mtu = 1500;
+  it = argmap.find("mtu");
+  if (it != argmap.end()) {
+    mtu = atoi(it->second.c_str());
+    if (mtu < 68 || mtu > 65500) {
+      printf("Virtio net device plugin INIT ERROR: `mtu` must be 68 to 65500.\n");
+      exit(1);
+    }
+  }
+
+  net = tap_open(ifname.c_str());
+  if (!net) {
+    printf("Virtio net device plugin INIT ERROR: cannot open the TAP interface %s.\n",
+           ifname.c_str());
+    exit(1);
+  }
+  memcpy(net->mac_addr, mac_addr, 6);
+
+  VIRTIOBusDef vbus_s, *vbus = &vbus_s;
+  memset(vbus, 0, sizeof(*vbus));
+  irq = new IRQSpike(intctrl, interrupt_id);
+  vbus->irq = irq;
+  vbus->queue_num_max = queue_size;
+  vbus->irq_batch = irq_batch;
+  vbus->irq_delay = irq_delay;
+
+  std::string stats_name = "virtionet" + std::to_string(instance);
+  if (!stats_file.empty()) {
+    vbus->stats_name = stats_name.c_str();
+    vbus->stats_file = stats_file.c_str();
+  }
+
+  virtio_dev = virtio_net_init(vbus, net, mtu, sim);
+  if (!restore_file.empty() && !checkpoint_restore(restore_file.c_str())) {
+    printf("Virtio net device plugin INIT ERROR: cannot restore the `restore` checkpoint %s.\n",
+           restore_file.c_str());
+    exit(1);
+  }
+}
+
+virtionet_t::~virtionet_t() {
+    if (irq) delete irq;
+    if (net) net->close(net);
+}
+
+
+std::string virtionet_generate_dts(const sim_t* sim, const std::vector<std::string>& args) {
+  int idx = virtionet_dts_count++;
+  if (idx >= VIRTIO_MAX_INSTANCES) {
+    printf("Virtio net device plugin INIT ERROR: at most %d devices are supported.\n",
+           VIRTIO_MAX_INSTANCES);
+    exit(1);
+  }
+  return virtio_generate_dts("virtionet", VIRTIO_TYPE_NET, idx);
+}
+
+virtionet_t* virtionet_parse_from_fdt(
+  const void* fdt, const sim_t* sim, reg_t* base,
+    std::vector<std::string> sargs)
+{
+  uint32_t netdev_int_id;
+  int idx = virtionet_fdt_count++;
+  if (idx < VIRTIO_MAX_INSTANCES &&
+      fdt_parse_virtio(fdt, VIRTIO_TYPE_NET, idx, base, &netdev_int_id) == 0) {
+    abstract_interrupt_controller_t* intctrl = sim->get_intctrl();
+    return new virtionet_t(sim, intctrl, netdev_int_id, idx, sargs);
+  } else {
+    return nullptr;
+  }
+}
+
+REGISTER_DEVICE(virtionet, virtionet_parse_from_fdt, virtionet_generate_dts);
@@ -27,10 +27,18 @@
 #include <inttypes.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <limits.h>
+#include <unistd.h>
+#include <type_traits>
 #include "virtio.h"
+#include "dma.h"
 #include "cutils.h"
+#include "stats.h"
+#include "checkpoint.h"
 #include "fs.h"
 #include "list.h"
+#include "workqueue.h"
 
 // #define DEBUG_VIRTIO
 
@@ -74,25 +82,52 @@
 
 #define MAX_QUEUE 8
 #define MAX_CONFIG_SPACE_SIZE 256
-#define MAX_QUEUE_NUM 16
+#define MAX_QUEUE_NUM 1024
+#define DEFAULT_QUEUE_NUM 128
 
-#define MAX_9P_MSIZE 0xE000
+#define MAX_9P_MSIZE (16 << 20)
+#define MIN_9P_MSIZE 4096 /* as Linux, room for the read and write headers */
+#define DEFAULT_9P_MSIZE (1 << 20)
+
+/* descriptor chain decoded by queue_notify(): the device readable
+   buffers, then the device writable ones */
+typedef struct {
+    virtio_phys_addr_t addr;
+    uint32_t len;
+} VIRTIOSGEntry;
+
+typedef struct {
+    VIRTIOSGEntry *sg;
+    int count;
+    int size; /* allocated entries, kept for the next chain */
+    int read_count; /* sg[0..read_count-1] are device readable */
+    int read_size;
+    int write_size;
+} VIRTIOSGList;
 
 typedef struct {
     uint32_t ready; /* 0 or 1 */
     uint32_t num;
     uint16_t last_avail_idx;
+    uint16_t used_idx; /* next used element */
+    uint16_t used_published; /* used index seen by the driver */
+    uint64_t used_pending_tick; /* tick of the oldest unpublished element */
     virtio_phys_addr_t desc_addr;
     virtio_phys_addr_t avail_addr;
     virtio_phys_addr_t used_addr;
     BOOL manual_recv; /* if TRUE, the device_recv() callback is not called */
+    VIRTIOSGList *sg_lists; /* indexed by head descriptor */
 } QueueState;
 
 #define VRING_DESC_F_NEXT	1
 #define VRING_DESC_F_WRITE	2
 #define VRING_DESC_F_INDIRECT	4
 
-// #define OPT_MEMCPY_RAM
+#define VRING_AVAIL_F_NO_INTERRUPT	1
+
+/* feature bits */
+#define VIRTIO_RING_F_INDIRECT_DESC	(1 << 28)
+#define VIRTIO_RING_F_EVENT_IDX		(1 << 29)
 
 typedef struct {
     uint64_t addr;
@@ -120,151 +155,44 @@ struct VIRTIODevice {
     uint32_t int_status;
     uint32_t status;
     uint32_t device_features_sel;
+    uint32_t driver_features_sel;
+    uint32_t driver_features; /* low 32 bits accepted by the driver */
     uint32_t queue_sel; /* currently selected queue */
+    uint32_t queue_num_max;
     QueueState queue[MAX_QUEUE];
+    /* used ring publication: at most irq_batch elements (0 = no limit)
+       and irq_delay ticks after the first one */
+    int irq_batch;
+    uint64_t irq_delay;
+    uint64_t tick_count;
+    /* first tick at which an unpublished element is due, UINT64_MAX if
+       there is none. The ticks before it do not scan the queues. */
+    uint64_t used_deadline;
 
     /* device specific */
     uint32_t device_id;
     uint32_t vendor_id;
     uint32_t device_features;
     VIRTIODeviceRecvFunc *device_recv;
+    VIRTIOGetRAMPtrFunc *get_ram_ptr;
     void (*config_write)(VIRTIODevice *s); /* called after the config
                                               is written */
+    void (*device_tick)(VIRTIODevice *s); /* called on every tick, may
+                                             be NULL */
+    /* checkpoint: complete the requests in progress, then write or read
+       back the device specific state. May be NULL. */
+    void (*device_drain)(VIRTIODevice *s);
+    void (*device_save)(VIRTIODevice *s, CheckpointFile *cp);
+    void (*device_load)(VIRTIODevice *s, CheckpointFile *cp);
+    DeviceStats *stats; /* NULL if no statistics */
+    int stats_notifies; /* counter indexes */
+    int stats_irqs;
     uint32_t config_space_size; /* in bytes, must be multiple of 4 */
     uint8_t config_space[MAX_CONFIG_SPACE_SIZE];
 };
 
-#define SECTOR_SIZE 512
-
-static int64_t bf_get_sector_count(BlockDevice *bs)
-{
-    BlockDeviceFile *bf = bs->opaque;
-    return bf->nb_sectors;
-}
-
-//#define DUMP_BLOCK_READ
-
-static int bf_read_async(BlockDevice *bs,
-                         uint64_t sector_num, uint8_t *buf, int n,
-                         BlockDeviceCompletionFunc *cb, VIRTIODevice *opaque)
-{
-    BlockDeviceFile *bf = bs->opaque;
-    //    printf("bf_read_async: sector_num=%" PRId64 " n=%d\n", sector_num, n);
-#ifdef DUMP_BLOCK_READ
-    {
-        static FILE *f;
-        if (!f)
-            f = fopen("/tmp/read_sect.txt", "wb");
-        fprintf(f, "%" PRId64 " %d\n", sector_num, n);
-    }
-#endif
-    if (!bf->f)
-        return -1;
-    if (bf->mode == BF_MODE_SNAPSHOT) {
-        int i;
-        for(i = 0; i < n; i++) {
-            if (!bf->sector_table[sector_num]) {
-                fseek(bf->f, sector_num * SECTOR_SIZE, SEEK_SET);
-                fread(buf, 1, SECTOR_SIZE, bf->f);
-            } else {
-                memcpy(buf, bf->sector_table[sector_num], SECTOR_SIZE);
-            }
-            sector_num++;
-            buf += SECTOR_SIZE;
-        }
-    } else {
-        fseek(bf->f, sector_num * SECTOR_SIZE, SEEK_SET);
-        fread(buf, 1, n * SECTOR_SIZE, bf->f);
-    }
-    /* synchronous read */
-        // printf("bf_read_async successfully finished.\n");
-    return 0;
-}
-
-static int bf_write_async(BlockDevice *bs,
-                          uint64_t sector_num, const uint8_t *buf, int n,
-                          BlockDeviceCompletionFunc *cb, VIRTIODevice *opaque)
-{
-    BlockDeviceFile *bf = bs->opaque;
-    int ret;
-
-    switch(bf->mode) {
-    case BF_MODE_RO:
-        ret = -1; /* error */
-        break;
-    case BF_MODE_RW:
-        fseek(bf->f, sector_num * SECTOR_SIZE, SEEK_SET);
-        fwrite(buf, 1, n * SECTOR_SIZE, bf->f);
-        ret = 0;
-        break;
-    case BF_MODE_SNAPSHOT:
-        {
-            int i;
-            if ((sector_num + n) > bf->nb_sectors)
-                return -1;
-            for(i = 0; i < n; i++) {
-                if (!bf->sector_table[sector_num]) {
-                    bf->sector_table[sector_num] = (uint8_t*)malloc(SECTOR_SIZE);
-                }
-                memcpy(bf->sector_table[sector_num], buf, SECTOR_SIZE);
-                sector_num++;
-                buf += SECTOR_SIZE;
-            }
-            ret = 0;
-        }
-        break;
-    default:
-        abort();
-    }
-
-    return ret;
-}
-
-BlockDevice *block_device_init(const char *filename,
-                                      BlockDeviceModeEnum mode)
-{
-    BlockDevice *bs;
-    BlockDeviceFile *bf;
-    int64_t file_size;
-    FILE *f;
-    const char *mode_str;
-
-    if (mode == BF_MODE_RW) {
-        mode_str = "r+b";
-    } else {
-        mode_str = "rb";
-    }
-    
-    f = fopen(filename, mode_str);
-    if (!f) {
-        perror(filename);
-        exit(1);
-    }
-    fseek(f, 0, SEEK_END);
-    file_size = ftello(f);
-
-    bs = (BlockDevice*)mallocz(sizeof(*bs));
-    bf = (BlockDeviceFile*)mallocz(sizeof(*bf));
-
-    bf->mode = mode;
-    bf->nb_sectors = file_size / 512;
-    bf->f = f;
-
-    if (mode == BF_MODE_SNAPSHOT) {
-        bf->sector_table = (uint8_t**)mallocz(sizeof(bf->sector_table[0]) *
-                                   bf->nb_sectors);
-    }
-    
-    bs->opaque = bf;
-    bs->get_sector_count = bf_get_sector_count;
-    bs->read_async = bf_read_async;
-    bs->write_async = bf_write_async;
-    return bs;
-}
-
-static uint32_t virtio_mmio_read(VIRTIODevice *opaque, uint32_t offset1, int size_log2);
-static void virtio_mmio_write(VIRTIODevice *opaque, uint32_t offset,
-                              uint32_t val, int size_log2);
+static uint8_t *virtio_mmio_get_ram_ptr(VIRTIODevice *s,
+                                        virtio_phys_addr_t paddr, BOOL is_rw);
 
 static void virtio_reset(VIRTIODevice *s)
 {
@@ -273,15 +201,19 @@ static void virtio_reset(VIRTIODevice *s)
     s->status = 0;
     s->queue_sel = 0;
     s->device_features_sel = 0;
+    s->driver_features_sel = 0;
+    s->driver_features = 0;
     s->int_status = 0;
     for(i = 0; i < MAX_QUEUE; i++) {
         QueueState *qs = &s->queue[i];
         qs->ready = 0;
-        qs->num = MAX_QUEUE_NUM;
+        qs->num = s->queue_num_max;
         qs->desc_addr = 0;
         qs->avail_addr = 0;
         qs->used_addr = 0;
         qs->last_avail_idx = 0;
+        qs->used_idx = 0;
+        qs->used_published = 0;
     }
 }
 
@@ -290,6 +222,8 @@ static void virtio_init(VIRTIODevice *s, VIRTIOBusDef *bus,
                         uint32_t device_id, int config_space_size,
                         VIRTIODeviceRecvFunc *device_recv, const simif_t* sim)
 {
+    int i;
+
     memset(s, 0, sizeof(*s));
 
     {
@@ -300,115 +234,107 @@ static void virtio_init(VIRTIODevice *s, VIRTIOBusDef *bus,
 
     s->device_id = device_id;
     s->vendor_id = 0xffff;
+    s->device_features = VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_RING_F_EVENT_IDX;
+    s->queue_num_max = bus->queue_num_max;
+    if (s->queue_num_max <= 0)
+        s->queue_num_max = DEFAULT_QUEUE_NUM;
+    s->irq_batch = bus->irq_batch;
+    s->irq_delay = bus->irq_delay;
+    for(i = 0; i < MAX_QUEUE; i++) {
+        s->queue[i].sg_lists =
+            (VIRTIOSGList *)mallocz(sizeof(VIRTIOSGList) * s->queue_num_max);
+    }
     s->config_space_size = config_space_size;
     s->device_recv = device_recv;
+    s->get_ram_ptr = virtio_mmio_get_ram_ptr;
     virtio_reset(s);
 }
 
+/* 'nb_ops' operations are reported by the device */
+static void virtio_stats_init(VIRTIODevice *s, VIRTIOBusDef *bus, int nb_ops)
+{
+    if (!bus->stats_file)
+        return;
+    s->stats = stats_new(bus->stats_name, bus->stats_file, nb_ops);
+    s->stats_notifies = stats_add_counter(s->stats, "notifies");
+    s->stats_irqs = stats_add_counter(s->stats, "irqs");
+}
+
+static uint8_t *virtio_mmio_get_ram_ptr(VIRTIODevice *s,
+                                        virtio_phys_addr_t paddr, BOOL is_rw)
+{
+    return dma_get_ram_ptr(s->sim, paddr);
+}
+
 static uint16_t virtio_read16(VIRTIODevice *s, virtio_phys_addr_t addr)
 {
-    mmu_t* simdram = s->sim->debug_mmu;
-    return simdram->load<uint16_t>(addr);
+    uint8_t *ptr;
+    if (addr & 1)
+        return 0; /* unaligned access are not supported */
+    ptr = s->get_ram_ptr(s, addr, FALSE);
+    if (!ptr)
+        return s->sim->debug_mmu->load<uint16_t>(addr);
+    return *(uint16_t *)ptr;
 }
 
 static void virtio_write16(VIRTIODevice *s, virtio_phys_addr_t addr,
                            uint16_t val)
 {
-    mmu_t* simdram = s->sim->debug_mmu;
-    simdram->store<uint16_t>(addr, val);
+    uint8_t *ptr;
+    if (addr & 1)
+        return; /* unaligned access are not supported */
+    ptr = s->get_ram_ptr(s, addr, TRUE);
+    if (!ptr) {
+        s->sim->debug_mmu->store<uint16_t>(addr, val);
+        return;
+    }
+    *(uint16_t *)ptr = val;
 }
 
 static void virtio_write32(VIRTIODevice *s, virtio_phys_addr_t addr,
                            uint32_t val)
 {
-    mmu_t* simdram = s->sim->debug_mmu;
-    simdram->store<uint32_t>(addr, val);
+    uint8_t *ptr;
+    if (addr & 3)
+        return; /* unaligned access are not supported */
+    ptr = s->get_ram_ptr(s, addr, TRUE);
+    if (!ptr) {
+        s->sim->debug_mmu->store<uint32_t>(addr, val);
+        return;
+    }
+    *(uint32_t *)ptr = val;
 }
 
+/* 'count' bytes which do not cross a page boundary */
 static int memcpy_from_ram_intrapage(VIRTIODevice *s, uint8_t *buf,
                                   virtio_phys_addr_t addr, int count)
 {
-    mmu_t* simdram = s->sim->debug_mmu;
-    int l = 0;
-    while (count > 0) {
-#ifdef OPT_MEMCPY_RAM
-        if (addr & 1 || count < 2) {
-            *(buf+l) = simdram->load<uint8_t>(addr);
-            count -= 1;
-            l += 1;
-            addr += 1;
-        }
-        else if (addr & 2 || count < 4) {
-            *(uint16_t*)(buf+l) = simdram->load<uint16_t>(addr);
-            count -= 2;
-            l += 2;
-            addr += 2;
-        }
-        else if (addr & 4 || count < 8) {
-            *(uint32_t*)(buf+l) = simdram->load<uint32_t>(addr);
-            count -= 4;
-            l += 4;
-            addr += 4;
-        }
-        else {// addr is 8byte aligned
-            *(uint64_t*)(buf+l) = simdram->load<uint64_t>(addr);
-            count -= 8;
-            l += 8;
-            addr += 8;
-        }
-#else 
-        buf[l] = simdram->load<uint8_t>(addr+l);
-        l++;
-        count--;
-#endif
-    }
-    return l;
+    uint8_t *ptr;
+
+    ptr = s->get_ram_ptr(s, addr, FALSE);
+    if (ptr)
+        memcpy(buf, ptr, count);
+    else
+        dma_mmu_load_intrapage(s->sim, buf, addr, count);
+    return count;
 }
 
 static int memcpy_to_ram_intrapage(VIRTIODevice *s, virtio_phys_addr_t addr,
                                    const uint8_t *buf, int count)
 {
-    mmu_t* simdram = s->sim->debug_mmu;
-    int l = 0;
-    while (count > 0) {
-#ifdef OPT_MEMCPY_RAM
-        if (addr & 1 || count < 2) {
-            simdram->store<uint8_t>(addr, *(uint8_t*)(buf+l));
-            count -= 1;
-            l += 1;
-            addr += 1;
-        }
-        else if (addr & 2 || count < 4) {
-            simdram->store<uint16_t>(addr, *(uint16_t*)(buf+l));
-            count -= 2;
-            l += 2;
-            addr += 2;
-        }
-        else if (addr & 4 || count < 8) {
-            simdram->store<uint32_t>(addr, *(uint32_t*)(buf+l));
-            count -= 4;
-            l += 4;
-            addr += 4;
-        }
-        else {// addr is 8byte aligned
-            simdram->store<uint64_t>(addr, *(uint64_t*)(buf+l));
-            count -= 8;
-            l += 8;
-            addr += 8;
-        }
-#else 
-        simdram->store<uint8_t>(addr+l, buf[l]);
-        l++;
-        count--;
-#endif
-    }
-    return l;
+    uint8_t *ptr;
+
+    ptr = s->get_ram_ptr(s, addr, TRUE);
+    if (ptr)
+        memcpy(ptr, buf, count);
+    else
+        dma_mmu_store_intrapage(s->sim, addr, buf, count);
+    return count;
 }
 
 static int virtio_memcpy_from_ram(VIRTIODevice *s, uint8_t *buf,
                                   virtio_phys_addr_t addr, int count)
 {
-    uint8_t *ptr;
     int l;
 
     while (count > 0) {
@@ -432,7 +358,6 @@ static int virtio_memcpy_from_ram(VIRTIODevice *s, uint8_t *buf,
 static int virtio_memcpy_to_ram(VIRTIODevice *s, virtio_phys_addr_t addr, 
                                 const uint8_t *buf, int count)
 {
-    uint8_t *ptr;
     int l;
 
     while (count > 0) {
@@ -445,21 +370,67 @@ static int virtio_memcpy_to_ram(VIRTIODevice *s, virtio_phys_addr_t addr,
     return 0;
 }
 
-static int get_desc(VIRTIODevice *s, VIRTIODesc *desc,  
-                    int queue_idx, int desc_idx)
+/* walk of a descriptor chain. The chain continues in an indirect table
+   if its head has the VRING_DESC_F_INDIRECT flag. */
+typedef struct {
+    virtio_phys_addr_t table_addr;
+    uint32_t table_num;
+    uint32_t count; /* descriptors visited, stops looping chains */
+    VIRTIODesc desc; /* current descriptor */
+} VIRTIODescIter;
+
+static int get_desc(VIRTIODevice *s, VIRTIODescIter *it, uint32_t desc_idx)
 {
-    QueueState *qs = &s->queue[queue_idx];
-    return virtio_memcpy_from_ram(s, (uint8_t *)desc, qs->desc_addr +
+    if (desc_idx >= it->table_num || ++it->count > it->table_num)
+        return -1;
+    return virtio_memcpy_from_ram(s, (uint8_t *)&it->desc, it->table_addr +
                                   desc_idx * sizeof(VIRTIODesc),
                                   sizeof(VIRTIODesc));
 }
 
+static int desc_iter_init(VIRTIODevice *s, VIRTIODescIter *it,
+                          int queue_idx, int desc_idx)
+{
+    QueueState *qs = &s->queue[queue_idx];
+
+    it->table_addr = qs->desc_addr;
+    it->table_num = qs->num;
+    it->count = 0;
+    if (get_desc(s, it, desc_idx) < 0)
+        return -1;
+    if (it->desc.flags & VRING_DESC_F_INDIRECT) {
+        if (!(s->driver_features & VIRTIO_RING_F_INDIRECT_DESC) ||
+            it->desc.len < sizeof(VIRTIODesc))
+            return -1;
+        it->table_addr = it->desc.addr;
+        it->table_num = it->desc.len / sizeof(VIRTIODesc);
+        it->count = 0;
+        if (get_desc(s, it, 0) < 0 ||
+            (it->desc.flags & VRING_DESC_F_INDIRECT))
+            return -1;
+    }
+    return 0;
+}
+
+/* return -1 at the end of the chain */
+static int desc_iter_next(VIRTIODevice *s, VIRTIODescIter *it)
+{
+    if (!(it->desc.flags & VRING_DESC_F_NEXT))
+        return -1;
+    if (get_desc(s, it, it->desc.next) < 0 ||
+        (it->desc.flags & VRING_DESC_F_INDIRECT))
+        return -1;
+    return 0;
+}
+
+/* the chain must have been decoded by queue_notify() */
 static int memcpy_to_from_queue(VIRTIODevice *s, uint8_t *buf,
                                 int queue_idx, int desc_idx,
                                 int offset, int count, BOOL to_queue)
 {
-    VIRTIODesc desc;
-    int l, f_write_flag;
+    VIRTIOSGList *sl = &s->queue[queue_idx].sg_lists[desc_idx];
+    VIRTIOSGEntry *e, *e_end;
+    int l;
 
 #ifdef DEBUG_VIRTIO
     if (to_queue) {
@@ -474,72 +445,41 @@ static int memcpy_to_from_queue(VIRTIODevice *s, uint8_t *buf,
     if (count == 0)
         return 0;
 
-    get_desc(s, &desc, queue_idx, desc_idx);
-
     if (to_queue) {
-        f_write_flag = VRING_DESC_F_WRITE;
-        /* find the first write descriptor */
-        for(;;) {
-            if ((desc.flags & VRING_DESC_F_WRITE) == f_write_flag)
-                break;
-            if (!(desc.flags & VRING_DESC_F_NEXT))
-                return -1;
-            desc_idx = desc.next;
-            get_desc(s, &desc, queue_idx, desc_idx);
-        }
+        e = sl->sg + sl->read_count;
+        e_end = sl->sg + sl->count;
     } else {
-        f_write_flag = 0;
+        e = sl->sg;
+        e_end = sl->sg + sl->read_count;
     }
 
-    /* find the descriptor at offset */
+    /* find the buffer at offset */
     for(;;) {
-#ifdef DEBUG_VIRTIO
-        printf("Searching for desc at offset %u, desc_idx = %d, desc.flags = %#x, desc.len = %u\n",
-            offset, desc_idx, desc.flags, desc.len);
-#endif 
-        if ((desc.flags & VRING_DESC_F_WRITE) != f_write_flag)
+        if (e >= e_end)
             return -1;
-        if (offset < desc.len)
+        if ((uint32_t)offset < e->len)
             break;
-        if (!(desc.flags & VRING_DESC_F_NEXT))
-            return -1;
-        desc_idx = desc.next;
-        offset -= desc.len;
-        get_desc(s, &desc, queue_idx, desc_idx);
+        offset -= e->len;
+        e++;
     }
-#ifdef DEBUG_VIRTIO
-        printf("Desc located at desc_idx %d, offset = %u\n",
-            desc_idx, offset);
-#endif 
 
     for(;;) {
-        l = min_int(count, desc.len - offset);
-#ifdef DEBUG_VIRTIO
-        printf("Reading queue of length %d ..., count = %d\n",
-            l, count);
-#endif 
+        l = min_int(count, e->len - offset);
         if (to_queue)
-            virtio_memcpy_to_ram(s, desc.addr + offset, buf, l);
+            virtio_memcpy_to_ram(s, e->addr + offset, buf, l);
         else
-            virtio_memcpy_from_ram(s, buf, desc.addr + offset, l);
+            virtio_memcpy_from_ram(s, buf, e->addr + offset, l);
         count -= l;
         if (count == 0)
             break;
         offset += l;
         buf += l;
-        if (offset == desc.len) {
-            if (!(desc.flags & VRING_DESC_F_NEXT))
-                return -1;
-            desc_idx = desc.next;
-            get_desc(s, &desc, queue_idx, desc_idx);
-            if ((desc.flags & VRING_DESC_F_WRITE) != f_write_flag)
+        if ((uint32_t)offset == e->len) {
+            if (++e >= e_end)
                 return -1;
             offset = 0;
         }
     }
-#ifdef DEBUG_VIRTIO
-    printf("Reading successfully finished.\n");
-#endif 
     return 0;
 }
 
@@ -559,66 +499,205 @@ static int memcpy_to_queue(VIRTIODevice *s,
                                 count, TRUE);
 }
 
-/* signal that the descriptor has been consumed */
+/* host pointers to 'count' bytes of the chain at 'offset', one entry per
+   guest page at most. Return the number of entries, or -1 if the range is
+   outside the chain, not in host RAM or needs more than 'max_iov'
+   entries. The chain must have been decoded by queue_notify(). */
+static int virtio_queue_get_iov(VIRTIODevice *s, struct iovec *iov,
+                                int max_iov, int queue_idx, int desc_idx,
+                                int offset, int count, BOOL to_queue)
+{
+    VIRTIOSGList *sl = &s->queue[queue_idx].sg_lists[desc_idx];
+    VIRTIOSGEntry *e, *e_end;
+    virtio_phys_addr_t addr;
+    uint8_t *ptr;
+    int l, iovcnt;
+
+    if (to_queue) {
+        e = sl->sg + sl->read_count;
+        e_end = sl->sg + sl->count;
+    } else {
+        e = sl->sg;
+        e_end = sl->sg + sl->read_count;
+    }
+
+    for(;;) {
+        if (e >= e_end)
+            return count == 0 ? 0 : -1;
+        if ((uint32_t)offset < e->len)
+            break;
+        offset -= e->len;
+        e++;
+    }
+
+    iovcnt = 0;
+    while (count > 0) {
+        addr = e->addr + offset;
+        l = min_int(count, e->len - offset);
+        l = min_int(l, DMA_PAGE_SIZE - (addr & (DMA_PAGE_SIZE - 1)));
+        ptr = s->get_ram_ptr(s, addr, to_queue);
+        if (!ptr)
+            return -1;
+        if (iovcnt > 0 &&
+            (uint8_t *)iov[iovcnt - 1].iov_base + iov[iovcnt - 1].iov_len == ptr) {
+            iov[iovcnt - 1].iov_len += l;
+        } else {
+            if (iovcnt >= max_iov)
+                return -1;
+            iov[iovcnt].iov_base = ptr;
+            iov[iovcnt].iov_len = l;
+            iovcnt++;
+        }
+        count -= l;
+        offset += l;
+        if ((uint32_t)offset == e->len && count > 0) {
+            if (++e >= e_end)
+                return -1;
+            offset = 0;
+        }
+    }
+    return iovcnt;
+}
+
+/* used_event and avail_event fields (VIRTIO_RING_F_EVENT_IDX) */
+static virtio_phys_addr_t used_event_addr(QueueState *qs)
+{
+    return qs->avail_addr + 4 + qs->num * 2;
+}
+
+static virtio_phys_addr_t avail_event_addr(QueueState *qs)
+{
+    return qs->used_addr + 4 + qs->num * 8;
+}
+
+/* TRUE if the driver wants an interrupt when the used index goes from
+   'old_idx' to 'new_idx' */
+static BOOL virtio_need_irq(VIRTIODevice *s, QueueState *qs,
+                            uint16_t old_idx, uint16_t new_idx)
+{
+    uint16_t event;
+
+    if (s->driver_features & VIRTIO_RING_F_EVENT_IDX) {
+        event = virtio_read16(s, used_event_addr(qs));
+        return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+    }
+    return !(virtio_read16(s, qs->avail_addr) & VRING_AVAIL_F_NO_INTERRUPT);
+}
+
+/* make the used elements visible to the driver and interrupt it if it
+   asks for it */
+static void virtio_publish_used(VIRTIODevice *s, QueueState *qs)
+{
+    uint16_t old_idx = qs->used_published;
+
+    if (qs->used_idx == old_idx)
+        return;
+    virtio_write16(s, qs->used_addr + 2, qs->used_idx);
+    qs->used_published = qs->used_idx;
+    if (virtio_need_irq(s, qs, old_idx, qs->used_idx)) {
+        s->int_status |= 1;
+        set_irq(s->irq, 1);
+        if (s->stats)
+            stats_inc(s->stats, s->stats_irqs, 1);
+    }
+}
+
+/* called after each queue_notify() pass and each tick */
+static void virtio_flush_used(VIRTIODevice *s)
+{
+    QueueState *qs;
+    uint64_t deadline;
+    int i;
+
+    s->used_deadline = UINT64_MAX;
+    for(i = 0; i < MAX_QUEUE; i++) {
+        qs = &s->queue[i];
+        if (qs->used_idx == qs->used_published)
+            continue;
+        deadline = qs->used_pending_tick + s->irq_delay;
+        if (s->tick_count >= deadline)
+            virtio_publish_used(s, qs);
+        else if (deadline < s->used_deadline)
+            s->used_deadline = deadline;
+    }
+}
+
+/* signal that the descriptor has been consumed. The used index is
+   published by virtio_flush_used(), so that the completions of a
+   notification or of a tick are seen with a single interrupt. */
 static void virtio_consume_desc(VIRTIODevice *s,
                                 int queue_idx, int desc_idx, int desc_len)
 {
     QueueState *qs = &s->queue[queue_idx];
     virtio_phys_addr_t addr;
-    uint32_t index;
-    addr = qs->used_addr + 2;
-    index = virtio_read16(s, addr);
-    virtio_write16(s, addr, index + 1);
-    addr = qs->used_addr + 4 + (index & (qs->num - 1)) * 8;
+
+    addr = qs->used_addr + 4 + (qs->used_idx & (qs->num - 1)) * 8;
     virtio_write32(s, addr, desc_idx);
     virtio_write32(s, addr + 4, desc_len);
-    s->int_status |= 1;
-    set_irq(s->irq, 1);
+    if (qs->used_idx == qs->used_published) {
+        qs->used_pending_tick = s->tick_count;
+        if (s->tick_count + s->irq_delay < s->used_deadline)
+            s->used_deadline = s->tick_count + s->irq_delay;
+    }
+    qs->used_idx++;
+    if (s->irq_batch > 0 &&
+        (uint16_t)(qs->used_idx - qs->used_published) >= s->irq_batch)
+        virtio_publish_used(s, qs);
 }
 
-static int get_desc_rw_size(VIRTIODevice *s, 
-                             int *pread_size, int *pwrite_size,
-                             int queue_idx, int desc_idx)
+static void sg_list_add(VIRTIOSGList *sl, const VIRTIODesc *desc)
 {
-    VIRTIODesc desc;
-    int read_size, write_size;
+    if (sl->count == sl->size) {
+        sl->size = max_int(8, sl->size * 2);
+        sl->sg = (VIRTIOSGEntry *)realloc(sl->sg, sizeof(sl->sg[0]) * sl->size);
+    }
+    sl->sg[sl->count].addr = desc->addr;
+    sl->sg[sl->count].len = desc->len;
+    sl->count++;
+}
 
-    read_size = 0;
-    write_size = 0;
-    get_desc(s, &desc, queue_idx, desc_idx);
+/* walk the chain once and store it in the SG list of its head */
+static int decode_desc_chain(VIRTIODevice *s, int queue_idx, int desc_idx)
+{
+    VIRTIOSGList *sl = &s->queue[queue_idx].sg_lists[desc_idx];
+    VIRTIODescIter it;
+
+    sl->count = 0;
+    sl->read_size = 0;
+    sl->write_size = 0;
+    if (desc_iter_init(s, &it, queue_idx, desc_idx) < 0)
+        return -1;
 
     for(;;) {
-        if (desc.flags & VRING_DESC_F_WRITE)
+        if (it.desc.flags & VRING_DESC_F_WRITE)
             break;
-        read_size += desc.len;
-        if (!(desc.flags & VRING_DESC_F_NEXT))
+        sg_list_add(sl, &it.desc);
+        sl->read_size += it.desc.len;
+        if (desc_iter_next(s, &it) < 0)
             goto done;
-        desc_idx = desc.next;
-        get_desc(s, &desc, queue_idx, desc_idx);
     }
-    
+    sl->read_count = sl->count;
+
     for(;;) {
-        if (!(desc.flags & VRING_DESC_F_WRITE))
+        if (!(it.desc.flags & VRING_DESC_F_WRITE))
             return -1;
-        write_size += desc.len;
-        if (!(desc.flags & VRING_DESC_F_NEXT))
-            break;
-        desc_idx = desc.next;
-        get_desc(s, &desc, queue_idx, desc_idx);
+        sg_list_add(sl, &it.desc);
+        sl->write_size += it.desc.len;
+        if (desc_iter_next(s, &it) < 0)
+            return 0;
     }
-
  done:
-    *pread_size = read_size;
-    *pwrite_size = write_size;
+    sl->read_count = sl->count;
     return 0;
 }
 
 /* XXX: test if the queue is ready ? */
-static void queue_notify(VIRTIODevice *s, int queue_idx)
+static void queue_notify1(VIRTIODevice *s, int queue_idx)
 {
     QueueState *qs = &s->queue[queue_idx];
     uint16_t avail_idx;
-    int desc_idx, read_size, write_size;
+    int desc_idx;
+    VIRTIOSGList *sl;
 
     if (qs->manual_recv)
         return;
@@ -628,186 +707,101 @@ static void queue_notify(VIRTIODevice *s, int queue_idx)
     printf("avail_idx = %d, qs->last_avail_idx = %d\n",
         avail_idx, qs->last_avail_idx);
 #endif 
-    while (qs->last_avail_idx != avail_idx) {
-        desc_idx = virtio_read16(s, qs->avail_addr + 4 + 
-                                 (qs->last_avail_idx & (qs->num - 1)) * 2);
-        if (!get_desc_rw_size(s, &read_size, &write_size, queue_idx, desc_idx)) {
+    for(;;) {
+        while (qs->last_avail_idx != avail_idx) {
+            desc_idx = virtio_read16(s, qs->avail_addr + 4 + 
+                                     (qs->last_avail_idx & (qs->num - 1)) * 2);
+            if ((uint32_t)desc_idx < qs->num &&
+                !decode_desc_chain(s, queue_idx, desc_idx)) {
+                sl = &qs->sg_lists[desc_idx];
 #ifdef DEBUG_VIRTIO
-            {
-                printf("queue_notify: idx=%d read_size=%d write_size=%d\n",
-                       queue_idx, read_size, write_size);
-            }
+                {
+                    printf("queue_notify: idx=%d read_size=%d write_size=%d\n",
+                           queue_idx, sl->read_size, sl->write_size);
+                }
 #endif
-            if (s->device_recv(s, queue_idx, desc_idx,
-                               read_size, write_size) < 0)
-                break;
+                if (s->device_recv(s, queue_idx, desc_idx,
+                                   sl->read_size, sl->write_size) < 0)
+                    return;
+            }
+            qs->last_avail_idx++;
         }
-        qs->last_avail_idx++;
+        if (!(s->driver_features & VIRTIO_RING_F_EVENT_IDX))
+            break;
+        /* ask for a notification on the next buffer, then check that
+           none was made available in the meantime */
+        virtio_write16(s, avail_event_addr(qs), qs->last_avail_idx);
+        avail_idx = virtio_read16(s, qs->avail_addr + 2);
+        if (avail_idx == qs->last_avail_idx)
+            break;
     }
 }
 
-static uint32_t virtio_config_read(VIRTIODevice *s, uint32_t offset,
-                                   int size_log2)
+static void queue_notify(VIRTIODevice *s, int queue_idx)
 {
-    uint32_t val;
-    switch(size_log2) {
-    case 0:
-        if (offset < s->config_space_size) {
-            val = s->config_space[offset];
-        } else {
-            val = 0;
-        }
-        break;
-    case 1:
-        if (offset < (s->config_space_size - 1)) {
-            val = get_le16(&s->config_space[offset]);
-        } else {
-            val = 0;
-        }
-        break;
-    case 2:
-        if (offset < (s->config_space_size - 3)) {
-            val = get_le32(s->config_space + offset);
-        } else {
-            val = 0;
-        }
-        break;
-    default:
-        abort();
-    }
-#ifdef DEBUG_VIRTIO
-    {
-        printf("virto_config_read: offset=0x%x val=0x%x size=%d\n", 
-               offset, val, 1 << size_log2);
-    }
-#endif
-    return val;
+    if (s->stats)
+        stats_inc(s->stats, s->stats_notifies, 1);
+    queue_notify1(s, queue_idx);
+    virtio_flush_used(s);
 }
 
-static void virtio_config_write(VIRTIODevice *s, uint32_t offset,
-                                uint32_t val, int size_log2)
-{
-    switch(size_log2) {
-    case 0:
-        if (offset < s->config_space_size) {
-            s->config_space[offset] = val;
-            if (s->config_write)
-                s->config_write(s);
-        }
-        break;
-    case 1:
-        if (offset < s->config_space_size - 1) {
-            put_le16(s->config_space + offset, val);
-            if (s->config_write)
-                s->config_write(s);
-        }
-        break;
-    case 2:
-        if (offset < s->config_space_size - 3) {
-            put_le32(s->config_space + offset, val);
-            if (s->config_write)
-                s->config_write(s);
-        }
-        break;
-    }
+static void virtio_tick(VIRTIODevice *s)
+{
+    s->tick_count++;
+    if (s->device_tick)
+        s->device_tick(s);
+    if (s->tick_count >= s->used_deadline)
+        virtio_flush_used(s);
+    if (s->stats)
+        stats_poll();
 }
 
-static uint32_t virtio_mmio_read(VIRTIODevice *opaque, uint32_t offset, int size_log2)
+/* accesses of 1 << size_log2 bytes to the configuration space. The
+   8 byte accesses are not split. */
+template <int size_log2>
+static uint64_t virtio_config_read(VIRTIODevice *s, uint32_t offset)
 {
-    VIRTIODevice *s = (VIRTIODevice*)opaque;
-    uint32_t val;
-
-    if (offset >= VIRTIO_MMIO_CONFIG) {
-        return virtio_config_read(s, offset - VIRTIO_MMIO_CONFIG, size_log2);
-    }
+    uint64_t val;
 
-    if (size_log2 == 2) {
-        switch(offset) {
-        case VIRTIO_MMIO_MAGIC_VALUE:
-            val = 0x74726976;
-            break;
-        case VIRTIO_MMIO_VERSION:
-            val = 2;
-            break;
-        case VIRTIO_MMIO_DEVICE_ID:
-            val = s->device_id;
-            break;
-        case VIRTIO_MMIO_VENDOR_ID:
-            val = s->vendor_id;
-            break;
-        case VIRTIO_MMIO_DEVICE_FEATURES:
-            switch(s->device_features_sel) {
-            case 0:
-                val = s->device_features;
-                break;
-            case 1:
-                val = 1; /* version 1 */
-                break;
-            default:
-                val = 0;
-                break;
-            }
-            break;
-        case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
-            val = s->device_features_sel;
-            break;
-        case VIRTIO_MMIO_QUEUE_SEL:
-            val = s->queue_sel;
-            break;
-        case VIRTIO_MMIO_QUEUE_NUM_MAX:
-            val = MAX_QUEUE_NUM;
-            break;
-        case VIRTIO_MMIO_QUEUE_NUM:
-            val = s->queue[s->queue_sel].num;
-            break;
-        case VIRTIO_MMIO_QUEUE_DESC_LOW:
-            val = s->queue[s->queue_sel].desc_addr;
-            break;
-        case VIRTIO_MMIO_QUEUE_AVAIL_LOW:
-            val = s->queue[s->queue_sel].avail_addr;
-            break;
-        case VIRTIO_MMIO_QUEUE_USED_LOW:
-            val = s->queue[s->queue_sel].used_addr;
-            break;
-#if VIRTIO_ADDR_BITS == 64
-        case VIRTIO_MMIO_QUEUE_DESC_HIGH:
-            val = s->queue[s->queue_sel].desc_addr >> 32;
-            break;
-        case VIRTIO_MMIO_QUEUE_AVAIL_HIGH:
-            val = s->queue[s->queue_sel].avail_addr >> 32;
-            break;
-        case VIRTIO_MMIO_QUEUE_USED_HIGH:
-            val = s->queue[s->queue_sel].used_addr >> 32;
-            break;
-#endif
-        case VIRTIO_MMIO_QUEUE_READY:
-            val = s->queue[s->queue_sel].ready;
-            break;
-        case VIRTIO_MMIO_INTERRUPT_STATUS:
-            val = s->int_status;
-            break;
-        case VIRTIO_MMIO_STATUS:
-            val = s->status;
-            break;
-        case VIRTIO_MMIO_CONFIG_GENERATION:
-            val = 0;
-            break;
-        default:
-            val = 0;
-            break;
-        }
-    } else {
+    if ((uint64_t)offset + (1 << size_log2) > s->config_space_size) {
         val = 0;
+    } else if constexpr (size_log2 == 0) {
+        val = s->config_space[offset];
+    } else if constexpr (size_log2 == 1) {
+        val = get_le16(s->config_space + offset);
+    } else if constexpr (size_log2 == 2) {
+        val = get_le32(s->config_space + offset);
+    } else {
+        val = get_le64(s->config_space + offset);
     }
 #ifdef DEBUG_VIRTIO
     {
-        printf("virto_mmio_read: offset=0x%x val=0x%x size=%d\n", 
+        printf("virto_config_read: offset=0x%x val=0x%" PRIx64 " size=%d\n",
                offset, val, 1 << size_log2);
     }
 #endif
     return val;
 }
 
+template <int size_log2>
+static void virtio_config_write(VIRTIODevice *s, uint32_t offset,
+                                uint64_t val)
+{
+    if ((uint64_t)offset + (1 << size_log2) > s->config_space_size)
+        return;
+    if constexpr (size_log2 == 0) {
+        s->config_space[offset] = val;
+    } else if constexpr (size_log2 == 1) {
+        put_le16(s->config_space + offset, val);
+    } else if constexpr (size_log2 == 2) {
+        put_le32(s->config_space + offset, val);
+    } else {
+        put_le64(s->config_space + offset, val);
+    }
+    if (s->config_write)
+        s->config_write(s);
+}
+
 #if VIRTIO_ADDR_BITS == 64
 static void set_low32(virtio_phys_addr_t *paddr, uint32_t val)
 {
@@ -825,119 +819,325 @@ static void set_low32(virtio_phys_addr_t *paddr, uint32_t val)
 }
 #endif
 
-static void virtio_mmio_write(VIRTIODevice *opaque, uint32_t offset,
-                              uint32_t val, int size_log2)
+/* 32 bit registers, NULL if the register reads as 0 or ignores writes */
+typedef uint32_t VIRTIORegReadFunc(VIRTIODevice *s);
+typedef void VIRTIORegWriteFunc(VIRTIODevice *s, uint32_t val);
+
+typedef struct {
+    VIRTIORegReadFunc *read[VIRTIO_MMIO_CONFIG / 4];
+    VIRTIORegWriteFunc *write[VIRTIO_MMIO_CONFIG / 4];
+} VIRTIORegTable;
+
+static constexpr VIRTIORegTable virtio_reg_table_init(void)
 {
-    VIRTIODevice *s = (VIRTIODevice*)opaque;
-    
-#ifdef DEBUG_VIRTIO
-    {
-        printf("virto_mmio_write: offset=0x%x val=0x%x size=%d\n",
-               offset, val, 1 << size_log2);
-    }
+    VIRTIORegTable t = {};
+
+#define REG_READ(reg, expr) \
+    t.read[(reg) / 4] = [](VIRTIODevice *s) -> uint32_t { return expr; }
+#define REG_WRITE(reg, stmt) \
+    t.write[(reg) / 4] = [](VIRTIODevice *s, uint32_t val) { stmt; }
+
+    REG_READ(VIRTIO_MMIO_MAGIC_VALUE, 0x74726976);
+    REG_READ(VIRTIO_MMIO_VERSION, 2);
+    REG_READ(VIRTIO_MMIO_DEVICE_ID, s->device_id);
+    REG_READ(VIRTIO_MMIO_VENDOR_ID, s->vendor_id);
+    /* bit 32 is VIRTIO_F_VERSION_1 */
+    REG_READ(VIRTIO_MMIO_DEVICE_FEATURES,
+             s->device_features_sel == 0 ? s->device_features :
+             s->device_features_sel == 1 ? 1 : 0);
+    REG_READ(VIRTIO_MMIO_DEVICE_FEATURES_SEL, s->device_features_sel);
+    REG_READ(VIRTIO_MMIO_DRIVER_FEATURES_SEL, s->driver_features_sel);
+    REG_READ(VIRTIO_MMIO_QUEUE_SEL, s->queue_sel);
+    REG_READ(VIRTIO_MMIO_QUEUE_NUM_MAX, s->queue_num_max);
+    REG_READ(VIRTIO_MMIO_QUEUE_NUM, s->queue[s->queue_sel].num);
+    REG_READ(VIRTIO_MMIO_QUEUE_DESC_LOW, s->queue[s->queue_sel].desc_addr);
+    REG_READ(VIRTIO_MMIO_QUEUE_AVAIL_LOW, s->queue[s->queue_sel].avail_addr);
+    REG_READ(VIRTIO_MMIO_QUEUE_USED_LOW, s->queue[s->queue_sel].used_addr);
+#if VIRTIO_ADDR_BITS == 64
+    REG_READ(VIRTIO_MMIO_QUEUE_DESC_HIGH,
+             s->queue[s->queue_sel].desc_addr >> 32);
+    REG_READ(VIRTIO_MMIO_QUEUE_AVAIL_HIGH,
+             s->queue[s->queue_sel].avail_addr >> 32);
+    REG_READ(VIRTIO_MMIO_QUEUE_USED_HIGH,
+             s->queue[s->queue_sel].used_addr >> 32);
+#endif
+    REG_READ(VIRTIO_MMIO_QUEUE_READY, s->queue[s->queue_sel].ready);
+    REG_READ(VIRTIO_MMIO_INTERRUPT_STATUS, s->int_status);
+    REG_READ(VIRTIO_MMIO_STATUS, s->status);
+
+    REG_WRITE(VIRTIO_MMIO_DEVICE_FEATURES_SEL, s->device_features_sel = val);
+    REG_WRITE(VIRTIO_MMIO_DRIVER_FEATURES_SEL, s->driver_features_sel = val);
+    REG_WRITE(VIRTIO_MMIO_DRIVER_FEATURES,
+              if (s->driver_features_sel == 0)
+                  s->driver_features = val & s->device_features);
+    REG_WRITE(VIRTIO_MMIO_QUEUE_SEL,
+              if (val < MAX_QUEUE)
+                  s->queue_sel = val);
+    REG_WRITE(VIRTIO_MMIO_QUEUE_NUM,
+              if ((val & (val - 1)) == 0 && val > 0 &&
+                  val <= s->queue_num_max)
+                  s->queue[s->queue_sel].num = val);
+    REG_WRITE(VIRTIO_MMIO_QUEUE_DESC_LOW,
+              set_low32(&s->queue[s->queue_sel].desc_addr, val));
+    REG_WRITE(VIRTIO_MMIO_QUEUE_AVAIL_LOW,
+              set_low32(&s->queue[s->queue_sel].avail_addr, val));
+    REG_WRITE(VIRTIO_MMIO_QUEUE_USED_LOW,
+              set_low32(&s->queue[s->queue_sel].used_addr, val));
+#if VIRTIO_ADDR_BITS == 64
+    REG_WRITE(VIRTIO_MMIO_QUEUE_DESC_HIGH,
+              set_high32(&s->queue[s->queue_sel].desc_addr, val));
+    REG_WRITE(VIRTIO_MMIO_QUEUE_AVAIL_HIGH,
+              set_high32(&s->queue[s->queue_sel].avail_addr, val));
+    REG_WRITE(VIRTIO_MMIO_QUEUE_USED_HIGH,
+              set_high32(&s->queue[s->queue_sel].used_addr, val));
 #endif
+    REG_WRITE(VIRTIO_MMIO_STATUS,
+              s->status = val;
+              if (val == 0) {
+                  /* reset */
+                  set_irq(s->irq, 0);
+                  virtio_reset(s);
+              });
+    REG_WRITE(VIRTIO_MMIO_QUEUE_READY,
+              s->queue[s->queue_sel].ready = val & 1);
+    REG_WRITE(VIRTIO_MMIO_QUEUE_NOTIFY,
+              if (val < MAX_QUEUE)
+                  queue_notify(s, val));
+    REG_WRITE(VIRTIO_MMIO_INTERRUPT_ACK,
+              s->int_status &= ~val;
+              if (s->int_status == 0)
+                  set_irq(s->irq, 0));
+#undef REG_READ
+#undef REG_WRITE
+    return t;
+}
 
-    if (offset >= VIRTIO_MMIO_CONFIG) {
-        virtio_config_write(s, offset - VIRTIO_MMIO_CONFIG, val, size_log2);
+static constexpr VIRTIORegTable virtio_reg_table = virtio_reg_table_init();
+
+static uint32_t virtio_reg_read(VIRTIODevice *s, uint32_t offset)
+{
+    VIRTIORegReadFunc *func;
+
+    if (offset & 3)
+        return 0;
+    func = virtio_reg_table.read[offset >> 2];
+    return func ? func(s) : 0;
+}
+
+static void virtio_reg_write(VIRTIODevice *s, uint32_t offset, uint32_t val)
+{
+    VIRTIORegWriteFunc *func;
+
+    if (offset & 3)
         return;
-    }
+    func = virtio_reg_table.write[offset >> 2];
+    if (func)
+        func(s, val);
+}
 
-    if (size_log2 == 2) {
-        switch(offset) {
-        case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
-            s->device_features_sel = val;
-            break;
-        case VIRTIO_MMIO_QUEUE_SEL:
-            if (val < MAX_QUEUE)
-                s->queue_sel = val;
-            break;
-        case VIRTIO_MMIO_QUEUE_NUM:
-            if ((val & (val - 1)) == 0 && val > 0) {
-                s->queue[s->queue_sel].num = val;
-            }
-            break;
-        case VIRTIO_MMIO_QUEUE_DESC_LOW:
-            set_low32(&s->queue[s->queue_sel].desc_addr, val);
-            break;
-        case VIRTIO_MMIO_QUEUE_AVAIL_LOW:
-            set_low32(&s->queue[s->queue_sel].avail_addr, val);
-            break;
-        case VIRTIO_MMIO_QUEUE_USED_LOW:
-            set_low32(&s->queue[s->queue_sel].used_addr, val);
-            break;
-#if VIRTIO_ADDR_BITS == 64
-        case VIRTIO_MMIO_QUEUE_DESC_HIGH:
-            set_high32(&s->queue[s->queue_sel].desc_addr, val);
-            break;
-        case VIRTIO_MMIO_QUEUE_AVAIL_HIGH:
-            set_high32(&s->queue[s->queue_sel].avail_addr, val);
-            break;
-        case VIRTIO_MMIO_QUEUE_USED_HIGH:
-            set_high32(&s->queue[s->queue_sel].used_addr, val);
-            break;
-#endif
-        case VIRTIO_MMIO_STATUS:
-            s->status = val;
-            if (val == 0) {
-                /* reset */
-                set_irq(s->irq, 0);
-                virtio_reset(s);
-            }
-            break;
-        case VIRTIO_MMIO_QUEUE_READY:
-            s->queue[s->queue_sel].ready = val & 1;
-            break;
-        case VIRTIO_MMIO_QUEUE_NOTIFY:
-            if (val < MAX_QUEUE)
+/* The registers only accept 32 bit accesses, the 64 bit ones are split
+   in two. The configuration space is accessed with any size. */
+template <int size_log2>
+static uint64_t virtio_mmio_read(VIRTIODevice *s, uint32_t offset)
+{
+    uint64_t val;
+
+    if (offset >= VIRTIO_MMIO_CONFIG)
+        return virtio_config_read<size_log2>(s, offset - VIRTIO_MMIO_CONFIG);
+    if constexpr (size_log2 == 2) {
+        val = virtio_reg_read(s, offset);
+    } else if constexpr (size_log2 == 3) {
+        val = virtio_reg_read(s, offset) |
+            ((uint64_t)virtio_reg_read(s, offset + 4) << 32);
+    } else {
+        val = 0;
+    }
 #ifdef DEBUG_VIRTIO
-            {
-        printf("queue_notify on qidx %d invoked by MMIO write begin.\n", val);
+    {
+        printf("virto_mmio_read: offset=0x%x val=0x%" PRIx64 " size=%d\n",
+               offset, val, 1 << size_log2);
+    }
 #endif
-                queue_notify(s, val);
+    return val;
+}
+
+template <int size_log2>
+static void virtio_mmio_write(VIRTIODevice *s, uint32_t offset, uint64_t val)
+{
 #ifdef DEBUG_VIRTIO
-        printf("queue_notify on qidx %d invoked by MMIO write finished.\n", val);
-            }
+    {
+        printf("virto_mmio_write: offset=0x%x val=0x%" PRIx64 " size=%d\n",
+               offset, val, 1 << size_log2);
+    }
 #endif
-            break;
-        case VIRTIO_MMIO_INTERRUPT_ACK:
-            s->int_status &= ~val;
-            if (s->int_status == 0) {
-                set_irq(s->irq, 0);
-            }
-            break;
-        }
+
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        virtio_config_write<size_log2>(s, offset - VIRTIO_MMIO_CONFIG, val);
+        return;
+    }
+    if constexpr (size_log2 == 2) {
+        virtio_reg_write(s, offset, val);
+    } else if constexpr (size_log2 == 3) {
+        virtio_reg_write(s, offset, val);
+        virtio_reg_write(s, offset + 4, val >> 32);
     }
 }
 
+/* indexed by log2 of the access size */
+typedef uint64_t VIRTIOMMIOReadFunc(VIRTIODevice *s, uint32_t offset);
+typedef void VIRTIOMMIOWriteFunc(VIRTIODevice *s, uint32_t offset,
+                                 uint64_t val);
+
+static VIRTIOMMIOReadFunc *const virtio_mmio_read_table[4] = {
+    virtio_mmio_read<0>, virtio_mmio_read<1>,
+    virtio_mmio_read<2>, virtio_mmio_read<3>,
+};
+
+static VIRTIOMMIOWriteFunc *const virtio_mmio_write_table[4] = {
+    virtio_mmio_write<0>, virtio_mmio_write<1>,
+    virtio_mmio_write<2>, virtio_mmio_write<3>,
+};
+
 void virtio_set_debug(VIRTIODevice *s, int debug)
 {
     s->debug = debug;
 }
 
-static void virtio_config_change_notify(VIRTIODevice *s)
+/*********************************************************************/
+/* checkpoint */
+
+/* The requests in progress are completed first, so that the state is
+   the registers and the ring indexes. The chains decoded in the SG lists
+   belong to requests in progress, so they are not saved. */
+static void virtio_save(VIRTIODevice *s, CheckpointFile *cp)
+{
+    QueueState *qs;
+    int i;
+
+    if (s->device_drain)
+        s->device_drain(s);
+    checkpoint_put_u32(cp, s->device_id);
+    checkpoint_put_u32(cp, s->int_status);
+    checkpoint_put_u32(cp, s->status);
+    checkpoint_put_u32(cp, s->device_features_sel);
+    checkpoint_put_u32(cp, s->driver_features_sel);
+    checkpoint_put_u32(cp, s->driver_features);
+    checkpoint_put_u32(cp, s->queue_sel);
+    checkpoint_put_u64(cp, s->tick_count);
+    checkpoint_put_u32(cp, s->config_space_size);
+    checkpoint_put(cp, s->config_space, s->config_space_size);
+    for(i = 0; i < MAX_QUEUE; i++) {
+        qs = &s->queue[i];
+        checkpoint_put_u32(cp, qs->ready);
+        checkpoint_put_u32(cp, qs->num);
+        checkpoint_put_u16(cp, qs->last_avail_idx);
+        checkpoint_put_u16(cp, qs->used_idx);
+        checkpoint_put_u16(cp, qs->used_published);
+        checkpoint_put_u64(cp, qs->used_pending_tick);
+        checkpoint_put_u64(cp, qs->desc_addr);
+        checkpoint_put_u64(cp, qs->avail_addr);
+        checkpoint_put_u64(cp, qs->used_addr);
+    }
+    if (s->device_save)
+        s->device_save(s, cp);
+}
+
+/* the device must have been created with the same parameters */
+static void virtio_load(VIRTIODevice *s, CheckpointFile *cp)
 {
-    /* INT_CONFIG interrupt */
-    s->int_status |= 2;
-    set_irq(s->irq, 1);
+    QueueState *qs;
+    uint32_t config_space_size;
+    int i;
+
+    if (checkpoint_get_u32(cp) != s->device_id) {
+        checkpoint_fail(cp, "checkpoint of another virtio device type");
+        return;
+    }
+    s->int_status = checkpoint_get_u32(cp);
+    s->status = checkpoint_get_u32(cp);
+    s->device_features_sel = checkpoint_get_u32(cp);
+    s->driver_features_sel = checkpoint_get_u32(cp);
+    s->driver_features = checkpoint_get_u32(cp);
+    s->queue_sel = checkpoint_get_u32(cp);
+    s->tick_count = checkpoint_get_u64(cp);
+    config_space_size = checkpoint_get_u32(cp);
+    if (config_space_size != s->config_space_size) {
+        checkpoint_fail(cp, "configuration of %u bytes, device has %u",
+                        config_space_size, s->config_space_size);
+        return;
+    }
+    checkpoint_get(cp, s->config_space, s->config_space_size);
+    if ((s->driver_features & ~s->device_features) != 0 ||
+        s->queue_sel >= MAX_QUEUE)
+        checkpoint_fail(cp, "features or queue not supported by the device");
+    for(i = 0; i < MAX_QUEUE; i++) {
+        qs = &s->queue[i];
+        qs->ready = checkpoint_get_u32(cp) & 1;
+        qs->num = checkpoint_get_u32(cp);
+        qs->last_avail_idx = checkpoint_get_u16(cp);
+        qs->used_idx = checkpoint_get_u16(cp);
+        qs->used_published = checkpoint_get_u16(cp);
+        qs->used_pending_tick = checkpoint_get_u64(cp);
+        qs->desc_addr = checkpoint_get_u64(cp);
+        qs->avail_addr = checkpoint_get_u64(cp);
+        qs->used_addr = checkpoint_get_u64(cp);
+        if (qs->num == 0 || qs->num > s->queue_num_max ||
+            (qs->num & (qs->num - 1)) != 0)
+            checkpoint_fail(cp, "queue %d has %u elements, at most %u supported",
+                            i, qs->num, s->queue_num_max);
+    }
+    if (cp->error)
+        return;
+    if (s->device_load)
+        s->device_load(s, cp);
+    s->used_deadline = 0; /* recomputed by the next tick */
+    set_irq(s->irq, s->int_status != 0);
 }
 
 /*********************************************************************/
 /* block device */
 
 typedef struct {
+    VIRTIODevice *dev;
+    BOOL in_progress;
     uint32_t type;
     uint8_t *buf;
     int write_size;
     int queue_idx;
     int desc_idx;
+    /* discard and write zeroes: segments in 'buf', executed in order */
+    int nb_segs;
+    int seg_idx;
+    /* statistics */
+    int stats_op;
+    uint64_t stats_bytes;
+    uint64_t start_tick;
+    uint64_t start_ns;
 } BlockRequest;
 
+/* operations in the statistics */
+enum {
+    BLK_STATS_READ,
+    BLK_STATS_WRITE,
+    BLK_STATS_FLUSH,
+    BLK_STATS_DISCARD,
+    BLK_STATS_WRITE_ZEROES,
+    BLK_STATS_UNSUPP,
+    BLK_STATS_NB,
+};
+
+static const char *virtio_block_stats_names[BLK_STATS_NB] = {
+    "read", "write", "flush", "discard", "write_zeroes", "unsupported",
+};
+
 struct VIRTIOBlockDevice : public VIRTIODevice {
 public:
     BlockDevice *bs;
+    int num_queues;
 
-    BOOL req_in_progress;
-    BlockRequest req; /* request in progress */
+    /* requests in progress of each queue, tagged by their head
+       descriptor index */
+    BlockRequest *req[MAX_QUEUE];
 } ;
 
 typedef struct {
@@ -946,10 +1146,27 @@ typedef struct {
     uint64_t sector_num;
 } BlockRequestHeader;
 
-#define VIRTIO_BLK_T_IN          0
-#define VIRTIO_BLK_T_OUT         1
-#define VIRTIO_BLK_T_FLUSH       4
-#define VIRTIO_BLK_T_FLUSH_OUT   5
+typedef struct {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+} BlockDiscardSegment;
+
+#define VIRTIO_BLK_T_IN           0
+#define VIRTIO_BLK_T_OUT          1
+#define VIRTIO_BLK_T_FLUSH        4
+#define VIRTIO_BLK_T_FLUSH_OUT    5
+#define VIRTIO_BLK_T_DISCARD      11
+#define VIRTIO_BLK_T_WRITE_ZEROES 13
+
+/* feature bits */
+#define VIRTIO_BLK_F_FLUSH        (1 << 9)
+#define VIRTIO_BLK_F_MQ           (1 << 12)
+#define VIRTIO_BLK_F_DISCARD      (1 << 13)
+#define VIRTIO_BLK_F_WRITE_ZEROES (1 << 14)
+
+#define MAX_DISCARD_SECTORS 0x400000 /* 2 GB */
+#define MAX_DISCARD_SEG     32
 
 #define VIRTIO_BLK_S_OK     0
 #define VIRTIO_BLK_S_IOERR  1
@@ -957,20 +1174,32 @@ typedef struct {
 
 #define SECTOR_SIZE 512
 
-static void virtio_block_req_end(VIRTIODevice *s, int ret)
+/* complete a request without data for the driver: the status is the
+   last device writable byte */
+static void virtio_block_req_status(VIRTIODevice *s, int queue_idx,
+                                    int desc_idx, int write_size, int status)
+{
+    uint8_t buf1[1];
+
+    buf1[0] = status;
+    if (write_size >= 1)
+        memcpy_to_queue(s, queue_idx, desc_idx, write_size - 1, buf1, 1);
+    virtio_consume_desc(s, queue_idx, desc_idx, write_size);
+}
+
+static void virtio_block_req_end(VIRTIODevice *s, BlockRequest *req, int ret)
 {
-    VIRTIOBlockDevice *s1 = (VIRTIOBlockDevice *)s;
     int write_size;
-    int queue_idx = s1->req.queue_idx;
-    int desc_idx = s1->req.desc_idx;
-    uint8_t *buf, buf1[1];
+    int queue_idx = req->queue_idx;
+    int desc_idx = req->desc_idx;
+    uint8_t *buf;
 #ifdef DEBUG_VIRTIO
-    printf("Entering req end func... ret = %d, req type =in?%d\n", ret, s1->req.type);
+    printf("Entering req end func... ret = %d, req type =in?%d\n", ret, req->type);
 #endif 
-    switch(s1->req.type) {
+    switch(req->type) {
     case VIRTIO_BLK_T_IN:
-        write_size = s1->req.write_size;
-        buf = s1->req.buf;
+        write_size = req->write_size;
+        buf = req->buf;
         if (ret < 0) {
             buf[write_size - 1] = VIRTIO_BLK_S_IOERR;
         } else {
@@ -980,33 +1209,83 @@ static void virtio_block_req_end(VIRTIODevice *s, int ret)
         free(buf);
         virtio_consume_desc(s, queue_idx, desc_idx, write_size);
         break;
-    case VIRTIO_BLK_T_OUT:
-        if (ret < 0)
-            buf1[0] = VIRTIO_BLK_S_IOERR;
-        else
-            buf1[0] = VIRTIO_BLK_S_OK;
-        memcpy_to_queue(s, queue_idx, desc_idx, 0, buf1, sizeof(buf1));
-        virtio_consume_desc(s, queue_idx, desc_idx, 1);
-        break;
     default:
-        abort();
+        free(req->buf);
+        virtio_block_req_status(s, queue_idx, desc_idx, req->write_size,
+                                ret < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK);
+        break;
+    }
+    req->buf = NULL;
+    req->in_progress = FALSE;
+    if (s->stats) {
+        stats_end(s->stats, req->stats_op, req->stats_bytes,
+                  s->tick_count - req->start_tick,
+                  stats_get_ns() - req->start_ns, ret < 0);
     }
 }
 
-static void virtio_block_req_cb(VIRTIODevice *opaque, int ret)
+static void virtio_block_stats_start(VIRTIODevice *s, BlockRequest *req,
+                                     int op, uint64_t bytes)
 {
-    VIRTIODevice *s = opaque;
-    VIRTIOBlockDevice *s1 = (VIRTIOBlockDevice *)s;
+    req->stats_op = op;
+    req->stats_bytes = bytes;
+    req->start_tick = s->tick_count;
+    req->start_ns = stats_get_ns();
+    stats_start(s->stats);
+}
 
-    virtio_block_req_end(s, ret);
-    
-    s1->req_in_progress = FALSE;
+static void virtio_block_req_cb(void *opaque, int ret)
+{
+    BlockRequest *req = (BlockRequest *)opaque;
+
+    virtio_block_req_end(req->dev, req, ret);
+}
+
+static void virtio_block_discard_cb(void *opaque, int ret);
+
+/* execute the remaining discard or write zeroes segments */
+static void virtio_block_discard_next(BlockRequest *req)
+{
+    VIRTIOBlockDevice *s1 = (VIRTIOBlockDevice *)req->dev;
+    BlockDevice *bs = s1->bs;
+    BlockDiscardSegment *seg;
+    int flags, ret;
+
+    flags = req->type == VIRTIO_BLK_T_WRITE_ZEROES ? BF_DISCARD_ZERO : 0;
+    /* also called from the completion of the previous segment */
+    if (bs->set_queue)
+        bs->set_queue(bs, req->queue_idx);
+    while (req->seg_idx < req->nb_segs) {
+        seg = (BlockDiscardSegment *)req->buf + req->seg_idx++;
+        if (seg->num_sectors > MAX_DISCARD_SECTORS ||
+            seg->sector + seg->num_sectors > (uint64_t)bs->get_sector_count(bs)) {
+            ret = -1;
+        } else {
+            ret = bs->discard_async(bs, seg->sector, seg->num_sectors, flags,
+                                    virtio_block_discard_cb, req);
+        }
+        if (ret > 0) {
+            req->in_progress = TRUE;
+            return;
+        }
+        if (ret < 0) {
+            virtio_block_req_end(req->dev, req, ret);
+            return;
+        }
+    }
+    virtio_block_req_end(req->dev, req, 0);
+}
 
-    /* handle next requests */
-    queue_notify((VIRTIODevice *)s, s1->req.queue_idx);
+static void virtio_block_discard_cb(void *opaque, int ret)
+{
+    BlockRequest *req = (BlockRequest *)opaque;
+
+    if (ret < 0)
+        virtio_block_req_end(req->dev, req, ret);
+    else
+        virtio_block_discard_next(req);
 }
 
-/* XXX: handle async I/O */
 static int virtio_block_recv_request(VIRTIODevice *s, int queue_idx,
                                      int desc_idx, int read_size,
                                      int write_size)
@@ -1014,7 +1293,7 @@ static int virtio_block_recv_request(VIRTIODevice *s, int queue_idx,
     VIRTIOBlockDevice *s1 = (VIRTIOBlockDevice *)s;
     BlockDevice *bs = s1->bs;
     BlockRequestHeader h;
-    uint8_t *buf;
+    BlockRequest *req;
     int len, ret;
 
 #ifdef DEBUG_VIRTIO
@@ -1022,53 +1301,95 @@ static int virtio_block_recv_request(VIRTIODevice *s, int queue_idx,
             queue_idx, desc_idx, read_size, write_size);
 #endif
 
-    if (s1->req_in_progress)
-#ifdef DEBUG_VIRTIO
-    {
-        printf("Request in progress, exit recv req function.\n");
-        return -1;
-    }
-#else
-        return -1;
-#endif 
-    if (memcpy_from_queue(s, &h, queue_idx, desc_idx, 0, sizeof(h)) < 0)
+    if (queue_idx >= s1->num_queues || (uint32_t)desc_idx >= s->queue[queue_idx].num)
+        return 0;
+    /* a descriptor cannot be made available twice before it is used */
+    req = &s1->req[queue_idx][desc_idx];
+    if (req->in_progress)
+        return 0;
+    if (write_size < 1 ||
+        memcpy_from_queue(s, &h, queue_idx, desc_idx, 0, sizeof(h)) < 0)
         return 0;
-    s1->req.type = h.type;
-    s1->req.queue_idx = queue_idx;
-    s1->req.desc_idx = desc_idx;
+    req->dev = s;
+    req->type = h.type;
+    req->queue_idx = queue_idx;
+    req->desc_idx = desc_idx;
+    req->buf = NULL;
+    req->write_size = write_size;
+    if (bs->set_queue)
+        bs->set_queue(bs, queue_idx);
 #ifdef DEBUG_VIRTIO
     printf("req in?=%d\n",h.type);
 #endif
     switch(h.type) {
     case VIRTIO_BLK_T_IN:
-        s1->req.buf = (uint8_t*)malloc(write_size);
-        s1->req.write_size = write_size;
-        ret = bs->read_async(bs, h.sector_num, s1->req.buf, 
+        if (s->stats)
+            virtio_block_stats_start(s, req, BLK_STATS_READ, write_size - 1);
+        req->buf = (uint8_t*)malloc(write_size);
+        ret = bs->read_async(bs, h.sector_num, req->buf, 
                              (write_size - 1) / SECTOR_SIZE,
-                             virtio_block_req_cb, s);
+                             virtio_block_req_cb, req);
         if (ret > 0) {
             /* asyncronous read */
-            s1->req_in_progress = TRUE;
+            req->in_progress = TRUE;
         } else {
-            virtio_block_req_end(s, ret);
+            virtio_block_req_end(s, req, ret);
         }
         break;
     case VIRTIO_BLK_T_OUT:
-        assert(write_size >= 1);
         len = read_size - sizeof(h);
-        buf = (uint8_t*)malloc(len);
-        memcpy_from_queue(s, buf, queue_idx, desc_idx, sizeof(h), len);
-        ret = bs->write_async(bs, h.sector_num, buf, len / SECTOR_SIZE,
-                              virtio_block_req_cb, s);
-        free(buf);
+        if (s->stats)
+            virtio_block_stats_start(s, req, BLK_STATS_WRITE, len);
+        req->buf = (uint8_t*)malloc(len);
+        memcpy_from_queue(s, req->buf, queue_idx, desc_idx, sizeof(h), len);
+        ret = bs->write_async(bs, h.sector_num, req->buf, len / SECTOR_SIZE,
+                              virtio_block_req_cb, req);
         if (ret > 0) {
             /* asyncronous write */
-            s1->req_in_progress = TRUE;
+            req->in_progress = TRUE;
         } else {
-            virtio_block_req_end(s, ret);
+            virtio_block_req_end(s, req, ret);
+        }
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        if (!bs->flush_async)
+            goto unsupported;
+        if (s->stats)
+            virtio_block_stats_start(s, req, BLK_STATS_FLUSH, 0);
+        ret = bs->flush_async(bs, virtio_block_req_cb, req);
+        if (ret > 0)
+            req->in_progress = TRUE;
+        else
+            virtio_block_req_end(s, req, ret);
+        break;
+    case VIRTIO_BLK_T_DISCARD:
+    case VIRTIO_BLK_T_WRITE_ZEROES:
+        if (!bs->discard_async)
+            goto unsupported;
+        if (s->stats) {
+            virtio_block_stats_start(s, req, h.type == VIRTIO_BLK_T_DISCARD ?
+                                     BLK_STATS_DISCARD : BLK_STATS_WRITE_ZEROES, 0);
+        }
+        len = read_size - sizeof(h);
+        req->nb_segs = len / sizeof(BlockDiscardSegment);
+        req->seg_idx = 0;
+        if (req->nb_segs == 0 || req->nb_segs > MAX_DISCARD_SEG) {
+            virtio_block_req_end(s, req, -1);
+            break;
         }
+        req->buf = (uint8_t*)malloc(req->nb_segs * sizeof(BlockDiscardSegment));
+        memcpy_from_queue(s, req->buf, queue_idx, desc_idx, sizeof(h),
+                          req->nb_segs * sizeof(BlockDiscardSegment));
+        virtio_block_discard_next(req);
         break;
     default:
+    unsupported:
+        virtio_block_req_status(s, queue_idx, desc_idx, write_size,
+                                VIRTIO_BLK_S_UNSUPP);
+        if (s->stats) {
+            virtio_block_stats_start(s, req, BLK_STATS_UNSUPP, 0);
+            stats_end(s->stats, BLK_STATS_UNSUPP, 0, 0, 0, TRUE);
+        }
         break;
     }
 #ifdef DEBUG_VIRTIO
@@ -1078,45 +1399,537 @@ static int virtio_block_recv_request(VIRTIODevice *s, int queue_idx,
     return 0;
 }
 
-VIRTIODevice *virtio_block_init(VIRTIOBusDef *bus, BlockDevice *bs, const simif_t* sim)
+/* run the completions of the asynchronous requests */
+static void virtio_block_tick(VIRTIODevice *s)
+{
+    VIRTIOBlockDevice *s1 = (VIRTIOBlockDevice *)s;
+    BlockDevice *bs = s1->bs;
+
+    bs->poll(bs);
+}
+
+static void virtio_block_drain(VIRTIODevice *s)
+{
+    VIRTIOBlockDevice *s1 = (VIRTIOBlockDevice *)s;
+    BlockDevice *bs = s1->bs;
+    int i, j;
+
+    for(i = 0; i < s1->num_queues; i++) {
+        for(j = 0; j < (int)s->queue_num_max; j++) {
+            while (s1->req[i][j].in_progress) {
+                bs->poll(bs);
+                if (s1->req[i][j].in_progress)
+                    usleep(100);
+            }
+        }
+    }
+}
+
+/* the image file is not saved, only what the block device keeps
+   elsewhere such as the sectors written in snapshot mode */
+static void virtio_block_save(VIRTIODevice *s, CheckpointFile *cp)
+{
+    VIRTIOBlockDevice *s1 = (VIRTIOBlockDevice *)s;
+    BlockDevice *bs = s1->bs;
+
+    checkpoint_put_u32(cp, s1->num_queues);
+    checkpoint_put_u8(cp, bs->save_state != NULL);
+    if (bs->save_state && !cp->error && bs->save_state(bs, cp->f) < 0)
+        checkpoint_fail(cp, "cannot save the block device");
+}
+
+static void virtio_block_load(VIRTIODevice *s, CheckpointFile *cp)
+{
+    VIRTIOBlockDevice *s1 = (VIRTIOBlockDevice *)s;
+    BlockDevice *bs = s1->bs;
+
+    if (checkpoint_get_u32(cp) != (uint32_t)s1->num_queues) {
+        checkpoint_fail(cp, "checkpoint with another number of queues");
+        return;
+    }
+    if (checkpoint_get_u8(cp) != (bs->save_state != NULL)) {
+        checkpoint_fail(cp, "checkpoint with another image mode");
+        return;
+    }
+    if (bs->load_state && !cp->error && bs->load_state(bs, cp->f) < 0)
+        checkpoint_fail(cp, "invalid block device state");
+}
+
+VIRTIODevice *virtio_block_init(VIRTIOBusDef *bus, BlockDevice *bs,
+                                int num_queues, const simif_t* sim)
 {
     VIRTIOBlockDevice *s;
     uint64_t nb_sectors;
+    int i;
 
     s = (VIRTIOBlockDevice *)mallocz(sizeof(*s));
     virtio_init(s, bus,
-                2, 8, virtio_block_recv_request, sim);
+                2, 60, virtio_block_recv_request, sim);
     s->bs = bs;
+    if (bs->poll) {
+        s->device_tick = virtio_block_tick;
+        s->device_drain = virtio_block_drain;
+    }
+    s->device_save = virtio_block_save;
+    s->device_load = virtio_block_load;
+    virtio_stats_init(s, bus, BLK_STATS_NB);
+    if (s->stats) {
+        for(i = 0; i < BLK_STATS_NB; i++)
+            stats_set_op_name(s->stats, i, virtio_block_stats_names[i]);
+    }
+
+    s->num_queues = min_int(max_int(num_queues, 1), MAX_QUEUE);
+    for(i = 0; i < s->num_queues; i++) {
+        s->req[i] = (BlockRequest *)mallocz(sizeof(BlockRequest) *
+                                            s->queue_num_max);
+    }
+    if (s->num_queues > 1)
+        s->device_features |= VIRTIO_BLK_F_MQ;
     
     nb_sectors = bs->get_sector_count(bs);
     put_le32(s->config_space, nb_sectors);
     put_le32(s->config_space + 4, nb_sectors >> 32);
+    put_le16(s->config_space + 34, s->num_queues);
+
+    if (bs->flush_async)
+        s->device_features |= VIRTIO_BLK_F_FLUSH;
+    if (bs->discard_async) {
+        s->device_features |= VIRTIO_BLK_F_DISCARD | VIRTIO_BLK_F_WRITE_ZEROES;
+        put_le32(s->config_space + 36, MAX_DISCARD_SECTORS);
+        put_le32(s->config_space + 40, MAX_DISCARD_SEG);
+        put_le32(s->config_space + 44, VIRTIO_PAGE_SIZE / SECTOR_SIZE);
+        put_le32(s->config_space + 48, MAX_DISCARD_SECTORS);
+        put_le32(s->config_space + 52, MAX_DISCARD_SEG);
+        s->config_space[56] = 1; /* write_zeroes_may_unmap */
+    }
+
+    return (VIRTIODevice *)s;
+}
+
+/*********************************************************************/
+/* network device */
+
+/* feature bits */
+#define VIRTIO_NET_F_MTU       (1 << 3)
+#define VIRTIO_NET_F_MAC       (1 << 5)
+#define VIRTIO_NET_F_MRG_RXBUF (1 << 15)
+#define VIRTIO_NET_F_STATUS    (1 << 16)
+
+#define VIRTIO_NET_S_LINK_UP 1
+
+#define NET_RX_QUEUE 0
+#define NET_TX_QUEUE 1
+
+#define NET_ETH_HLEN 18 /* Ethernet header with a VLAN tag */
+#define NET_RX_BURST 64 /* frames received on one tick at most */
+#define NET_MAX_RX_CHAINS 64 /* chains of a mergeable frame at most */
+
+/* header of the frames, without offloads. num_buffers is always present
+   with VIRTIO_F_VERSION_1. */
+typedef struct {
+    uint8_t flags;
+    uint8_t gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t num_buffers; /* chains of a mergeable frame */
+} VIRTIONetHeader;
+
+#define NET_HDR_SIZE 12
+
+/* operations in the statistics */
+enum {
+    NET_STATS_RX,
+    NET_STATS_TX,
+    NET_STATS_NB,
+};
+
+static const char *virtio_net_stats_names[NET_STATS_NB] = {
+    "rx", "tx",
+};
+
+/* The RX queue is not driven by the notifications: the frames are
+   received on the ticks at which the backend has one, directly into the
+   buffers made available by the driver. With VIRTIO_NET_F_MRG_RXBUF, a
+   frame may span several chains. */
+struct VIRTIONetDevice : public VIRTIODevice {
+    EthernetDevice *net;
+    int max_frame; /* Ethernet header included */
+    struct iovec *iov; /* guest buffers of a frame */
+    int max_iov;
+    int *rx_desc; /* chains of the frame being received */
+    int *rx_len; /* bytes of each chain used by the frame */
+    uint8_t *buf; /* frame copy, for the buffers not in host RAM */
+};
+
+/* send a frame to the network */
+static int virtio_net_recv_request(VIRTIODevice *s, int queue_idx,
+                                   int desc_idx, int read_size,
+                                   int write_size)
+{
+    VIRTIONetDevice *s1 = (VIRTIONetDevice *)s;
+    EthernetDevice *net = s1->net;
+    struct iovec iov1;
+    int len, iovcnt, ret;
+
+    if (queue_idx != NET_TX_QUEUE)
+        return 0;
+    /* the header is ignored as no offload is offered */
+    len = read_size - NET_HDR_SIZE;
+    if (len <= 0 || len > s1->max_frame) {
+        ret = -1;
+    } else {
+        iovcnt = virtio_queue_get_iov(s, s1->iov, s1->max_iov, queue_idx,
+                                      desc_idx, NET_HDR_SIZE, len, FALSE);
+        if (iovcnt >= 0) {
+            ret = net->write_packet(net, s1->iov, iovcnt);
+        } else {
+            memcpy_from_queue(s, s1->buf, queue_idx, desc_idx, NET_HDR_SIZE,
+                              len);
+            iov1.iov_base = s1->buf;
+            iov1.iov_len = len;
+            ret = net->write_packet(net, &iov1, 1);
+        }
+    }
+    if (s->stats) {
+        stats_start(s->stats);
+        stats_end(s->stats, NET_STATS_TX, max_int(len, 0), 0, 0, ret < 0);
+    }
+    virtio_consume_desc(s, queue_idx, desc_idx, 0);
+    return 0;
+}
+
+/* receive one frame. Return FALSE if there was no frame or no buffer
+   for it. */
+static BOOL virtio_net_rx(VIRTIONetDevice *s)
+{
+    EthernetDevice *net = s->net;
+    QueueState *qs = &s->queue[NET_RX_QUEUE];
+    VIRTIONetHeader h;
+    struct iovec *iov, iov1;
+    uint16_t avail_idx, idx;
+    int need, total, nb_chains, max_chains, iovcnt, desc_idx, len, pos;
+    int n, i, skip;
+    BOOL zero_copy, truncated;
+
+    if (!qs->ready)
+        return FALSE;
+    avail_idx = virtio_read16(s, qs->avail_addr + 2);
+    need = NET_HDR_SIZE + s->max_frame;
+    max_chains = (s->driver_features & VIRTIO_NET_F_MRG_RXBUF) ?
+        NET_MAX_RX_CHAINS : 1;
+
+    /* buffers for the largest frame. They are only consumed if the frame
+       uses them. */
+    total = 0;
+    nb_chains = 0;
+    iovcnt = 0;
+    zero_copy = TRUE;
+    for(idx = qs->last_avail_idx; idx != avail_idx && total < need &&
+            nb_chains < max_chains; idx++) {
+        desc_idx = virtio_read16(s, qs->avail_addr + 4 +
+                                 (idx & (qs->num - 1)) * 2);
+        if ((uint32_t)desc_idx >= qs->num ||
+            decode_desc_chain(s, NET_RX_QUEUE, desc_idx) < 0 ||
+            qs->sg_lists[desc_idx].write_size <=
+            (nb_chains == 0 ? NET_HDR_SIZE : 0)) {
+            /* skipped as in queue_notify1() */
+            if (nb_chains > 0)
+                break;
+            qs->last_avail_idx++;
+            continue;
+        }
+        len = min_int(qs->sg_lists[desc_idx].write_size, need - total);
+        if (zero_copy) {
+            n = virtio_queue_get_iov(s, s->iov + iovcnt, s->max_iov - iovcnt,
+                                     NET_RX_QUEUE, desc_idx, 0, len, TRUE);
+            if (n < 0)
+                zero_copy = FALSE;
+            else
+                iovcnt += n;
+        }
+        s->rx_desc[nb_chains] = desc_idx;
+        s->rx_len[nb_chains] = len;
+        nb_chains++;
+        total += len;
+    }
+    if (nb_chains == 0)
+        return FALSE;
+    /* leave the frame in the backend until the guest adds buffers,
+       unless they cannot hold it anyway */
+    if (total < need && idx == avail_idx &&
+        (uint16_t)(avail_idx - qs->last_avail_idx) < qs->num)
+        return FALSE;
+
+    if (zero_copy) {
+        /* the frame follows the header */
+        iov = s->iov;
+        skip = NET_HDR_SIZE;
+        while (iovcnt > 0 && (size_t)skip >= iov->iov_len) {
+            skip -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        iov->iov_base = (uint8_t *)iov->iov_base + skip;
+        iov->iov_len -= skip;
+        n = net->read_packet(net, iov, iovcnt);
+    } else {
+        iov1.iov_base = s->buf;
+        iov1.iov_len = total - NET_HDR_SIZE;
+        n = net->read_packet(net, &iov1, 1);
+    }
+    if (n <= 0)
+        return FALSE;
+    truncated = n > total - NET_HDR_SIZE;
+    if (s->stats) {
+        stats_start(s->stats);
+        stats_end(s->stats, NET_STATS_RX, n, 0, 0, truncated);
+    }
+    /* the backend may return the length of the whole frame: it is
+       dropped and the buffers are kept for the next one */
+    if (truncated)
+        return TRUE;
+
+    /* bytes of each chain used by the header and the frame */
+    len = NET_HDR_SIZE + n;
+    for(i = 0, pos = 0; pos < len; i++) {
+        n = min_int(len - pos, s->rx_len[i]);
+        if (!zero_copy) {
+            if (i == 0) {
+                memcpy_to_queue(s, NET_RX_QUEUE, s->rx_desc[i], NET_HDR_SIZE,
+                                s->buf, n - NET_HDR_SIZE);
+            } else {
+                memcpy_to_queue(s, NET_RX_QUEUE, s->rx_desc[i], 0,
+                                s->buf + pos - NET_HDR_SIZE, n);
+            }
+        }
+        s->rx_len[i] = n;
+        pos += n;
+    }
+    nb_chains = i;
+
+    memset(&h, 0, sizeof(h));
+    h.num_buffers = nb_chains;
+    memcpy_to_queue(s, NET_RX_QUEUE, s->rx_desc[0], 0, &h, NET_HDR_SIZE);
+    for(i = 0; i < nb_chains; i++)
+        virtio_consume_desc(s, NET_RX_QUEUE, s->rx_desc[i], s->rx_len[i]);
+    qs->last_avail_idx += nb_chains;
+    return TRUE;
+}
+
+static void virtio_net_tick(VIRTIODevice *s)
+{
+    VIRTIONetDevice *s1 = (VIRTIONetDevice *)s;
+    EthernetDevice *net = s1->net;
+    int i;
+
+    for(i = 0; i < NET_RX_BURST && net->can_read(net); i++) {
+        if (!virtio_net_rx(s1))
+            break;
+    }
+}
+
+/* the frames waiting in the backend are not part of the state */
+static void virtio_net_save(VIRTIODevice *s, CheckpointFile *cp)
+{
+    VIRTIONetDevice *s1 = (VIRTIONetDevice *)s;
 
+    checkpoint_put_u32(cp, s1->max_frame);
+}
+
+static void virtio_net_load(VIRTIODevice *s, CheckpointFile *cp)
+{
+    VIRTIONetDevice *s1 = (VIRTIONetDevice *)s;
+
+    if (checkpoint_get_u32(cp) != (uint32_t)s1->max_frame)
+        checkpoint_fail(cp, "checkpoint with another MTU");
+}
+
+VIRTIODevice *virtio_net_init(VIRTIOBusDef *bus, EthernetDevice *net,
+                              int mtu, const simif_t* sim)
+{
+    VIRTIONetDevice *s;
+    int i;
+
+    s = (VIRTIONetDevice *)mallocz(sizeof(*s));
+    virtio_init(s, bus,
+                1, 12, virtio_net_recv_request, sim);
+    s->device_features |= VIRTIO_NET_F_MTU | VIRTIO_NET_F_MAC |
+        VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS;
+    s->queue[NET_RX_QUEUE].manual_recv = TRUE;
+    s->device_tick = virtio_net_tick;
+    s->device_save = virtio_net_save;
+    s->device_load = virtio_net_load;
+    virtio_stats_init(s, bus, NET_STATS_NB);
+    if (s->stats) {
+        for(i = 0; i < NET_STATS_NB; i++)
+            stats_set_op_name(s->stats, i, virtio_net_stats_names[i]);
+    }
+
+    s->net = net;
+    s->max_frame = mtu + NET_ETH_HLEN;
+    s->max_iov = (NET_HDR_SIZE + s->max_frame) / DMA_PAGE_SIZE +
+        2 * NET_MAX_RX_CHAINS + 2;
+    s->iov = (struct iovec *)malloc(sizeof(s->iov[0]) * s->max_iov);
+    s->rx_desc = (int *)malloc(sizeof(s->rx_desc[0]) * NET_MAX_RX_CHAINS);
+    s->rx_len = (int *)malloc(sizeof(s->rx_len[0]) * NET_MAX_RX_CHAINS);
+    s->buf = (uint8_t *)malloc(s->max_frame);
+
+    memcpy(s->config_space, net->mac_addr, 6);
+    put_le16(s->config_space + 6, VIRTIO_NET_S_LINK_UP);
+    put_le16(s->config_space + 8, 1); /* max_virtqueue_pairs */
+    put_le16(s->config_space + 10, mtu);
     return (VIRTIODevice *)s;
 }
 
 /*********************************************************************/
 /* 9p filesystem device */
 
+/* fid table: hash table of FIDDesc chained by bucket. The entries are
+   allocated by blocks and recycled through a free list. */
+#define FID_HASH_BITS_MIN 6
+#define FID_BLOCK_SIZE 64
+
+/* the file of a fid. A request holds a reference while it uses it, so
+   that a clunk or a walk to the same fid on another worker thread does
+   not delete it. */
 typedef struct {
-    struct list_head link;
-    uint32_t fid;
     FSFile *fd;
+    int refcount; /* protected by fid_lock */
+} FIDFile;
+
+typedef struct {
+    struct list_head link; /* in a hash bucket or in fid_free_list */
+    uint32_t fid;
+    FIDFile *file;
 } FIDDesc;
 
+typedef struct FIDBlock {
+    struct FIDBlock *next;
+    FIDDesc fids[FID_BLOCK_SIZE];
+} FIDBlock;
+
+#define P9_REPLY_BUF_SIZE 1031 /* header + 1024 bytes */
+/* larger message and payload buffers are freed when their request
+   completes, so that a burst of large requests does not keep msize
+   bytes per descriptor */
+#define P9_BUF_KEEP_SIZE (64 * 1024)
+#define P9_NOTAG 0xffff
+#define P9_MAX_REQ_FILES 2 /* link and renameat use two fids */
+
+/* state of a lopen completed by the fs_open() callback */
+enum {
+    P9_OPEN_NONE,
+    P9_OPEN_WAIT, /* the callback has not been called yet */
+    P9_OPEN_REPLIED, /* the reply is built, the request can complete */
+};
+
+struct VIRTIO9PDevice;
+
+/* 9p request, indexed by head descriptor. Its message is copied from the
+   queue before it is executed, so that it can run on a worker thread. The
+   reply is written back to the queue by virtio_9p_req_complete(). */
+typedef struct P9Request {
+    WorkItem work;
+    VIRTIO9PDevice *dev;
+    int queue_idx;
+    int desc_idx;
+    uint8_t id;
+    uint16_t tag;
+    uint8_t *msg; /* request message */
+    int msg_len;
+    int msg_size; /* allocated size of msg */
+    struct iovec *iov; /* read or write payload in guest RAM */
+    int iovcnt; /* -1 if the payload is copied */
+    uint8_t *reply; /* header and fixed fields of the reply */
+    int reply_len;
+    int data_len; /* payload following the reply */
+    const uint8_t *data; /* payload to copy to the queue, NULL if it is
+                            already in the guest buffers */
+    uint8_t *data_buf; /* readdir and read payload, kept across requests
+                          up to P9_BUF_KEEP_SIZE bytes */
+    int data_buf_size;
+    uint8_t reply_buf[P9_REPLY_BUF_SIZE];
+    FIDFile *files[P9_MAX_REQ_FILES]; /* references taken by fid_find() */
+    int nb_files;
+    int open_state; /* P9_OPEN_x, written by the fs_open() callback */
+    BOOL exec_done; /* virtio_9p_req_done() was called */
+    struct P9Request *flush_req; /* Tflush waiting for this request */
+    /* statistics */
+    uint8_t stats_op; /* request id, 'id' is changed by virtio_9p_send_error() */
+    uint64_t start_tick;
+    uint64_t start_ns;
+} P9Request;
+
 struct VIRTIO9PDevice : public VIRTIODevice {
     FSDevice *fs;
     uint32_t msize; /* maximum message size */
-    struct list_head fid_list; /* list of FIDDesc */
-    BOOL req_in_progress;
+    uint32_t max_msize; /* largest msize accepted in Tversion */
+    struct list_head *fid_hash; /* 1 << fid_hash_bits buckets */
+    int fid_hash_bits;
+    int fid_count;
+    struct list_head fid_free_list;
+    FIDBlock *fid_blocks;
+    pthread_mutex_t fid_lock; /* protects the fid table */
+    P9Request *req; /* indexed by head descriptor */
+    P9Request **tags; /* requests in progress, indexed by tag */
+    WorkQueue *wq; /* NULL if the requests are executed synchronously */
+    int nb_open_replied; /* deferred lopen replies not completed yet */
 };
 
+static struct list_head *fid_bucket(VIRTIO9PDevice *s, uint32_t fid)
+{
+    return &s->fid_hash[(fid * 0x9e3779b1) >> (32 - s->fid_hash_bits)];
+}
+
+static void fid_hash_resize(VIRTIO9PDevice *s, int hash_bits)
+{
+    struct list_head *old_hash, *el, *el1;
+    int i, old_size;
+    FIDDesc *f;
+
+    old_hash = s->fid_hash;
+    old_size = old_hash ? 1 << s->fid_hash_bits : 0;
+    s->fid_hash = (struct list_head *)malloc(sizeof(s->fid_hash[0]) <<
+                                             hash_bits);
+    s->fid_hash_bits = hash_bits;
+    for(i = 0; i < (1 << hash_bits); i++)
+        init_list_head(&s->fid_hash[i]);
+    for(i = 0; i < old_size; i++) {
+        list_for_each_safe(el, el1, &old_hash[i]) {
+            f = list_entry(el, FIDDesc, link);
+            list_add_tail(&f->link, fid_bucket(s, f->fid));
+        }
+    }
+    free(old_hash);
+}
+
+static FIDDesc *fid_alloc(VIRTIO9PDevice *s)
+{
+    FIDBlock *b;
+    FIDDesc *f;
+    int i;
+
+    if (list_empty(&s->fid_free_list)) {
+        b = (FIDBlock *)malloc(sizeof(*b));
+        b->next = s->fid_blocks;
+        s->fid_blocks = b;
+        for(i = 0; i < FID_BLOCK_SIZE; i++)
+            list_add_tail(&b->fids[i].link, &s->fid_free_list);
+    }
+    f = list_entry(s->fid_free_list.next, FIDDesc, link);
+    list_del(&f->link);
+    return f;
+}
+
 static FIDDesc *fid_find1(VIRTIO9PDevice *s, uint32_t fid)
 {
-    struct list_head *el;
+    struct list_head *el, *head;
     FIDDesc *f;
 
-    list_for_each(el, &s->fid_list) {
+    head = fid_bucket(s, fid);
+    list_for_each(el, head) {
         f = list_entry(el, FIDDesc, link);
         if (f->fid == fid)
             return f;
@@ -1124,46 +1937,88 @@ static FIDDesc *fid_find1(VIRTIO9PDevice *s, uint32_t fid)
     return NULL;
 }
 
-static FSFile *fid_find(VIRTIO9PDevice *s, uint32_t fid)
+/* with fid_lock held */
+static void fid_file_unref(VIRTIO9PDevice *s, FIDFile *file)
+{
+    if (--file->refcount == 0) {
+        s->fs->fs_delete(s->fs, file->fd);
+        free(file);
+    }
+}
+
+/* the file stays valid until the request completes */
+static FSFile *fid_find(VIRTIO9PDevice *s, P9Request *req, uint32_t fid)
 {
     FIDDesc *f;
+    FSFile *fd;
 
+    pthread_mutex_lock(&s->fid_lock);
     f = fid_find1(s, fid);
-    if (!f)
-        return NULL;
-    return f->fd;
+    fd = NULL;
+    if (f && req->nb_files < P9_MAX_REQ_FILES) {
+        f->file->refcount++;
+        req->files[req->nb_files++] = f->file;
+        fd = f->file->fd;
+    }
+    pthread_mutex_unlock(&s->fid_lock);
+    return fd;
+}
+
+/* release the references taken by fid_find() */
+static void fid_put_req_files(VIRTIO9PDevice *s, P9Request *req)
+{
+    int i;
+
+    if (req->nb_files == 0)
+        return;
+    pthread_mutex_lock(&s->fid_lock);
+    for(i = 0; i < req->nb_files; i++)
+        fid_file_unref(s, req->files[i]);
+    pthread_mutex_unlock(&s->fid_lock);
+    req->nb_files = 0;
 }
 
 static void fid_delete(VIRTIO9PDevice *s, uint32_t fid)
 {
     FIDDesc *f;
 
+    pthread_mutex_lock(&s->fid_lock);
     f = fid_find1(s, fid);
     if (f) {
-        s->fs->fs_delete(s->fs, f->fd);
+        fid_file_unref(s, f->file);
         list_del(&f->link);
-        free(f);
+        list_add(&f->link, &s->fid_free_list);
+        s->fid_count--;
     }
+    pthread_mutex_unlock(&s->fid_lock);
 }
 
 static void fid_set(VIRTIO9PDevice *s, uint32_t fid, FSFile *fd)
 {
     FIDDesc *f;
+    FIDFile *file;
 
+    file = (FIDFile *)malloc(sizeof(*file));
+    file->fd = fd;
+    file->refcount = 1;
+    pthread_mutex_lock(&s->fid_lock);
     f = fid_find1(s, fid);
     if (f) {
-        s->fs->fs_delete(s->fs, f->fd);
-        f->fd = fd;
+        fid_file_unref(s, f->file);
+        f->file = file;
     } else {
-        f = (FIDDesc*)malloc(sizeof(*f));
+        /* at most two fids per bucket on average */
+        if (s->fid_count >= (2 << s->fid_hash_bits))
+            fid_hash_resize(s, s->fid_hash_bits + 1);
+        f = fid_alloc(s);
         f->fid = fid;
-        f->fd = fd;
-        list_add(&f->link, &s->fid_list);
+        f->file = file;
+        list_add(&f->link, fid_bucket(s, fid));
+        s->fid_count++;
     }
+    pthread_mutex_unlock(&s->fid_lock);
 }
 
-#ifdef DEBUG_VIRTIO
-
 typedef struct {
     uint8_t tag;
     const char *name;
@@ -1197,6 +2052,8 @@ static const Virtio9POPName virtio_9p_op_names[] = {
     { 0, NULL },
 };
 
+#ifdef DEBUG_VIRTIO
+
 static const char *get_9p_op_name(int tag)
 {
     const Virtio9POPName *p;
@@ -1313,10 +2170,16 @@ static int marshall(VIRTIO9PDevice *s,
 
 /* return < 0 if error */
 /* XXX: free allocated strings in case of error */
-static int unmarshall(VIRTIO9PDevice *s, int queue_idx,
-                      int desc_idx, int *poffset, const char *fmt, ...)
+static int p9_msg_read(P9Request *req, void *buf, int offset, int count)
+{
+    if (offset + count > req->msg_len)
+        return -1;
+    memcpy(buf, req->msg + offset, count);
+    return 0;
+}
+
+static int unmarshall(P9Request *req, int *poffset, const char *fmt, ...)
 {
-    VIRTIODevice *s1 = (VIRTIODevice *)s;
     va_list ap;
     int offset, c;
     uint8_t buf[16];
@@ -1331,7 +2194,7 @@ static int unmarshall(VIRTIO9PDevice *s, int queue_idx,
         case 'b':
             {
                 uint8_t *ptr;
-                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 1))
+                if (p9_msg_read(req, buf, offset, 1))
                     return -1;
                 ptr = va_arg(ap, uint8_t *);
                 *ptr = buf[0];
@@ -1345,7 +2208,7 @@ static int unmarshall(VIRTIO9PDevice *s, int queue_idx,
         case 'h':
             {
                 uint16_t *ptr;
-                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 2))
+                if (p9_msg_read(req, buf, offset, 2))
                     return -1;
                 ptr = va_arg(ap, uint16_t *);
                 *ptr = get_le16(buf);
@@ -1359,7 +2222,7 @@ static int unmarshall(VIRTIO9PDevice *s, int queue_idx,
         case 'w':
             {
                 uint32_t *ptr;
-                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 4))
+                if (p9_msg_read(req, buf, offset, 4))
                     return -1;
                 ptr = va_arg(ap, uint32_t *);
                 *ptr = get_le32(buf);
@@ -1373,7 +2236,7 @@ static int unmarshall(VIRTIO9PDevice *s, int queue_idx,
         case 'd':
             {
                 uint64_t *ptr;
-                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 8))
+                if (p9_msg_read(req, buf, offset, 8))
                     return -1;
                 ptr = va_arg(ap, uint64_t *);
                 *ptr = get_le64(buf);
@@ -1389,12 +2252,12 @@ static int unmarshall(VIRTIO9PDevice *s, int queue_idx,
                 char *str, **ptr;
                 int len;
 
-                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 2))
+                if (p9_msg_read(req, buf, offset, 2))
                     return -1;
                 len = get_le16(buf);
                 offset += 2;
                 str = (char*)malloc(len + 1);
-                if (memcpy_from_queue(s1, str, queue_idx, desc_idx, offset, len))
+                if (p9_msg_read(req, str, offset, len))
                     return -1;
                 str[len] = '\0';
                 offset += len;
@@ -1415,109 +2278,348 @@ static int unmarshall(VIRTIO9PDevice *s, int queue_idx,
     return 0;
 }
 
-static void virtio_9p_send_reply(VIRTIO9PDevice *s, int queue_idx,
-                                 int desc_idx, uint8_t id, uint16_t tag, 
-                                 uint8_t *buf, int buf_len)
+/* Layouts of the frequent messages, after the header, with the field
+   types of marshall() and unmarshall() ('s' only in requests, 'Q' only
+   in replies). The encoders and decoders generated from them check the
+   bounds once for each run of fixed size fields and do not parse a
+   format string or walk a va_list. */
+static constexpr char P9_TLOPEN[] = "ww"; /* fid flags */
+static constexpr char P9_RLOPEN[] = "Qw"; /* qid iounit */
+static constexpr char P9_TGETATTR[] = "wd"; /* fid request_mask */
+static constexpr char P9_RGETATTR[] = "dQwwwddddddddddddddd";
+static constexpr char P9_TREAD[] = "wdw"; /* fid offset count, also
+                                             readdir and write */
+static constexpr char P9_RCOUNT[] = "w"; /* read, readdir and write */
+static constexpr char P9_TWALK[] = "wwh"; /* fid newfid nwname */
+static constexpr char P9_WNAME[] = "s";
+static constexpr char P9_RWALK[] = "h"; /* nwqid, followed by the qids */
+static constexpr char P9_QID[] = "Q";
+
+/* size of the fixed size fields of 'fmt' from field 'i' to the next
+   string, including its length. -1 if a field type is invalid. */
+static constexpr int p9_run_size(const char *fmt, int i)
+{
+    int n = 0;
+    for(; fmt[i] != '\0'; i++) {
+        switch(fmt[i]) {
+        case 'b':
+            n += 1;
+            break;
+        case 'h':
+            n += 2;
+            break;
+        case 'w':
+            n += 4;
+            break;
+        case 'd':
+            n += 8;
+            break;
+        case 'Q':
+            n += 13;
+            break;
+        case 's':
+            return n + 2;
+        default:
+            return -1;
+        }
+    }
+    return n;
+}
+
+/* TRUE if field 'i' starts a run of fixed size fields */
+static constexpr bool p9_run_start(const char *fmt, int i)
+{
+    return i == 0 || fmt[i - 1] == 's';
+}
+
+static constexpr int p9_field_count(const char *fmt)
+{
+    int n = 0;
+    while (fmt[n] != '\0')
+        n++;
+    return n;
+}
+
+template <const char *fmt, int i>
+static inline int p9_decode(const uint8_t *msg, int msg_len, int *poffset)
+{
+    return 0;
+}
+
+template <const char *fmt, int i, typename T, typename... Rest>
+static inline int p9_decode(const uint8_t *msg, int msg_len, int *poffset,
+                            T *ptr, Rest *...rest)
+{
+    constexpr char c = fmt[i];
+    int offset = *poffset;
+
+    if constexpr (p9_run_start(fmt, i)) {
+        static_assert(p9_run_size(fmt, i) >= 0, "invalid 9p field type");
+        if (offset + p9_run_size(fmt, i) > msg_len)
+            return -1;
+    }
+    if constexpr (c == 'b') {
+        static_assert(std::is_same<T, uint8_t>::value, "'b' needs a uint8_t *");
+        *ptr = msg[offset];
+        offset += 1;
+    } else if constexpr (c == 'h') {
+        static_assert(std::is_same<T, uint16_t>::value, "'h' needs a uint16_t *");
+        *ptr = get_le16(msg + offset);
+        offset += 2;
+    } else if constexpr (c == 'w') {
+        static_assert(std::is_same<T, uint32_t>::value, "'w' needs a uint32_t *");
+        *ptr = get_le32(msg + offset);
+        offset += 4;
+    } else if constexpr (c == 'd') {
+        static_assert(std::is_same<T, uint64_t>::value, "'d' needs a uint64_t *");
+        *ptr = get_le64(msg + offset);
+        offset += 8;
+    } else if constexpr (c == 's') {
+        static_assert(std::is_same<T, char *>::value, "'s' needs a char **");
+        int len = get_le16(msg + offset);
+        offset += 2;
+        if (offset + len > msg_len)
+            return -1;
+        *ptr = (char *)malloc(len + 1);
+        memcpy(*ptr, msg + offset, len);
+        (*ptr)[len] = '\0';
+        offset += len;
+    } else {
+        static_assert(c == 'b', "invalid 9p request field type");
+    }
+    *poffset = offset;
+    return p9_decode<fmt, i + 1>(msg, msg_len, poffset, rest...);
+}
+
+/* same as unmarshall() with the layout 'fmt' */
+template <const char *fmt, typename... Args>
+static inline int p9_unpack(P9Request *req, int *poffset, Args *...args)
+{
+    int offset __attribute__((unused)) = *poffset;
+
+    static_assert(sizeof...(Args) == p9_field_count(fmt),
+                  "9p field count mismatch");
+#ifdef DEBUG_VIRTIO
+    /* traced by unmarshall() */
+    return unmarshall(req, poffset, fmt, args...);
+#else
+    if (p9_decode<fmt, 0>(req->msg, req->msg_len, &offset, args...) < 0)
+        return -1;
+    *poffset = offset;
+    return 0;
+#endif
+}
+
+template <const char *fmt, int i>
+static inline uint8_t *p9_encode(uint8_t *buf, uint8_t *buf_end)
+{
+    return buf;
+}
+
+template <const char *fmt, int i, typename T, typename... Rest>
+static inline uint8_t *p9_encode(uint8_t *buf, uint8_t *buf_end, T val,
+                                 Rest... rest)
+{
+    constexpr char c = fmt[i];
+
+    if constexpr (p9_run_start(fmt, i)) {
+        static_assert(p9_run_size(fmt, i) >= 0, "invalid 9p field type");
+        assert(buf + p9_run_size(fmt, i) <= buf_end);
+    }
+    if constexpr (c == 'b' || c == 'h' || c == 'w' || c == 'd') {
+        static_assert(std::is_integral<T>::value, "9p integer field");
+        if constexpr (c == 'b') {
+            buf[0] = val;
+            buf += 1;
+        } else if constexpr (c == 'h') {
+            put_le16(buf, val);
+            buf += 2;
+        } else if constexpr (c == 'w') {
+            put_le32(buf, val);
+            buf += 4;
+        } else {
+            put_le64(buf, val);
+            buf += 8;
+        }
+    } else if constexpr (c == 'Q') {
+        static_assert(std::is_convertible<T, const FSQID *>::value,
+                      "'Q' needs a FSQID *");
+        buf[0] = val->type;
+        put_le32(buf + 1, val->version);
+        put_le64(buf + 5, val->path);
+        buf += 13;
+    } else if constexpr (c == 's') {
+        static_assert(std::is_convertible<T, const char *>::value,
+                      "'s' needs a char *");
+        int len = strlen(val);
+        assert(len <= 65535);
+        /* the length is counted in the run */
+        assert(buf + 2 + len <= buf_end);
+        put_le16(buf, len);
+        memcpy(buf + 2, val, len);
+        buf += 2 + len;
+    } else {
+        static_assert(c == 'b', "invalid 9p reply field type");
+    }
+    return p9_encode<fmt, i + 1>(buf, buf_end, rest...);
+}
+
+/* same as marshall() with the layout 'fmt' */
+template <const char *fmt, typename... Args>
+static inline int p9_pack(uint8_t *buf, int max_len, Args... args)
+{
+    static_assert(sizeof...(Args) == p9_field_count(fmt),
+                  "9p field count mismatch");
+#ifdef DEBUG_VIRTIO
+    /* traced by marshall() */
+    return marshall(NULL, buf, max_len, fmt, args...);
+#else
+    return p9_encode<fmt, 0>(buf, buf + max_len, args...) - buf;
+#endif
+}
+
+/* the reply header is followed by 'buf' then by 'data_len' bytes of
+   'data', or by 'data_len' bytes which are already in the guest buffers if
+   'data' is NULL */
+static void virtio_9p_send_reply_data(P9Request *req, uint8_t *buf,
+                                      int buf_len, const uint8_t *data,
+                                      int data_len)
 {
-    uint8_t *buf1;
     int len;
 
 #ifdef DEBUG_VIRTIO
      {
-        if (id == 6)
+        if (req->id == 6)
             printf(" (error)");
         printf("\n");
     }
 #endif
-    len = buf_len + 7;
-    buf1 = (uint8_t*)malloc(len);
-    put_le32(buf1, len);
-    buf1[4] = id + 1;
-    put_le16(buf1 + 5, tag);
-    memcpy(buf1 + 7, buf, buf_len);
-    memcpy_to_queue((VIRTIODevice *)s, queue_idx, desc_idx, 0, buf1, len);
-    virtio_consume_desc((VIRTIODevice *)s, queue_idx, desc_idx, len);
-    free(buf1);
+    len = 7 + buf_len;
+    if (len <= (int)sizeof(req->reply_buf))
+        req->reply = req->reply_buf;
+    else
+        req->reply = (uint8_t *)malloc(len);
+    put_le32(req->reply, len + data_len);
+    req->reply[4] = req->id + 1;
+    put_le16(req->reply + 5, req->tag);
+    if (buf_len > 0)
+        memcpy(req->reply + 7, buf, buf_len);
+    req->reply_len = len;
+    req->data = data;
+    req->data_len = data_len;
+}
+
+static void virtio_9p_send_reply(P9Request *req, uint8_t *buf, int buf_len)
+{
+    virtio_9p_send_reply_data(req, buf, buf_len, NULL, 0);
+}
+
+/* return a buffer of at least 'size' bytes for the reply payload */
+static uint8_t *virtio_9p_get_data_buf(P9Request *req, int size)
+{
+    if (size > req->data_buf_size) {
+        req->data_buf = (uint8_t *)realloc(req->data_buf, size);
+        req->data_buf_size = size;
+    }
+    return req->data_buf;
 }
 
-static void virtio_9p_send_error(VIRTIO9PDevice *s, int queue_idx,
-                                 int desc_idx, uint16_t tag, uint32_t error)
+static void virtio_9p_send_error(P9Request *req, uint32_t error)
 {
     uint8_t buf[4];
     int buf_len;
 
-    buf_len = marshall(s, buf, sizeof(buf), "w", -error);
-    virtio_9p_send_reply(s, queue_idx, desc_idx, 6, tag, buf, buf_len);
+    buf_len = marshall(req->dev, buf, sizeof(buf), "w", -error);
+    req->id = 6; /* Rlerror */
+    virtio_9p_send_reply(req, buf, buf_len);
 }
 
-typedef struct {
-    VIRTIO9PDevice *dev;
-    int queue_idx;
-    int desc_idx;
-    uint16_t tag;
-} P9OpenInfo;
+/* write the reply to the queue. Then the requests flushing this one can
+   be answered. */
+static void virtio_9p_req_complete(P9Request *req)
+{
+    VIRTIO9PDevice *s = req->dev;
+    P9Request *flush_req;
+
+    memcpy_to_queue(s, req->queue_idx, req->desc_idx, 0,
+                    req->reply, req->reply_len);
+    if (req->data) {
+        memcpy_to_queue(s, req->queue_idx, req->desc_idx, req->reply_len,
+                        req->data, req->data_len);
+        req->data = NULL;
+    }
+    virtio_consume_desc(s, req->queue_idx, req->desc_idx,
+                        req->reply_len + req->data_len);
+    if (s->stats) {
+        stats_end(s->stats, req->stats_op,
+                  req->msg_len + req->reply_len + req->data_len,
+                  s->tick_count - req->start_tick,
+                  stats_get_ns() - req->start_ns,
+                  req->id == 6 && req->stats_op != 6);
+    }
+    if (req->reply != req->reply_buf)
+        free(req->reply);
+    req->reply = NULL;
+    if (req->data_buf_size > P9_BUF_KEEP_SIZE) {
+        free(req->data_buf);
+        req->data_buf = NULL;
+        req->data_buf_size = 0;
+    }
+    if (req->msg_size > P9_BUF_KEEP_SIZE) {
+        free(req->msg);
+        req->msg = NULL;
+        req->msg_size = 0;
+    }
+    fid_put_req_files(s, req);
+    if (s->tags[req->tag] == req)
+        s->tags[req->tag] = NULL;
+    flush_req = req->flush_req;
+    req->flush_req = NULL;
+    if (flush_req)
+        virtio_9p_req_complete(flush_req);
+}
 
-static void virtio_9p_open_reply(FSDevice *fs, FSQID *qid, int err,
-                                 P9OpenInfo *oi)
+static void virtio_9p_open_reply(P9Request *req, FSQID *qid, int err)
 {
-    VIRTIO9PDevice *s = oi->dev;
+    VIRTIO9PDevice *s = req->dev;
     uint8_t buf[32];
     int buf_len;
     
     if (err < 0) {
-        virtio_9p_send_error(s, oi->queue_idx, oi->desc_idx, oi->tag, err);
+        virtio_9p_send_error(req, err);
     } else {
-        buf_len = marshall(s, buf, sizeof(buf),
-                           "Qw", qid, s->msize - 24);
-        virtio_9p_send_reply(s, oi->queue_idx, oi->desc_idx, 12, oi->tag,
-                             buf, buf_len);
+        buf_len = p9_pack<P9_RLOPEN>(buf, sizeof(buf), qid, s->msize - 24);
+        virtio_9p_send_reply(req, buf, buf_len);
     }
-    free(oi);
 }
 
+/* may be called from any thread: only the reply is built here. The
+   request is completed on the simulator thread, by virtio_9p_req_done()
+   or by the next tick. */
 static void virtio_9p_open_cb(FSDevice *fs, FSQID *qid, int err,
                               void *opaque)
 {
-    P9OpenInfo *oi = (P9OpenInfo *)opaque;
-    VIRTIO9PDevice *s = oi->dev;
-    int queue_idx = oi->queue_idx;
-    
-    virtio_9p_open_reply(fs, qid, err, oi);
-
-    s->req_in_progress = FALSE;
+    P9Request *req = (P9Request *)opaque;
+    VIRTIO9PDevice *s = req->dev;
 
-    /* handle next requests */
-    queue_notify((VIRTIODevice *)s, queue_idx);
+    virtio_9p_open_reply(req, qid, err);
+    __atomic_store_n(&req->open_state, P9_OPEN_REPLIED, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&s->nb_open_replied, 1, __ATOMIC_RELEASE);
 }
 
-static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
-                                   int desc_idx, int read_size,
-                                   int write_size)
+/* execute the request and build its reply. Runs on a worker thread if
+   the device has a work queue. */
+static void virtio_9p_handle_request(P9Request *req)
 {
-    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
-    int offset, header_len;
+    VIRTIO9PDevice *s = req->dev;
+    int offset;
     uint8_t id;
-    uint16_t tag;
     uint8_t buf[1024];
     int buf_len, err;
     FSDevice *fs = s->fs;
 
-    if (queue_idx != 0)
-        return 0;
-    
-    if (s->req_in_progress)
-        return -1;
-    
-    offset = 0;
-    header_len = 4 + 1 + 2;
-    if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, header_len)) {
-        tag = 0;
-        goto protocol_error;
-    }
-    //size = get_le32(buf);
-    id = buf[4];
-    tag = get_le16(buf + 5);
-    offset += header_len;
+    id = req->id;
+    offset = 7;
     
 #ifdef DEBUG_VIRTIO
      {
@@ -1549,7 +2651,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
                                0, /* id */
                                256 /* max filename length */
                                );
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            virtio_9p_send_reply(req, buf, buf_len);
         }
         break;
     case 12: /* lopen */
@@ -1557,27 +2659,20 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             uint32_t fid, flags;
             FSFile *f;
             FSQID qid;
-            P9OpenInfo *oi;
             
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "ww", &fid, &flags))
+            if (p9_unpack<P9_TLOPEN>(req, &offset, &fid, &flags))
                 goto protocol_error;
 #ifdef DEBUG_VIRTIO
             printf("Virtio 9p fs lopen: fid = %d, flags = %d\n", fid, flags);
 #endif
-            f = fid_find(s, fid);
+            f = fid_find(s, req, fid);
             if (!f)
                 goto fid_not_found;
-            oi = (P9OpenInfo *)malloc(sizeof(*oi));
-            oi->dev = s;
-            oi->queue_idx = queue_idx;
-            oi->desc_idx = desc_idx;
-            oi->tag = tag;
-            err = fs->fs_open(fs, &qid, f, flags, virtio_9p_open_cb, oi);
+            req->open_state = P9_OPEN_WAIT;
+            err = fs->fs_open(fs, &qid, f, flags, virtio_9p_open_cb, req);
             if (err <= 0) {
-                virtio_9p_open_reply(fs, &qid, err, oi);
-            } else {
-                s->req_in_progress = TRUE;
+                req->open_state = P9_OPEN_NONE;
+                virtio_9p_open_reply(req, &qid, err);
             }
         }
         break;
@@ -1588,10 +2683,10 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             FSFile *f;
             FSQID qid;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
+            if (unmarshall(req, &offset,
                            "wswww", &fid, &name, &flags, &mode, &gid))
                 goto protocol_error;
-            f = fid_find(s, fid);
+            f = fid_find(s, req, fid);
             if (!f) {
                 err = -P9_EPROTO;
             } else {
@@ -1602,7 +2697,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
                 goto error;
             buf_len = marshall(s, buf, sizeof(buf),
                                "Qw", &qid, s->msize - 24);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            virtio_9p_send_reply(req, buf, buf_len);
         }
         break;
     case 16: /* symlink */
@@ -1612,10 +2707,10 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             FSFile *f;
             FSQID qid;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
+            if (unmarshall(req, &offset,
                            "wssw", &fid, &name, &symgt, &gid))
                 goto protocol_error;
-            f = fid_find(s, fid);
+            f = fid_find(s, req, fid);
             if (!f) {
                 err = -P9_EPROTO;
             } else {
@@ -1627,7 +2722,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
                 goto error;
             buf_len = marshall(s, buf, sizeof(buf),
                                "Q", &qid);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            virtio_9p_send_reply(req, buf, buf_len);
         }
         break;
     case 18: /* mknod */
@@ -1637,10 +2732,10 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             FSFile *f;
             FSQID qid;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
+            if (unmarshall(req, &offset,
                            "wswwww", &fid, &name, &mode, &major, &minor, &gid))
                 goto protocol_error;
-            f = fid_find(s, fid);
+            f = fid_find(s, req, fid);
             if (!f) {
                 err = -P9_EPROTO;
             } else {
@@ -1651,7 +2746,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
                 goto error;
             buf_len = marshall(s, buf, sizeof(buf),
                                "Q", &qid);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            virtio_9p_send_reply(req, buf, buf_len);
         }
         break;
     case 22: /* readlink */
@@ -1660,10 +2755,10 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             char buf1[1024];
             FSFile *f;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
+            if (unmarshall(req, &offset,
                            "w", &fid))
                 goto protocol_error;
-            f = fid_find(s, fid);
+            f = fid_find(s, req, fid);
             if (!f) {
                 err = -P9_EPROTO;
             } else {
@@ -1672,7 +2767,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             if (err)
                 goto error;
             buf_len = marshall(s, buf, sizeof(buf), "s", buf1);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            virtio_9p_send_reply(req, buf, buf_len);
         }
         break;
     case 24: /* getattr */
@@ -1682,18 +2777,16 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             FSFile *f;
             FSStat st;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wd", &fid, &mask))
+            if (p9_unpack<P9_TGETATTR>(req, &offset, &fid, &mask))
                 goto protocol_error;
-            f = fid_find(s, fid);
+            f = fid_find(s, req, fid);
             if (!f)
                 goto fid_not_found;
             err = fs->fs_stat(fs, f, &st);
             if (err)
                 goto error;
 
-            buf_len = marshall(s, buf, sizeof(buf),
-                               "dQwwwddddddddddddddd", 
+            buf_len = p9_pack<P9_RGETATTR>(buf, sizeof(buf),
                                mask, &st.qid,
                                st.st_mode, st.st_uid, st.st_gid,
                                st.st_nlink, st.st_rdev, st.st_size,
@@ -1703,7 +2796,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
                                st.st_ctime_sec, (uint64_t)st.st_ctime_nsec,
                                (uint64_t)0, (uint64_t)0,
                                (uint64_t)0, (uint64_t)0);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            virtio_9p_send_reply(req, buf, buf_len);
         }
         break;
     case 26: /* setattr */
@@ -1712,19 +2805,19 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             uint64_t size, atime_sec, atime_nsec, mtime_sec, mtime_nsec;
             FSFile *f;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
+            if (unmarshall(req, &offset,
                            "wwwwwddddd", &fid, &mask, &mode, &uid, &gid,
                            &size, &atime_sec, &atime_nsec, 
                            &mtime_sec, &mtime_nsec))
                 goto protocol_error;
-            f = fid_find(s, fid);
+            f = fid_find(s, req, fid);
             if (!f)
                 goto fid_not_found;
             err = fs->fs_setattr(fs, f, mask, mode, uid, gid, size, atime_sec,
                                  atime_nsec, mtime_sec, mtime_nsec);
             if (err)
                 goto error;
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+            virtio_9p_send_reply(req, NULL, 0);
         }
         break;
     case 30: /* xattrwalk */
@@ -1738,35 +2831,36 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
         {
             uint32_t fid, count;
             uint64_t offs;
-            uint8_t *buf;
+            uint8_t *buf1;
             int n;
             FSFile *f;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wdw", &fid, &offs, &count))
+            if (p9_unpack<P9_TREAD>(req, &offset, &fid, &offs, &count))
                 goto protocol_error;
-            f = fid_find(s, fid);
+            f = fid_find(s, req, fid);
             if (!f)
                 goto fid_not_found;
-            buf = (uint8_t*)malloc(count + 4);
-            n = fs->fs_readdir(fs, f, offs, buf + 4, count);
+            /* the reply must fit in msize */
+            if (count > s->msize - 11)
+                count = s->msize - 11;
+            buf1 = virtio_9p_get_data_buf(req, count);
+            n = fs->fs_readdir(fs, f, offs, buf1, count);
             if (n < 0) {
                 err = n;
                 goto error;
             }
-            put_le32(buf, n);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, n + 4);
-            free(buf);
+            buf_len = p9_pack<P9_RCOUNT>(buf, sizeof(buf), n);
+            virtio_9p_send_reply_data(req, buf, buf_len, buf1, n);
         }
         break;
     case 50: /* fsync */
         {
             uint32_t fid;
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
+            if (unmarshall(req, &offset,
                            "w", &fid))
                 goto protocol_error;
             /* ignored */
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+            virtio_9p_send_reply(req, NULL, 0);
         }
         break;
     case 52: /* lock */
@@ -1775,12 +2869,12 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             FSFile *f;
             FSLock lock;
             
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
+            if (unmarshall(req, &offset,
                            "wbwddws", &fid, &lock.type, &lock.flags,
                            &lock.start, &lock.length,
                            &lock.proc_id, &lock.client_id))
                 goto protocol_error;
-            f = fid_find(s, fid);
+            f = fid_find(s, req, fid);
             if (!f)
                 err = -P9_EPROTO;
             else
@@ -1789,7 +2883,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             if (err < 0)
                 goto error;
             buf_len = marshall(s, buf, sizeof(buf), "b", err);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            virtio_9p_send_reply(req, buf, buf_len);
         }
         break;
     case 54: /* getlock */
@@ -1798,12 +2892,12 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             FSFile *f;
             FSLock lock;
             
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
+            if (unmarshall(req, &offset,
                            "wbddws", &fid, &lock.type,
                            &lock.start, &lock.length,
                            &lock.proc_id, &lock.client_id))
                 goto protocol_error;
-            f = fid_find(s, fid);
+            f = fid_find(s, req, fid);
             if (!f)
                 err = -P9_EPROTO;
             else
@@ -1817,7 +2911,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
                                &lock.start, &lock.length,
                                &lock.proc_id, &lock.client_id);
             free(lock.client_id);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            virtio_9p_send_reply(req, buf, buf_len);
         }
         break;
     case 70: /* link */
@@ -1826,11 +2920,11 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             char *name;
             FSFile *f, *df;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
+            if (unmarshall(req, &offset,
                            "wws", &dfid, &fid, &name))
                 goto protocol_error;
-            df = fid_find(s, dfid);
-            f = fid_find(s, fid);
+            df = fid_find(s, req, dfid);
+            f = fid_find(s, req, fid);
             if (!df || !f) {
                 err = -P9_EPROTO;
             } else {
@@ -1839,7 +2933,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             free(name);
             if (err)
                 goto error;
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+            virtio_9p_send_reply(req, NULL, 0);
         }
         break;
     case 72: /* mkdir */
@@ -1849,17 +2943,17 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             FSFile *f;
             FSQID qid;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
+            if (unmarshall(req, &offset,
                            "wsww", &fid, &name, &mode, &gid))
                 goto protocol_error;
-            f = fid_find(s, fid);
+            f = fid_find(s, req, fid);
             if (!f)
                 goto fid_not_found;
             err = fs->fs_mkdir(fs, &qid, f, name, mode, gid);
             if (err != 0)
                 goto error;
             buf_len = marshall(s, buf, sizeof(buf), "Q", &qid);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            virtio_9p_send_reply(req, buf, buf_len);
         }
         break;
     case 74: /* renameat */
@@ -1868,11 +2962,11 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             char *name, *new_name;
             FSFile *f, *new_f;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
+            if (unmarshall(req, &offset,
                            "wsws", &fid, &name, &new_fid, &new_name))
                 goto protocol_error;
-            f = fid_find(s, fid);
-            new_f = fid_find(s, new_fid);
+            f = fid_find(s, req, fid);
+            new_f = fid_find(s, req, new_fid);
             if (!f || !new_f) {
                 err = -P9_EPROTO;
             } else {
@@ -1882,7 +2976,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             free(new_name);
             if (err != 0)
                 goto error;
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+            virtio_9p_send_reply(req, NULL, 0);
         }
         break;
     case 76: /* unlinkat */
@@ -1891,10 +2985,10 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             char *name;
             FSFile *f;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
+            if (unmarshall(req, &offset,
                            "wsw", &fid, &name, &flags))
                 goto protocol_error;
-            f = fid_find(s, fid);
+            f = fid_find(s, req, fid);
             if (!f) {
                 err = -P9_EPROTO;
             } else {
@@ -1903,23 +2997,27 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             free(name);
             if (err != 0)
                 goto error;
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+            virtio_9p_send_reply(req, NULL, 0);
         }
         break;
     case 100: /* version */
         {
             uint32_t msize;
             char *version;
-            if (unmarshall(s, queue_idx, desc_idx, &offset, 
+            if (unmarshall(req, &offset, 
                            "ws", &msize, &version))
                 goto protocol_error;
-            if (msize > MAX_9P_MSIZE)
-                msize = MAX_9P_MSIZE;
+            if (msize < MIN_9P_MSIZE) {
+                free(version);
+                err = -P9_EINVAL;
+                goto error;
+            }
+            if (msize > s->max_msize)
+                msize = s->max_msize;
             s->msize = msize;
-            //            printf("version: msize=%d version=%s\n", msize, version);
             free(version);
             buf_len = marshall(s, buf, sizeof(buf), "ws", s->msize, "9P2000.L");
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            virtio_9p_send_reply(req, buf, buf_len);
         }
         break;
     case 104: /* attach */
@@ -1929,7 +3027,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             FSQID qid;
             FSFile *f;
             
-            if (unmarshall(s, queue_idx, desc_idx, &offset, 
+            if (unmarshall(req, &offset, 
                            "wwssw", &fid, &afid, &uname, &aname, &uid))
                 goto protocol_error;
             err = fs->fs_attach(fs, &f, &qid, uid, uname, aname);
@@ -1939,17 +3037,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             free(uname);
             free(aname);
             buf_len = marshall(s, buf, sizeof(buf), "Q", &qid);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
-        }
-        break;
-    case 108: /* flush */
-        {
-            uint16_t oldtag;
-            if (unmarshall(s, queue_idx, desc_idx, &offset, 
-                           "h", &oldtag))
-                goto protocol_error;
-            /* ignored */
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+            virtio_9p_send_reply(req, buf, buf_len);
         }
         break;
     case 110: /* walk */
@@ -1961,17 +3049,15 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             FSFile *f;
             int i;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset, 
-                           "wwh", &fid, &newfid, &nwname))
+            if (p9_unpack<P9_TWALK>(req, &offset, &fid, &newfid, &nwname))
                 goto protocol_error;
-            f = fid_find(s, fid);
+            f = fid_find(s, req, fid);
             if (!f)
                 goto fid_not_found;
             names = (char**)mallocz(sizeof(names[0]) * nwname);
             qids = (FSQID*)malloc(sizeof(qids[0]) * nwname);
             for(i = 0; i < nwname; i++) {
-                if (unmarshall(s, queue_idx, desc_idx, &offset, 
-                               "s", &names[i])) {
+                if (p9_unpack<P9_WNAME>(req, &offset, &names[i])) {
                     err = -P9_EPROTO;
                     goto walk_done;
                 }
@@ -1986,99 +3072,379 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
                 free(qids);
                 goto error;
             }
-            buf_len = marshall(s, buf, sizeof(buf), "h", err);
+            buf_len = p9_pack<P9_RWALK>(buf, sizeof(buf), (uint16_t)err);
             for(i = 0; i < err; i++) {
-                buf_len += marshall(s, buf + buf_len, sizeof(buf) - buf_len,
-                                    "Q", &qids[i]);
+                buf_len += p9_pack<P9_QID>(buf + buf_len, sizeof(buf) - buf_len,
+                                           &qids[i]);
             }
             free(qids);
             fid_set(s, newfid, f);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            virtio_9p_send_reply(req, buf, buf_len);
         }
         break;
     case 116: /* read */
         {
             uint32_t fid, count;
             uint64_t offs;
-            uint8_t *buf;
+            uint8_t *buf1;
             int n;
             FSFile *f;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wdw", &fid, &offs, &count))
+            if (p9_unpack<P9_TREAD>(req, &offset, &fid, &offs, &count))
                 goto protocol_error;
-            f = fid_find(s, fid);
+            f = fid_find(s, req, fid);
             if (!f)
                 goto fid_not_found;
-            buf = (uint8_t*)malloc(count + 4);
-            n = fs->fs_read(fs, f, offs, buf + 4, count);
+            if (req->iovcnt >= 0) {
+                /* read directly into the guest buffers, after the
+                   header and the count */
+                n = fs->fs_readv(fs, f, offs, req->iov, req->iovcnt);
+                if (n < 0) {
+                    err = n;
+                    goto error;
+                }
+                buf_len = p9_pack<P9_RCOUNT>(buf, sizeof(buf), n);
+                virtio_9p_send_reply_data(req, buf, buf_len, NULL, n);
+                break;
+            }
+            if (count > s->msize - 11)
+                count = s->msize - 11;
+            buf1 = virtio_9p_get_data_buf(req, count);
+            n = fs->fs_read(fs, f, offs, buf1, count);
             if (n < 0) {
                 err = n;
-                free(buf);
                 goto error;
             }
-            put_le32(buf, n);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, n + 4);
-            free(buf);
+            buf_len = p9_pack<P9_RCOUNT>(buf, sizeof(buf), n);
+            virtio_9p_send_reply_data(req, buf, buf_len, buf1, n);
         }
         break;
     case 118: /* write */
         {
             uint32_t fid, count;
             uint64_t offs;
-            uint8_t *buf1;
             int n;
             FSFile *f;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wdw", &fid, &offs, &count))
+            if (p9_unpack<P9_TREAD>(req, &offset, &fid, &offs, &count))
                 goto protocol_error;
-            f = fid_find(s, fid);
+            f = fid_find(s, req, fid);
             if (!f)
                 goto fid_not_found;
-            buf1 = (uint8_t*)malloc(count);
-            if (memcpy_from_queue(s1, buf1, queue_idx, desc_idx, offset,
-                                  count)) {
-                free(buf1);
-                goto protocol_error;
+            if (req->iovcnt >= 0) {
+                /* write directly from the guest buffers */
+                n = fs->fs_writev(fs, f, offs, req->iov, req->iovcnt);
+            } else {
+                if ((int64_t)offset + count > req->msg_len)
+                    goto protocol_error;
+                n = fs->fs_write(fs, f, offs, req->msg + offset, count);
             }
-            n = fs->fs_write(fs, f, offs, buf1, count);
-            free(buf1);
             if (n < 0) {
                 err = n;
                 goto error;
             }
-            buf_len = marshall(s, buf, sizeof(buf), "w", n);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            buf_len = p9_pack<P9_RCOUNT>(buf, sizeof(buf), n);
+            virtio_9p_send_reply(req, buf, buf_len);
         }
         break;
     case 120: /* clunk */
         {
             uint32_t fid;
             
-            if (unmarshall(s, queue_idx, desc_idx, &offset, 
+            if (unmarshall(req, &offset, 
                            "w", &fid))
                 goto protocol_error;
             fid_delete(s, fid);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+            virtio_9p_send_reply(req, NULL, 0);
         }
         break;
     default:
         printf("9p: unsupported operation id=%d\n", id);
         goto protocol_error;
     }
-    return 0;
+    return;
  error:
-    virtio_9p_send_error(s, queue_idx, desc_idx, tag, err);
-    return 0;
+    virtio_9p_send_error(req, err);
+    return;
  protocol_error:
  fid_not_found:
     err = -P9_EPROTO;
     goto error;
 }
 
+static void virtio_9p_req_exec(void *opaque)
+{
+    virtio_9p_handle_request((P9Request *)opaque);
+}
+
+/* simulator thread */
+static void virtio_9p_req_done(void *opaque)
+{
+    P9Request *req = (P9Request *)opaque;
+    VIRTIO9PDevice *s = req->dev;
+
+    switch(__atomic_load_n(&req->open_state, __ATOMIC_ACQUIRE)) {
+    case P9_OPEN_WAIT:
+        /* completed by virtio_9p_complete_opens() */
+        req->exec_done = TRUE;
+        break;
+    case P9_OPEN_REPLIED:
+        __atomic_sub_fetch(&s->nb_open_replied, 1, __ATOMIC_RELAXED);
+        req->open_state = P9_OPEN_NONE;
+        /* fall through */
+    default:
+        virtio_9p_req_complete(req);
+        break;
+    }
+}
+
+/* complete the lopen requests whose fs_open() callback was called after
+   virtio_9p_req_done() */
+static void virtio_9p_complete_opens(VIRTIO9PDevice *s)
+{
+    P9Request *req;
+    int i;
+
+    if (__atomic_load_n(&s->nb_open_replied, __ATOMIC_ACQUIRE) == 0)
+        return;
+    for(i = 0; i < (int)s->queue_num_max; i++) {
+        req = &s->req[i];
+        if (req->exec_done &&
+            __atomic_load_n(&req->open_state, __ATOMIC_ACQUIRE) ==
+            P9_OPEN_REPLIED) {
+            req->exec_done = FALSE;
+            virtio_9p_req_done(req);
+        }
+    }
+}
+
+/* extend the copy of the message to its first 'len' bytes. Return < 0
+   if error. */
+static int virtio_9p_req_copy_msg(P9Request *req, int len)
+{
+    VIRTIO9PDevice *s = req->dev;
+    int pos = req->msg_len;
+
+    if (len <= pos)
+        return 0;
+    if (len > req->msg_size) {
+        req->msg = (uint8_t *)realloc(req->msg, len);
+        req->msg_size = len;
+    }
+    req->msg_len = len;
+    return memcpy_from_queue(s, req->msg + pos, req->queue_idx, req->desc_idx,
+                             pos, len - pos);
+}
+
+/* map the payload of a read or write message to the guest buffers */
+static void virtio_9p_req_map_payload(P9Request *req)
+{
+    VIRTIO9PDevice *s = req->dev;
+    FSDevice *fs = s->fs;
+    int max_iov, count;
+
+    /* size[4] id[1] tag[2] fid[4] offset[8] count[4] */
+    if (req->msg_len < 23)
+        return;
+    count = get_le32(req->msg + 19);
+    if (count < 0)
+        return;
+    /* larger payloads are copied */
+    max_iov = min_int(s->max_msize / DMA_PAGE_SIZE + 2, IOV_MAX);
+    if (!req->iov)
+        req->iov = (struct iovec *)malloc(sizeof(req->iov[0]) * max_iov);
+    if (req->id == 116 && fs->fs_readv) {
+        /* the reply must fit in msize */
+        if ((uint32_t)count > s->msize - 11)
+            count = s->msize - 11;
+        /* after size[4] id[1] tag[2] count[4] in the reply */
+        req->iovcnt = virtio_queue_get_iov(s, req->iov, max_iov,
+                                           req->queue_idx, req->desc_idx,
+                                           11, count, TRUE);
+    } else if (req->id == 118 && fs->fs_writev) {
+        req->iovcnt = virtio_queue_get_iov(s, req->iov, max_iov,
+                                           req->queue_idx, req->desc_idx,
+                                           23, count, FALSE);
+    }
+}
+
+static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
+                                   int desc_idx, int read_size,
+                                   int write_size)
+{
+    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
+    P9Request *req, *req1;
+    uint16_t oldtag;
+
+    if (queue_idx != 0)
+        return 0;
+
+    req = &s->req[desc_idx];
+    req->queue_idx = queue_idx;
+    req->desc_idx = desc_idx;
+    req->iovcnt = -1;
+    req->nb_files = 0;
+    req->open_state = P9_OPEN_NONE;
+    req->exec_done = FALSE;
+    req->flush_req = NULL;
+    req->msg_len = 0;
+    req->stats_op = 0;
+    if (s->stats) {
+        req->start_tick = s->tick_count;
+        req->start_ns = stats_get_ns();
+        stats_start(s->stats);
+    }
+    /* the header and the fixed fields of a read or write are copied
+       together, then the rest of the message is appended */
+    if (virtio_9p_req_copy_msg(req, min_int(read_size, 23)) ||
+        req->msg_len < 7) {
+        req->id = 0;
+        req->tag = 0;
+        goto protocol_error;
+    }
+    req->id = req->msg[4];
+    req->tag = get_le16(req->msg + 5);
+    req->stats_op = req->id;
+    if ((uint32_t)read_size > s->max_msize)
+        goto protocol_error;
+
+    if (req->id == 118) {
+        /* the payload is copied only if it is not in host RAM */
+        virtio_9p_req_map_payload(req);
+        if (req->iovcnt < 0 && virtio_9p_req_copy_msg(req, read_size))
+            goto protocol_error;
+    } else {
+        if (virtio_9p_req_copy_msg(req, read_size))
+            goto protocol_error;
+        if (req->id == 116)
+            virtio_9p_req_map_payload(req);
+    }
+
+    if (req->id == 108) {
+        /* flush: answered after the flushed request */
+        if (req->msg_len < 9)
+            goto protocol_error;
+        oldtag = get_le16(req->msg + 7);
+        virtio_9p_send_reply(req, NULL, 0);
+        req1 = s->tags[oldtag];
+        if (!req1 || req1 == req) {
+            virtio_9p_req_complete(req);
+        } else {
+            while (req1->flush_req)
+                req1 = req1->flush_req;
+            req1->flush_req = req;
+        }
+        return 0;
+    }
+
+    if (req->tag != P9_NOTAG)
+        s->tags[req->tag] = req;
+    if (req->id == 100 && s->wq) {
+        /* version changes msize, which the other requests read: it is
+           executed once they are finished */
+        workqueue_drain(s->wq);
+        virtio_9p_handle_request(req);
+        virtio_9p_req_done(req);
+    } else if (s->wq) {
+        workqueue_submit(s->wq, &req->work, virtio_9p_req_exec,
+                         virtio_9p_req_done, req);
+    } else {
+        virtio_9p_handle_request(req);
+        virtio_9p_req_done(req);
+    }
+    return 0;
+ protocol_error:
+    virtio_9p_send_error(req, -P9_EPROTO);
+    virtio_9p_req_complete(req);
+    return 0;
+}
+
+static void virtio_9p_tick(VIRTIODevice *s1)
+{
+    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
+
+    if (s->wq)
+        workqueue_poll(s->wq);
+    virtio_9p_complete_opens(s);
+}
+
+static void virtio_9p_drain(VIRTIODevice *s1)
+{
+    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
+
+    if (s->wq)
+        workqueue_drain(s->wq);
+    virtio_9p_complete_opens(s);
+}
+
+/* msize[4], then for each fid: 1[1] fid[4] len[4] followed by the
+   fs_save_file() record, and 0[1]. The host locks are not saved. */
+static void virtio_9p_save(VIRTIODevice *s1, CheckpointFile *cp)
+{
+    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
+    FSDevice *fs = s->fs;
+    uint8_t buf[FS_FILE_STATE_MAX];
+    struct list_head *el;
+    FIDDesc *f;
+    int i, len;
+
+    checkpoint_put_u32(cp, s->msize);
+    pthread_mutex_lock(&s->fid_lock);
+    for(i = 0; i < (1 << s->fid_hash_bits); i++) {
+        list_for_each(el, &s->fid_hash[i]) {
+            f = list_entry(el, FIDDesc, link);
+            len = fs->fs_save_file ? fs->fs_save_file(fs, f->file->fd, buf,
+                                                            sizeof(buf)) : -1;
+            if (len < 0) {
+                fprintf(stderr, "virtio9p: fid %u cannot be saved\n", f->fid);
+                continue;
+            }
+            checkpoint_put_u8(cp, 1);
+            checkpoint_put_u32(cp, f->fid);
+            checkpoint_put_u32(cp, len);
+            checkpoint_put(cp, buf, len);
+        }
+    }
+    pthread_mutex_unlock(&s->fid_lock);
+    checkpoint_put_u8(cp, 0);
+}
+
+static void virtio_9p_load(VIRTIODevice *s1, CheckpointFile *cp)
+{
+    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
+    FSDevice *fs = s->fs;
+    uint8_t buf[FS_FILE_STATE_MAX];
+    uint32_t fid, len;
+    FSFile *fd;
+
+    s->msize = checkpoint_get_u32(cp);
+    if (s->msize < MIN_9P_MSIZE || s->msize > s->max_msize) {
+        checkpoint_fail(cp, "invalid msize %u", s->msize);
+        return;
+    }
+    while (checkpoint_get_u8(cp) == 1) {
+        fid = checkpoint_get_u32(cp);
+        len = checkpoint_get_u32(cp);
+        if (len > sizeof(buf)) {
+            checkpoint_fail(cp, "invalid fid record");
+            return;
+        }
+        checkpoint_get(cp, buf, len);
+        if (cp->error)
+            return;
+        fd = fs->fs_restore_file ? fs->fs_restore_file(fs, buf, len) : NULL;
+        if (!fd) {
+            /* the guest gets an error when it uses the fid */
+            fprintf(stderr, "virtio9p: fid %u cannot be restored\n", fid);
+            continue;
+        }
+        fid_set(s, fid, fd);
+    }
+}
+
 VIRTIODevice *virtio_9p_init(VIRTIOBusDef *bus, FSDevice *fs,
-                             const char *mount_tag, const simif_t* sim)
+                             const char *mount_tag, uint32_t max_msize,
+                             int nb_threads, const simif_t* sim)
 
 {
     VIRTIO9PDevice *s;
@@ -2089,7 +3455,7 @@ VIRTIODevice *virtio_9p_init(VIRTIOBusDef *bus, FSDevice *fs,
     s = (VIRTIO9PDevice*)mallocz(sizeof(*s));
     virtio_init(s, bus,
                 9, 2 + len, virtio_9p_recv_request, sim);
-    s->device_features = 1 << 0;
+    s->device_features |= 1 << 0;
 
     /* set the mount tag */
     cfg = s->config_space;
@@ -2107,84 +3473,179 @@ VIRTIODevice *virtio_9p_init(VIRTIOBusDef *bus, FSDevice *fs,
 
     s->fs = fs;
     s->msize = 8192;
-    init_list_head(&s->fid_list);
+    if (max_msize == 0)
+        max_msize = DEFAULT_9P_MSIZE;
+    s->max_msize = min_int(max_int(max_msize, MIN_9P_MSIZE), MAX_9P_MSIZE);
+    fid_hash_resize(s, FID_HASH_BITS_MIN);
+    init_list_head(&s->fid_free_list);
+    pthread_mutex_init(&s->fid_lock, NULL);
+    s->req = (P9Request *)mallocz(sizeof(P9Request) * s->queue_num_max);
+    for(int i = 0; i < (int)s->queue_num_max; i++)
+        s->req[i].dev = s;
+    s->tags = (P9Request **)mallocz(sizeof(s->tags[0]) * 65536);
+    virtio_stats_init(s, bus, 256);
+    if (s->stats) {
+        for(const Virtio9POPName *p = virtio_9p_op_names; p->name; p++)
+            stats_set_op_name(s->stats, p->tag, p->name);
+    }
+    if (nb_threads > 0)
+        s->wq = workqueue_new(nb_threads);
+    s->device_tick = virtio_9p_tick;
+    s->device_drain = virtio_9p_drain;
+    s->device_save = virtio_9p_save;
+    s->device_load = virtio_9p_load;
 
     return (VIRTIODevice *)s;
 }
 
+reg_t virtio_mmio_base(int type, int idx)
+{
+    return VIRTIO_MMIO_BASE + (reg_t)(idx * VIRTIO_MAX_TYPES + type) * VIRTIO_SIZE;
+}
+
+uint32_t virtio_mmio_irq(int type, int idx)
+{
+    return 1 + idx * VIRTIO_MAX_TYPES + type;
+}
+
+std::string virtio_generate_dts(const char *label, int type, int idx)
+{
+  std::stringstream s;
+  reg_t base = virtio_mmio_base(type, idx);
+  reg_t size = VIRTIO_SIZE;
+
+  s << std::hex
+    << "    " << label << std::dec << idx << ": virtio@" << std::hex << base << " {\n"
+    << "      compatible = \"virtio,mmio\";\n"
+       "      interrupt-parent = <&PLIC>;\n"
+       "      interrupts = <" << std::dec << virtio_mmio_irq(type, idx);
+  s << std::hex << ">;\n"
+       "      reg = <0x" << (base >> 32) << " 0x" << (base & (uint32_t)-1) <<
+                   " 0x" << (size >> 32) << " 0x" << (size & (uint32_t)-1) << ">;\n"
+       "    };\n";
+  return s.str();
+}
+
+/* the instances are recognized by their address, so that the devices of
+   different types do not take each other's nodes */
+int fdt_parse_virtio(const void *fdt, int type, int idx,
+                     reg_t *addr, uint32_t *irq)
+{
+  int nodeoffset, rc, len;
+  const fdt32_t *reg_p;
+  reg_t base = virtio_mmio_base(type, idx);
+
+  nodeoffset = -1;
+  for(;;) {
+    nodeoffset = fdt_node_offset_by_compatible(fdt, nodeoffset, "virtio,mmio");
+    if (nodeoffset < 0)
+      return nodeoffset;
+    rc = fdt_get_node_addr_size(fdt, nodeoffset, addr, NULL, "reg");
+    if (rc == 0 && *addr == base)
+      break;
+  }
+
+  reg_p = (fdt32_t *)fdt_getprop(fdt, nodeoffset, "interrupts", &len);
+  if (reg_p)
+    *irq = fdt32_to_cpu(*reg_p);
+  else
+    *irq = virtio_mmio_irq(type, idx);
+  return 0;
+}
+
 virtio_base_t::virtio_base_t(
       const simif_t* sim,
       abstract_interrupt_controller_t *intctrl,
       uint32_t interrupt_id,
       std::vector<std::string> sargs)
   : sim(sim), intctrl(intctrl), interrupt_id(interrupt_id)
-{}
+{
+  std::map<std::string, std::string> argmap;
+
+  for (auto arg : sargs) {
+    size_t eq_idx = arg.find('=');
+    if (eq_idx != std::string::npos) {
+      argmap.insert(std::pair<std::string, std::string>(arg.substr(0, eq_idx), arg.substr(eq_idx+1)));
+    }
+  }
+
+  // options common to all the virtio devices
+  auto it = argmap.find("queue_size");
+  if (it != argmap.end()) {
+    queue_size = atoi(it->second.c_str());
+    if (queue_size <= 0 || queue_size > MAX_QUEUE_NUM ||
+        (queue_size & (queue_size - 1)) != 0) {
+      printf("Virtio device plugin INIT ERROR: `queue_size` must be a power of 2, at most %d.\n",
+             MAX_QUEUE_NUM);
+      exit(1);
+    }
+  }
+
+  it = argmap.find("irq_batch");
+  if (it != argmap.end())
+    irq_batch = atoi(it->second.c_str());
+  it = argmap.find("irq_delay");
+  if (it != argmap.end())
+    irq_delay = atoi(it->second.c_str());
+  if (irq_batch < 0 || irq_delay < 0) {
+    printf("Virtio device plugin INIT ERROR: `irq_batch` and `irq_delay` must not be negative.\n");
+    exit(1);
+  }
+
+  it = argmap.find("stats");
+  if (it != argmap.end())
+    stats_file = it->second;
+
+  it = argmap.find("checkpoint");
+  if (it != argmap.end()) {
+    checkpoint_file = it->second;
+    checkpoint_init();
+  }
+  it = argmap.find("restore");
+  if (it != argmap.end())
+    restore_file = it->second;
+}
 
 virtio_base_t::~virtio_base_t() {
 
 }
 
 bool virtio_base_t::load(reg_t addr, size_t len, uint8_t *bytes) {
-    if (len > 8) return false;
-
-    if (len == 1) {
-        // virtio_mmio_read will not return correct value here.
-        uint8_t val = virtio_mmio_read(virtio_dev, addr, 0);
-        read_little_endian_reg(val, 0, len, bytes);
-        return true;
-    }
-    else if (len == 2) {
-        // virtio_mmio_read will not return correct value here.
-        uint16_t val = virtio_mmio_read(virtio_dev, addr, 1);
-        read_little_endian_reg(val, 0, len, bytes);
-        return true;
-    }
-    else if (len == 4) {
-        uint32_t val = virtio_mmio_read(virtio_dev, addr, 2);
-        read_little_endian_reg(val, 0, len, bytes);
-    }
-    else if (len == 8) {
-        uint64_t low = virtio_mmio_read(virtio_dev, addr, 2);
-        uint64_t high = virtio_mmio_read(virtio_dev, addr+4, 2);
-        read_little_endian_reg(low | (high << 32), 0, len, bytes);
-    }
-    else {
+    if (len == 0 || len > 8 || (len & (len - 1)) != 0)
         return false;
-    }
-
+    uint64_t val = virtio_mmio_read_table[ctz32(len)](virtio_dev, addr);
+    read_little_endian_reg(val, 0, len, bytes);
     return true;
+}
+
+void virtio_base_t::tick(reg_t rtc_ticks) {
+    virtio_tick(virtio_dev);
+    if (!checkpoint_file.empty() && checkpoint_requested(&checkpoint_count))
+        checkpoint_save(checkpoint_file.c_str());
+}
 
+bool virtio_base_t::checkpoint_save(const char *filename) {
+    CheckpointFile *cp = checkpoint_create(filename, "virtio");
+    if (!cp)
+        return false;
+    virtio_save(virtio_dev, cp);
+    return checkpoint_close(cp) == 0;
+}
+
+bool virtio_base_t::checkpoint_restore(const char *filename) {
+    CheckpointFile *cp = checkpoint_open(filename, "virtio");
+    if (!cp)
+        return false;
+    virtio_load(virtio_dev, cp);
+    return checkpoint_close(cp) == 0;
 }
 
 bool virtio_base_t::store(reg_t addr, size_t len, const uint8_t *bytes) {
-    if (len > 8) return false;
-
-    if (len == 1) {
-        uint8_t val;
-        write_little_endian_reg(&val, 0, len, bytes);
-        virtio_mmio_write(virtio_dev, addr, val, 0);
-        return true;
-    }
-    else if (len == 2) {
-        uint16_t val;
-        write_little_endian_reg(&val, 0, len, bytes);
-        virtio_mmio_write(virtio_dev, addr, val, 1);
-        return true;
-    }
-    else if (len == 4) {
-        uint32_t val;
-        write_little_endian_reg(&val, 0, len, bytes);
-        virtio_mmio_write(virtio_dev, addr, val, 2);
-    }
-    else if (len == 8) {
-        uint64_t val;
-        write_little_endian_reg(&val, 0, len, bytes);
-        virtio_mmio_write(virtio_dev, addr, val & 0xffffffff, 2);
-        virtio_mmio_write(virtio_dev, addr+4, (val >> 32) & 0xffffffff, 2);
-    }
-    else {
-        return false;   
-    }
+    if (len == 0 || len > 8 || (len & (len - 1)) != 0)
+        return false;
+    uint64_t val = 0;
+    write_little_endian_reg(&val, 0, len, bytes);
+    virtio_mmio_write_table[ctz32(len)](virtio_dev, addr, val);
     return true;
 }
 
@@ -25,6 +25,7 @@
 #define VIRTIO_H
 
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <riscv/abstract_device.h>
 #include <riscv/simif.h>
 #include <riscv/abstract_interrupt_controller.h>
@@ -34,9 +35,25 @@
 #include <riscv/sim.h>
 #include <riscv/dts.h>
 #include <fdt/libfdt.h>
+#include "cutils.h"
+#include "block_device.h"
 
 #define VIRTIO_SIZE      0x1000
 
+/* MMIO layout: the instance 'idx' of a device type uses the slot
+   idx * VIRTIO_MAX_TYPES + type, i.e. the register window at
+   VIRTIO_MMIO_BASE + slot * VIRTIO_SIZE and the interrupt 1 + slot. The
+   first instances keep the historical addresses and interrupts. */
+#define VIRTIO_MMIO_BASE 0x40010000
+#define VIRTIO_MAX_TYPES 4
+#define VIRTIO_MAX_INSTANCES 7 /* the interrupts must fit in the PLIC */
+
+enum {
+    VIRTIO_TYPE_BLOCK,
+    VIRTIO_TYPE_9P,
+    VIRTIO_TYPE_NET,
+};
+
 #define VIRTIO_PAGE_SIZE 4096
 
 #if defined(EMSCRIPTEN)
@@ -69,6 +86,11 @@ typedef struct {
     /* MMIO only: */
     uint64_t addr;
     IRQSpike *irq;
+    int queue_num_max; /* largest queue size, 0 for the default */
+    int irq_batch; /* used elements published at once, 0 = no limit */
+    int irq_delay; /* ticks a used element may wait before publication */
+    const char *stats_name; /* device instance name in the statistics */
+    const char *stats_file; /* NULL if no statistics */
 } VIRTIOBusDef;
 
 struct VIRTIODevice; 
@@ -80,43 +102,55 @@ void virtio_set_debug(VIRTIODevice *s, int debug_flags);
 
 /* block device */
 
-typedef void BlockDeviceCompletionFunc(VIRTIODevice *opaque, int ret);
-
-struct BlockDevice ;
-struct BlockDeviceFile;
-
-typedef enum {
-    BF_MODE_RO,
-    BF_MODE_RW,
-    BF_MODE_SNAPSHOT,
-} BlockDeviceModeEnum;
-
-typedef struct BlockDeviceFile {
-    FILE *f;
-    int64_t nb_sectors;
-    BlockDeviceModeEnum mode;
-    uint8_t **sector_table;
-} BlockDeviceFile;
-
-
-struct BlockDevice {
-    int64_t (*get_sector_count)(BlockDevice *bs);
-    int (*read_async)(BlockDevice *bs,
-                      uint64_t sector_num, uint8_t *buf, int n,
-                      BlockDeviceCompletionFunc *cb, VIRTIODevice *opaque);
-    int (*write_async)(BlockDevice *bs,
-                       uint64_t sector_num, const uint8_t *buf, int n,
-                       BlockDeviceCompletionFunc *cb, VIRTIODevice *opaque);
-    BlockDeviceFile *opaque;
+/* 'num_queues' request queues, at most 8 */
+VIRTIODevice *virtio_block_init(VIRTIOBusDef *bus, BlockDevice *bs,
+                                int num_queues, const simif_t* sim);
+
+/* network device */
+
+/* host side of a network device. The packets are Ethernet frames
+   without the virtio header. */
+typedef struct EthernetDevice EthernetDevice;
+
+struct EthernetDevice {
+    uint8_t mac_addr[6]; /* of the guest */
+    /* send a frame of the guest, read from its buffers. Return < 0 if
+       it was dropped. */
+    int (*write_packet)(EthernetDevice *net, const struct iovec *iov,
+                        int iovcnt);
+    /* receive the next frame directly into the guest buffers. Return its
+       length, 0 if there is none or < 0 if error. A frame larger than
+       the buffers is truncated, and the returned length may be the one
+       of the whole frame: such a frame is dropped. */
+    int (*read_packet)(EthernetDevice *net, const struct iovec *iov,
+                       int iovcnt);
+    /* FALSE if read_packet() would return 0. Called on every tick, so
+       it must not make a system call. */
+    BOOL (*can_read)(EthernetDevice *net);
+    void (*close)(EthernetDevice *net);
+    void *opaque;
 };
 
-BlockDevice *block_device_init(const char *filename, BlockDeviceModeEnum mode);
-VIRTIODevice *virtio_block_init(VIRTIOBusDef *bus, BlockDevice *bs, const simif_t* sim);
+/* frames of at most 'mtu' bytes of payload, one RX and one TX queue */
+VIRTIODevice *virtio_net_init(VIRTIOBusDef *bus, EthernetDevice *net,
+                              int mtu, const simif_t* sim);
 
 struct FSDevice;
 
-VIRTIODevice *virtio_9p_init(VIRTIOBusDef *bus, FSDevice *fs, const char *mount_tag, const simif_t* sim);
-
+/* messages up to 'max_msize' bytes (0 for the default). If 'nb_threads'
+   > 0, the requests are executed on a pool of host threads. */
+VIRTIODevice *virtio_9p_init(VIRTIOBusDef *bus, FSDevice *fs,
+                             const char *mount_tag, uint32_t max_msize,
+                             int nb_threads, const simif_t* sim);
+
+reg_t virtio_mmio_base(int type, int idx);
+uint32_t virtio_mmio_irq(int type, int idx);
+/* DTS node of the instance 'idx' of a device type */
+std::string virtio_generate_dts(const char *label, int type, int idx);
+/* find the node of the instance 'idx' of a device type in 'fdt'. Return
+   < 0 if not found. */
+int fdt_parse_virtio(const void *fdt, int type, int idx,
+                     reg_t *addr, uint32_t *irq);
 
 class virtio_base_t : public abstract_device_t {
 public:
@@ -128,6 +162,10 @@ public:
   ~virtio_base_t();
   bool load(reg_t addr, size_t len, uint8_t* bytes) override;
   bool store(reg_t addr, size_t len, const uint8_t* bytes) override;
+  void tick(reg_t rtc_ticks) override;
+  // device state without the guest RAM, return false if error
+  bool checkpoint_save(const char *filename);
+  bool checkpoint_restore(const char *filename);
 private:
   const simif_t* sim;
   abstract_interrupt_controller_t *intctrl;
@@ -136,6 +174,13 @@ private:
 protected:
   VIRTIODevice* virtio_dev;
   IRQSpike* irq;
+  int queue_size = 0; // `queue_size` argument, 0 if not given
+  int irq_batch = 0;  // `irq_batch` argument
+  int irq_delay = 0;  // `irq_delay` argument
+  std::string stats_file; // `stats` argument, empty if not given
+  std::string checkpoint_file; // `checkpoint` argument, written on SIGUSR2
+  std::string restore_file; // `restore` argument, read by the constructor
+  int checkpoint_count = 0;
 };
 
 
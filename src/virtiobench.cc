@@ -0,0 +1,790 @@
+/*
+ * Virtqueue benchmark
+ *
+ * Drive the virtio block and 9p devices of virtio_base.o through their
+ * MMIO registers, as a guest driver would. The vrings and the buffers are
+ * in a flat host buffer standing for the guest RAM, behind a minimal
+ * simif_t, so that the measure covers the descriptor processing, the
+ * copies and the backends, but not the simulated harts.
+ *
+ * Each run makes as many requests available as the queue can hold, each
+ * one a chain of a header, 'chain' data descriptors sharing the payload
+ * and a status or reply descriptor, notifies the queue and waits for the
+ * used index. This is repeated for the given duration.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <vector>
+#include <string>
+
+#include "virtio.h"
+#include "fs.h"
+#include "block_device.h"
+#include "stats.h"
+#include "cutils.h"
+
+/* virtio-mmio registers used by the driver */
+#define MMIO_DEVICE_FEATURES     0x010
+#define MMIO_DEVICE_FEATURES_SEL 0x014
+#define MMIO_DRIVER_FEATURES     0x020
+#define MMIO_DRIVER_FEATURES_SEL 0x024
+#define MMIO_QUEUE_SEL           0x030
+#define MMIO_QUEUE_NUM           0x038
+#define MMIO_QUEUE_READY         0x044
+#define MMIO_QUEUE_NOTIFY        0x050
+#define MMIO_INTERRUPT_STATUS    0x060
+#define MMIO_INTERRUPT_ACK       0x064
+#define MMIO_STATUS              0x070
+#define MMIO_QUEUE_DESC_LOW      0x080
+#define MMIO_QUEUE_DESC_HIGH     0x084
+#define MMIO_QUEUE_AVAIL_LOW     0x090
+#define MMIO_QUEUE_AVAIL_HIGH    0x094
+#define MMIO_QUEUE_USED_LOW      0x0a0
+#define MMIO_QUEUE_USED_HIGH     0x0a4
+
+#define VRING_DESC_F_NEXT  1
+#define VRING_DESC_F_WRITE 2
+
+#define MAX_QUEUE_SIZE 1024 /* largest queue_size of the devices */
+
+/* guest RAM layout */
+#define RAM_BASE      0x80000000
+#define RING_DESC     0x0000
+#define RING_AVAIL    0x4000
+#define RING_USED     0x5000
+#define CTRL_BASE     0x8000 /* per request header and status */
+#define CTRL_SIZE     512
+#define CTRL_IN       256 /* offset of the device writable part */
+#define DATA_BASE     (CTRL_BASE + CTRL_SIZE * MAX_QUEUE_SIZE)
+/* payload of a request slot, page aligned */
+#define DATA_SLOT_SIZE(size) (((reg_t)(size) + 4095) & ~(reg_t)4095)
+
+#define SECTOR_SIZE   512
+#define BACKING_SIZE  (16 << 20) /* RAM disk and 9p file */
+
+#define P9_FID_ROOT   0
+#define P9_FID_FILE   1
+#define P9_GETATTR_BASIC 0x7ff
+
+typedef enum {
+    OP_BLK_READ,
+    OP_BLK_WRITE,
+    OP_9P_READ,
+    OP_9P_WRITE,
+    OP_9P_GETATTR,
+    OP_COUNT,
+} BenchOpEnum;
+
+static const char *op_names[OP_COUNT] = {
+    "blk-read", "blk-write", "9p-read", "9p-write", "9p-getattr",
+};
+
+/* guest RAM without harts: only the DMA of the devices accesses it */
+class bench_sim_t : public simif_t {
+public:
+  bench_sim_t(size_t size) : ram_size(size) {
+    ram = (uint8_t *)mallocz(size);
+    debug_mmu = NULL; // every device access hits the RAM
+  }
+  ~bench_sim_t() { free(ram); }
+  char* addr_to_mem(reg_t paddr) override {
+    if (paddr < RAM_BASE || paddr - RAM_BASE >= ram_size)
+      return NULL;
+    return (char *)ram + (paddr - RAM_BASE);
+  }
+  bool mmio_load(reg_t paddr, size_t len, uint8_t* bytes) override { return false; }
+  bool mmio_store(reg_t paddr, size_t len, const uint8_t* bytes) override { return false; }
+  void proc_reset(unsigned id) override {}
+  const std::map<size_t, processor_t*>& get_harts() const override { return harts; }
+  const char* get_symbol(uint64_t paddr) override { return NULL; }
+
+  uint8_t *ptr(reg_t gpa) { return ram + (gpa - RAM_BASE); }
+
+private:
+  uint8_t *ram;
+  size_t ram_size;
+  std::map<size_t, processor_t*> harts;
+};
+
+class bench_intctrl_t : public abstract_interrupt_controller_t {
+public:
+  void set_interrupt_level(uint32_t interrupt_id, int level) override {
+    if (level && !this->level)
+      nb_irqs++;
+    this->level = level;
+  }
+  int level = 0;
+  uint64_t nb_irqs = 0;
+};
+
+/* a virtio device of virtio_base.o on the fake simulator */
+class bench_dev_t : public virtio_base_t {
+public:
+  bench_dev_t(const simif_t* sim, abstract_interrupt_controller_t *intctrl,
+              BlockDevice *bs, FSDevice *fs, uint32_t max_msize,
+              int nb_threads)
+    : virtio_base_t(sim, intctrl, 1, std::vector<std::string>()) {
+    VIRTIOBusDef vbus_s, *vbus = &vbus_s;
+
+    memset(vbus, 0, sizeof(*vbus));
+    irq = new IRQSpike(intctrl, 1);
+    vbus->irq = irq;
+    vbus->queue_num_max = MAX_QUEUE_SIZE;
+    if (bs)
+      virtio_dev = virtio_block_init(vbus, bs, 1, sim);
+    else
+      virtio_dev = virtio_9p_init(vbus, fs, "bench", max_msize,
+                                  nb_threads, sim);
+  }
+  ~bench_dev_t() { delete irq; }
+};
+
+/* synchronous RAM disk, so that the block requests measure the virtqueue */
+typedef struct {
+    uint8_t *data;
+    int64_t nb_sectors;
+} RAMDisk;
+
+static int64_t ramdisk_get_sector_count(BlockDevice *bs)
+{
+    RAMDisk *d = (RAMDisk *)bs->opaque;
+    return d->nb_sectors;
+}
+
+static int ramdisk_read_async(BlockDevice *bs, uint64_t sector_num,
+                              uint8_t *buf, int n,
+                              BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    RAMDisk *d = (RAMDisk *)bs->opaque;
+    if (sector_num + n > (uint64_t)d->nb_sectors)
+        return -1;
+    memcpy(buf, d->data + sector_num * SECTOR_SIZE, n * SECTOR_SIZE);
+    return 0;
+}
+
+static int ramdisk_write_async(BlockDevice *bs, uint64_t sector_num,
+                               const uint8_t *buf, int n,
+                               BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    RAMDisk *d = (RAMDisk *)bs->opaque;
+    if (sector_num + n > (uint64_t)d->nb_sectors)
+        return -1;
+    memcpy(d->data + sector_num * SECTOR_SIZE, buf, n * SECTOR_SIZE);
+    return 0;
+}
+
+static void ramdisk_close(BlockDevice *bs)
+{
+    RAMDisk *d = (RAMDisk *)bs->opaque;
+    free(d->data);
+    free(d);
+    free(bs);
+}
+
+static BlockDevice *ramdisk_init(size_t size)
+{
+    BlockDevice *bs;
+    RAMDisk *d;
+
+    d = (RAMDisk *)mallocz(sizeof(*d));
+    d->data = (uint8_t *)mallocz(size);
+    d->nb_sectors = size / SECTOR_SIZE;
+    bs = (BlockDevice *)mallocz(sizeof(*bs));
+    bs->opaque = d;
+    bs->get_sector_count = ramdisk_get_sector_count;
+    bs->read_async = ramdisk_read_async;
+    bs->write_async = ramdisk_write_async;
+    bs->close = ramdisk_close;
+    return bs;
+}
+
+typedef struct {
+    bench_sim_t *sim;
+    bench_intctrl_t *intctrl;
+    bench_dev_t *dev;
+    int queue_size;
+    uint16_t avail_idx; /* next avail index of the driver */
+    uint16_t used_idx; /* used entries seen by the driver */
+    uint16_t tag;
+} BenchQueue;
+
+static uint32_t mmio_read32(BenchQueue *q, reg_t offset)
+{
+    uint8_t buf[4];
+    q->dev->load(offset, 4, buf);
+    return get_le32(buf);
+}
+
+static void mmio_write32(BenchQueue *q, reg_t offset, uint32_t val)
+{
+    uint8_t buf[4];
+    put_le32(buf, val);
+    q->dev->store(offset, 4, buf);
+}
+
+/* device reset and initialization of the request queue 0, with all the
+   device features accepted */
+static void queue_setup(BenchQueue *q, int queue_size)
+{
+    reg_t addr;
+    int i;
+
+    mmio_write32(q, MMIO_STATUS, 0);
+    mmio_write32(q, MMIO_STATUS, 1 | 2); /* ACKNOWLEDGE | DRIVER */
+    for(i = 0; i < 2; i++) {
+        mmio_write32(q, MMIO_DEVICE_FEATURES_SEL, i);
+        mmio_write32(q, MMIO_DRIVER_FEATURES_SEL, i);
+        mmio_write32(q, MMIO_DRIVER_FEATURES,
+                     mmio_read32(q, MMIO_DEVICE_FEATURES));
+    }
+    mmio_write32(q, MMIO_STATUS, 1 | 2 | 8); /* FEATURES_OK */
+
+    memset(q->sim->ptr(RAM_BASE), 0, CTRL_BASE);
+    mmio_write32(q, MMIO_QUEUE_SEL, 0);
+    mmio_write32(q, MMIO_QUEUE_NUM, queue_size);
+    addr = RAM_BASE + RING_DESC;
+    mmio_write32(q, MMIO_QUEUE_DESC_LOW, addr);
+    mmio_write32(q, MMIO_QUEUE_DESC_HIGH, addr >> 32);
+    addr = RAM_BASE + RING_AVAIL;
+    mmio_write32(q, MMIO_QUEUE_AVAIL_LOW, addr);
+    mmio_write32(q, MMIO_QUEUE_AVAIL_HIGH, addr >> 32);
+    addr = RAM_BASE + RING_USED;
+    mmio_write32(q, MMIO_QUEUE_USED_LOW, addr);
+    mmio_write32(q, MMIO_QUEUE_USED_HIGH, addr >> 32);
+    mmio_write32(q, MMIO_QUEUE_READY, 1);
+    mmio_write32(q, MMIO_STATUS, 1 | 2 | 8 | 4); /* DRIVER_OK */
+
+    q->queue_size = queue_size;
+    q->avail_idx = 0;
+    q->used_idx = 0;
+}
+
+static void desc_set(BenchQueue *q, int idx, reg_t addr, uint32_t len,
+                     uint16_t flags, uint16_t next)
+{
+    uint8_t *p = q->sim->ptr(RAM_BASE + RING_DESC + idx * 16);
+    put_le64(p, addr);
+    put_le32(p + 8, len);
+    put_le16(p + 12, flags);
+    put_le16(p + 14, next);
+}
+
+static void avail_push(BenchQueue *q, int head)
+{
+    uint8_t *p = q->sim->ptr(RAM_BASE + RING_AVAIL);
+    put_le16(p + 4 + (q->avail_idx & (q->queue_size - 1)) * 2, head);
+    q->avail_idx++;
+}
+
+/* publish the available entries, notify and run the device until all
+   of them are used. The driver asks for one interrupt per batch. */
+static void queue_kick(BenchQueue *q)
+{
+    uint8_t *avail = q->sim->ptr(RAM_BASE + RING_AVAIL);
+    uint8_t *used = q->sim->ptr(RAM_BASE + RING_USED);
+
+    put_le16(avail + 4 + q->queue_size * 2, q->avail_idx - 1); /* used_event */
+    put_le16(avail + 2, q->avail_idx);
+    mmio_write32(q, MMIO_QUEUE_NOTIFY, 0);
+    while (get_le16(used + 2) != q->avail_idx)
+        q->dev->tick(1);
+    q->used_idx = q->avail_idx;
+    if (q->intctrl->level)
+        mmio_write32(q, MMIO_INTERRUPT_ACK,
+                     mmio_read32(q, MMIO_INTERRUPT_STATUS));
+}
+
+/* the reply of the last 9p request made on the descriptor chain 0 */
+static uint8_t *p9_call(BenchQueue *q, const uint8_t *msg, int len)
+{
+    reg_t ctrl = RAM_BASE + CTRL_BASE;
+
+    memcpy(q->sim->ptr(ctrl), msg, len);
+    put_le32(q->sim->ptr(ctrl), len);
+    desc_set(q, 0, ctrl, len, VRING_DESC_F_NEXT, 1);
+    desc_set(q, 1, ctrl + CTRL_IN, CTRL_SIZE - CTRL_IN, VRING_DESC_F_WRITE, 0);
+    avail_push(q, 0);
+    queue_kick(q);
+    return q->sim->ptr(ctrl + CTRL_IN);
+}
+
+/* 9p message header: the size is set when sending */
+static int p9_header(uint8_t *buf, int id, uint16_t tag)
+{
+    buf[4] = id;
+    put_le16(buf + 5, tag);
+    return 7;
+}
+
+static int p9_string(uint8_t *buf, const char *str)
+{
+    int len = strlen(str);
+    put_le16(buf, len);
+    memcpy(buf + 2, str, len);
+    return 2 + len;
+}
+
+/* negotiate 'msize' and open the file 'filename' of the export as
+   P9_FID_FILE */
+static int p9_open(BenchQueue *q, uint32_t msize, const char *filename)
+{
+    uint8_t msg[256], *r;
+    int len;
+
+    len = p9_header(msg, 100, 0xffff); /* version */
+    put_le32(msg + len, msize);
+    len += 4;
+    len += p9_string(msg + len, "9P2000.L");
+    r = p9_call(q, msg, len);
+    if (r[4] != 101)
+        return -1;
+
+    len = p9_header(msg, 104, 0); /* attach */
+    put_le32(msg + len, P9_FID_ROOT);
+    put_le32(msg + len + 4, 0xffffffff);
+    len += 8;
+    len += p9_string(msg + len, "");
+    len += p9_string(msg + len, "");
+    put_le32(msg + len, 0);
+    len += 4;
+    r = p9_call(q, msg, len);
+    if (r[4] != 105)
+        return -1;
+
+    len = p9_header(msg, 110, 0); /* walk */
+    put_le32(msg + len, P9_FID_ROOT);
+    put_le32(msg + len + 4, P9_FID_FILE);
+    put_le16(msg + len + 8, 1);
+    len += 10;
+    len += p9_string(msg + len, filename);
+    r = p9_call(q, msg, len);
+    if (r[4] != 111 || get_le16(r + 7) != 1)
+        return -1;
+
+    len = p9_header(msg, 12, 0); /* lopen */
+    put_le32(msg + len, P9_FID_FILE);
+    put_le32(msg + len + 4, O_RDWR);
+    len += 8;
+    r = p9_call(q, msg, len);
+    if (r[4] != 13)
+        return -1;
+    return 0;
+}
+
+typedef struct {
+    BenchOpEnum op;
+    int queue_size;
+    int chain; /* data descriptors per request */
+    int size; /* payload bytes per request */
+    double duration; /* seconds */
+} BenchConfig;
+
+static BOOL op_has_data(BenchOpEnum op)
+{
+    return op != OP_9P_GETATTR;
+}
+
+static int request_nb_desc(const BenchConfig *c)
+{
+    /* header and status or reply */
+    return 2 + (op_has_data(c->op) ? c->chain : 0);
+}
+
+typedef struct {
+    reg_t addr;
+    uint32_t len;
+    BOOL write; /* written by the device */
+} BenchSeg;
+
+static void seg_add(BenchSeg *segs, int *n, reg_t addr, uint32_t len,
+                    BOOL write)
+{
+    segs[*n].addr = addr;
+    segs[*n].len = len;
+    segs[*n].write = write;
+    (*n)++;
+}
+
+/* chain the header, the 'chain' payload descriptors and the status or
+   reply of the request slot 'i'. Return its head. */
+static int request_build(BenchQueue *q, const BenchConfig *c, int i)
+{
+    BenchSeg segs[MAX_QUEUE_SIZE];
+    int head = i * request_nb_desc(c);
+    reg_t ctrl = RAM_BASE + CTRL_BASE + i * CTRL_SIZE;
+    reg_t data = RAM_BASE + DATA_BASE +
+        i * DATA_SLOT_SIZE(c->size);
+    reg_t status = ctrl + CTRL_IN;
+    int n, j, l, pos;
+    BOOL data_write;
+
+    n = 0;
+    switch(c->op) {
+    case OP_BLK_READ:
+    case OP_BLK_WRITE:
+        seg_add(segs, &n, ctrl, 16, FALSE);
+        break;
+    case OP_9P_READ:
+        seg_add(segs, &n, ctrl, 23, FALSE);
+        seg_add(segs, &n, status, 11, TRUE);
+        break;
+    case OP_9P_WRITE:
+        seg_add(segs, &n, ctrl, 23, FALSE);
+        break;
+    default:
+        seg_add(segs, &n, ctrl, 19, FALSE);
+        break;
+    }
+    if (op_has_data(c->op)) {
+        data_write = c->op == OP_BLK_READ || c->op == OP_9P_READ;
+        pos = 0;
+        for(j = 0; j < c->chain; j++) {
+            l = c->size / c->chain;
+            if (j == c->chain - 1)
+                l = c->size - pos;
+            seg_add(segs, &n, data + pos, l, data_write);
+            pos += l;
+        }
+    }
+    switch(c->op) {
+    case OP_BLK_READ:
+    case OP_BLK_WRITE:
+        seg_add(segs, &n, status, 1, TRUE);
+        break;
+    case OP_9P_READ:
+        break;
+    case OP_9P_WRITE:
+        seg_add(segs, &n, status, 11, TRUE);
+        break;
+    default:
+        seg_add(segs, &n, status, CTRL_SIZE - CTRL_IN, TRUE);
+        break;
+    }
+
+    for(j = 0; j < n; j++) {
+        desc_set(q, head + j, segs[j].addr, segs[j].len,
+                 (segs[j].write ? VRING_DESC_F_WRITE : 0) |
+                 (j < n - 1 ? VRING_DESC_F_NEXT : 0), head + j + 1);
+    }
+    return head;
+}
+
+static uint64_t backing_size = BACKING_SIZE;
+
+/* header of the request slot 'i', at position 'seq' of the sequential
+   access pattern */
+static void request_set_header(BenchQueue *q, const BenchConfig *c, int i,
+                               uint64_t seq)
+{
+    uint8_t *p = q->sim->ptr(RAM_BASE + CTRL_BASE + i * CTRL_SIZE);
+    uint64_t nb_pos, pos;
+
+    nb_pos = c->size ? backing_size / c->size : 1;
+    pos = (seq % nb_pos) * c->size;
+    switch(c->op) {
+    case OP_BLK_READ:
+    case OP_BLK_WRITE:
+        put_le32(p, c->op == OP_BLK_WRITE); /* VIRTIO_BLK_T_OUT */
+        put_le32(p + 4, 0);
+        put_le64(p + 8, pos / SECTOR_SIZE);
+        break;
+    case OP_9P_READ:
+    case OP_9P_WRITE:
+        put_le32(p, 23 + (c->op == OP_9P_WRITE ? c->size : 0));
+        p9_header(p, c->op == OP_9P_READ ? 116 : 118, q->tag++);
+        put_le32(p + 7, P9_FID_FILE);
+        put_le64(p + 11, pos);
+        put_le32(p + 19, c->size);
+        break;
+    default:
+        put_le32(p, 19);
+        p9_header(p, 24, q->tag++);
+        put_le32(p + 7, P9_FID_FILE);
+        put_le64(p + 11, P9_GETATTR_BASIC);
+        break;
+    }
+}
+
+/* payload bytes of the completed request slot 'i', < 0 if error */
+static int64_t request_result(BenchQueue *q, const BenchConfig *c, int i)
+{
+    uint8_t *p = q->sim->ptr(RAM_BASE + CTRL_BASE + i * CTRL_SIZE);
+    uint8_t *r = p + CTRL_IN;
+
+    switch(c->op) {
+    case OP_BLK_READ:
+    case OP_BLK_WRITE:
+        return r[0] == 0 ? c->size : -1;
+    case OP_9P_READ:
+    case OP_9P_WRITE:
+        if (r[4] != p[4] + 1)
+            return -1;
+        return get_le32(r + 7);
+    default:
+        return r[4] == p[4] + 1 ? 0 : -1;
+    }
+}
+
+static void bench_run(BenchQueue *q, const BenchConfig *c)
+{
+    int i, nb_reqs, nb_desc;
+    int64_t n, nb_errors, nb_done;
+    uint64_t seq, bytes, irqs, start_ns, end_ns, t;
+    double dt;
+
+    queue_setup(q, c->queue_size);
+    if (c->op >= OP_9P_READ &&
+        p9_open(q, max_int(c->size + 4096, 8192), "virtiobench.data") < 0) {
+        fprintf(stderr, "%s: cannot open the 9p file\n", op_names[c->op]);
+        exit(1);
+    }
+
+    nb_desc = request_nb_desc(c);
+    nb_reqs = c->queue_size / nb_desc;
+    for(i = 0; i < nb_reqs; i++)
+        request_build(q, c, i);
+
+    seq = 0;
+    bytes = 0;
+    nb_done = 0;
+    nb_errors = 0;
+    irqs = q->intctrl->nb_irqs;
+    start_ns = stats_get_ns();
+    end_ns = start_ns + (uint64_t)(c->duration * 1e9);
+    do {
+        for(i = 0; i < nb_reqs; i++) {
+            request_set_header(q, c, i, seq++);
+            avail_push(q, i * nb_desc);
+        }
+        queue_kick(q);
+        for(i = 0; i < nb_reqs; i++) {
+            n = request_result(q, c, i);
+            if (n < 0)
+                nb_errors++;
+            else
+                bytes += n;
+        }
+        nb_done += nb_reqs;
+        t = stats_get_ns();
+    } while (t < end_ns);
+    dt = (t - start_ns) / 1e9;
+    irqs = q->intctrl->nb_irqs - irqs;
+
+    printf("%-10s q=%-4d chain=%-3d size=%-8d %9.0f req/s %10.0f desc/s %9.1f MB/s %5.2f irq/kick",
+           op_names[c->op], c->queue_size, op_has_data(c->op) ? c->chain : 0,
+           op_has_data(c->op) ? c->size : 0, nb_done / dt,
+           nb_done * nb_desc / dt, bytes / dt / 1e6,
+           (double)irqs / (nb_done / nb_reqs));
+    if (nb_errors)
+        printf(" errors %" PRId64, nb_errors);
+    printf("\n");
+}
+
+/* comma separated list of positive integers */
+static int parse_list(int *tab, int max, const char *str)
+{
+    char *p;
+    int n;
+
+    n = 0;
+    for(;;) {
+        if (n >= max)
+            return -1;
+        tab[n] = strtol(str, &p, 0);
+        if (p == str || tab[n] <= 0)
+            return -1;
+        n++;
+        if (*p == '\0')
+            return n;
+        if (*p != ',')
+            return -1;
+        str = p + 1;
+    }
+}
+
+static void help(void)
+{
+    printf("usage: virtiobench [options]\n"
+           "\n"
+           "Options:\n"
+           "-o ops      comma separated list of blk-read, blk-write, 9p-read,\n"
+           "            9p-write and 9p-getattr (default: all)\n"
+           "-q sizes    queue sizes, powers of 2 up to %d (default 64,256)\n"
+           "-c counts   payload descriptors per request (default 1,4,16)\n"
+           "-s sizes    payload bytes per request (default 512,4096,65536)\n"
+           "-t seconds  duration of each run (default 0.2)\n"
+           "-j threads  host threads of the devices, 0 to execute the requests\n"
+           "            on notification (default 0)\n"
+           "-d dir      directory of the 9p test file (default /tmp)\n"
+           "\n"
+           "The combinations whose requests do not fit in the queue, and the\n"
+           "block payloads which are not a multiple of %d bytes, are skipped.\n",
+           MAX_QUEUE_SIZE, SECTOR_SIZE);
+    exit(1);
+}
+
+#define MAX_VALUES 16
+
+int main(int argc, char **argv)
+{
+    int queue_sizes[MAX_VALUES] = { 64, 256 };
+    int chains[MAX_VALUES] = { 1, 4, 16 };
+    int sizes[MAX_VALUES] = { 512, 4096, 65536 };
+    int nb_queue_sizes = 2, nb_chains = 3, nb_sizes = 3;
+    BOOL ops[OP_COUNT];
+    const char *dir = "/tmp";
+    int nb_threads = 0, max_queue_size, max_size, c, i, j, k, fd;
+    double duration = 0.2;
+    bench_sim_t *sim;
+    bench_intctrl_t intctrl;
+    BenchQueue blk_q, p9_q;
+    BenchConfig conf;
+    char filename[1024];
+    size_t ram_size;
+    char *p, *str;
+
+    for(i = 0; i < OP_COUNT; i++)
+        ops[i] = TRUE;
+    for(;;) {
+        c = getopt(argc, argv, "o:q:c:s:t:j:d:h");
+        if (c == -1)
+            break;
+        switch(c) {
+        case 'o':
+            for(i = 0; i < OP_COUNT; i++)
+                ops[i] = FALSE;
+            str = strdup(optarg);
+            for(p = strtok(str, ","); p; p = strtok(NULL, ",")) {
+                for(i = 0; i < OP_COUNT; i++) {
+                    if (!strcmp(p, op_names[i]))
+                        break;
+                }
+                if (i == OP_COUNT)
+                    help();
+                ops[i] = TRUE;
+            }
+            free(str);
+            break;
+        case 'q':
+            nb_queue_sizes = parse_list(queue_sizes, MAX_VALUES, optarg);
+            if (nb_queue_sizes < 0)
+                help();
+            break;
+        case 'c':
+            nb_chains = parse_list(chains, MAX_VALUES, optarg);
+            if (nb_chains < 0)
+                help();
+            break;
+        case 's':
+            nb_sizes = parse_list(sizes, MAX_VALUES, optarg);
+            if (nb_sizes < 0)
+                help();
+            break;
+        case 't':
+            duration = strtod(optarg, NULL);
+            break;
+        case 'j':
+            nb_threads = atoi(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            help();
+        }
+    }
+    if (optind != argc)
+        help();
+
+    max_queue_size = 0;
+    for(i = 0; i < nb_queue_sizes; i++) {
+        if (queue_sizes[i] > MAX_QUEUE_SIZE ||
+            (queue_sizes[i] & (queue_sizes[i] - 1)) != 0)
+            help();
+        max_queue_size = max_int(max_queue_size, queue_sizes[i]);
+    }
+    max_size = 0;
+    for(i = 0; i < nb_sizes; i++) {
+        if (sizes[i] > (8 << 20)) {
+            fprintf(stderr, "the payload size is limited to %d bytes\n", 8 << 20);
+            exit(1);
+        }
+        max_size = max_int(max_size, sizes[i]);
+    }
+    if (duration <= 0 || nb_threads < 0)
+        help();
+    backing_size = max_int(BACKING_SIZE, max_size);
+
+    /* at least 3 descriptors per request with a payload */
+    ram_size = DATA_BASE +
+        (max_queue_size / 3 + 1) * DATA_SLOT_SIZE(max_size);
+    sim = new bench_sim_t(ram_size);
+
+    memset(&blk_q, 0, sizeof(blk_q));
+    blk_q.sim = sim;
+    blk_q.intctrl = &intctrl;
+    if (ops[OP_BLK_READ] || ops[OP_BLK_WRITE]) {
+        BlockDevice *bs = ramdisk_init(backing_size);
+        if (nb_threads > 0)
+            bs = block_device_init_async(bs, nb_threads, 1);
+        blk_q.dev = new bench_dev_t(sim, &intctrl, bs, NULL, 0, 0);
+    }
+
+    p9_q = blk_q;
+    p9_q.dev = NULL;
+    filename[0] = '\0';
+    if (ops[OP_9P_READ] || ops[OP_9P_WRITE] || ops[OP_9P_GETATTR]) {
+        FSDevice *fs;
+
+        snprintf(filename, sizeof(filename), "%s/virtiobench.data", dir);
+        fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, backing_size) < 0) {
+            perror(filename);
+            exit(1);
+        }
+        close(fd);
+        fs = fs_disk_init(dir, FS_CACHE_NONE, FS_DISK_PATH);
+        if (!fs) {
+            fprintf(stderr, "%s: not a directory\n", dir);
+            exit(1);
+        }
+        p9_q.dev = new bench_dev_t(sim, &intctrl, NULL, fs,
+                                   max_size + 4096, nb_threads);
+    }
+
+    printf("threads=%d duration=%.2f s\n", nb_threads, duration);
+    conf.duration = duration;
+    for(conf.op = OP_BLK_READ; conf.op < OP_COUNT;
+        conf.op = (BenchOpEnum)(conf.op + 1)) {
+        if (!ops[conf.op])
+            continue;
+        for(i = 0; i < nb_queue_sizes; i++) {
+            conf.queue_size = queue_sizes[i];
+            for(j = 0; j < nb_chains; j++) {
+                conf.chain = chains[j];
+                for(k = 0; k < nb_sizes; k++) {
+                    conf.size = sizes[k];
+                    if (request_nb_desc(&conf) > conf.queue_size ||
+                        conf.size < conf.chain ||
+                        (conf.op <= OP_BLK_WRITE && conf.size % SECTOR_SIZE))
+                        continue;
+                    bench_run(conf.op <= OP_BLK_WRITE ? &blk_q : &p9_q, &conf);
+                    /* the payload is not used by 9p-getattr */
+                    if (!op_has_data(conf.op))
+                        break;
+                }
+                if (!op_has_data(conf.op))
+                    break;
+            }
+        }
+    }
+
+    if (filename[0] != '\0')
+        unlink(filename);
+    return 0;
+}
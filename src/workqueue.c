@@ -0,0 +1,241 @@
+/*
+ * Host worker threads for device I/O
+ *
+ * All the work queues share one pool of threads. Each queue has a home
+ * thread which takes its items first, so that the requests of a device
+ * queue tend to stay on the same host thread; an idle thread steals the
+ * items of the other queues. The queues are scanned in round robin
+ * order so that a busy device does not starve the others.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "cutils.h"
+#include "workqueue.h"
+
+struct WorkQueue {
+    struct list_head link; /* WorkPool.queue_list */
+    int home; /* home thread, modulo the number of threads */
+    struct list_head pending_list; /* submitted, not started yet (pool lock) */
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond; /* signaled when an item is finished */
+    struct list_head done_list; /* finished, waiting for workqueue_poll() */
+    int nb_done; /* length of done_list, read without the lock */
+    int nb_active; /* submitted, 'done' not called yet */
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* signaled when an item is submitted */
+    struct list_head queue_list;
+    int nb_queues;
+    int nb_pending; /* items in the pending lists of all the queues */
+    int next_home;
+    BOOL stop;
+    int nb_threads;
+    pthread_t *threads;
+} WorkPool;
+
+static WorkPool work_pool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    { &work_pool.queue_list, &work_pool.queue_list },
+};
+
+/* return the next item for the thread 'idx', with the pool lock held */
+static WorkItem *work_pool_take(WorkPool *p, int idx)
+{
+    struct list_head *el;
+    WorkQueue *wq, *wq1;
+    WorkItem *w;
+
+    wq1 = NULL;
+    list_for_each(el, &p->queue_list) {
+        wq = list_entry(el, WorkQueue, link);
+        if (list_empty(&wq->pending_list))
+            continue;
+        if (wq->home % p->nb_threads == idx) {
+            wq1 = wq;
+            break;
+        }
+        if (!wq1)
+            wq1 = wq; /* steal it if no home queue has work */
+    }
+    w = list_entry(wq1->pending_list.next, WorkItem, link);
+    list_del(&w->link);
+    p->nb_pending--;
+    /* the queue is scanned last by the next threads */
+    list_del(&wq1->link);
+    list_add_tail(&wq1->link, &p->queue_list);
+    return w;
+}
+
+static void *work_pool_thread(void *opaque)
+{
+    WorkPool *p = &work_pool;
+    int idx = (intptr_t)opaque;
+    WorkQueue *wq;
+    WorkItem *w;
+
+    pthread_mutex_lock(&p->lock);
+    for(;;) {
+        while (p->nb_pending == 0 && !p->stop)
+            pthread_cond_wait(&p->cond, &p->lock);
+        if (p->nb_pending == 0)
+            break;
+        w = work_pool_take(p, idx);
+        wq = w->wq;
+        pthread_mutex_unlock(&p->lock);
+
+        w->func(w->opaque);
+
+        pthread_mutex_lock(&wq->lock);
+        list_add_tail(&w->link, &wq->done_list);
+        __atomic_store_n(&wq->nb_done, wq->nb_done + 1, __ATOMIC_RELEASE);
+        pthread_cond_signal(&wq->done_cond);
+        pthread_mutex_unlock(&wq->lock);
+
+        pthread_mutex_lock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+WorkQueue *workqueue_new(int nb_threads)
+{
+    WorkPool *p = &work_pool;
+    WorkQueue *wq;
+    int i;
+
+    if (nb_threads <= 0)
+        nb_threads = 1;
+    wq = (WorkQueue *)mallocz(sizeof(*wq));
+    pthread_mutex_init(&wq->lock, NULL);
+    pthread_cond_init(&wq->done_cond, NULL);
+    init_list_head(&wq->pending_list);
+    init_list_head(&wq->done_list);
+
+    pthread_mutex_lock(&p->lock);
+    if (nb_threads > p->nb_threads) {
+        p->threads = (pthread_t *)realloc(p->threads,
+                                          sizeof(p->threads[0]) * nb_threads);
+        for(i = p->nb_threads; i < nb_threads; i++) {
+            if (pthread_create(&p->threads[i], NULL, work_pool_thread,
+                               (void *)(intptr_t)i) != 0) {
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+        p->nb_threads = nb_threads;
+    }
+    wq->home = p->next_home++;
+    list_add_tail(&wq->link, &p->queue_list);
+    p->nb_queues++;
+    pthread_mutex_unlock(&p->lock);
+    return wq;
+}
+
+void workqueue_free(WorkQueue *wq)
+{
+    WorkPool *p = &work_pool;
+    pthread_t *threads;
+    int i, nb_threads;
+
+    pthread_mutex_lock(&wq->lock);
+    while (wq->nb_done < wq->nb_active)
+        pthread_cond_wait(&wq->done_cond, &wq->lock);
+    pthread_mutex_unlock(&wq->lock);
+    workqueue_poll(wq);
+
+    pthread_mutex_lock(&p->lock);
+    list_del(&wq->link);
+    nb_threads = 0;
+    threads = NULL;
+    if (--p->nb_queues == 0) {
+        /* the last queue: stop the threads */
+        p->stop = TRUE;
+        pthread_cond_broadcast(&p->cond);
+        nb_threads = p->nb_threads;
+        threads = p->threads;
+    }
+    pthread_mutex_unlock(&p->lock);
+    if (threads) {
+        for(i = 0; i < nb_threads; i++)
+            pthread_join(threads[i], NULL);
+        free(threads);
+        p->threads = NULL;
+        p->nb_threads = 0;
+        p->next_home = 0;
+        p->stop = FALSE;
+    }
+
+    pthread_cond_destroy(&wq->done_cond);
+    pthread_mutex_destroy(&wq->lock);
+    free(wq);
+}
+
+void workqueue_submit(WorkQueue *wq, WorkItem *w,
+                      WorkFunc *func, WorkFunc *done, void *opaque)
+{
+    WorkPool *p = &work_pool;
+
+    w->wq = wq;
+    w->func = func;
+    w->done = done;
+    w->opaque = opaque;
+    wq->nb_active++;
+    pthread_mutex_lock(&p->lock);
+    list_add_tail(&w->link, &wq->pending_list);
+    p->nb_pending++;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+int workqueue_poll(WorkQueue *wq)
+{
+    struct list_head done_list, *el, *el1;
+    WorkItem *w;
+    int n;
+
+    if (__atomic_load_n(&wq->nb_done, __ATOMIC_ACQUIRE) == 0)
+        return 0;
+
+    /* detach the finished items so that the callbacks can submit new
+       work without holding the lock */
+    pthread_mutex_lock(&wq->lock);
+    if (list_empty(&wq->done_list)) {
+        pthread_mutex_unlock(&wq->lock);
+        return 0;
+    }
+    done_list.next = wq->done_list.next;
+    done_list.prev = wq->done_list.prev;
+    done_list.next->prev = &done_list;
+    done_list.prev->next = &done_list;
+    init_list_head(&wq->done_list);
+    __atomic_store_n(&wq->nb_done, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&wq->lock);
+
+    n = 0;
+    list_for_each_safe(el, el1, &done_list) {
+        w = list_entry(el, WorkItem, link);
+        list_del(&w->link);
+        wq->nb_active--;
+        w->done(w->opaque);
+        n++;
+    }
+    return n;
+}
+
+void workqueue_drain(WorkQueue *wq)
+{
+    while (wq->nb_active > 0) {
+        pthread_mutex_lock(&wq->lock);
+        while (list_empty(&wq->done_list))
+            pthread_cond_wait(&wq->done_cond, &wq->lock);
+        pthread_mutex_unlock(&wq->lock);
+        workqueue_poll(wq);
+    }
+}
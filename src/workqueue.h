@@ -0,0 +1,52 @@
+/*
+ * Host worker threads for device I/O
+ *
+ * Work items are executed on a pool of host threads. Their completion
+ * callbacks are run later, from workqueue_poll(), on the thread which
+ * drives the devices (the simulator thread), so that they can safely
+ * touch the device state and guest memory.
+ *
+ * A device uses one work queue per request queue. The queues share a
+ * single pool, which grows to the largest 'nb_threads' requested, and
+ * the idle threads take the items of any queue.
+ */
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include "list.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void WorkFunc(void *opaque);
+
+typedef struct WorkQueue WorkQueue;
+
+typedef struct {
+    struct list_head link;
+    WorkQueue *wq;
+    WorkFunc *func; /* executed on a worker thread */
+    WorkFunc *done; /* executed from workqueue_poll() */
+    void *opaque;
+} WorkItem;
+
+/* the pool has at least 'nb_threads' threads while the queue exists */
+WorkQueue *workqueue_new(int nb_threads);
+/* wait for the submitted items and run their completion callbacks */
+void workqueue_free(WorkQueue *wq);
+/* 'w' must stay valid until its 'done' callback is called */
+void workqueue_submit(WorkQueue *wq, WorkItem *w,
+                      WorkFunc *func, WorkFunc *done, void *opaque);
+/* run the completion callbacks of the finished items. Return their
+   number. Cheap when nothing has completed. */
+int workqueue_poll(WorkQueue *wq);
+/* wait for the submitted items, including those submitted by the
+   completion callbacks, and run their completion callbacks */
+void workqueue_drain(WorkQueue *wq);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WORKQUEUE_H */